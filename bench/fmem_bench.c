@@ -0,0 +1,336 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "fmem/fmem.h"
+#include "fmem/fmem_fast.h"
+
+/*
+ * micro benchmarks for fmem. every workload reports ops/sec and p50/p99/p999
+ * latency of single ops. run `make bench` or build and run with
+ * -n <ops> -t <max threads> -f <file used for msync committer>
+ */
+#define errExit(msg)    do { perror(msg); exit(EXIT_FAILURE); } while (0)
+#define BENCH_MEM_SIZE (sizeof(char) * 1024 * 1024 * 64)
+#define BENCH_SLOTS 4096 // live allocations a workload juggles
+
+static uint64_t ops = 1000 * 1000;
+static int max_threads = 4;
+static const char *bench_file = "/tmp/fmem_bench.mem";
+
+static inline uint64_t now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+// cheap per thread random numbers (xorshift)
+static inline uint64_t next_rand(uint64_t *state){
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+// latency samples of a run, one per op
+struct samples{
+  uint64_t *ns;
+  uint64_t count;
+  uint64_t capacity;
+};
+
+static void samples_init(struct samples *s, uint64_t capacity){
+  s->ns = malloc(capacity * sizeof(uint64_t));
+  if(s->ns == NULL) errExit("malloc samples");
+  s->count = 0;
+  s->capacity = capacity;
+}
+
+static inline void samples_add(struct samples *s, uint64_t ns){
+  if(s->count < s->capacity) s->ns[s->count++] = ns;
+}
+
+static int compare_u64(const void *a, const void *b){
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void report(const char *name, struct samples *s, uint64_t total_ops, uint64_t elapsed_ns){
+  qsort(s->ns, s->count, sizeof(uint64_t), compare_u64);
+  uint64_t p50 = s->count ? s->ns[s->count * 50 / 100] : 0;
+  uint64_t p99 = s->count ? s->ns[s->count * 99 / 100] : 0;
+  uint64_t p999 = s->count ? s->ns[s->count * 999 / 1000] : 0;
+  double ops_sec = elapsed_ns ? (double) total_ops * 1e9 / (double) elapsed_ns : 0;
+  printf("%-34s %12.0f ops/sec  p50 %6lu ns  p99 %7lu ns  p999 %8lu ns\n",
+         name, ops_sec, p50, p99, p999);
+}
+
+static struct fmem* bench_fmem(void *mem, size_t size, committer_t committer){
+  memset(mem, 0, size);
+  struct fmem *fm = fmem_create_new(mem, size, 0, committer);
+  if((int64_t) fm <= 0) errExit("fmem_create_new");
+  return fm;
+}
+
+static void* bench_mem(){
+  void *mem = mmap(NULL, BENCH_MEM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(mem == MAP_FAILED) errExit("mmap");
+  return mem;
+}
+
+// mixed sizes, a slot is freed if it is taken, allocated if it is not
+static void bench_mixed(void *mem){
+  struct fmem *fm = bench_fmem(mem, BENCH_MEM_SIZE, NULL);
+  void *slots[BENCH_SLOTS] = {0};
+  uint64_t state = 42;
+  struct samples s;
+  samples_init(&s, ops);
+
+  uint64_t start = now_ns();
+  for(uint64_t i = 0; i < ops; i++){
+    uint64_t r = next_rand(&state);
+    uint32_t slot = r % BENCH_SLOTS;
+    uint64_t t0 = now_ns();
+    if(slots[slot] == NULL){
+      void *m = fmem_alloc(fm, 16 + (r >> 32) % 512);
+      if((int64_t) m > 0) slots[slot] = m;
+    }else{
+      fmem_free(fm, slots[slot]);
+      slots[slot] = NULL;
+    }
+    samples_add(&s, now_ns() - t0);
+  }
+  report("alloc/free mixed sizes", &s, ops, now_ns() - start);
+  free(s.ns);
+}
+
+FMEM_DEFINE(bench_fast, FMEM_UNLOCKED, FMEM_VOLATILE, FMEM_UNPOISONED)
+
+// small mixed sizes through fmem_alloc and through a FMEM_DEFINE(..) fast path
+static void bench_small(void *mem, bool fast){
+  struct fmem *fm = bench_fmem(mem, BENCH_MEM_SIZE, NULL);
+  struct fmem_cache cache;
+  bench_fast_init(&cache, fm);
+  void *slots[BENCH_SLOTS] = {0};
+  uint64_t state = 42;
+  struct samples s;
+  samples_init(&s, ops);
+
+  uint64_t start = now_ns();
+  for(uint64_t i = 0; i < ops; i++){
+    uint64_t r = next_rand(&state);
+    uint32_t slot = r % BENCH_SLOTS;
+    uint32_t size = 1 + (r >> 32) % (FMEM_CACHE_CLASSES * fm->min_alloc);
+    uint64_t t0 = now_ns();
+    if(slots[slot] == NULL){
+      void *m = fast ? bench_fast_alloc(&cache, size) : fmem_alloc(fm, size);
+      if((int64_t) m > 0) slots[slot] = m;
+    }else{
+      if(fast) bench_fast_free(&cache, slots[slot]); else fmem_free(fm, slots[slot]);
+      slots[slot] = NULL;
+    }
+    samples_add(&s, now_ns() - t0);
+  }
+  report(fast ? "alloc/free small sizes, fast path" : "alloc/free small sizes", &s, ops, now_ns() - start);
+  bench_fast_flush(&cache);
+  free(s.ns);
+}
+
+// fill the memory, free at random then allocate into the holes
+static void bench_fragmentation(void *mem){
+  struct fmem *fm = bench_fmem(mem, BENCH_MEM_SIZE, NULL);
+  uint64_t state = 7;
+  uint64_t capacity = BENCH_MEM_SIZE / 64;
+  void **all = calloc(capacity, sizeof(void *));
+  if(all == NULL) errExit("calloc");
+
+  uint64_t filled = 0;
+  while(filled < capacity){
+    void *m = fmem_alloc(fm, 24 + next_rand(&state) % 200);
+    if((int64_t) m <= 0) break;
+    all[filled++] = m;
+  }
+
+  // half of it becomes holes
+  for(uint64_t i = 0; i < filled / 2; i++){
+    uint64_t at = next_rand(&state) % filled;
+    if(all[at] == NULL) continue;
+    fmem_free(fm, all[at]);
+    all[at] = NULL;
+  }
+
+  struct samples s;
+  samples_init(&s, ops);
+  uint64_t start = now_ns();
+  for(uint64_t i = 0; i < ops; i++){
+    uint64_t r = next_rand(&state);
+    uint64_t at = r % filled;
+    uint64_t t0 = now_ns();
+    if(all[at] == NULL){
+      void *m = fmem_alloc(fm, 24 + (r >> 32) % 200);
+      if((int64_t) m > 0) all[at] = m;
+    }else{
+      fmem_free(fm, all[at]);
+      all[at] = NULL;
+    }
+    samples_add(&s, now_ns() - t0);
+  }
+  report("fill then random free/alloc", &s, ops, now_ns() - start);
+  free(s.ns);
+  free(all);
+}
+
+// contention, n threads doing alloc/free on the same fmem
+struct thread_bench{
+  struct fmem *fm;
+  uint64_t ops;
+  uint64_t seed;
+  struct samples s;
+};
+
+static void* bench_thread(void *arg){
+  struct thread_bench *tb = (struct thread_bench *) arg;
+  void *slots[BENCH_SLOTS / 16] = {0};
+  uint32_t slot_count = BENCH_SLOTS / 16;
+  for(uint64_t i = 0; i < tb->ops; i++){
+    uint64_t r = next_rand(&tb->seed);
+    uint32_t slot = r % slot_count;
+    uint64_t t0 = now_ns();
+    if(slots[slot] == NULL){
+      void *m = fmem_alloc(tb->fm, 16 + (r >> 32) % 256);
+      if((int64_t) m > 0) slots[slot] = m;
+    }else{
+      fmem_free(tb->fm, slots[slot]);
+      slots[slot] = NULL;
+    }
+    samples_add(&tb->s, now_ns() - t0);
+  }
+  for(uint32_t i = 0; i < slot_count; i++) if(slots[i] != NULL) fmem_free(tb->fm, slots[i]);
+  return NULL;
+}
+
+static void bench_threads(void *mem, int threads){
+  struct fmem *fm = bench_fmem(mem, BENCH_MEM_SIZE, NULL);
+  struct thread_bench tb[threads];
+  pthread_t ids[threads];
+  uint64_t per_thread = ops / threads;
+
+  uint64_t start = now_ns();
+  for(int i = 0; i < threads; i++){
+    tb[i].fm = fm;
+    tb[i].ops = per_thread;
+    tb[i].seed = 1000 + i;
+    samples_init(&tb[i].s, per_thread);
+    if(pthread_create(&ids[i], NULL, bench_thread, &tb[i]) != 0) errExit("pthread_create");
+  }
+  for(int i = 0; i < threads; i++) pthread_join(ids[i], NULL);
+  uint64_t elapsed = now_ns() - start;
+
+  // all samples in one
+  struct samples all;
+  samples_init(&all, per_thread * threads);
+  for(int i = 0; i < threads; i++){
+    memcpy(all.ns + all.count, tb[i].s.ns, tb[i].s.count * sizeof(uint64_t));
+    all.count += tb[i].s.count;
+    free(tb[i].s.ns);
+  }
+  char name[64];
+  snprintf(name, sizeof(name), "contention %d thread(s)", threads);
+  report(name, &all, per_thread * threads, elapsed);
+  free(all.ns);
+}
+
+// committers
+static void *msync_base = NULL;
+static int noop_committer(struct commit_range *ranges, uint8_t count){
+  return 0;
+}
+
+static int msync_committer(struct commit_range *ranges, uint8_t count){
+  const uintptr_t page_size = getpagesize();
+  for(int i = 0; i < count; i++){
+    uintptr_t start = (uintptr_t) ranges[i].start;
+    uintptr_t aligned = start - (start % page_size);
+    if(aligned < (uintptr_t) msync_base) aligned = (uintptr_t) msync_base;
+    if(msync((void *) aligned, (start - aligned) + ranges[i].len, MS_SYNC) != 0) return -1;
+  }
+  return 0;
+}
+
+static void bench_committer(void *mem, size_t size, const char *name, committer_t committer, uint64_t n){
+  struct fmem *fm = bench_fmem(mem, size, committer);
+  void *slots[BENCH_SLOTS] = {0};
+  uint64_t state = 99;
+  struct samples s;
+  samples_init(&s, n);
+
+  uint64_t start = now_ns();
+  for(uint64_t i = 0; i < n; i++){
+    uint64_t r = next_rand(&state);
+    uint32_t slot = r % BENCH_SLOTS;
+    uint64_t t0 = now_ns();
+    if(slots[slot] == NULL){
+      void *m = fmem_alloc(fm, 16 + (r >> 32) % 256);
+      if((int64_t) m > 0) slots[slot] = m;
+    }else{
+      fmem_free(fm, slots[slot]);
+      slots[slot] = NULL;
+    }
+    samples_add(&s, now_ns() - t0);
+  }
+  report(name, &s, n, now_ns() - start);
+  free(s.ns);
+}
+
+static void bench_msync(){
+  size_t size = 1024 * 1024 * 4;
+  int fd = open(bench_file, O_CREAT | O_RDWR, 0600);
+  if(fd == -1) errExit("open bench file");
+  if(ftruncate(fd, size) != 0) errExit("ftruncate bench file");
+  msync_base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(msync_base == MAP_FAILED) errExit("mmap bench file");
+
+  // msync is slow, we do fewer ops
+  uint64_t n = ops / 100 < 1000 ? 1000 : ops / 100;
+  bench_committer(msync_base, size, "committer msync(MS_SYNC)", msync_committer, n);
+
+  munmap(msync_base, size);
+  close(fd);
+  remove(bench_file);
+}
+
+int main(int argc, char *argv[]){
+  int opt = 0;
+  while((opt = getopt(argc, argv, "n:t:f:")) != -1){
+    switch(opt){
+      case 'n': ops = strtoull(optarg, NULL, 10); break;
+      case 't': max_threads = atoi(optarg); break;
+      case 'f': bench_file = optarg; break;
+      default:
+        fprintf(stderr, "Usage: %s [-n ops] [-t max threads] [-f file for msync committer]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if(ops == 0 || max_threads <= 0) errExit("bad args");
+
+  void *mem = bench_mem();
+  printf("fmem bench, %lu ops per workload\n", ops);
+  bench_mixed(mem);
+  bench_small(mem, false);
+  bench_small(mem, true);
+  bench_fragmentation(mem);
+  for(int threads = 1; threads <= max_threads; threads *= 2) bench_threads(mem, threads);
+  bench_committer(mem, BENCH_MEM_SIZE, "committer no-op", noop_committer, ops);
+  bench_msync();
+  munmap(mem, BENCH_MEM_SIZE);
+  return EXIT_SUCCESS;
+}
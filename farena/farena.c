@@ -0,0 +1,194 @@
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "fmem/fmem.h"
+#include "farena.h"
+
+// arena index of calling thread, -1 until it is given one
+static __thread int32_t thread_arena = -1;
+
+static inline size_t farena_page_size(){
+	return (size_t) sysconf(_SC_PAGESIZE);
+}
+
+static inline struct fmem* farena_fm(struct farena *arenas, uint32_t n){
+	return (struct fmem *) (((char *) arenas) + arenas->fm[n]);
+}
+
+struct farena* farena_create(void *on_mem, size_t length, uint32_t count, const struct fmem_options *opts){
+	if(count == 0 || count > FARENA_MAX) return (void *) E_BAD_ARENA;
+
+	size_t page_size = farena_page_size();
+	size_t first = (sizeof(struct farena) + page_size - 1) & ~(page_size - 1);
+	if(length <= first) return (void *) E_BAD_ARENA;
+	size_t arena_size = ((length - first) / count) & ~(page_size - 1);
+	if(arena_size == 0 || arena_size > UINT32_MAX) return (void *) E_BAD_ARENA; // an arena is one fmem
+
+	struct farena *arenas = (struct farena *) on_mem;
+	memset(arenas, 0, sizeof(struct farena));
+	arenas->count = count;
+	arenas->arena_size = arena_size;
+	arenas->first = first;
+
+	for(uint32_t n = 0; n < count; n++){
+		struct fmem *fm = fmem_create_new_opts(((char *) on_mem) + first + n * arena_size, arena_size, opts);
+		if((int64_t) fm < 0) return (struct farena *) fm;
+		arenas->fm[n] = (char *) fm - (char *) arenas;
+	}
+
+	// magic goes last, a directory is only valid once all arenas are created
+	arenas->magic = FARENA_MAGIC;
+	if(opts->committer != NULL){
+		struct commit_range r = {0};
+		r.start = arenas;
+		r.len = sizeof(struct farena);
+		if(opts->committer(&r, 1) < 0) return (void *) E_COMMIT_FAILED;
+	}
+	return arenas;
+}
+
+struct farena* farena_from_existing(void *on_mem, committer_t committer){
+	struct farena *arenas = (struct farena *) on_mem;
+	if(arenas->magic != FARENA_MAGIC || arenas->count == 0 || arenas->count > FARENA_MAX) return (void *) E_BAD_ARENA;
+
+	for(uint32_t n = 0; n < arenas->count; n++){
+		struct fmem *fm = fmem_from_existing(((char *) on_mem) + arenas->first + n * arenas->arena_size, committer);
+		if((int64_t) fm < 0) return (struct farena *) fm;
+	}
+	return arenas;
+}
+
+struct fmem* farena_get(struct farena *arenas, uint32_t n){
+	return n < arenas->count ? farena_fm(arenas, n) : NULL;
+}
+
+struct fmem* farena_of(struct farena *arenas, void *mem){
+	char *at = (char *) mem;
+	char *start = ((char *) arenas) + arenas->first;
+	if(at < start) return NULL;
+
+	uint64_t n = (at - start) / arenas->arena_size;
+	return n < arenas->count ? farena_fm(arenas, (uint32_t) n) : NULL;
+}
+
+struct fmem* farena_for_thread(struct farena *arenas){
+	if(thread_arena < 0) thread_arena = (int32_t) (__atomic_fetch_add(&arenas->next, 1, __ATOMIC_RELAXED) % FARENA_MAX);
+	return farena_fm(arenas, (uint32_t) thread_arena % arenas->count);
+}
+
+#ifdef __UNIT_TESTING__
+#include <stdio.h>
+#include <stdlib.h>
+#include "munit/munit.h"
+
+#define arena_test_size 1024 * 1024
+static char arena_test_mem[arena_test_size] __attribute__((aligned(4096)));
+
+static MunitResult test_arena_create(const MunitParameter params[], void* data){
+	struct fmem_options opts = {0};
+	munit_assert(farena_create(arena_test_mem, arena_test_size, 0, &opts) == (void *) E_BAD_ARENA);
+	munit_assert(farena_create(arena_test_mem, arena_test_size, FARENA_MAX + 1, &opts) == (void *) E_BAD_ARENA);
+	munit_assert(farena_create(arena_test_mem, farena_page_size(), 1, &opts) == (void *) E_BAD_ARENA);
+
+	struct farena *arenas = farena_create(arena_test_mem, arena_test_size, 4, &opts);
+	munit_assert(arenas > 0);
+	munit_assert(arenas->count == 4);
+	munit_assert(farena_get(arenas, 4) == NULL);
+
+	// arenas are independent, memory comes from (and is owned by) the arena asked
+	for(uint32_t n = 0; n < 4; n++){
+		struct fmem *fm = farena_get(arenas, n);
+		munit_assert(fm != NULL);
+		munit_assert(((uintptr_t) fm - sizeof(struct fmem_page)) % farena_page_size() == 0);
+		void *mem = fmem_alloc(fm, 1000);
+		munit_assert(mem > 0);
+		munit_assert(farena_of(arenas, mem) == fm);
+		munit_assert(fm->alloc_objects == 1);
+	}
+	munit_assert(farena_of(arenas, arenas) == NULL);
+	munit_assert(farena_of(arenas, arena_test_mem + arena_test_size) == NULL);
+
+	// an arena that runs out does not take from the others
+	struct fmem *first = farena_get(arenas, 0);
+	while((int64_t) fmem_alloc(first, 4000) > 0);
+	munit_assert(fmem_alloc(farena_get(arenas, 1), 4000) > 0);
+
+	// attaching finds all of them
+	munit_assert(farena_from_existing(arena_test_mem, NULL) == arenas);
+	munit_assert(farena_get(arenas, 1)->alloc_objects == 2);
+	memset(arena_test_mem, 0, sizeof(struct farena));
+	munit_assert(farena_from_existing(arena_test_mem, NULL) == (void *) E_BAD_ARENA);
+	return MUNIT_OK;
+}
+
+struct arena_test_worker{
+	struct farena *arenas;
+	struct fmem *fm;
+	int failures;
+};
+
+static void* arena_test_work(void *arg){
+	struct arena_test_worker *worker = (struct arena_test_worker *) arg;
+	struct fmem *fm = farena_for_thread(worker->arenas);
+	worker->fm = fm;
+	void *mems[64] = {0};
+	for(int round = 0; round < 200; round++){
+		for(int i = 0; i < 64; i++){
+			mems[i] = fmem_alloc(fm, 16 + (i % 16) * 24);
+			if((int64_t) mems[i] <= 0 || farena_of(worker->arenas, mems[i]) != fm) worker->failures++;
+		}
+		// frees go to the arena that owns memory
+		for(int i = 0; i < 64; i++){
+			if((int64_t) mems[i] > 0 && fmem_free(farena_of(worker->arenas, mems[i]), mems[i]) <= 0) worker->failures++;
+		}
+	}
+	return NULL;
+}
+
+static MunitResult test_arena_threads(const MunitParameter params[], void* data){
+	struct fmem_options opts = {0};
+	struct farena *arenas = farena_create(arena_test_mem, arena_test_size, 4, &opts);
+	munit_assert(arenas > 0);
+	size_t available = farena_get(arenas, 0)->total_available;
+
+	pthread_t threads[4];
+	struct arena_test_worker workers[4] = {0};
+	for(int i = 0; i < 4; i++){
+		workers[i].arenas = arenas;
+		munit_assert(pthread_create(&threads[i], NULL, arena_test_work, &workers[i]) == 0);
+	}
+	for(int i = 0; i < 4; i++) munit_assert(pthread_join(threads[i], NULL) == 0);
+
+	// four threads, four arenas, one each
+	for(int i = 0; i < 4; i++){
+		munit_assert(workers[i].failures == 0);
+		for(int j = 0; j < i; j++) munit_assert(workers[i].fm != workers[j].fm);
+	}
+	for(uint32_t n = 0; n < 4; n++){
+		struct fmem *fm = farena_get(arenas, n);
+		munit_assert(fm->alloc_objects == 0);
+		munit_assert(fm->total_available == available);
+	}
+	return MUNIT_OK;
+}
+
+MunitTest farena_tests[] = {
+	{"/arena-create", test_arena_create, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/arena-threads", test_arena_threads, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+static const MunitSuite farena_test_suite = {
+	(char*) "farena-tests",
+	farena_tests,
+	NULL,
+	1,
+	MUNIT_SUITE_OPTION_NONE
+};
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]){
+	return munit_suite_main(&farena_test_suite, NULL, argc, argv);
+}
+#endif
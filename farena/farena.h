@@ -0,0 +1,46 @@
+#ifndef __FARENA__
+#define __FARENA__
+#include <stdint.h>
+#include <stddef.h>
+#include "fmem/fmem.h"
+
+// arenas split one mapping into many independent fmem instances, each with
+// its own head page, lock and free index. a small directory at the start of
+// the mapping describes them, arenas follow it (os page aligned, same size).
+// threads (or object types) are pinned to an arena so they don't fight over
+// one lock. memory is freed to the arena it came from, see farena_of(..).
+// -- the directory keeps offsets only, the mapping can move.
+// -- arenas are plain fmem, every fmem_* function works on them.
+#define FARENA_MAGIC 0x46415245 // "FARE"
+#define FARENA_MAX 64 // max # of arenas in a mapping
+
+#define E_BAD_ARENA -9 // bad arena count, mapping too small or no directory found
+
+struct farena{
+	uint32_t magic;
+	uint32_t count;         // # of arenas
+	uint64_t arena_size;    // size of each arena
+	uint64_t first;         // offset of first arena from the directory
+	uint32_t next;          // round robin counter for farena_for_thread(..)
+	uint32_t unused;
+	uint64_t fm[FARENA_MAX]; // offset of every arena fmem from the directory
+};
+
+// creates count arenas on on_mem, every arena is created with opts
+// returns E_BAD_ARENA or any fmem_create_new_opts(..) error
+struct farena* farena_create(void *on_mem, size_t length, uint32_t count, const struct fmem_options *opts);
+
+// attaches to arenas created by farena_create(..). see fmem_from_existing(..)
+// returns E_BAD_ARENA or any fmem_from_existing(..) error
+struct farena* farena_from_existing(void *on_mem, committer_t committer);
+
+// returns arena n, NULL if n is out of range
+struct fmem* farena_get(struct farena *arenas, uint32_t n);
+
+// returns the arena that owns mem, NULL if mem is not in any arena
+struct fmem* farena_of(struct farena *arenas, void *mem);
+
+// returns the arena of calling thread. threads are given arenas round robin
+// on their first call and keep them
+struct fmem* farena_for_thread(struct farena *arenas);
+#endif
@@ -0,0 +1,423 @@
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "fmem/fmem.h"
+#include "fdirty.h"
+
+// a tracked fmem. trackers are process local, the fault handler finds them
+// in a fixed table (no locks or allocs in the handler)
+struct fdirty_tracker{
+	struct fmem *fm;       // NULL if slot is not used
+	char *start;           // tracked memory, os page aligned
+	size_t length;
+	size_t pages;          // # of os pages in tracked memory
+	uint64_t *map;         // bit n is set if page n was written
+	committer_t committer; // fm committer before tracking started
+	pthread_mutex_t lock;  // serializes commits
+};
+
+static struct fdirty_tracker trackers[FDIRTY_MAX];
+static pthread_mutex_t trackers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sigaction old_action;
+static bool installed = false;
+static size_t page_size = 0;
+
+// stands in for fm committer while tracking, what fmem commits is found by faults
+static int fdirty_noop_committer(struct commit_range *ranges, uint8_t count){
+	return 0;
+}
+
+static void fdirty_on_fault(int sig, siginfo_t *info, void *ctx){
+	char *at = (char *) info->si_addr;
+	for(int i = 0; i < FDIRTY_MAX; i++){
+		struct fdirty_tracker *t = &trackers[i];
+		if(__atomic_load_n(&t->fm, __ATOMIC_ACQUIRE) == NULL) continue;
+		if(at < t->start || at >= t->start + t->length) continue;
+
+		// protection is lifted before the page is marked. a commit that runs in
+		// between protects it again and the write faults once more, a page that
+		// is writable is always marked
+		size_t page = (at - t->start) / page_size;
+		mprotect(t->start + page * page_size, page_size, PROT_READ | PROT_WRITE);
+		__atomic_fetch_or(&t->map[page / 64], 1ULL << (page % 64), __ATOMIC_RELEASE);
+		return;
+	}
+
+	// not ours
+	if(old_action.sa_flags & SA_SIGINFO){
+		old_action.sa_sigaction(sig, info, ctx);
+	}else if(old_action.sa_handler == SIG_DFL || old_action.sa_handler == SIG_IGN){
+		signal(sig, SIG_DFL); // the write faults again and the process dies as it would have
+	}else{
+		old_action.sa_handler(sig);
+	}
+}
+
+static struct fdirty_tracker* fdirty_tracker_of(struct fmem *fm){
+	for(int i = 0; i < FDIRTY_MAX; i++){
+		if(__atomic_load_n(&trackers[i].fm, __ATOMIC_ACQUIRE) == fm) return &trackers[i];
+	}
+	return NULL;
+}
+
+static int fdirty_commit_ranges(struct fdirty_tracker *t, struct commit_range *ranges, uint32_t count){
+	if(t->committer == NULL || count == 0) return 0;
+	return t->committer(ranges, (uint8_t) count) < 0 ? E_COMMIT_FAILED : 0;
+}
+
+// adds a run of dirty pages, protected again (if asked) before it is committed
+static int fdirty_add_run(struct fdirty_tracker *t, struct commit_range *ranges, uint32_t *count, size_t first, size_t len, bool protect){
+	char *start = t->start + first * page_size;
+	if(protect && mprotect(start, len * page_size, PROT_READ) != 0) return E_BAD_DIRTY;
+
+	ranges[*count].start = start;
+	ranges[*count].len = len * page_size;
+	(*count)++;
+	if(*count < FDIRTY_COMMIT_RANGES) return 0;
+
+	int res = fdirty_commit_ranges(t, ranges, *count);
+	*count = 0;
+	return res;
+}
+
+// takes every dirty page (bits are cleared first) and commits them in
+// runs of neighbour pages. caller must hold tracker lock
+static int64_t fdirty_flush(struct fdirty_tracker *t, bool protect){
+	struct commit_range ranges[FDIRTY_COMMIT_RANGES];
+	uint32_t count = 0;
+	int64_t pages = 0;
+	int res = 0;
+	size_t run_first = 0;
+	size_t run_len = 0;
+
+	for(size_t word = 0; word < (t->pages + 63) / 64; word++){
+		uint64_t bits = __atomic_exchange_n(&t->map[word], 0, __ATOMIC_ACQ_REL);
+		while(bits != 0){
+			size_t page = word * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			pages++;
+			if(run_len > 0 && run_first + run_len == page){
+				run_len++;
+				continue;
+			}
+			if(run_len > 0){
+				int run_res = fdirty_add_run(t, ranges, &count, run_first, run_len, protect);
+				if(res == 0) res = run_res;
+			}
+			run_first = page;
+			run_len = 1;
+		}
+	}
+	if(run_len > 0){
+		int run_res = fdirty_add_run(t, ranges, &count, run_first, run_len, protect);
+		if(res == 0) res = run_res;
+	}
+	int last_res = fdirty_commit_ranges(t, ranges, count);
+	if(res == 0) res = last_res;
+	return res != 0 ? res : pages;
+}
+
+// the committer is swapped and memory protected holding fm lock, no op of
+// this process runs in between with one and not the other
+static int64_t fdirty_start_locked(struct fmem *fm, void *ctx){
+	struct fdirty_tracker *t = (struct fdirty_tracker *) ctx;
+	t->committer = fmem_committer(fm);
+	if(fmem_set_committer(fm, fdirty_noop_committer) != 0) return E_BAD_DIRTY;
+
+	// the handler must see the tracker before the first fault
+	__atomic_store_n(&t->fm, fm, __ATOMIC_RELEASE);
+	if(mprotect(t->start, t->length, PROT_READ) != 0){
+		__atomic_store_n(&t->fm, NULL, __ATOMIC_RELEASE);
+		mprotect(t->start, t->length, PROT_READ | PROT_WRITE);
+		fmem_set_committer(fm, t->committer);
+		return E_BAD_DIRTY;
+	}
+	return 0;
+}
+
+// no more faults once everything is writable, then the last dirty pages
+// are committed and fm gets its committer back
+static int64_t fdirty_stop_locked(struct fmem *fm, void *ctx){
+	struct fdirty_tracker *t = (struct fdirty_tracker *) ctx;
+	int64_t res = mprotect(t->start, t->length, PROT_READ | PROT_WRITE) == 0 ? 0 : E_BAD_DIRTY;
+	pthread_mutex_lock(&t->lock);
+	int64_t flushed = fdirty_flush(t, false);
+	pthread_mutex_unlock(&t->lock);
+	if(res == 0 && flushed < 0) res = flushed;
+
+	fmem_set_committer(fm, t->committer);
+	__atomic_store_n(&t->fm, NULL, __ATOMIC_RELEASE);
+	return res;
+}
+
+int64_t fmem_dirty_start(struct fmem *fm){
+	if(fm->flags & FMEM_F_REDO_LOG) return E_BAD_DIRTY;
+
+	pthread_mutex_lock(&trackers_lock);
+	struct fdirty_tracker *t = NULL;
+	for(int i = 0; i < FDIRTY_MAX && fdirty_tracker_of(fm) == NULL; i++){
+		if(trackers[i].fm == NULL){
+			t = &trackers[i];
+			break;
+		}
+	}
+	if(t == NULL){
+		pthread_mutex_unlock(&trackers_lock);
+		return E_BAD_DIRTY;
+	}
+
+	if(!installed){
+		page_size = (size_t) sysconf(_SC_PAGESIZE);
+		struct sigaction action = {0};
+		action.sa_sigaction = fdirty_on_fault;
+		action.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigemptyset(&action.sa_mask);
+		if(sigaction(SIGSEGV, &action, &old_action) != 0){
+			pthread_mutex_unlock(&trackers_lock);
+			return E_BAD_DIRTY;
+		}
+		installed = true;
+	}
+
+	// everything fmem owns, head page included
+	uintptr_t start = ((uintptr_t) fm - sizeof(struct fmem_page)) & ~(page_size - 1);
+	uintptr_t end = ((uintptr_t) fm - sizeof(struct fmem_page) + fmem_length(fm) + page_size - 1) & ~(page_size - 1);
+	t->start = (char *) start;
+	t->length = end - start;
+	t->pages = t->length / page_size;
+	t->map = calloc((t->pages + 63) / 64, sizeof(uint64_t));
+	if(t->map == NULL){
+		pthread_mutex_unlock(&trackers_lock);
+		return E_BAD_DIRTY;
+	}
+	pthread_mutex_init(&t->lock, NULL);
+	int64_t res = fmem_run_locked(fm, fdirty_start_locked, t);
+	if(res != 0){
+		pthread_mutex_destroy(&t->lock);
+		free(t->map);
+		t->map = NULL;
+	}
+	pthread_mutex_unlock(&trackers_lock);
+	return res;
+}
+
+int64_t fmem_commit_dirty(struct fmem *fm){
+	struct fdirty_tracker *t = fdirty_tracker_of(fm);
+	if(t == NULL) return E_BAD_DIRTY;
+
+	pthread_mutex_lock(&t->lock);
+	int64_t res = fdirty_flush(t, true);
+	pthread_mutex_unlock(&t->lock);
+	return res;
+}
+
+int64_t fmem_dirty_pages(struct fmem *fm){
+	struct fdirty_tracker *t = fdirty_tracker_of(fm);
+	if(t == NULL) return E_BAD_DIRTY;
+
+	int64_t pages = 0;
+	for(size_t word = 0; word < (t->pages + 63) / 64; word++){
+		pages += __builtin_popcountll(__atomic_load_n(&t->map[word], __ATOMIC_ACQUIRE));
+	}
+	return pages;
+}
+
+int64_t fmem_dirty_stop(struct fmem *fm){
+	pthread_mutex_lock(&trackers_lock);
+	struct fdirty_tracker *t = fdirty_tracker_of(fm);
+	if(t == NULL){
+		pthread_mutex_unlock(&trackers_lock);
+		return E_BAD_DIRTY;
+	}
+
+	int64_t res = fmem_run_locked(fm, fdirty_stop_locked, t);
+	if(res == E_BROKEN_MEM) res = fdirty_stop_locked(fm, t); // tracking ends all the same
+	pthread_mutex_destroy(&t->lock);
+	free(t->map);
+	t->map = NULL;
+	pthread_mutex_unlock(&trackers_lock);
+	return res;
+}
+
+#ifdef __UNIT_TESTING__
+#include <stdio.h>
+#include "munit/munit.h"
+
+#define dirty_test_size 1024 * 1024
+#define dirty_test_max_ranges 256
+
+static struct commit_range dirty_test_ranges[dirty_test_max_ranges];
+static int dirty_test_count = 0;
+
+static int dirty_test_committer(struct commit_range *ranges, uint8_t count){
+	for(uint8_t i = 0; i < count && dirty_test_count < dirty_test_max_ranges; i++){
+		dirty_test_ranges[dirty_test_count++] = ranges[i];
+	}
+	return 0;
+}
+
+// returns true if mem was handed to the committer
+static bool dirty_test_committed(void *mem){
+	for(int i = 0; i < dirty_test_count; i++){
+		char *start = (char *) dirty_test_ranges[i].start;
+		if((char *) mem >= start && (char *) mem < start + dirty_test_ranges[i].len) return true;
+	}
+	return false;
+}
+
+static char* dirty_test_map(){
+	char *mem = mmap(NULL, dirty_test_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	return mem == MAP_FAILED ? NULL : mem;
+}
+
+static MunitResult test_dirty_commit(const MunitParameter params[], void* data){
+	char *mem = dirty_test_map();
+	munit_assert(mem != NULL);
+	struct fmem *fm = fmem_create_new(mem, dirty_test_size, 0, dirty_test_committer);
+	munit_assert(fm > 0);
+	munit_assert(fmem_commit_dirty(fm) == E_BAD_DIRTY);
+	munit_assert(fmem_dirty_start(fm) == 0);
+	munit_assert(fmem_committer(fm) == fdirty_noop_committer);
+	munit_assert(fmem_dirty_start(fm) == E_BAD_DIRTY);
+	munit_assert(fmem_committer(fm) == fdirty_noop_committer);
+	// giving the lock back is the first write, to the head page
+	munit_assert(fm->lock == 0);
+	int64_t head = fmem_dirty_pages(fm);
+	munit_assert(head <= 1);
+	munit_assert(fmem_commit_dirty(fm) == head);
+	munit_assert(fmem_commit_dirty(fm) == 0);
+
+	// fmem commits nothing on its own while tracked
+	dirty_test_count = 0;
+	char *first = fmem_alloc(fm, 100);
+	char *big = fmem_alloc(fm, 64 * 1024);
+	munit_assert(first > 0 && big > 0);
+	munit_assert(fmem_commit_mem(fm, first, 0) > 0);
+	munit_assert(dirty_test_count == 0);
+	munit_assert(fmem_dirty_pages(fm) > 0);
+
+	// writes nobody committed are found, each page once
+	memset(first, 1, 100);
+	big[0] = 1;
+	big[32 * 1024] = 1;
+	int64_t pages = fmem_dirty_pages(fm);
+	munit_assert(fmem_commit_dirty(fm) == pages);
+	munit_assert(dirty_test_count > 0 && dirty_test_count <= pages);
+	munit_assert(dirty_test_committed(fm));
+	munit_assert(dirty_test_committed(first));
+	munit_assert(dirty_test_committed(big) && dirty_test_committed(big + 32 * 1024));
+	munit_assert(!dirty_test_committed(big + 16 * 1024));
+	for(int i = 0; i < dirty_test_count; i++){
+		munit_assert((uintptr_t) dirty_test_ranges[i].start % page_size == 0);
+		munit_assert(dirty_test_ranges[i].len % page_size == 0);
+	}
+
+	// committed pages are protected again, nothing is dirty until written
+	dirty_test_count = 0;
+	munit_assert(fmem_commit_dirty(fm) == 0);
+	munit_assert(dirty_test_count == 0);
+	big[16 * 1024] = 1;
+	munit_assert(fmem_dirty_pages(fm) == 1);
+	munit_assert(fmem_commit_dirty(fm) == 1);
+	munit_assert(dirty_test_count == 1 && dirty_test_committed(big + 16 * 1024));
+
+	// stop commits what is left and gives committer back
+	big[48 * 1024] = 1;
+	dirty_test_count = 0;
+	munit_assert(fmem_dirty_stop(fm) == 0);
+	munit_assert(dirty_test_committed(big + 48 * 1024));
+	munit_assert(fmem_committer(fm) == dirty_test_committer);
+	munit_assert(fmem_dirty_stop(fm) == E_BAD_DIRTY);
+	munit_assert(fmem_free(fm, big) > 0);
+	munit_assert(munmap(mem, dirty_test_size) == 0);
+
+	// redo log is not tracked
+	mem = dirty_test_map();
+	struct fmem_options opts = {0};
+	opts.flags = FMEM_F_REDO_LOG;
+	opts.committer = dirty_test_committer;
+	fm = fmem_create_new_opts(mem, dirty_test_size, &opts);
+	munit_assert(fm > 0);
+	munit_assert(fmem_dirty_start(fm) == E_BAD_DIRTY);
+	munit_assert(munmap(mem, dirty_test_size) == 0);
+	return MUNIT_OK;
+}
+
+#define dirty_test_block_pages 4
+
+// writes the round to the first byte of every page of its block, pages are
+// protected again under it. returns non NULL if a write did not stick
+static void* dirty_test_write(void *arg){
+	char *block = (char *) arg;
+	size_t page = sysconf(_SC_PAGESIZE);
+	for(int round = 1; round <= 500; round++){
+		for(size_t at = 0; at < dirty_test_block_pages * page; at += page){
+			block[at] = (char) round;
+			if(block[at] != (char) round) return block + at;
+		}
+	}
+	return NULL;
+}
+
+static MunitResult test_dirty_threads(const MunitParameter params[], void* data){
+	char *mem = dirty_test_map();
+	munit_assert(mem != NULL);
+	struct fmem *fm = fmem_create_new(mem, dirty_test_size, 0, dirty_test_committer);
+	munit_assert(fm > 0);
+	size_t available = fm->total_available;
+	size_t page = sysconf(_SC_PAGESIZE);
+	char *blocks[4];
+	for(int i = 0; i < 4; i++) munit_assert((blocks[i] = fmem_alloc_aligned(fm, dirty_test_block_pages * page, page)) > 0);
+	munit_assert(fmem_dirty_start(fm) == 0);
+
+	// threads fault while pages are committed and protected again
+	pthread_t threads[4];
+	for(int i = 0; i < 4; i++) munit_assert(pthread_create(&threads[i], NULL, dirty_test_write, blocks[i]) == 0);
+	for(int i = 0; i < 200; i++){
+		dirty_test_count = 0;
+		munit_assert(fmem_commit_dirty(fm) >= 0);
+	}
+	for(int i = 0; i < 4; i++){
+		void *res = NULL;
+		munit_assert(pthread_join(threads[i], &res) == 0);
+		munit_assert(res == NULL);
+	}
+
+	// what was written after the last commit is committed, every write stuck
+	dirty_test_count = 0;
+	munit_assert(fmem_commit_dirty(fm) >= 0);
+	munit_assert(fmem_dirty_pages(fm) == 0);
+	for(int i = 0; i < 4; i++){
+		for(size_t at = 0; at < dirty_test_block_pages * page; at += page) munit_assert(blocks[i][at] == (char) 500);
+		munit_assert(fmem_free(fm, blocks[i]) > 0);
+	}
+	munit_assert(fm->alloc_objects == 0 && fm->total_available == available);
+	munit_assert(fmem_dirty_stop(fm) == 0);
+	munit_assert(munmap(mem, dirty_test_size) == 0);
+	return MUNIT_OK;
+}
+
+MunitTest fdirty_tests[] = {
+	{"/dirty-commit", test_dirty_commit, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/dirty-threads", test_dirty_threads, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+static const MunitSuite fdirty_test_suite = {
+	(char*) "fdirty-tests",
+	fdirty_tests,
+	NULL,
+	1,
+	MUNIT_SUITE_OPTION_NONE
+};
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]){
+	return munit_suite_main(&fdirty_test_suite, NULL, argc, argv);
+}
+#endif
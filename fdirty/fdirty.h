@@ -0,0 +1,39 @@
+#ifndef __FDIRTY__
+#define __FDIRTY__
+#include <stdint.h>
+#include <stddef.h>
+#include "fmem/fmem.h"
+
+// dirty tracking finds what changed instead of callers saying it. memory of a
+// tracked fmem is write protected, the first write to an os page faults, the
+// fault handler records the page and lifts protection. fmem_commit_dirty(..)
+// hands every recorded page to the committer once (neighbours merged into one
+// range) and protects them again. while tracking, commits of fmem itself and
+// fmem_commit_mem(..) are no-ops, nothing is committed twice and a change the
+// caller forgot to commit is still found.
+// -- tracking is per process, every process that writes must track (or commit
+// 	 on its own).
+// -- the kernel does not fault on behalf of syscalls, read(2) (and friends)
+// 	 into tracked memory fail with EFAULT. read into a buffer then copy.
+// -- not for fmem with a redo log, the log is what makes ops atomic.
+// -- faults outside tracked memory go to the handler that was installed before.
+#define FDIRTY_MAX 16 // max # of fmem tracked by a process
+#define FDIRTY_COMMIT_RANGES 64 // max # of ranges handed to the committer at once
+
+#define E_BAD_DIRTY -11 // fmem is not tracked (or already is), has a redo log, or protection failed
+
+// starts tracking fm, fm committer is used by fmem_commit_dirty(..) only
+// returns E_BAD_DIRTY
+int64_t fmem_dirty_start(struct fmem *fm);
+
+// commits every page written since the last call and protects them again
+// returns # of pages committed, E_BAD_DIRTY, E_COMMIT_FAILED
+int64_t fmem_commit_dirty(struct fmem *fm);
+
+// returns # of pages written since the last fmem_commit_dirty(..), E_BAD_DIRTY
+int64_t fmem_dirty_pages(struct fmem *fm);
+
+// commits what is dirty, stops tracking and gives fm its committer back
+// returns E_BAD_DIRTY, E_COMMIT_FAILED
+int64_t fmem_dirty_stop(struct fmem *fm);
+#endif
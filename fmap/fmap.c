@@ -0,0 +1,610 @@
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "list/list.h"
+#include "fmem/fmem.h"
+#include "fmap.h"
+
+static inline struct fmem* fmap_fm(struct fmem_map *map){
+	return (struct fmem *) rptr_get(&map->fm);
+}
+
+static inline uint8_t* fmap_ctrl(struct fmem_map *map){
+	return (uint8_t *) rptr_get(&map->table);
+}
+
+static inline uint64_t fmap_slots(struct fmem_map *map){
+	return (uint64_t) map->groups * FMAP_GROUP;
+}
+
+static inline char* fmap_entry(struct fmem_map *map, uint8_t *ctrl, uint64_t slot){
+	return ((char *) ctrl) + fmap_slots(map) + slot * map->entry_size;
+}
+
+// at most 7/8 of slots are used (or deleted) before the table grows
+static inline uint64_t fmap_max_used(uint64_t slots){
+	return slots - slots / 8;
+}
+
+static inline uint64_t fmap_mix(uint64_t x){
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+// low 7 bits go to the control byte, the rest picks the group
+static inline uint64_t fmap_hash(struct fmem_map *map, const void *key){
+	const unsigned char *at = (const unsigned char *) key;
+	uint32_t len = map->key_size;
+	uint64_t hash = map->seed ^ len;
+	uint64_t word;
+	for(; len >= 8; len -= 8, at += 8){
+		memcpy(&word, at, 8);
+		hash = fmap_mix(hash ^ word);
+	}
+	if(len > 0){
+		word = 0;
+		memcpy(&word, at, len);
+		hash = fmap_mix(hash ^ word);
+	}
+	return hash;
+}
+
+// group matching gives a bit per slot of the group. words hold 8 control
+// bytes, bytes that are tag become 0 and x - 1 borrows into thier high bit.
+// the borrow can also flag a byte after a match, keys are compared anyway
+static inline uint32_t fmap_pack(uint64_t high_bits){
+	return (uint32_t) (((high_bits >> 7) * 0x0102040810204080ULL) >> 56);
+}
+
+static inline uint32_t fmap_match_scalar(const uint8_t *group, uint8_t tag){
+	uint32_t mask = 0;
+	for(int i = 0; i < 2; i++){
+		uint64_t word;
+		memcpy(&word, group + i * 8, 8);
+		uint64_t x = word ^ (0x0101010101010101ULL * tag);
+		mask |= fmap_pack((x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL) << (i * 8);
+	}
+	return mask;
+}
+
+// exact, empty is the only control byte with the high bit set and bit 1 clear
+static inline uint32_t fmap_match_empty_scalar(const uint8_t *group){
+	uint32_t mask = 0;
+	for(int i = 0; i < 2; i++){
+		uint64_t word;
+		memcpy(&word, group + i * 8, 8);
+		mask |= fmap_pack(word & ~(word << 6) & 0x8080808080808080ULL) << (i * 8);
+	}
+	return mask;
+}
+
+static inline uint32_t fmap_match_free_scalar(const uint8_t *group){
+	uint32_t mask = 0;
+	for(int i = 0; i < 2; i++){
+		uint64_t word;
+		memcpy(&word, group + i * 8, 8);
+		mask |= fmap_pack(word & 0x8080808080808080ULL) << (i * 8);
+	}
+	return mask;
+}
+
+#ifdef __SSE2__
+static inline uint32_t fmap_match(const uint8_t *group, uint8_t tag){
+	__m128i ctrl = _mm_load_si128((const __m128i *) group);
+	return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char) tag)));
+}
+
+static inline uint32_t fmap_match_empty(const uint8_t *group){
+	return fmap_match(group, FMAP_EMPTY);
+}
+
+// empty or deleted
+static inline uint32_t fmap_match_free(const uint8_t *group){
+	return (uint32_t) _mm_movemask_epi8(_mm_load_si128((const __m128i *) group));
+}
+#else
+#define fmap_match fmap_match_scalar
+#define fmap_match_empty fmap_match_empty_scalar
+#define fmap_match_free fmap_match_free_scalar
+#endif
+
+// returns slot of key, -1 if it is not in the map. free (if not NULL) is set
+// to the first empty or deleted slot on the way, -1 if there was none
+static int64_t fmap_find(struct fmem_map *map, uint8_t *ctrl, const void *key, uint64_t hash, int64_t *free){
+	uint8_t tag = hash & 0x7F;
+	uint32_t mask = map->groups - 1;
+	uint32_t group = (hash >> 7) & mask;
+	if(free != NULL) *free = -1;
+
+	for(uint32_t step = 1; step <= map->groups; step++){
+		uint8_t *at = ctrl + (uint64_t) group * FMAP_GROUP;
+		for(uint32_t match = fmap_match(at, tag); match != 0; match &= match - 1){
+			uint64_t slot = (uint64_t) group * FMAP_GROUP + __builtin_ctz(match);
+			if(memcmp(fmap_entry(map, ctrl, slot), key, map->key_size) == 0) return slot;
+		}
+		if(free != NULL && *free < 0){
+			uint32_t match = fmap_match_free(at);
+			if(match != 0) *free = (uint64_t) group * FMAP_GROUP + __builtin_ctz(match);
+		}
+		if(fmap_match_empty(at) != 0) return -1;
+		group = (group + step) & mask;
+	}
+	return -1;
+}
+
+// map and table are allocations of their own, ranges inside them are
+// committed via fmem_commit_mem_at(..). nothing to do if fmem is not persisted
+static inline int fmap_commit(struct fmem *fm, void *mem, void *at, uint64_t len){
+	if(fmem_committer(fm) == NULL || len == 0) return 0;
+	return fmem_commit_mem_at(fm, mem, at, (uint32_t) len) < 0 ? E_COMMIT_FAILED : 0;
+}
+
+static inline int fmap_commit_header(struct fmem_map *map){
+	return fmap_commit(fmap_fm(map), map, map, sizeof(struct fmem_map));
+}
+
+static inline uint32_t fmap_groups_for(uint64_t count){
+	uint32_t groups = 1;
+	while(fmap_max_used((uint64_t) groups * FMAP_GROUP) < count && groups < (1u << 31)) groups <<= 1;
+	return groups;
+}
+
+// moves every key to a new table of groups. the new table is committed
+// before the map points to it, the old one is freed after. on a crash in
+// between we leak one of them instead of pointing to freed memory
+static int64_t fmap_resize(struct fmem_map *map, uint32_t groups){
+	struct fmem *fm = fmap_fm(map);
+	uint64_t slots = (uint64_t) groups * FMAP_GROUP;
+	uint64_t bytes = slots + slots * map->entry_size;
+	if(bytes > UINT32_MAX / 2) return FMEM_E_NOMEM;
+
+	uint8_t *table = (uint8_t *) fmem_alloc_aligned(fm, (uint32_t) bytes, FMAP_ALIGN);
+	if((int64_t) table <= 0) return (int64_t) table;
+	memset(table, FMAP_EMPTY, slots);
+
+	uint8_t *old = fmap_ctrl(map);
+	struct fmem_map resized = *map;
+	resized.groups = groups;
+	for(uint64_t slot = 0; old != NULL && slot < fmap_slots(map); slot++){
+		if(old[slot] & 0x80) continue;
+		char *entry = fmap_entry(map, old, slot);
+		uint64_t hash = fmap_hash(map, entry);
+		int64_t to = -1;
+		fmap_find(&resized, table, entry, hash, &to);
+		table[to] = hash & 0x7F;
+		memcpy(fmap_entry(&resized, table, to), entry, map->entry_size);
+	}
+	if(fmap_commit(fm, table, table, bytes) != 0){
+		fmem_free(fm, table);
+		return E_COMMIT_FAILED;
+	}
+
+	rptr_set(&map->table, table);
+	map->groups = groups;
+	map->deleted = 0;
+	map->growth_left = fmap_max_used(slots) - map->count;
+	if(fmap_commit_header(map) != 0) return E_COMMIT_FAILED;
+	if(old != NULL && fmem_free(fm, old) < 0) return E_COMMIT_FAILED;
+	return slots;
+}
+
+struct fmem_map* fmem_map_create(struct fmem *fm, uint32_t key_size, uint32_t value_size, uint64_t count){
+	uint32_t value_offset = (key_size + 7) & ~7u;
+	uint64_t entry_size = ((uint64_t) value_offset + value_size + 7) & ~7ULL;
+	if(key_size == 0 || entry_size > UINT16_MAX) return (void *) E_BAD_MAP;
+
+	struct fmem_map *map = (struct fmem_map *) fmem_alloc(fm, sizeof(struct fmem_map));
+	if((int64_t) map <= 0) return map;
+
+	memset(map, 0, sizeof(struct fmem_map));
+	rptr_set(&map->fm, fm);
+	map->key_size = key_size;
+	map->value_size = value_size;
+	map->value_offset = value_offset;
+	map->entry_size = (uint32_t) entry_size;
+	// hashes must be the same in every process, the seed is kept in the map
+	map->seed = fmap_mix((uintptr_t) map - (uintptr_t) fm);
+
+	int64_t res = fmap_resize(map, fmap_groups_for(count));
+	if(res < 0){
+		void *table = rptr_get(&map->table);
+		if(table != NULL) fmem_free(fm, table);
+		fmem_free(fm, map);
+		return (void *) res;
+	}
+	return map;
+}
+
+void* fmem_map_get(struct fmem_map *map, const void *key){
+	uint8_t *ctrl = fmap_ctrl(map);
+	int64_t slot = fmap_find(map, ctrl, key, fmap_hash(map, key), NULL);
+	if(slot < 0) return NULL;
+	return fmap_entry(map, ctrl, slot) + map->value_offset;
+}
+
+int64_t fmem_map_put(struct fmem_map *map, const void *key, const void *value){
+	struct fmem *fm = fmap_fm(map);
+	uint64_t hash = fmap_hash(map, key);
+	uint8_t *ctrl = fmap_ctrl(map);
+	int64_t free = -1;
+	int64_t slot = fmap_find(map, ctrl, key, hash, &free);
+
+	if(slot >= 0){
+		char *at = fmap_entry(map, ctrl, slot) + map->value_offset;
+		memcpy(at, value, map->value_size);
+		return fmap_commit(fm, ctrl, at, map->value_size) != 0 ? E_COMMIT_FAILED : 0;
+	}
+
+	// an empty slot is used only if there is growth left, deleted slots are
+	// reused as is. a table that is full of deleted slots is rehashed at the
+	// same size
+	if(free < 0 || (ctrl[free] == FMAP_EMPTY && map->growth_left == 0)){
+		uint32_t groups = map->groups;
+		if(map->count + 1 > fmap_max_used(fmap_slots(map)) / 2) groups <<= 1;
+		int64_t res = fmap_resize(map, groups);
+		if(res < 0) return res;
+		ctrl = fmap_ctrl(map);
+		fmap_find(map, ctrl, key, hash, &free);
+	}
+
+	char *entry = fmap_entry(map, ctrl, free);
+	memcpy(entry, key, map->key_size);
+	memcpy(entry + map->value_offset, value, map->value_size);
+	int res = fmap_commit(fm, ctrl, entry, map->entry_size);
+
+	// the key is in the map once its control byte is
+	if(ctrl[free] == FMAP_DELETED){
+		map->deleted--;
+	}else{
+		map->growth_left--;
+	}
+	ctrl[free] = hash & 0x7F;
+	map->count++;
+	res |= fmap_commit(fm, ctrl, &ctrl[free], 1);
+	res |= fmap_commit_header(map);
+	return res != 0 ? E_COMMIT_FAILED : 1;
+}
+
+// a group that has an empty slot now always had one since the last resize,
+// no probe went past it, so the slot can be empty again. otherwise it is
+// left deleted for probes to go on
+int64_t fmem_map_del(struct fmem_map *map, const void *key){
+	struct fmem *fm = fmap_fm(map);
+	uint8_t *ctrl = fmap_ctrl(map);
+	int64_t slot = fmap_find(map, ctrl, key, fmap_hash(map, key), NULL);
+	if(slot < 0) return 0;
+
+	if(fmap_match_empty(ctrl + (slot / FMAP_GROUP) * FMAP_GROUP) != 0){
+		ctrl[slot] = FMAP_EMPTY;
+		map->growth_left++;
+	}else{
+		ctrl[slot] = FMAP_DELETED;
+		map->deleted++;
+	}
+	map->count--;
+	int res = fmap_commit(fm, ctrl, &ctrl[slot], 1);
+	res |= fmap_commit_header(map);
+	return res != 0 ? E_COMMIT_FAILED : 1;
+}
+
+int64_t fmem_map_commit(struct fmem_map *map, void *value){
+	uint8_t *ctrl = fmap_ctrl(map);
+	char *entries = fmap_entry(map, ctrl, 0);
+	uint64_t offset = (char *) value - entries - map->value_offset;
+	if((char *) value < entries + map->value_offset || offset % map->entry_size != 0) return E_BAD_MAP;
+	uint64_t slot = offset / map->entry_size;
+	if(slot >= fmap_slots(map) || (ctrl[slot] & 0x80)) return E_BAD_MAP;
+	return fmap_commit(fmap_fm(map), ctrl, value, map->value_size) != 0 ? E_COMMIT_FAILED : 0;
+}
+
+int64_t fmem_map_reserve(struct fmem_map *map, uint64_t count){
+	uint32_t groups = fmap_groups_for(count);
+	if(groups <= map->groups) return fmap_slots(map);
+	return fmap_resize(map, groups);
+}
+
+void* fmem_map_next(struct fmem_map *map, uint64_t *at){
+	uint8_t *ctrl = fmap_ctrl(map);
+	for(uint64_t slot = *at; slot < fmap_slots(map); slot++){
+		if(ctrl[slot] & 0x80) continue;
+		*at = slot + 1;
+		return fmap_entry(map, ctrl, slot);
+	}
+	*at = fmap_slots(map);
+	return NULL;
+}
+
+// the map goes first, on a crash after it the table leaks
+int64_t fmem_map_destroy(struct fmem_map *map){
+	struct fmem *fm = fmap_fm(map);
+	void *table = rptr_get(&map->table);
+	if(fmem_free(fm, map) < 0) return E_COMMIT_FAILED;
+	if(table != NULL && fmem_free(fm, table) < 0) return E_COMMIT_FAILED;
+	return 0;
+}
+
+#ifdef __UNIT_TESTING__
+#include <stdio.h>
+#include <stdlib.h>
+#include "munit/munit.h"
+#include "things.h"
+
+#define map_test_size 4 * 1024 * 1024
+static char map_test_live[map_test_size] __attribute__((aligned(4096)));
+static char map_test_disk[map_test_size];
+static int map_test_calls = 0;
+static int map_test_fail_at = 0; // the call that fails, 0 if none
+
+// copies committed ranges to a disk image, a crash is a copy back
+static int map_test_committer(struct commit_range *ranges, uint8_t count){
+	if(++map_test_calls == map_test_fail_at) return -1;
+	for(int i = 0; i < count; i++){
+		size_t offset = (char *) ranges[i].start - map_test_live;
+		if(offset + ranges[i].len > map_test_size) return -1;
+		memcpy(map_test_disk + offset, ranges[i].start, ranges[i].len);
+	}
+	return 0;
+}
+
+static struct fmem* map_test_fmem(committer_t committer){
+	memset(map_test_live, 0, map_test_size);
+	memset(map_test_disk, 0, map_test_size);
+	struct fmem *fm = fmem_create_new(map_test_live, map_test_size, 0, committer);
+	if(committer != NULL) memcpy(map_test_disk, map_test_live, map_test_size);
+	return fm;
+}
+
+// control bytes agree with the counters and every key is found where it is
+static bool map_consistent(struct fmem_map *map){
+	uint8_t *ctrl = fmap_ctrl(map);
+	uint64_t count = 0;
+	uint64_t deleted = 0;
+	uint64_t empty = 0;
+	for(uint64_t slot = 0; slot < fmap_slots(map); slot++){
+		if(ctrl[slot] == FMAP_EMPTY){
+			empty++;
+		}else if(ctrl[slot] == FMAP_DELETED){
+			deleted++;
+		}else{
+			char *entry = fmap_entry(map, ctrl, slot);
+			if(ctrl[slot] != (fmap_hash(map, entry) & 0x7F)) return false;
+			if(fmem_map_get(map, entry) != entry + map->value_offset) return false;
+			count++;
+		}
+	}
+	if(count != map->count || deleted != map->deleted) return false;
+	return count + deleted + map->growth_left == fmap_max_used(fmap_slots(map)) && empty >= map->growth_left;
+}
+
+FMEM_MAP_DEFINE(ages, uint64_t, uint32_t)
+FMEM_MAP_DEFINE(things_by_id, uint32_t, struct thing)
+
+static MunitResult test_map_match(const MunitParameter params[], void* data){
+	uint8_t group[FMAP_GROUP] __attribute__((aligned(16)));
+	srand(1);
+	for(int round = 0; round < 10000; round++){
+		for(int i = 0; i < FMAP_GROUP; i++){
+			int kind = rand() % 4;
+			group[i] = kind == 0 ? FMAP_EMPTY : kind == 1 ? FMAP_DELETED : (uint8_t) (rand() % 4);
+		}
+		uint8_t tag = (uint8_t) (rand() % 4);
+		uint32_t exact = 0;
+		uint32_t empty = 0;
+		uint32_t free = 0;
+		for(int i = 0; i < FMAP_GROUP; i++){
+			if(group[i] == tag) exact |= 1u << i;
+			if(group[i] == FMAP_EMPTY) empty |= 1u << i;
+			if(group[i] & 0x80) free |= 1u << i;
+		}
+		// matches may have extras (keys are compared), never miss one
+		munit_assert((fmap_match(group, tag) & exact) == exact);
+		munit_assert((fmap_match_scalar(group, tag) & exact) == exact);
+		munit_assert(fmap_match_empty(group) == empty && fmap_match_empty_scalar(group) == empty);
+		munit_assert(fmap_match_free(group) == free && fmap_match_free_scalar(group) == free);
+	}
+	return MUNIT_OK;
+}
+
+static MunitResult test_map_put_get(const MunitParameter params[], void* data){
+	struct fmem *fm = map_test_fmem(NULL);
+	munit_assert(fm > 0);
+	size_t available = fm->total_available;
+
+	munit_assert(fmem_map_create(fm, 0, 8, 0) == (void *) E_BAD_MAP);
+	struct fmem_map *map = ages_create(fm, 0);
+	munit_assert(map > 0);
+	munit_assert(map->groups == 1 && map->entry_size == 16 && map->value_offset == 8);
+	munit_assert(((uintptr_t) fmap_ctrl(map)) % FMAP_ALIGN == 0);
+	munit_assert(ages_get(map, 1) == NULL);
+	munit_assert(ages_del(map, 1) == 0);
+
+	// grows as it fills
+	const uint64_t n = 20000;
+	for(uint64_t i = 0; i < n; i++) munit_assert(ages_put(map, i * 7919, (uint32_t) i) == 1);
+	munit_assert(map->count == n);
+	munit_assert(map->count <= fmap_max_used(fmap_slots(map)));
+	munit_assert(map_consistent(map));
+	for(uint64_t i = 0; i < n; i++){
+		uint32_t *age = ages_get(map, i * 7919);
+		munit_assert(age != NULL && *age == i);
+	}
+	munit_assert(ages_get(map, 1) == NULL);
+
+	// replaced in place
+	munit_assert(ages_put(map, 7919, 5) == 0);
+	munit_assert(*ages_get(map, 7919) == 5);
+	munit_assert(map->count == n);
+
+	for(uint64_t i = 0; i < n; i += 2) munit_assert(ages_del(map, i * 7919) == 1);
+	munit_assert(ages_del(map, 0) == 0);
+	munit_assert(map->count == n / 2);
+	munit_assert(map_consistent(map));
+	for(uint64_t i = 0; i < n; i++) munit_assert((ages_get(map, i * 7919) != NULL) == (i % 2 == 1));
+
+	// walk sees every key once
+	uint64_t at = 0;
+	uint64_t seen = 0;
+	uint64_t *key;
+	while((key = fmem_map_next(map, &at)) != NULL){
+		munit_assert((*key / 7919) % 2 == 1);
+		munit_assert(*((uint32_t *) fmem_map_value(map, key)) == (*key == 7919 ? 5 : *key / 7919));
+		seen++;
+	}
+	munit_assert(seen == n / 2);
+	munit_assert(fmem_map_destroy(map) == 0);
+
+	// struct values, room asked for up front
+	map = things_by_id_create(fm, 1000);
+	munit_assert(map > 0);
+	uint32_t groups = map->groups;
+	for(uint32_t i = 0; i < 1000; i++){
+		struct thing t = {0};
+		t.value = (char) i;
+		munit_assert(things_by_id_put(map, i, t) == 1);
+	}
+	munit_assert(map->groups == groups);
+	struct thing *t = things_by_id_get(map, 10);
+	t->value = 'x';
+	munit_assert(fmem_map_commit(map, t) == 0);
+	munit_assert(fmem_map_commit(map, ((char *) t) + 1) == E_BAD_MAP);
+	munit_assert(fmem_map_reserve(map, 10) == fmap_slots(map));
+	munit_assert(fmem_map_reserve(map, 8000) > 8000);
+	munit_assert(things_by_id_get(map, 10)->value == 'x');
+	munit_assert(map_consistent(map));
+	munit_assert(fmem_map_destroy(map) == 0);
+
+	munit_assert(fm->alloc_objects == 0);
+	munit_assert(fm->total_available == available);
+	return MUNIT_OK;
+}
+
+static MunitResult test_map_churn(const MunitParameter params[], void* data){
+	struct fmem *fm = map_test_fmem(NULL);
+	munit_assert(fm > 0);
+
+	// keys come and go, deleted slots are reused or cleared by a rehash at
+	// the same size, the table does not grow
+	struct fmem_map *map = ages_create(fm, 512);
+	munit_assert(map > 0);
+	uint32_t groups = map->groups;
+	for(uint64_t i = 0; i < 100000; i++){
+		munit_assert(ages_put(map, i, (uint32_t) i) == 1);
+		if(i >= 400) munit_assert(ages_del(map, i - 400) == 1);
+	}
+	munit_assert(map->count == 400);
+	munit_assert(map->groups == groups);
+	munit_assert(map_consistent(map));
+	for(uint64_t i = 100000 - 400; i < 100000; i++) munit_assert(*ages_get(map, i) == i);
+	munit_assert(fmem_map_destroy(map) == 0);
+	munit_assert(fm->alloc_objects == 0);
+	return MUNIT_OK;
+}
+
+static MunitResult test_map_persisted(const MunitParameter params[], void* data){
+	struct fmem *fm = map_test_fmem(map_test_committer);
+	munit_assert(fm > 0);
+
+	struct fmem_map *map = ages_create(fm, 0);
+	munit_assert(map > 0);
+	fmem_set_root(fm, 3, map);
+	munit_assert(fmem_commit_user_data(fm) > 0);
+	for(uint64_t i = 0; i < 3000; i++) munit_assert(ages_put(map, i, (uint32_t) i * 2) == 1);
+	for(uint64_t i = 0; i < 3000; i += 3) munit_assert(ages_del(map, i) == 1);
+
+	// crash, everything we did is on disk
+	memcpy(map_test_live, map_test_disk, map_test_size);
+	fm = fmem_from_existing(map_test_live, map_test_committer);
+	munit_assert(fm > 0);
+	map = fmem_get_root(fm, 3);
+	munit_assert(map->count == 2000);
+	munit_assert(map_consistent(map));
+	for(uint64_t i = 0; i < 3000; i++){
+		uint32_t *value = ages_get(map, i);
+		munit_assert(i % 3 == 0 ? value == NULL : (value != NULL && *value == i * 2));
+	}
+	munit_assert(fm->alloc_objects == 2); // old tables were freed
+
+	// puts in a batch get to the committer once
+	struct fmem_batch batch;
+	struct commit_range storage[32];
+	munit_assert(fmem_batch_begin(fm, &batch, storage, 32) == 0);
+	map_test_calls = 0;
+	for(uint64_t i = 0; i < 100; i++) munit_assert(ages_put(map, 10000 + i, 1) == 1);
+	munit_assert(map_test_calls == 0);
+	munit_assert(fmem_batch_commit(fm) > 0);
+	munit_assert(map_test_calls == 1);
+
+	memcpy(map_test_live, map_test_disk, map_test_size);
+	fm = fmem_from_existing(map_test_live, map_test_committer);
+	map = fmem_get_root(fm, 3);
+	munit_assert(map->count == 2100);
+	munit_assert(map_consistent(map));
+	munit_assert(*ages_get(map, 10099) == 1);
+	munit_assert(fmem_map_destroy(map) == 0);
+	munit_assert(fm->alloc_objects == 0);
+	return MUNIT_OK;
+}
+
+static MunitResult test_map_commit_failed(const MunitParameter params[], void* data){
+	struct fmem *fm = map_test_fmem(map_test_committer);
+	munit_assert(fm > 0);
+	struct fmem_map *map = ages_create(fm, 0);
+	munit_assert(map > 0);
+	for(uint64_t i = 0; i < 10; i++) munit_assert(ages_put(map, i, 1) == 1);
+	void *table = fmap_ctrl(map);
+	uint32_t alloc_objects = fm->alloc_objects;
+
+	// a new table that doesn't make it to disk is freed, the map is untouched
+	map_test_calls = 0;
+	map_test_fail_at = 2; // alloc, then the table
+	munit_assert(fmem_map_reserve(map, 1000) == E_COMMIT_FAILED);
+	munit_assert((void *) fmap_ctrl(map) == table && map->count == 10);
+	munit_assert(map_consistent(map));
+	munit_assert(fm->alloc_objects == alloc_objects);
+
+	// so is a map, at the table or at the map itself
+	map_test_calls = 0;
+	map_test_fail_at = 3; // map alloc, table alloc, then the table
+	munit_assert(ages_create(fm, 0) == (void *) E_COMMIT_FAILED);
+	munit_assert(fm->alloc_objects == alloc_objects);
+	map_test_calls = 0;
+	map_test_fail_at = 4;
+	munit_assert(ages_create(fm, 0) == (void *) E_COMMIT_FAILED);
+	munit_assert(fm->alloc_objects == alloc_objects);
+	map_test_fail_at = 0;
+
+	munit_assert(ages_put(map, 100, 1) == 1);
+	munit_assert(fmem_map_destroy(map) == 0);
+	munit_assert(fm->alloc_objects == 0);
+	return MUNIT_OK;
+}
+
+MunitTest fmap_tests[] = {
+	{"/map-match", test_map_match, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/map-put-get", test_map_put_get, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/map-churn", test_map_churn, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/map-persisted", test_map_persisted, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/map-commit-failed", test_map_commit_failed, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+static const MunitSuite fmap_test_suite = {
+	(char*) "fmap-tests",
+	fmap_tests,
+	NULL,
+	1,
+	MUNIT_SUITE_OPTION_NONE
+};
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]){
+	return munit_suite_main(&fmap_test_suite, NULL, argc, argv);
+}
+#endif
@@ -0,0 +1,102 @@
+#ifndef __FMAP__
+#define __FMAP__
+#include <stdint.h>
+#include "list/list.h"
+#include "fmem/fmem.h"
+
+// an open addressing hash map of fixed size keys and values (swiss table).
+// slots are in groups of FMAP_GROUP, every slot has a control byte: empty,
+// deleted or 7 bits of the hash of its key. a lookup hashes the key once,
+// picks a group and matches all control bytes of the group against the 7
+// bits at once (sse2, or 64 bit words where there is none), keys are only
+// compared for slots that match. groups are probed (triangular) until a group
+// with an empty slot. the map lives in fmem memory, control bytes and entries
+// in one allocation that doubles at 7/8 full. links are relative so the map
+// can be stashed as a root (fmem_set_root(..)) and used by every process
+// attached.
+// -- keys are compared and hashed as bytes, padding in struct keys must be zeroed.
+// -- every change is committed (entry, then control byte, then the map), ops
+// 	 in a batch (fmem_batch_begin(..)) reach the committer as one call. a
+// 	 crash between the last two leaves count (not the entries) one op behind.
+// -- the table is 64 bytes aligned, compaction does not move it. pointers to
+// 	 values are good until the next put or del.
+// -- a map is not locked, callers that share one must serialize access.
+// FMEM_MAP_DEFINE(name, key_type, value_type) defines typed static inline
+// wrappers, e.g. FMEM_MAP_DEFINE(ages, uint64_t, uint32_t) then
+// ages_put(map, id, 42), *ages_get(map, id)
+#define FMAP_GROUP 16
+#define FMAP_ALIGN 64
+#define FMAP_EMPTY 0x80
+#define FMAP_DELETED 0xFE
+
+#define E_BAD_MAP -19 // key size is 0 or key and value are too big
+
+struct fmem_map{
+	rptr_t fm;             // fmem the map allocates from
+	rptr_t table;          // groups * FMAP_GROUP control bytes then as many entries
+	uint32_t key_size;
+	uint32_t value_size;
+	uint32_t value_offset; // value is at entry + value_offset (8 bytes aligned)
+	uint32_t entry_size;   // key and value, rounded up to 8 bytes
+	uint32_t groups;       // power of 2
+	uint32_t unused;
+	uint64_t seed;
+	uint64_t count;        // # of keys
+	uint64_t deleted;      // # of deleted slots
+	uint64_t growth_left;  // # of empty slots that can be used before the table grows
+};
+
+// creates a map (in fmem memory) with room for count keys before it grows
+// returns E_BAD_MAP, FMEM_E_NOMEM, E_COMMIT_FAILED
+struct fmem_map* fmem_map_create(struct fmem *fm, uint32_t key_size, uint32_t value_size, uint64_t count);
+
+// returns the value of key, NULL if key is not in the map
+void* fmem_map_get(struct fmem_map *map, const void *key);
+
+// adds key with a copy of value, or replaces the value if key is there
+// returns 1 if key was added, 0 if replaced
+// returns FMEM_E_NOMEM (map is untouched), E_COMMIT_FAILED
+int64_t fmem_map_put(struct fmem_map *map, const void *key, const void *value);
+
+// removes key
+// returns 1 if removed, 0 if key is not in the map, E_COMMIT_FAILED
+int64_t fmem_map_del(struct fmem_map *map, const void *key);
+
+// commits value (returned by fmem_map_get(..)) after it was changed in place
+// returns E_BAD_MAP if value is not in the table, E_COMMIT_FAILED
+int64_t fmem_map_commit(struct fmem_map *map, void *value);
+
+// makes room for count keys
+// returns # of slots, FMEM_E_NOMEM (map is untouched), E_COMMIT_FAILED
+int64_t fmem_map_reserve(struct fmem_map *map, uint64_t count);
+
+// walks keys in table order, *at starts at 0 and is moved past the key returned
+// returns the key, NULL once there are no more
+void* fmem_map_next(struct fmem_map *map, uint64_t *at);
+
+// returns the value of a key returned by fmem_map_next(..)
+static inline void* fmem_map_value(struct fmem_map *map, void *key){
+	return ((char *) key) + map->value_offset;
+}
+
+// frees the table and the map itself
+// returns E_COMMIT_FAILED
+int64_t fmem_map_destroy(struct fmem_map *map);
+
+#define FMEM_MAP_DEFINE(name, key_type, value_type) \
+static inline struct fmem_map* name##_create(struct fmem *fm, uint64_t count){ \
+	return fmem_map_create(fm, sizeof(key_type), sizeof(value_type), count); \
+} \
+\
+static inline value_type* name##_get(struct fmem_map *map, key_type key){ \
+	return (value_type *) fmem_map_get(map, &key); \
+} \
+\
+static inline int64_t name##_put(struct fmem_map *map, key_type key, value_type value){ \
+	return fmem_map_put(map, &key, &value); \
+} \
+\
+static inline int64_t name##_del(struct fmem_map *map, key_type key){ \
+	return fmem_map_del(map, &key); \
+}
+#endif
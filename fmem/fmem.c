@@ -2,6 +2,18 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 
 #include "list/list.h"
@@ -15,15 +27,74 @@
 // this ensure that we don't end up with unusable pages
 #define PAGE_REMAIN_FREE 2 * sizeof(struct fmem_page) // if you change that check the fit tests below.
 
+// compact pages (FMEM_F_COMPACT) have a flags + size header only. they are
+// not linked, the next page starts where a page ends. a free page keeps its
+// size in its last 4 bytes (footer) and the page after it has the prev free
+// flag set, that is how a free page before a page is found. the head page
+// always has a full header, fmem is at the same place in both formats.
+#define COMPACT_OVERHEAD (2 * sizeof(uint32_t))
+// a free page body holds a free list link and the footer
+#define COMPACT_MIN_BODY (sizeof(struct rlist_head) + sizeof(uint32_t))
+#define COMPACT_REMAIN_FREE (COMPACT_OVERHEAD + COMPACT_MIN_BODY)
+
 
 #define CAN_NOT_FIT    0 // this page can not fit the needed size
 #define FIT_AS_IS      1 // this page can fit but without split, the entire page will be used
 #define FIT_WITH_CARVE 2 // this page can fit with enough space to split into a new one
 
-#define POISON 0xBEEF // when __BAD_MEM__ is defined we will use this value to check for corruption
+#define POISON FMEM_POISON // when __BAD_MEM__ is defined we will use this value to check for corruption
+
+// compact flag is set on every page (but head) of a compact fmem
+static inline bool fpage_is_compact(struct fmem_page *fpage){
+  const uint32_t mask =  1 << 12;
+  return (fpage->flags & mask) > 0;
+}
+
+static inline void fpage_set_compact(struct fmem_page *fpage){
+  const uint32_t mask = 1 << 12;
+  fpage->flags |= mask;
+}
+
+// prev free flag is only used by compact pages, page before this one is free
+static inline bool fpage_prev_is_free(struct fmem_page *fpage){
+  const uint32_t mask =  1 << 11;
+  return (fpage->flags & mask) > 0;
+}
+
+static inline void fpage_set_prev_free(struct fmem_page *fpage, bool prev_free){
+  const uint32_t mask = 1 << 11;
+  if(prev_free) fpage->flags |= mask; else fpage->flags &= ~mask;
+}
+
+// header size of a page
+static inline uint32_t fpage_overhead(struct fmem_page *fpage){
+  return fpage_is_compact(fpage) ? COMPACT_OVERHEAD : PAGE_OVERHEAD;
+}
+
+// header size of pages (but head) in fmem
+static inline uint32_t fmem_overhead(struct fmem *fm){
+  return (fm->flags & FMEM_F_COMPACT) ? COMPACT_OVERHEAD : PAGE_OVERHEAD;
+}
+
+// see PAGE_REMAIN_FREE
+static inline uint32_t fmem_remain_free(struct fmem *fm){
+  return (fm->flags & FMEM_F_COMPACT) ? COMPACT_REMAIN_FREE : PAGE_REMAIN_FREE;
+}
+
+// with a default alignment every page (but the head) starts align - overhead
+// after a boundary, so its body is aligned and pages are multiples of align.
+// compaction can then move a page by a free page in front of it and keep the
+// alignment. returns the body size of a page of size bytes that keeps that
+static inline uint32_t fmem_align_body(struct fmem *fm, uint32_t size){
+  if(fm->align <= 1) return size;
+  uint32_t overhead = fmem_overhead(fm);
+  uint64_t page = ((uint64_t) size + overhead + fm->align - 1) & ~((uint64_t) fm->align - 1);
+  return page - overhead > UINT32_MAX ? UINT32_MAX : (uint32_t) (page - overhead);
+}
+
 // returns actual free size in byes
 static inline uint32_t fpage_actual(struct fmem_page *fpage){
-  return fpage->size - PAGE_OVERHEAD;
+  return fpage->size - fpage_overhead(fpage);
 }
 
 // given a page (WE DON'T CHECK IF IT IS FREE) and an arbitrary
@@ -36,26 +107,67 @@ static inline int fpage_can_fit(struct fmem_page *fpage, uint32_t size_needed){
   // can't fit
   if(size_needed > actual) return CAN_NOT_FIT;
   // fit as is, the remining is too small to be used in a different page
-  if(size_needed + PAGE_REMAIN_FREE >= actual) return FIT_AS_IS;
+  if(size_needed + (fpage_is_compact(fpage) ? COMPACT_REMAIN_FREE : PAGE_REMAIN_FREE) >= actual) return FIT_AS_IS;
   // it is a big page, split it
   return FIT_WITH_CARVE;
 }
 
+// the page after fpage (head if fpage is the last one)
+static inline struct fmem_page* fpage_next(struct fmem *fm, struct fmem_page *fpage){
+  if(!(fm->flags & FMEM_F_COMPACT)) return rlist_entry(rlist_next(&fpage->list), struct fmem_page, list);
+
+  char *head = ((char *) fm) - PAGE_OVERHEAD;
+  char *next = ((char *) fpage) + fpage->size;
+  return (struct fmem_page *) (next == head + fm->total_size ? head : next);
+}
+
+// the page before fpage if it is free, NULL otherwise
+static inline struct fmem_page* fpage_prev_free(struct fmem *fm, struct fmem_page *fpage){
+  if(!(fm->flags & FMEM_F_COMPACT)){
+    struct fmem_page *prev = rlist_entry(rlist_prev(&fpage->list), struct fmem_page, list);
+    return (prev != fpage && (prev->flags & (1 << 15)) == 0) ? prev : NULL;
+  }
+
+  if(!fpage_prev_is_free(fpage)) return NULL;
+  uint32_t prev_size;
+  memcpy(&prev_size, ((char *) fpage) - sizeof(uint32_t), sizeof(uint32_t));
+  return (struct fmem_page *) (((char *) fpage) - prev_size);
+}
+
+// walks every page but head, in address order
+#define fpage_for_each(fm, fpage) \
+  for(fpage = fpage_next(fm, fpage_from_mem(fm)); fpage != fpage_from_mem(fm); fpage = fpage_next(fm, fpage))
+
+// links a new page after at, compact pages are not linked
+static inline void fpage_link_after(struct fmem *fm, struct fmem_page *at, struct fmem_page *fpage){
+  if(!(fm->flags & FMEM_F_COMPACT)) rlist_add_after(&at->list, &fpage->list);
+}
+
+static inline void fpage_unlink(struct fmem *fm, struct fmem_page *fpage){
+  if(!(fm->flags & FMEM_F_COMPACT)) rlist_remove_at(&fpage->list);
+}
+
+// zeroes the header of a new page and sets its size
+static inline void fpage_init(struct fmem *fm, struct fmem_page *fpage, uint32_t size){
+  memset(fpage, 0, fmem_overhead(fm)); // we let the user reset the memory if the want
+  fpage->size = size;
+  if(fm->flags & FMEM_F_COMPACT) fpage_set_compact(fpage);
+}
+
 // given fmem page (fpage) of arbitrary size, carve out a new page (created)
 // and adjust sizes accordingly. The function does not perform size nor
 // fit checks, it goes straight to carving logic. we always add overhead
 // to the carve needed
-static void fpage_carve(struct fmem_page *fpage, struct fmem_page **created, uint32_t to_carve){
-  uint32_t actual_needed = to_carve + PAGE_OVERHEAD;
+static void fpage_carve(struct fmem *fm, struct fmem_page *fpage, struct fmem_page **created, uint32_t to_carve){
+  uint32_t actual_needed = to_carve + fmem_overhead(fm);
   // set new size on old page
   fpage->size = fpage->size - actual_needed;
 
   char * start = (char *) fpage;
   *created = (struct fmem_page *) (start + fpage->size);
-  memset(*created, 0, sizeof(struct fmem_page)); // we let the user reset the memory if the want
   // set the new page
-  (*created)->size = actual_needed;
-  list_add_after(&fpage->list, &(*created)->list);
+  fpage_init(fm, *created, actual_needed);
+  fpage_link_after(fm, fpage, *created);
 }
 
 // a magic number is a 2 bytes wide arbitrary value that can
@@ -85,44 +197,85 @@ static inline void fpage_set_busy(struct fmem_page *fpage){
 }
 
 static inline void fpage_set_free(struct fmem_page *fpage){
-  const uint32_t mask = ~(1 << 15);
+  const uint32_t mask = ~((1 << 15) | (1 << 14) | (1 << 13) | (1 << 10)); // a free page is neither a handle, pinned nor sampled
   fpage->flags &= mask;
 }
 
+// handle flag is next to busy flag, set on pages allocated via fmem_halloc(..). the
+// handle is stashed in the last 4 bytes of the body
+static inline bool fpage_is_handle(struct fmem_page *fpage){
+  const uint32_t mask =  1 << 14;
+  return (fpage->flags & mask) > 0;
+}
+
+static inline void fpage_set_handle(struct fmem_page *fpage){
+  const uint32_t mask = 1 << 14;
+  fpage->flags |= mask;
+}
+
+// pinned flag is set on pages aligned past the default alignment, compaction
+// does not move them
+static inline bool fpage_is_pinned(struct fmem_page *fpage){
+  const uint32_t mask =  1 << 13;
+  return (fpage->flags & mask) > 0;
+}
+
+static inline void fpage_set_pinned(struct fmem_page *fpage){
+  const uint32_t mask = 1 << 13;
+  fpage->flags |= mask;
+}
+
+// sampled flag is set on pages the sampler was called for (see fmem_set_sampler(..)),
+// thier free and moves are reported too. it means nothing to other processes
+static inline bool fpage_is_sampled(struct fmem_page *fpage){
+  const uint32_t mask =  1 << 10;
+  return (fpage->flags & mask) > 0;
+}
+
+static inline void fpage_set_sampled(struct fmem_page *fpage){
+  const uint32_t mask = 1 << 10;
+  fpage->flags |= mask;
+}
+
+static inline void fpage_clear_sampled(struct fmem_page *fpage){
+  const uint32_t mask = 1 << 10;
+  fpage->flags &= ~mask;
+}
+
 // merges the page with prev, next pages where possible
 // we merge pages to:
 // 1- minimize the # of iteration needed to find a free page
 // 2- create holes of free mem big enough to accomdate large allocs
-static struct fmem_page* fpage_merge(struct fmem_page *fpage){
+static struct fmem_page* fpage_merge(struct fmem *fm, struct fmem_page *fpage){
 // there are three possibilities:
 // 1- prev and next are free (best case) merge all
 // 2- prev is free merge current into previous
 // 3- next is free merge next into current
-  struct fmem_page *prev = list_entry(fpage->list.prev, struct fmem_page, list);
-  struct fmem_page *next = list_entry(fpage->list.next, struct fmem_page, list);
+  struct fmem_page *prev = fpage_prev_free(fm, fpage);
+  struct fmem_page *next = fpage_next(fm, fpage);
 
-  bool prev_is_same = (prev == fpage);
-  bool next_is_same = (next == fpage);
+  bool prev_is_free = (prev != NULL);
+  bool next_is_free = (next != fpage && fpage_is_free(next));
 
   // merge current and next into prev
-  if((!prev_is_same && fpage_is_free(prev)) && (!next_is_same && fpage_is_free(next))){
+  if(prev_is_free && next_is_free){
     prev->size = prev->size + fpage->size + next->size; // give all size to first one
-    list_remove_at(&next->list);
-    list_remove_at(&fpage->list);
+    fpage_unlink(fm, next);
+    fpage_unlink(fm, fpage);
     return prev;
   }
 
   // merge current into previous
-  if(!prev_is_same && fpage_is_free(prev)){
+  if(prev_is_free){
     prev->size = prev->size + fpage->size;
-    list_remove_at(&fpage->list);
+    fpage_unlink(fm, fpage);
     return prev;
   }
 
   // merge next into current
-  if(!next_is_same && fpage_is_free(next)){
+  if(next_is_free){
     fpage->size = fpage->size + next->size;
-    list_remove_at(&next->list);
+    fpage_unlink(fm, next);
     return fpage;
   }
 
@@ -132,392 +285,5134 @@ static struct fmem_page* fpage_merge(struct fmem_page *fpage){
 
 // returns a refrence to memory owned by a page
 static inline void* mem_from_fpage(struct fmem_page *fpage){
-  return (void *) ( ((char *) fpage) + PAGE_OVERHEAD);
+  return (void *) ( ((char *) fpage) + fpage_overhead(fpage));
 }
-// returns the page owned by a memory reference
+// returns the page owned by a memory reference (head, or any page of an fmem
+// with full headers). see fpage_of(..)
 static inline struct fmem_page* fpage_from_mem(void *mem){
   return (struct fmem_page *) ( ((char *) mem) - PAGE_OVERHEAD);
 }
+// returns the page owned by a memory reference that was allocated from fm
+static inline struct fmem_page* fpage_of(struct fmem *fm, void *mem){
+  return (struct fmem_page *) ( ((char *) mem) - fmem_overhead(fm));
+}
 
+// a handle page keeps its handle at the end of its body (it may not be aligned)
+static inline void* fpage_handle_slot(struct fmem_page *fpage){
+  return ((char *) mem_from_fpage(fpage)) + fpage_actual(fpage) - sizeof(fmem_handle_t);
+}
 
-static inline bool atomic_compare_swap(uint32_t * ptr, uint32_t compare, uint32_t exchange) {
-  return __atomic_compare_exchange_n(ptr, &compare, exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+static inline fmem_handle_t fpage_handle_of(struct fmem_page *fpage){
+  fmem_handle_t handle;
+  memcpy(&handle, fpage_handle_slot(fpage), sizeof(fmem_handle_t));
+  return handle;
 }
 
-// spin lock style locking mechnasim, we have only one lock
-// we are trying to minimize deps so we are not trying to link
-// to pthread
-static void inline fmem_lock(struct fmem *fm){
-   while(!atomic_compare_swap(&fm->lock, 0, 1)) {
-            }
+// counters are only maintained if asked for on creation. some are updated
+// outside the lock (commits), so they are all atomic
+#define FMEM_STAT(fm, counter, n) do { \
+  if((fm)->flags & FMEM_F_STATS) __atomic_add_fetch(&(fm)->counters.counter, (n), __ATOMIC_RELAXED); \
+} while(0)
+
+// committers are per process, a function pointer means nothing to another
+// process attached to the same memory. entries are never freed (an fmem
+// created again at the same address takes its entry over), so lookups need
+// no lock. the last entry found is kept per thread, it is the common case
+struct fmem_committer_entry{
+  struct fmem *fm;
+  committer_t committer;
+  struct fmem_committer_entry *next;
+};
+static struct fmem_committer_entry *committers = NULL;
+static pthread_mutex_t committers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct fmem_committer_entry *last_committer = NULL;
+
+static inline struct fmem_committer_entry* fmem_committer_entry_of(struct fmem *fm){
+  struct fmem_committer_entry *entry = last_committer;
+  if(entry != NULL && entry->fm == fm) return entry;
+  for(entry = __atomic_load_n(&committers, __ATOMIC_ACQUIRE); entry != NULL; entry = entry->next){
+    if(entry->fm == fm){
+      last_committer = entry;
+      return entry;
+    }
+  }
+  return NULL;
 }
 
+committer_t fmem_committer(struct fmem *fm){
+  struct fmem_committer_entry *entry = fmem_committer_entry_of(fm);
+  return entry == NULL ? NULL : __atomic_load_n(&entry->committer, __ATOMIC_ACQUIRE);
+}
 
-static void inline fmem_unlock(struct fmem *fm){
-   __atomic_store_n(&fm->lock, 0, __ATOMIC_SEQ_CST);
+int64_t fmem_set_committer(struct fmem *fm, committer_t committer){
+  struct fmem_committer_entry *entry = fmem_committer_entry_of(fm);
+  if(entry == NULL){
+    if(committer == NULL) return 0; // nothing to clear
+    pthread_mutex_lock(&committers_mutex);
+    for(entry = committers; entry != NULL && entry->fm != fm; entry = entry->next);
+    if(entry == NULL){
+      entry = calloc(1, sizeof(struct fmem_committer_entry));
+      if(entry == NULL){
+        pthread_mutex_unlock(&committers_mutex);
+        return FMEM_E_NOMEM;
+      }
+      entry->fm = fm;
+      entry->next = committers;
+      entry->committer = committer;
+      __atomic_store_n(&committers, entry, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&committers_mutex);
+  }
+  __atomic_store_n(&entry->committer, committer, __ATOMIC_RELEASE);
+  return 0;
 }
 
-static inline int64_t fail_on_poison_check(uint16_t poison, uint16_t expected, char* message){
-#if defined(__UNIT_TESTING__) && defined(__BAD_MEM__)
-  // used only during unit testing
-  if(poison != expected){
-    return EE_BAD_MEM;
+// open batches are owned by the thread that opened them. a thread can
+// have one open batch per fmem
+static __thread struct fmem_batch *open_batches = NULL;
+
+static inline struct fmem_batch* fmem_batch_of(struct fmem *fm){
+  for(struct fmem_batch *batch = open_batches; batch != NULL; batch = batch->next){
+    if(batch->fm == fm) return batch;
   }
-#endif
+  return NULL;
+}
 
-#if !defined(__UNIT_TESTING__) && defined(__BAD_MEM__)
-  if if(poison != expected){
-    // runtime mode. we need to exit. This should - hopefully - be detected in integration testing
-    printf("******************* WARNING! WARNING!*********************");
-    printf("memory corruption detected on: %s", message);
-    printf("**********************************************************");
-    exit(2);
+// async commits are per process, started on an fmem by fmem_async_start(..)
+static struct fmem_async *async_commits = NULL;
+static pthread_mutex_t async_commits_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline struct fmem_async* fmem_async_of(struct fmem *fm){
+  struct fmem_async *async = __atomic_load_n(&async_commits, __ATOMIC_ACQUIRE);
+  for(; async != NULL; async = async->next){
+    if(async->fm == fm) return async;
+  }
+  return NULL;
+}
+
+// queues ranges on the ring, waits for room if the ring is full
+static void fmem_async_enqueue(struct fmem_async *async, struct commit_range *ranges, uint32_t count){
+  for(uint32_t i = 0; i < count; i++){
+    uint64_t pos = __atomic_load_n(&async->enqueue_pos, __ATOMIC_RELAXED);
+    struct fmem_async_slot *slot = NULL;
+    for(;;){
+      slot = &async->slots[pos & async->mask];
+      uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+      int64_t diff = (int64_t) seq - (int64_t) pos;
+      if(diff == 0){
+        if(__atomic_compare_exchange_n(&async->enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+      }else if(diff < 0){
+        // full, the flusher is behind
+        sched_yield();
+        pos = __atomic_load_n(&async->enqueue_pos, __ATOMIC_RELAXED);
+      }else{
+        pos = __atomic_load_n(&async->enqueue_pos, __ATOMIC_RELAXED);
+      }
+    }
+    slot->range = ranges[i];
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  }
+
+  if(__atomic_load_n(&async->idle, __ATOMIC_SEQ_CST)){
+    pthread_mutex_lock(&async->mutex);
+    pthread_cond_signal(&async->wake);
+    pthread_mutex_unlock(&async->mutex);
+  }
+}
+
+// drains the ring, ranges are handed to the committer in chunks
+static void* fmem_async_flusher(void *arg){
+  struct fmem_async *async = (struct fmem_async *) arg;
+  struct commit_range ranges[UINT8_MAX];
+
+  for(;;){
+    uint8_t count = 0;
+    uint64_t pos = async->dequeue_pos;
+    while(count < UINT8_MAX){
+      struct fmem_async_slot *slot = &async->slots[pos & async->mask];
+      if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) break;
+      ranges[count++] = slot->range;
+      // slot is free for the next round
+      __atomic_store_n(&slot->seq, pos + async->mask + 1, __ATOMIC_RELEASE);
+      pos++;
+    }
+
+    if(count > 0){
+      async->dequeue_pos = pos;
+      committer_t committer = fmem_committer(async->fm);
+      if(committer != NULL && committer(ranges, count) < 0) __atomic_store_n(&async->failed, true, __ATOMIC_RELEASE);
+      pthread_mutex_lock(&async->mutex);
+      __atomic_store_n(&async->completed, pos, __ATOMIC_RELEASE);
+      pthread_cond_broadcast(&async->done);
+      pthread_mutex_unlock(&async->mutex);
+      continue;
+    }
+
+    // nothing to do, sleep until a producer wakes us up (or a while passes)
+    pthread_mutex_lock(&async->mutex);
+    __atomic_store_n(&async->idle, 1, __ATOMIC_SEQ_CST);
+    struct fmem_async_slot *slot = &async->slots[pos & async->mask];
+    bool empty = __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != pos + 1;
+    if(empty && async->stop){
+      pthread_mutex_unlock(&async->mutex);
+      break;
+    }
+    if(empty){
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_nsec += FMEM_ASYNC_WAIT_NS;
+      if(until.tv_nsec >= 1000 * 1000 * 1000){
+        until.tv_sec++;
+        until.tv_nsec -= 1000 * 1000 * 1000;
+      }
+      pthread_cond_timedwait(&async->wake, &async->mutex, &until);
+    }
+    __atomic_store_n(&async->idle, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&async->mutex);
+  }
+  return NULL;
+}
+
+// hands ranges to the committer, or to the flusher if async commits are started
+static int fmem_committer_call(struct fmem *fm, struct commit_range *ranges, uint8_t count){
+  if(fm->flags & FMEM_F_STATS){
+    size_t bytes = 0;
+    for(uint8_t i = 0; i < count; i++) bytes += ranges[i].len;
+    FMEM_STAT(fm, commits, 1);
+    FMEM_STAT(fm, commit_ranges, count);
+    FMEM_STAT(fm, commit_bytes, bytes);
+  }
+
+  struct fmem_async *async = fmem_async_of(fm);
+  if(async == NULL){
+    committer_t committer = fmem_committer(fm);
+    return committer != NULL && committer(ranges, count) < 0 ? E_COMMIT_FAILED : 0;
   }
-#endif
 
+  fmem_async_enqueue(async, ranges, count);
   return 0;
 }
 
-// creates an allocator on preallocated memory. The allocator uses the entire length of memory
-struct fmem* fmem_create_new(void * on_mem, size_t length, uint32_t min_alloc, committer_t committer){
-  if(length < MIN_TOTAL_ALLOCATION) return (void *) E_TOTAL_ALLOCATION_SIZE_TOO_SMALL;
-  if (length < (min_alloc + (2 * PAGE_OVERHEAD) + sizeof(struct fmem))) return  (void *) E_BAD_INIT_MEM; // we can't really use it
-  if (min_alloc < DEFAULT_MIN_ALLOC) min_alloc = DEFAULT_MIN_ALLOC;
-  // TODO check that total size + overhead is > min alloc
+static inline uint64_t fmem_now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
 
-  // we are doing this manually here, but other
-  // allocs are done automatically
-  struct fmem_page *fpage_head = (struct fmem_page *) on_mem; //first create a page, that will become our head
-  fpage_head->size = (PAGE_OVERHEAD /*page header*/ + sizeof(struct fmem) /*where we stash fmem object*/);
-  list_head_init(&fpage_head->list); // init the list
+static inline size_t os_page_size(){
+  static size_t page_size = 0;
+  if(page_size == 0) page_size = (size_t) sysconf(_SC_PAGESIZE);
+  return page_size;
+}
 
-  // init acocunting object
-  struct fmem *fm = mem_from_fpage(fpage_head); // create our main accounting object, stashed in the headerpage
-  fm->total_size = length; // total is all
-  fm->total_available = length - ((2 * PAGE_OVERHEAD) + sizeof(struct fmem)); // but we used two headers and main accounting object
-  fm->min_alloc = min_alloc; // set the min alloc we operate on
-  fm->alloc_objects = 0;
-	if (committer != NULL){
-		fm->committer = committer;
-	}
+// hands all ranges in the batch to the committer. the committer can not
+// take more than 255 ranges in one call, larger batches are chunked
+static int fmem_batch_flush(struct fmem *fm, struct fmem_batch *batch){
+  int res = 0;
+  uint32_t done = 0;
+  while(done < batch->count){
+    uint32_t chunk = batch->count - done;
+    if(chunk > UINT8_MAX) chunk = UINT8_MAX;
+    if(fmem_committer_call(fm, batch->ranges + done, (uint8_t) chunk) < 0) res = E_COMMIT_FAILED;
+    for(uint32_t i = done; i < done + chunk; i++) batch->committed += batch->ranges[i].len;
+    done += chunk;
+  }
+  batch->count = 0;
+  if(res != 0) batch->failed = true;
+  return res;
+}
 
-	/* for rare cases where fmem left in locked state*/
-	fmem_unlock(fm);
+// adds a range to a batch. ranges are rounded to os pages (clamped to
+// fmem memory) and kept sorted, overlapping and adjacent ranges are merged.
+// a full batch is flushed to the committer.
+static int fmem_batch_add(struct fmem *fm, struct fmem_batch *batch, void *start, size_t len){
+  const size_t page_size = os_page_size();
+  char *low = (char *) fpage_from_mem(fm);
+  char *high = low + fmem_length(fm); // the huge zone too
+
+  char *s = (char *) start;
+  char *e = s + len;
+  s = s - ((uintptr_t) s % page_size);
+  if(s < low) s = low;
+  if((uintptr_t) e % page_size != 0) e = e + (page_size - ((uintptr_t) e % page_size));
+  if(e > high) e = high;
+  if(e <= s) return 0; // not fmem memory
+
+  // first range that starts after us
+  uint32_t lo = 0, hi = batch->count;
+  while(lo < hi){
+    uint32_t mid = (lo + hi) / 2;
+    if((char *) batch->ranges[mid].start <= s) lo = mid + 1; else hi = mid;
+  }
 
-  // create a second page (this is first empty massive page
-  char * start = (char *) fpage_head;
-  struct fmem_page *main_fpage = (struct fmem_page *) (start + fpage_head->size);
-  main_fpage->size = length - fpage_head->size; // assign the remaining to it
-  list_add_after(&fpage_head->list, &main_fpage->list); // link pages
+  // we may merge with the one before and any number after
+  uint32_t first = lo;
+  if(first > 0){
+    struct commit_range *before = &batch->ranges[first - 1];
+    if((char *) before->start + before->len >= s) first--;
+  }
+  uint32_t last = first;
+  while(last < batch->count && (char *) batch->ranges[last].start <= e){
+    char *rs = (char *) batch->ranges[last].start;
+    char *re = rs + batch->ranges[last].len;
+    if(rs < s) s = rs;
+    if(re > e) e = re;
+    last++;
+  }
 
+  int res = 0;
+  if(last > first){
+    // [first, last) collapse into first
+    batch->ranges[first].start = s;
+    batch->ranges[first].len = e - s;
+    memmove(&batch->ranges[first + 1], &batch->ranges[last], (batch->count - last) * sizeof(struct commit_range));
+    batch->count -= (last - first - 1);
+    return 0;
+  }
 
-  fpage_set_busy(fpage_head); // set head page as busy
-  fpage_set_free(main_fpage); // set main page as free
-#ifdef __BAD_MEM__
-  fpage_set_magic(fpage_head, POISON);
-  fpage_set_magic(main_fpage, POISON);
-#endif
+  if(batch->count == batch->capacity){
+    res = fmem_batch_flush(fm, batch);
+    first = 0;
+  }
+  memmove(&batch->ranges[first + 1], &batch->ranges[first], (batch->count - first) * sizeof(struct commit_range));
+  batch->ranges[first].start = s;
+  batch->ranges[first].len = e - s;
+  batch->count++;
+  return res;
+}
 
-	// commit if needed
-	if(fm->committer != NULL){
-		struct commit_range r = {0};
-		r.start = on_mem;
-		r.len = PAGE_OVERHEAD + sizeof(struct fmem) + PAGE_OVERHEAD;
-		if (fm->committer(&r, 1) < 0) return (struct fmem *) E_COMMIT_FAILED;
-	}
+// all commits go through here. ranges go to the open batch of the
+// calling thread if there is one, otherwise straight to the committer
+static int fmem_commit_ranges(struct fmem *fm, struct commit_range *ranges, uint8_t count){
+  if(fmem_committer(fm) == NULL || count == 0) return 0;
 
-  return fm;
+  struct fmem_batch *batch = fmem_batch_of(fm);
+  if(batch == NULL) return fmem_committer_call(fm, ranges, count);
+
+  int res = 0;
+  for(uint8_t i = 0; i < count; i++) res |= fmem_batch_add(fm, batch, ranges[i].start, ranges[i].len);
+  return res;
 }
 
-// gets a reference to an existing allocator occupying on_mem memory
-struct fmem* fmem_from_existing(void * on_mem, committer_t committer){
-  // our accounting object is stashed in head page
-  struct fmem_page *fpage_head = (struct fmem_page *) on_mem;
+// a commit set collects all the ranges touched by a single operation
+// so they can be handed to the committer in one call. overlapping and
+// adjacent ranges are merged as they are added.
+// when the redo log is used, the set also carries fences: ranges that were
+// handed to users by the op. replay never writes older log data over them.
+// a set that is flushed in the middle of an op splits the op over two log
+// records, ops that share a set call commit_set_op_done(..) between them.
+#define COMMIT_SET_MAX 32
+#define COMMIT_SET_OP_MAX 16 // max ranges a single alloc/free adds
+#define COMMIT_SET_MAX_FENCES 4
+struct commit_set{
+  struct commit_range ranges[COMMIT_SET_MAX];
+  struct commit_range fences[COMMIT_SET_MAX_FENCES];
+  uint8_t count;
+  uint8_t fence_count;
+};
 
-  int64_t check = fail_on_poison_check(fpage_get_magic(fpage_head), POISON, "reloading existing allocator (head page)");
-  if( check != 0) return  ((struct fmem *) check);
+static int flog_append(struct fmem *fm, struct commit_set *set);
 
+// hands whatever ranges the set have to the committer (via the redo log
+// if we have one) and empties the set
+static int commit_set_flush(struct fmem *fm, struct commit_set *set){
+  int res = 0;
+  if(fm->log_size != 0){
+    res = flog_append(fm, set);
+  }else{
+    res = fmem_commit_ranges(fm, set->ranges, set->count);
+  }
+  set->count = 0;
+  set->fence_count = 0;
+  return res;
+}
 
-  struct fmem *fm = (struct fmem *) mem_from_fpage(fpage_head);
-	if (committer != NULL){
-		fm->committer = committer;
-	}
+// adds a range to the set. if the set is full it gets flushed first
+static int commit_set_add(struct fmem *fm, struct commit_set *set, void *start, size_t len){
+  if(fmem_committer(fm) == NULL) return 0; // nothing will be committed anyway
+  char *s = (char *) start;
+  char *e = s + len;
+  for(int i = 0; i < set->count; i++){
+    char *rs = (char *) set->ranges[i].start;
+    char *re = rs + set->ranges[i].len;
+    if(s > re || e < rs) continue; // neither overlapping nor adjacent
+    // the merged range may now touch other ranges in the set, so we
+    // take it out and add it again
+    if(s < rs) rs = s;
+    if(e > re) re = e;
+    set->count--;
+    set->ranges[i] = set->ranges[set->count];
+    return commit_set_add(fm, set, rs, re - rs);
+  }
 
-	fmem_unlock(fm); // this could be potentially dangerous
+  int res = 0;
+  if(set->count == COMMIT_SET_MAX) res = commit_set_flush(fm, set);
+  set->ranges[set->count].start = start;
+  set->ranges[set->count].len = len;
+  set->count++;
+  return res;
+}
 
-	// we don't try to commit here. because one of the following is true
-	// this was commited before and create_from_new does not change anything so there is no need to commit again
-	// this was not committed before and commit is just used, in this case we will save the header anyway
-	// on first alloc/free ops
+// marks memory that is handed over to the user by this op
+static int commit_set_fence(struct fmem *fm, struct commit_set *set, void *start, size_t len){
+  if(fmem_committer(fm) == NULL || fm->log_size == 0) return 0;
+  int res = 0;
+  if(set->fence_count == COMMIT_SET_MAX_FENCES) res = commit_set_flush(fm, set);
+  set->fences[set->fence_count].start = start;
+  set->fences[set->fence_count].len = len;
+  set->fence_count++;
+  return res;
+}
 
-  return fm;
+// flushes the set if the next op may not fit in it
+static inline int commit_set_op_done(struct fmem *fm, struct commit_set *set){
+  if(set->count > COMMIT_SET_MAX - COMMIT_SET_OP_MAX || set->fence_count == COMMIT_SET_MAX_FENCES){
+    return commit_set_flush(fm, set);
+  }
+  return 0;
+}
+
+// every op that touches pages changes the accounting. free lists heads
+// are added by the free list ops that touch them. fmem is no longer clean
+// once an op touched it, the marker is cleared on disk right away since with
+// a redo log the header reaches its place only by checkpoint
+static inline int commit_set_add_accounting(struct fmem *fm, struct commit_set *set){
+  if(fm->clean != 0){
+    fm->clean = 0;
+    struct commit_range r = {0};
+    r.start = &fm->clean;
+    r.len = sizeof(fm->clean);
+    if(fmem_committer(fm) != NULL && fmem_committer_call(fm, &r, 1) < 0) return E_COMMIT_FAILED;
+  }
+  return commit_set_add(fm, set, fm, offsetof(struct fmem, free_lists));
+}
+
+// compact pages only. must be called once a page changed its state or size,
+// (re)writes the footer of a free page and prev free flag of the page after
+// it and commits both
+static int fpage_tag(struct fmem *fm, struct fmem_page *fpage, struct commit_set *set){
+  if(!(fm->flags & FMEM_F_COMPACT)) return 0;
+  int res = 0;
+  bool is_free = fpage_is_free(fpage);
+  if(is_free){
+    char *footer = ((char *) fpage) + fpage->size - sizeof(uint32_t);
+    memcpy(footer, &fpage->size, sizeof(uint32_t));
+    res |= commit_set_add(fm, set, footer, sizeof(uint32_t));
+  }
+  struct fmem_page *next = fpage_next(fm, fpage);
+  if(next != fpage_from_mem(fm)){
+    fpage_set_prev_free(next, is_free);
+    res |= commit_set_add(fm, set, next, COMPACT_OVERHEAD);
+  }
+  return res;
+}
+
+// commits the page list link of fpage, compact pages have none
+static inline int fpage_commit_link(struct fmem *fm, struct commit_set *set, struct fmem_page *fpage){
+  if(fm->flags & FMEM_F_COMPACT) return 0;
+  return commit_set_add(fm, set, &fpage->list, sizeof(struct rlist_head));
+}
+
+// commits the header of a page
+static inline int fpage_commit_header(struct fmem *fm, struct commit_set *set, struct fmem_page *fpage){
+  return commit_set_add(fm, set, fpage, fpage_overhead(fpage));
+}
+
+// crc32 (ieee), used to validate log records
+uint32_t fmem_crc32(uint32_t crc, const void *data, size_t len){
+  static uint32_t table[256];
+  static bool table_ready = false;
+  if(!table_ready){
+    for(uint32_t i = 0; i < 256; i++){
+      uint32_t c = i;
+      for(int k = 0; k < 8; k++) c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+      table[i] = c;
+    }
+    table_ready = true;
+  }
+
+  const uint8_t *bytes = (const uint8_t *) data;
+  crc = ~crc;
+  for(size_t i = 0; i < len; i++) crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+// crc of what a clean attach trusts: accounting (and generation), free index
+// and log state. roots are not part of it, users commit them on their own
+static uint32_t fmem_header_crc(struct fmem *fm){
+  uint32_t crc = fmem_crc32(0, fm, offsetof(struct fmem, clean));
+  return fmem_crc32(crc, fm->free_lists, offsetof(struct fmem, user1) - offsetof(struct fmem, free_lists));
+}
+
+static inline bool fmem_is_clean(struct fmem *fm){
+  return fm->clean == FMEM_CLEAN && fm->header_crc == fmem_header_crc(fm);
+}
+
+// the redo log lives in the head page right after struct fmem. every op
+// that uses a commit set appends one record that has the after image of
+// every range the op touched, and commits the record (one sequential
+// write). the ranges themselves are committed lazily when the log is
+// full (checkpoint). on reload the log is replayed.
+// record format:
+// [flog_record][flog_entry][data, padded to 8]...[flog_entry][data]
+#define FLOG_MAGIC 0xF10C
+#define FLOG_DATA  1 // entry carries after image of the range
+#define FLOG_FENCE 2 // range was handed to user, older data must not be replayed on it
+struct flog_record{
+  uint32_t magic;
+  uint32_t crc;   // crc of the record starting at len
+  uint32_t len;   // total len including this header
+  uint32_t count; // # of entries
+  uint64_t seq;
+};
+
+struct flog_entry{
+  uint64_t offset; // from start of fmem memory
+  uint32_t len;
+  uint32_t kind;
+};
+
+static inline char* flog_area(struct fmem *fm){
+  return ((char *) fm) + sizeof(struct fmem);
+}
+
+// extent table of the huge zone follows the log
+static inline struct fmem_extent* fmem_extents(struct fmem *fm){
+  return (struct fmem_extent *) (flog_area(fm) + fm->log_size);
+}
+
+static inline uint32_t flog_crc(struct flog_record *record){
+  size_t skip = offsetof(struct flog_record, len);
+  return fmem_crc32(0, ((char *) record) + skip, record->len - skip);
+}
+
+static inline uint32_t flog_pad(uint32_t len){
+  return (len + 7) & ~((uint32_t) 7);
+}
+
+// commits ranges straight to the committer, log and batches are bypassed.
+// async commits are not, they keep the order of commits
+static int flog_commit_direct(struct fmem *fm, struct commit_range *ranges, uint32_t count){
+  int res = 0;
+  while(count > 0){
+    uint8_t chunk = count > UINT8_MAX ? UINT8_MAX : count;
+    if(fmem_committer_call(fm, ranges, chunk) < 0) res = E_COMMIT_FAILED;
+    ranges += chunk;
+    count -= chunk;
+  }
+  return res;
+}
+
+// walks valid records in the log, calls on_entry for each entry. returns
+// the offset of the end of the last valid record
+typedef void (*flog_each_t)(struct fmem *fm, struct flog_entry *entry, uint32_t entry_pos, void *ctx);
+static uint32_t flog_walk(struct fmem *fm, flog_each_t on_entry, void *ctx){
+  char *area = flog_area(fm);
+  uint32_t pos = 0;
+  uint64_t expected_seq = fm->log_seq;
+
+  while(pos + sizeof(struct flog_record) <= fm->log_size){
+    struct flog_record *record = (struct flog_record *) (area + pos);
+    if(record->magic != FLOG_MAGIC || record->seq != expected_seq) break;
+    if(record->len < sizeof(struct flog_record) || record->len > fm->log_size - pos) break;
+
+    if(record->crc != flog_crc(record)) break; // torn record, everything after is garbage
+
+    if(on_entry != NULL){
+      uint32_t entry_pos = pos + sizeof(struct flog_record);
+      for(uint32_t i = 0; i < record->count; i++){
+        struct flog_entry *entry = (struct flog_entry *) (area + entry_pos);
+        on_entry(fm, entry, entry_pos, ctx);
+        entry_pos += sizeof(struct flog_entry);
+        if(entry->kind == FLOG_DATA) entry_pos += flog_pad(entry->len);
+      }
+    }
+    pos += record->len;
+    expected_seq++;
+  }
+  return pos;
+}
+
+// collects data ranges of the log for checkpoint
+struct flog_ranges{
+  struct commit_range ranges[COMMIT_SET_MAX];
+  uint32_t count;
+  int res;
+};
+
+static void flog_checkpoint_entry(struct fmem *fm, struct flog_entry *entry, uint32_t entry_pos, void *ctx){
+  struct flog_ranges *collected = (struct flog_ranges *) ctx;
+  if(entry->kind != FLOG_DATA) return;
+  if(collected->count == COMMIT_SET_MAX){
+    collected->res |= flog_commit_direct(fm, collected->ranges, collected->count);
+    collected->count = 0;
+  }
+  collected->ranges[collected->count].start = ((char *) fpage_from_mem(fm)) + entry->offset;
+  collected->ranges[collected->count].len = entry->len;
+  collected->count++;
+}
+
+// commits every range that is in the log then empties the log. caller
+// must hold the lock
+static int flog_checkpoint(struct fmem *fm){
+  if(fm->log_size == 0 || fmem_committer(fm) == NULL) return 0;
+
+  struct flog_ranges collected = {0};
+  flog_walk(fm, flog_checkpoint_entry, &collected);
+  collected.res |= flog_commit_direct(fm, collected.ranges, collected.count);
+  if(collected.res != 0) return E_COMMIT_FAILED;
+
+  // only once ranges are on disk the log can start over
+  fm->log_seq += fm->log_records;
+  fm->log_head = 0;
+  fm->log_records = 0;
+  struct commit_range r = {0};
+  r.start = &fm->log_size;
+  r.len = offsetof(struct fmem, user1) - offsetof(struct fmem, log_size);
+  return flog_commit_direct(fm, &r, 1);
+}
+
+// appends a record for the set to the log and commits it
+static int flog_append(struct fmem *fm, struct commit_set *set){
+  if(set->count == 0 && set->fence_count == 0) return 0;
+
+  uint32_t len = sizeof(struct flog_record);
+  for(int i = 0; i < set->count; i++) len += sizeof(struct flog_entry) + flog_pad(set->ranges[i].len);
+  len += set->fence_count * sizeof(struct flog_entry);
+
+  if(len > fm->log_size){
+    // can not be logged at all, we checkpoint and commit it directly
+    int res = flog_checkpoint(fm);
+    return res | fmem_commit_ranges(fm, set->ranges, set->count);
+  }
+  if(fm->log_head + len > fm->log_size){
+    int res = flog_checkpoint(fm);
+    if(res != 0) return res;
+  }
+
+  char *base = (char *) fpage_from_mem(fm);
+  char *area = flog_area(fm);
+  struct flog_record *record = (struct flog_record *) (area + fm->log_head);
+  uint32_t pos = fm->log_head + sizeof(struct flog_record);
+
+  for(int i = 0; i < set->fence_count; i++){
+    struct flog_entry *entry = (struct flog_entry *) (area + pos);
+    entry->offset = (char *) set->fences[i].start - base;
+    entry->len = set->fences[i].len;
+    entry->kind = FLOG_FENCE;
+    pos += sizeof(struct flog_entry);
+  }
+
+  for(int i = 0; i < set->count; i++){
+    struct flog_entry *entry = (struct flog_entry *) (area + pos);
+    entry->offset = (char *) set->ranges[i].start - base;
+    entry->len = set->ranges[i].len;
+    entry->kind = FLOG_DATA;
+    pos += sizeof(struct flog_entry);
+    memcpy(area + pos, set->ranges[i].start, set->ranges[i].len);
+    memset(area + pos + set->ranges[i].len, 0, flog_pad(set->ranges[i].len) - set->ranges[i].len);
+    pos += flog_pad(set->ranges[i].len);
+  }
+
+  record->magic = FLOG_MAGIC;
+  record->len = len;
+  record->seq = fm->log_seq + fm->log_records;
+  record->count = set->count + set->fence_count;
+  record->crc = flog_crc(record);
+
+  fm->log_head += len;
+  fm->log_records++;
+
+  struct commit_range r = {0};
+  r.start = record;
+  r.len = len;
+  return fmem_commit_ranges(fm, &r, 1);
+}
+
+// replay context, entries of the log are replayed in order. data entries
+// that are covered by a later fence are skipped. the log is small so we
+// go for the simple (quadratic) approach
+struct flog_replay{
+  uint32_t entry_pos; // entry being replayed
+  bool fenced;
+};
+
+static void flog_find_fence(struct fmem *fm, struct flog_entry *entry, uint32_t entry_pos, void *ctx){
+  struct flog_replay *replay = (struct flog_replay *) ctx;
+  if(entry->kind != FLOG_FENCE || entry_pos <= replay->entry_pos) return;
+
+  struct flog_entry *data = (struct flog_entry *) (flog_area(fm) + replay->entry_pos);
+  uint64_t data_end = data->offset + data->len;
+  uint64_t fence_end = entry->offset + entry->len;
+  if(data->offset < fence_end && entry->offset < data_end) replay->fenced = true;
+}
+
+static void flog_replay_entry(struct fmem *fm, struct flog_entry *entry, uint32_t entry_pos, void *ctx){
+  if(entry->kind != FLOG_DATA) return;
+  if(entry->offset + entry->len > fm->total_size) return; // can't be ours
+
+  struct flog_replay replay = {.entry_pos = entry_pos, .fenced = false};
+  flog_walk(fm, flog_find_fence, &replay);
+  if(replay.fenced) return;
+
+  char *base = (char *) fpage_from_mem(fm);
+  memcpy(base + entry->offset, ((char *) entry) + sizeof(struct flog_entry), entry->len);
+}
+
+// replays the log, and checkpoints it. caller must hold the lock
+static int flog_replay(struct fmem *fm){
+  if(fm->log_size == 0) return 0;
+
+  fm->log_head = flog_walk(fm, flog_replay_entry, NULL);
+  // count what we have replayed, checkpoint needs it to move seq forward
+  fm->log_records = 0;
+  char *area = flog_area(fm);
+  for(uint32_t pos = 0; pos < fm->log_head; pos += ((struct flog_record *) (area + pos))->len) fm->log_records++;
+
+  return flog_checkpoint(fm);
+}
+
+// returns the size class of a page size
+static inline uint32_t fclass_of(uint32_t size){
+  return 31 - __builtin_clz(size);
+}
+
+// free pages carry a second link in their body which threads
+// them in the free list of thier size class
+static inline struct rlist_head* fpage_free_link(struct fmem_page *fpage){
+  return (struct rlist_head *) mem_from_fpage(fpage);
+}
+
+static inline struct fmem_page* fpage_from_free_link(struct fmem *fm, struct rlist_head *link){
+  return fpage_of(fm, link);
+}
+
+// adds a free page to the free list of its class. pages are added at
+// the front of the list, this keeps recently freed (hot) pages first
+static int flist_insert(struct fmem *fm, struct fmem_page *fpage, struct commit_set *set){
+  uint32_t class = fclass_of(fpage->size);
+  struct rlist_head *link = fpage_free_link(fpage);
+
+  rlist_add_after(&fm->free_lists[class], link);
+  fm->free_map |= (1u << class);
+
+  int res = commit_set_add(fm, set, link, sizeof(struct rlist_head));
+  if(res != 0) return res;
+  res = commit_set_add(fm, set, rlist_prev(link), sizeof(struct rlist_head));
+  if(res != 0) return res;
+  return commit_set_add(fm, set, rlist_next(link), sizeof(struct rlist_head));
+}
+
+// removes a free page from its class list. must be called before
+// size of the page is changed
+static int flist_remove(struct fmem *fm, struct fmem_page *fpage, struct commit_set *set){
+  uint32_t class = fclass_of(fpage->size);
+  struct rlist_head *link = fpage_free_link(fpage);
+  struct rlist_head *prev = rlist_prev(link);
+  struct rlist_head *next = rlist_next(link);
+
+  rlist_remove_at(link);
+  if(rlist_next(&fm->free_lists[class]) == &fm->free_lists[class]) fm->free_map &= ~(1u << class);
+
+  int res = commit_set_add(fm, set, prev, sizeof(struct rlist_head));
+  if(res != 0) return res;
+  return commit_set_add(fm, set, next, sizeof(struct rlist_head));
+}
+
+// large free pages (class >= FMEM_SKIP_MIN_CLASS) are kept in a skip list
+// ordered by (size, address) instead, so best fit is O(log n). the node sits
+// in the page body (large pages have plenty of room) and links are relative.
+struct fskip_node{
+  uint32_t level; // # of links this node has
+  uint32_t unused;
+  rptr_t next[];  // next node at each level
+};
+
+static inline struct fskip_node* fpage_skip_node(struct fmem_page *fpage){
+  return (struct fskip_node *) mem_from_fpage(fpage);
+}
+
+static inline struct fmem_page* fpage_from_skip_node(struct fmem *fm, struct fskip_node *node){
+  return fpage_of(fm, node);
+}
+
+static inline bool findex_in_skip(uint32_t size){
+  return fclass_of(size) >= FMEM_SKIP_MIN_CLASS;
+}
+
+// true if node sorts before (size, at)
+static inline bool fskip_before(struct fmem *fm, struct fskip_node *node, uint32_t size, struct fmem_page *at){
+  struct fmem_page *fpage = fpage_from_skip_node(fm, node);
+  return fpage->size < size || (fpage->size == size && fpage < at);
+}
+
+// finds at each level the links array that points to the first node at or
+// after (size, at). head of the list is fm->free_skip
+static void fskip_find(struct fmem *fm, uint32_t size, struct fmem_page *at, rptr_t **preds){
+  rptr_t *links = fm->free_skip;
+  for(int level = FMEM_SKIP_LEVELS - 1; level >= 0; level--){
+    struct fskip_node *next = rptr_get(&links[level]);
+    while(next != NULL && fskip_before(fm, next, size, at)){
+      links = next->next;
+      next = rptr_get(&links[level]);
+    }
+    preds[level] = links;
+  }
+}
+
+// random level, each level is 1/4 as likely as the one below
+static uint32_t fskip_random_level(struct fmem_page *fpage){
+  static __thread uint64_t state = 0;
+  if(state == 0) state = ((uint64_t) (uintptr_t) fpage) ^ 0x9E3779B97F4A7C15ull;
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+
+  uint32_t level = 1;
+  uint64_t bits = state;
+  while(level < FMEM_SKIP_LEVELS && (bits & 0x3) == 0){
+    level++;
+    bits >>= 2;
+  }
+  return level;
+}
+
+static int fskip_insert(struct fmem *fm, struct fmem_page *fpage, struct commit_set *set){
+  rptr_t *preds[FMEM_SKIP_LEVELS];
+  fskip_find(fm, fpage->size, fpage, preds);
+
+  struct fskip_node *node = fpage_skip_node(fpage);
+  node->level = fskip_random_level(fpage);
+  node->unused = 0;
+  int res = 0;
+  for(uint32_t level = 0; level < node->level; level++){
+    rptr_set(&node->next[level], rptr_get(&preds[level][level]));
+    rptr_set(&preds[level][level], node);
+    res |= commit_set_add(fm, set, &preds[level][level], sizeof(rptr_t));
+  }
+  res |= commit_set_add(fm, set, node, sizeof(struct fskip_node) + node->level * sizeof(rptr_t));
+  return res;
+}
+
+static int fskip_remove(struct fmem *fm, struct fmem_page *fpage, struct commit_set *set){
+  rptr_t *preds[FMEM_SKIP_LEVELS];
+  fskip_find(fm, fpage->size, fpage, preds);
+
+  struct fskip_node *node = fpage_skip_node(fpage);
+  int res = 0;
+  for(uint32_t level = 0; level < node->level; level++){
+    if(rptr_get(&preds[level][level]) != node) break; // not linked at this level (can't happen)
+    rptr_set(&preds[level][level], rptr_get(&node->next[level]));
+    res |= commit_set_add(fm, set, &preds[level][level], sizeof(rptr_t));
+  }
+  return res;
+}
+
+// smallest large free page with size >= size
+static inline struct fmem_page* fskip_best_fit(struct fmem *fm, uint32_t size){
+  rptr_t *preds[FMEM_SKIP_LEVELS];
+  fskip_find(fm, size, NULL, preds);
+  struct fskip_node *node = rptr_get(&preds[0][0]);
+  return node == NULL ? NULL : fpage_from_skip_node(fm, node);
+}
+
+// adds a free page to the index. must be called after the size of the page is set
+static inline int findex_insert(struct fmem *fm, struct fmem_page *fpage, struct commit_set *set){
+  return findex_in_skip(fpage->size) ? fskip_insert(fm, fpage, set) : flist_insert(fm, fpage, set);
+}
+
+// removes a free page from the index. must be called before the size of the page is changed
+static inline int findex_remove(struct fmem *fm, struct fmem_page *fpage, struct commit_set *set){
+  return findex_in_skip(fpage->size) ? fskip_remove(fm, fpage, set) : flist_remove(fm, fpage, set);
+}
+
+// size of what the index keeps in the body of a free page
+static inline size_t findex_link_len(struct fmem_page *fpage){
+  if(!findex_in_skip(fpage->size)) return sizeof(struct rlist_head);
+  return sizeof(struct fskip_node) + fpage_skip_node(fpage)->level * sizeof(rptr_t);
+}
+
+// true if a free page changes its place in the index when it shrinks to new_size.
+// a large page that still sorts after the page before it stays where it is, this
+// is the common case of carving from the largest page
+static inline bool findex_moves(struct fmem *fm, struct fmem_page *fpage, uint32_t new_size){
+  bool in_skip = findex_in_skip(fpage->size);
+  if(in_skip != findex_in_skip(new_size)) return true;
+  if(!in_skip) return fclass_of(fpage->size) != fclass_of(new_size);
+
+  rptr_t *preds[FMEM_SKIP_LEVELS];
+  fskip_find(fm, fpage->size, fpage, preds);
+  if(preds[0] == fm->free_skip) return false; // first, it stays first
+  struct fskip_node *before = (struct fskip_node *) (((char *) preds[0]) - offsetof(struct fskip_node, next));
+  return !fskip_before(fm, before, new_size, fpage);
+}
+
+// finds a free page that can fit size. returns NULL if none
+// 1- the first page in the list of the class needed size falls in is tried, this
+// is the most recently freed page of that class.
+// 2- any page from a class higher than the class of needed size is guaranteed
+// to fit, so we pick the first page of the first non empty class.
+// 3- only if none exists we walk the list of the class needed size falls in
+// large pages are in the skip list, they are picked best fit before the walk.
+// large sizes go straight to the skip list.
+static struct fmem_page* findex_find(struct fmem *fm, uint32_t size){
+  uint32_t needed = size + fmem_overhead(fm);
+  if(needed < size) return NULL; // overflow
+  uint32_t class = fclass_of(needed);
+  uint32_t first_fit_class = ((needed & (needed - 1)) == 0) ? class : class + 1;
+  if(class >= FMEM_SKIP_MIN_CLASS) return fskip_best_fit(fm, needed);
+
+  struct rlist_head *bucket = &fm->free_lists[class];
+  if(rlist_next(bucket) != bucket){
+    struct fmem_page *first = fpage_from_free_link(fm, rlist_next(bucket));
+    if(fpage_can_fit(first, size) != CAN_NOT_FIT) return first;
+  }
+
+  if(first_fit_class < FMEM_SKIP_MIN_CLASS){
+    uint32_t candidates = fm->free_map & (~0u << first_fit_class);
+    if(candidates != 0){
+      struct rlist_head *fit_bucket = &fm->free_lists[__builtin_ctz(candidates)];
+      return fpage_from_free_link(fm, rlist_next(fit_bucket));
+    }
+  }
+
+  struct fmem_page *large = fskip_best_fit(fm, needed);
+  if(large != NULL) return large;
+
+  struct rlist_head *current = bucket;
+  uint64_t steps = 0;
+  struct fmem_page *found = NULL;
+  rlist_for_each(current, bucket){
+    struct fmem_page *this_page = fpage_from_free_link(fm, current);
+    steps++;
+    if(fpage_can_fit(this_page, size) != CAN_NOT_FIT){
+      found = this_page;
+      break;
+    }
+  }
+  FMEM_STAT(fm, findex_scans, 1);
+  FMEM_STAT(fm, findex_steps, steps);
+  return found;
+}
+
+// validates that the free lists are sane. this is a cheap check, it looks
+// at the first page of every list and at the bitmap
+static bool findex_valid(struct fmem *fm){
+  struct fmem_page *head_page = fpage_from_mem(fm);
+  char *low = (char *) head_page;
+  char *high = low + fm->total_size;
+
+  for(uint32_t class = 0; class < FMEM_SIZE_CLASSES; class++){
+    struct rlist_head *bucket = &fm->free_lists[class];
+    bool empty = (rlist_next(bucket) == bucket);
+    bool marked = (fm->free_map & (1u << class)) != 0;
+    if(empty != !marked) return false;
+    if(empty) continue;
+
+    if((char *) rlist_next(bucket) < low || (char *) rlist_next(bucket) >= high) return false;
+    if((char *) rlist_prev(bucket) < low || (char *) rlist_prev(bucket) >= high) return false;
+    struct fmem_page *first = fpage_from_free_link(fm, rlist_next(bucket));
+    if(!fpage_is_free(first) || fclass_of(first->size) != class) return false;
+#ifdef __BAD_MEM__
+    if(fpage_get_magic(first) != POISON) return false;
+#endif
+  }
+
+  for(uint32_t level = 0; level < FMEM_SKIP_LEVELS; level++){
+    struct fskip_node *node = rptr_get(&fm->free_skip[level]);
+    if(node == NULL) continue;
+    if((char *) node < low || (char *) node >= high) return false;
+    struct fmem_page *first = fpage_from_skip_node(fm, node);
+    if(!fpage_is_free(first) || !findex_in_skip(first->size) || node->level <= level) return false;
+#ifdef __BAD_MEM__
+    if(fpage_get_magic(first) != POISON) return false;
+#endif
+  }
+  return true;
+}
+
+// rebuilds the free lists by walking the page list
+static int findex_rebuild(struct fmem *fm){
+  struct commit_set set = {0};
+  int res = 0;
+
+  fm->free_map = 0;
+  for(uint32_t class = 0; class < FMEM_SIZE_CLASSES; class++) rlist_head_init(&fm->free_lists[class]);
+  memset(fm->free_skip, 0, sizeof(fm->free_skip));
+
+  struct fmem_page *this_page = NULL;
+  fpage_for_each(fm, this_page){
+    // compact pages footers and prev free flags are redone too
+    res = fpage_tag(fm, this_page, &set);
+    if(res != 0) return res;
+    if(!fpage_is_free(this_page)) continue;
+    res = findex_insert(fm, this_page, &set);
+    if(res != 0) return res;
+  }
+
+  res = commit_set_add(fm, &set, fm->free_lists, sizeof(fm->free_lists) + sizeof(fm->free_skip));
+  if(res != 0) return res;
+  res = commit_set_add_accounting(fm, &set);
+  if(res != 0) return res;
+  return commit_set_flush(fm, &set);
+}
+
+
+static inline bool atomic_compare_swap(uint32_t * ptr, uint32_t compare, uint32_t exchange) {
+  return __atomic_compare_exchange_n(ptr, &compare, exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+// returns free bytes of the huge zone going by the extent table
+static uint64_t fextent_available(struct fmem *fm){
+  uint64_t available = 0;
+  struct fmem_extent *extents = fmem_extents(fm);
+  for(uint32_t n = 0; n < fm->huge_count && n < fm->huge_extents; n++){
+    if(!(extents[n].size & FMEM_EXTENT_BUSY)) available += extents[n].size;
+  }
+  return available;
+}
+
+// a list torn by a holder that died can have pages of any size linked
+// anywhere. walks of it stop at the first page that can't be right: outside
+// memory, size 0 or past the end, or more pages than memory can hold
+static inline bool fpage_walk_sane(struct fmem *fm, struct fmem_page *fpage, size_t total, uint64_t steps){
+  char *head = (char *) fpage_from_mem(fm);
+  if((char *) fpage < head + fpage_from_mem(fm)->size || (char *) fpage >= head + fm->total_size) return false;
+  return fpage->size != 0 && total + fpage->size <= fm->total_size && steps <= fm->total_size / fmem_overhead(fm);
+}
+
+// walks the page list and checks that it adds up to the accounting. a broken
+// list stops the walk
+static bool fmem_accounting_valid(struct fmem *fm){
+  struct fmem_page *head_page = fpage_from_mem(fm);
+  struct fmem_page *this_page = NULL;
+  size_t total = head_page->size;
+  size_t busy = 0;
+  uint32_t busy_count = 0;
+  uint64_t steps = 0;
+
+  fpage_for_each(fm, this_page){
+    if(!fpage_walk_sane(fm, this_page, total, ++steps)) return false;
+    total += this_page->size;
+    if(fpage_is_free(this_page)) continue;
+    busy += this_page->size;
+    busy_count++;
+  }
+  return total == fm->total_size && busy_count == fm->alloc_objects &&
+         fm->total_available == fm->total_size - (head_page->size + fmem_overhead(fm)) - busy &&
+         fextent_available(fm) == fm->huge_available;
+}
+
+// recomputes accounting and rebuilds free lists from the page list. this is
+// what we can do after taking the lock from a holder that died in the middle
+// of an op. caller must hold the lock
+// returns E_BROKEN_MEM if the page list itself is broken, nothing is rebuilt
+static int fmem_recover_locked(struct fmem *fm){
+  struct fmem_page *head_page = fpage_from_mem(fm);
+  struct fmem_page *this_page = NULL;
+  size_t total = head_page->size;
+  size_t busy = 0;
+  uint32_t busy_count = 0;
+  uint64_t steps = 0;
+
+  fpage_for_each(fm, this_page){
+    if(!fpage_walk_sane(fm, this_page, total, ++steps)) return E_BROKEN_MEM;
+    total += this_page->size;
+    if(fpage_is_free(this_page)) continue;
+    busy += this_page->size;
+    busy_count++;
+  }
+  if(total != fm->total_size) return E_BROKEN_MEM;
+
+  fm->total_available = fm->total_size - (head_page->size + fmem_overhead(fm)) - busy;
+  fm->alloc_objects = busy_count;
+  fm->huge_available = fextent_available(fm);
+  return findex_rebuild(fm);
+}
+
+// brings back memory a holder may have left in the middle of an op. ops
+// that made it to the redo log are replayed first (the log is the one
+// consistent record of them), then accounting and free lists are validated,
+// if they don't look right we rebuild them from the pages. caller must hold
+// the lock
+// returns E_BROKEN_MEM, E_COMMIT_FAILED
+static int fmem_repair_locked(struct fmem *fm){
+  int res = flog_replay(fm);
+  if(res == 0 && (!fmem_accounting_valid(fm) || !findex_valid(fm))) res = fmem_recover_locked(fm);
+  return res;
+}
+
+static inline void cpu_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+// the lock holds the pid of its owner (0 when it is free)
+// a holder that is dead is detected by the waiters that spun long enough
+static inline bool fmem_lock_owner_dead(uint32_t owner){
+  return owner != 0 && kill((pid_t) owner, 0) == -1 && errno == ESRCH;
+}
+
+static void fmem_lock_wait(struct fmem *fm, uint32_t owner){
+#ifdef __linux__
+  if((fm->flags & FMEM_F_FUTEX_LOCK) != 0){
+    // we wake up periodically to check on the owner
+    struct timespec timeout = {.tv_sec = 0, .tv_nsec = FMEM_LOCK_WAIT_NS};
+    __atomic_add_fetch(&fm->lock_waiters, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &fm->lock, FUTEX_WAIT, owner, &timeout, NULL, 0);
+    __atomic_sub_fetch(&fm->lock_waiters, 1, __ATOMIC_SEQ_CST);
+    return;
+  }
+#endif
+  sched_yield();
+}
+
+// locks work across processes mapping the same memory:
+// 1- spin with exponential backoff (using pause) up to FMEM_LOCK_SPINS rounds
+// 2- then yield (or sleep on a futex if FMEM_F_FUTEX_LOCK is set) until
+// 	the lock is released. every time we wake up we check if the owner is alive.
+// 	if it is dead we take the lock over and repair what it left (see fmem_repair_locked(..)).
+// 	if that fails memory is marked broken (see fmem_lock(..))
+// pthread mutexes are not used, one held by a process that died can not be recovered by others
+static void fmem_lock_take(struct fmem *fm){
+  uint32_t me = (uint32_t) getpid();
+  uint32_t backoff = 1;
+  uint32_t rounds = 0;
+  uint32_t waits = 0;
+
+  while(!atomic_compare_swap(&fm->lock, 0, me)){
+    uint32_t owner = __atomic_load_n(&fm->lock, __ATOMIC_SEQ_CST);
+    if(owner == 0) continue;
+
+    if(rounds < FMEM_LOCK_SPINS){
+      for(uint32_t i = 0; i < backoff; i++) cpu_relax();
+      if(backoff < FMEM_LOCK_MAX_BACKOFF) backoff <<= 1;
+      rounds++;
+      continue;
+    }
+
+    if(fmem_lock_owner_dead(owner) && atomic_compare_swap(&fm->lock, owner, me)){
+      // owner is gone and we have the lock now
+      fm->lock_recoveries++;
+      if(fmem_repair_locked(fm) != 0) fm->broken = 1;
+      break;
+    }
+    fmem_lock_wait(fm, owner);
+    waits++;
+  }
+
+  // we hold the lock, counters don't need to be exact
+  if(fm->flags & FMEM_F_STATS){
+    fm->counters.lock_acquires++;
+    fm->counters.lock_spins += rounds;
+    fm->counters.lock_waits += waits;
+  }
+}
+
+static void inline fmem_unlock(struct fmem *fm){
+   __atomic_store_n(&fm->lock, 0, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+   if(__atomic_load_n(&fm->lock_waiters, __ATOMIC_SEQ_CST) > 0){
+     syscall(SYS_futex, &fm->lock, FUTEX_WAKE, 1, NULL, NULL, 0);
+   }
+#endif
+}
+
+// takes the lock for an op. memory a dead holder left broken is never
+// operated on, every op fails until fmem_from_existing(..) repairs it
+// returns E_BROKEN_MEM (the lock is not held)
+static int fmem_lock(struct fmem *fm){
+  fmem_lock_take(fm);
+  if(fm->broken != 0){
+    fmem_unlock(fm);
+    return E_BROKEN_MEM;
+  }
+  return 0;
+}
+
+static inline int64_t fail_on_poison_check(uint16_t poison, uint16_t expected, char* message){
+#if defined(__UNIT_TESTING__) && defined(__BAD_MEM__)
+  // used only during unit testing
+  if(poison != expected){
+    return EE_BAD_MEM;
+  }
+#endif
+
+#if !defined(__UNIT_TESTING__) && defined(__BAD_MEM__)
+  if(poison != expected){
+    // runtime mode. we need to exit. This should - hopefully - be detected in integration testing
+    printf("******************* WARNING! WARNING!*********************");
+    printf("memory corruption detected on: %s", message);
+    printf("**********************************************************");
+    exit(2);
+  }
+#endif
+
+  return 0;
+}
+
+// creates an allocator on preallocated memory. The allocator uses the entire length of memory
+struct fmem* fmem_create_new(void * on_mem, size_t length, uint32_t min_alloc, committer_t committer){
+  struct fmem_options opts = {0};
+  opts.min_alloc = min_alloc;
+  opts.committer = committer;
+  return fmem_create_new_opts(on_mem, length, &opts);
+}
+
+// creates an allocator on preallocated memory using options
+struct fmem* fmem_create_new_opts(void * on_mem, size_t length, const struct fmem_options *opts){
+  uint32_t min_alloc = opts->min_alloc;
+  committer_t committer = opts->committer;
+  uint32_t log_size = 0;
+  if(opts->flags & FMEM_F_REDO_LOG){
+    log_size = opts->log_size == 0 ? FMEM_DEFAULT_LOG_SIZE : flog_pad(opts->log_size);
+  }
+  if(length < MIN_TOTAL_ALLOCATION) return (void *) E_TOTAL_ALLOCATION_SIZE_TOO_SMALL;
+
+  // the page list takes what is not asked for huge allocs, up to what 32 bit
+  // pages can cover. the huge zone starts on the os page after it
+  size_t list_length = length;
+  if(opts->huge_size != 0){
+    if(opts->huge_size >= length) return (void *) E_BAD_INIT_MEM;
+    list_length = length - opts->huge_size;
+  }
+  if(list_length > FMEM_MAX_PAGE_LIST) list_length = FMEM_MAX_PAGE_LIST;
+  uint64_t huge_offset = 0;
+  uint64_t huge_size = 0;
+  if(list_length < length){
+    uintptr_t zone_start = ((uintptr_t) on_mem + list_length) & ~(os_page_size() - 1);
+    uintptr_t zone_end = ((uintptr_t) on_mem + length) & ~(os_page_size() - 1);
+    if(zone_end > zone_start && zone_start > (uintptr_t) on_mem){
+      list_length = zone_start - (uintptr_t) on_mem;
+      huge_offset = list_length;
+      huge_size = zone_end - zone_start;
+    }else if(opts->huge_size != 0){
+      return (void *) E_BAD_INIT_MEM;
+    }
+  }
+  uint32_t huge_extents = huge_size == 0 ? 0 : (opts->huge_extents == 0 ? FMEM_DEFAULT_EXTENTS : opts->huge_extents);
+  uint32_t extents_size = huge_extents * sizeof(struct fmem_extent);
+
+  if (list_length < (min_alloc + (2 * PAGE_OVERHEAD) + sizeof(struct fmem) + log_size + extents_size)) return  (void *) E_BAD_INIT_MEM; // we can't really use it
+  if (!(opts->flags & FMEM_F_COMPACT) && min_alloc < DEFAULT_MIN_ALLOC) min_alloc = DEFAULT_MIN_ALLOC;
+  if ((opts->flags & FMEM_F_COMPACT) && min_alloc < COMPACT_MIN_BODY) min_alloc = COMPACT_MIN_BODY; // a free page must fit in
+  if (opts->align > os_page_size() || (opts->align & (opts->align - 1)) != 0) return (void *) E_BAD_ALIGN;
+  // TODO check that total size + overhead is > min alloc
+
+  // head page is padded so the first page body is at the default alignment
+  uint32_t head_size = PAGE_OVERHEAD /*page header*/ + sizeof(struct fmem) /*where we stash fmem object*/ + log_size /*redo log*/ + extents_size /*extent table*/;
+  if(opts->align > 1){
+    uintptr_t first_body = (uintptr_t) on_mem + head_size + ((opts->flags & FMEM_F_COMPACT) ? COMPACT_OVERHEAD : PAGE_OVERHEAD);
+    head_size += (opts->align - (first_body & (opts->align - 1))) & (opts->align - 1);
+    if(list_length < (size_t) head_size + min_alloc + PAGE_OVERHEAD) return (void *) E_BAD_INIT_MEM;
+  }
+
+  // we are doing this manually here, but other
+  // allocs are done automatically
+  struct fmem_page *fpage_head = (struct fmem_page *) on_mem; //first create a page, that will become our head
+  fpage_head->flags = 0; // head always has a full header
+  fpage_head->size = head_size;
+  rlist_head_init(&fpage_head->list); // init the list
+
+  // init acocunting object
+  struct fmem *fm = mem_from_fpage(fpage_head); // create our main accounting object, stashed in the headerpage
+  fm->total_size = list_length; // total is all the page list has
+  fm->flags = opts->flags;
+  fm->total_available = list_length - (head_size + fmem_overhead(fm)); // but we used two headers, main accounting object, the log and the extent table
+  fm->min_alloc = min_alloc; // set the min alloc we operate on
+  fm->alloc_objects = 0;
+  fm->free_map = 0;
+  fm->align = opts->align;
+  fm->handle_table = 0; // no handle table until fmem_htable_create(..)
+  fm->handle_count = 0;
+  fm->handle_free = 0;
+  rptr_set(&fm->epochs, NULL);
+  fm->generation = 0; // never detached
+  fm->clean = 0;
+  fm->header_crc = 0;
+  fm->snapshot_epoch = 0;
+  // one free extent covers the huge zone
+  fm->huge_offset = huge_offset;
+  fm->huge_size = huge_size;
+  fm->huge_available = huge_size;
+  fm->huge_extents = huge_extents;
+  fm->huge_count = huge_size == 0 ? 0 : 1;
+  fm->huge_threshold = huge_size == 0 ? 0 : opts->huge_threshold;
+  fm->huge_unused = 0;
+  for(uint32_t class = 0; class < FMEM_SIZE_CLASSES; class++) rlist_head_init(&fm->free_lists[class]);
+  memset(fm->free_skip, 0, sizeof(fm->free_skip));
+	// NULL too, this process may have used an fmem at this address before
+	if(fmem_set_committer(fm, committer) != 0) return (struct fmem *) FMEM_E_NOMEM;
+
+	// empty log, a zeroed first record header is never valid
+	fm->log_size = log_size;
+	fm->log_head = 0;
+	fm->log_records = 0;
+	fm->log_seq = 0;
+	if(log_size != 0) memset(flog_area(fm), 0, sizeof(struct flog_record));
+	if(huge_size != 0){
+		fmem_extents(fm)[0].offset = huge_offset;
+		fmem_extents(fm)[0].size = huge_size;
+	}
+
+	/* for rare cases where fmem left in locked state*/
+	fm->lock = 0;
+	fm->lock_waiters = 0;
+	fm->lock_recoveries = 0;
+	fm->broken = 0;
+	memset(&fm->counters, 0, sizeof(struct fmem_counters));
+
+  // create a second page (this is first empty massive page
+  char * start = (char *) fpage_head;
+  struct fmem_page *main_fpage = (struct fmem_page *) (start + fpage_head->size);
+  fpage_init(fm, main_fpage, list_length - fpage_head->size); // assign the remaining to it
+  fpage_link_after(fm, fpage_head, main_fpage); // link pages
+
+
+  fpage_set_busy(fpage_head); // set head page as busy
+  fpage_set_free(main_fpage); // set main page as free
+#ifdef __BAD_MEM__
+  fpage_set_magic(fpage_head, POISON);
+  fpage_set_magic(main_fpage, POISON);
+#endif
+  // the main page is our first free page
+  struct commit_set set = {0};
+  findex_insert(fm, main_fpage, &set);
+  fpage_tag(fm, main_fpage, &set);
+
+	// commit if needed. without a log everything we touched is contiguous, head page,
+	// main page header and main page index link. with a log we skip the log body.
+	// compact main page has its footer at the very end
+	if(committer != NULL){
+		struct commit_range r[4] = {0};
+		uint8_t count = 1;
+		r[0].start = on_mem;
+		r[0].len = fpage_head->size + fmem_overhead(fm) + findex_link_len(main_fpage);
+		if(log_size != 0){
+			r[0].len = PAGE_OVERHEAD + sizeof(struct fmem) + sizeof(struct flog_record);
+			r[1].start = main_fpage;
+			r[1].len = fmem_overhead(fm) + findex_link_len(main_fpage);
+			count = 2;
+			if(extents_size != 0){
+				r[count].start = fmem_extents(fm);
+				r[count].len = sizeof(struct fmem_extent);
+				count++;
+			}
+		}
+		if(fm->flags & FMEM_F_COMPACT){
+			r[count].start = ((char *) on_mem) + list_length - sizeof(uint32_t);
+			r[count].len = sizeof(uint32_t);
+			count++;
+		}
+		if (committer(r, count) < 0) return (struct fmem *) E_COMMIT_FAILED;
+	}
+
+  return fm;
+}
+
+// gets a reference to an existing allocator occupying on_mem memory
+struct fmem* fmem_from_existing(void * on_mem, committer_t committer){
+  // our accounting object is stashed in head page
+  struct fmem_page *fpage_head = (struct fmem_page *) on_mem;
+
+  int64_t check = fail_on_poison_check(fpage_get_magic(fpage_head), POISON, "reloading existing allocator (head page)");
+  if( check != 0) return  ((struct fmem *) check);
+
+
+  struct fmem *fm = (struct fmem *) mem_from_fpage(fpage_head);
+	// attach may commit (replay, rebuilt accounting). the committer is ours
+	// only, other attached processes keep their own
+	if(fmem_set_committer(fm, committer) != 0) return (struct fmem *) FMEM_E_NOMEM;
+
+	// other processes may be attached and working on this memory, so we
+	// don't touch the lock state. we take the lock like everybody else, if
+	// the holder died, the lock recovers the accounting and free lists.
+	fmem_lock_take(fm);
+	// nothing to check if fmem was cleanly detached and did not change since.
+	// memory left broken gets another try
+	int res = 0;
+	if(!fmem_is_clean(fm) || fm->broken != 0){
+		res = fmem_repair_locked(fm);
+		if(res == 0) fm->broken = 0;
+		if(res == E_BROKEN_MEM) fm->broken = 1;
+	}
+	fmem_unlock(fm);
+	if(res == E_BROKEN_MEM) return (struct fmem *) E_BROKEN_MEM;
+	if(res != 0) return (struct fmem *) E_COMMIT_FAILED;
+
+	// we don't try to commit here. because one of the following is true
+	// this was commited before and create_from_new does not change anything so there is no need to commit again
+	// this was not committed before and commit is just used, in this case we will save the header anyway
+	// on first alloc/free ops
+
+  return fm;
+}
+
+int64_t fmem_detach(struct fmem *fm){
+  int res = 0;
+
+  if(fmem_lock(fm) != 0) return E_BROKEN_MEM;
+  // the log is emptied first, a clean fmem has nothing to replay
+  if(fm->log_size != 0) res = flog_checkpoint(fm);
+  if(res == 0){
+    fm->generation++;
+    fm->clean = FMEM_CLEAN;
+    fm->header_crc = fmem_header_crc(fm);
+    if(fmem_committer(fm) != NULL){
+      struct commit_range r = {0};
+      r.start = fm;
+      r.len = offsetof(struct fmem, user1);
+      res = fmem_commit_ranges(fm, &r, 1);
+    }
+  }
+  int64_t generation = (int64_t) fm->generation;
+  fmem_unlock(fm);
+
+  return res != 0 ? E_COMMIT_FAILED : generation;
+}
+
+int64_t fmem_run_locked(struct fmem *fm, fmem_locked_t fn, void *ctx){
+  if(fmem_lock(fm) != 0) return E_BROKEN_MEM;
+  int64_t res = fn(fm, ctx);
+  fmem_unlock(fm);
+  return res;
+}
+
+// gives the tail of a busy page (everything after keep) back as a free page,
+// it merges with the next page if that one is free. caller commits fpage
+// header and accounting
+static void fpage_release_tail(struct fmem *fm, struct fmem_page *fpage, uint32_t keep, struct commit_set *set, int *res){
+  struct fmem_page *tail = (struct fmem_page *) (((char *) fpage) + keep);
+  uint32_t tail_size = fpage->size - keep;
+  fpage->size = keep;
+  fpage_init(fm, tail, tail_size);
+  fpage_set_free(tail);
+#ifdef __BAD_MEM__
+  fpage_set_magic(tail, POISON);
+#endif
+  fpage_link_after(fm, fpage, tail);
+  fm->total_available += tail_size;
+
+  struct fmem_page *next = fpage_next(fm, tail);
+  if(fpage_is_free(next)) *res |= findex_remove(fm, next, set);
+  tail = fpage_merge(fm, tail); // prev is busy, only next can merge
+  *res |= findex_insert(fm, tail, set);
+
+  // tail header and the link of the page after it
+  *res |= fpage_commit_header(fm, set, tail);
+  *res |= fpage_commit_link(fm, set, fpage_next(fm, tail));
+  *res |= fpage_tag(fm, tail, set);
+}
+
+// allocates size at an align boundary (power of 2). the page is carved out
+// of the end of a free page with the body moved down to the boundary. what
+// is left after the body (if it is big enough) is given back as a free page,
+// so the padding is not lost. caller must hold the lock, the ranges that
+// need to be committed are collected in set and it is up to the caller to
+// flush them.
+static void* fmem_alloc_aligned_locked(struct fmem *fm, uint32_t size, uint32_t align, struct commit_set *set){
+  uint32_t adjusted_alloc = fmem_align_body(fm, size < fm->min_alloc ? fm->min_alloc : size);
+  if(align < fm->align) align = fm->align;
+  // worst case, the body goes align - 1 down and the page in front of it
+  // must still be a usable free page
+  uint64_t worst = (uint64_t) adjusted_alloc + align + fmem_remain_free(fm) + fmem_overhead(fm);
+  int res = 0;
+
+  struct fmem_page *this_page = NULL;
+  if(worst <= UINT32_MAX && fm->total_available >= worst) this_page = findex_find(fm, worst);
+  if(this_page == NULL || fpage_can_fit(this_page, worst) == CAN_NOT_FIT){
+    FMEM_STAT(fm, alloc_failures, 1);
+    return (void *) FMEM_E_NOMEM;
+  }
+  int64_t check = fail_on_poison_check(fpage_get_magic(this_page), POISON, "selecting free mem page for aligned alloc");
+  if( check != 0) return (void *) check;
+
+  char *page_end = ((char *) this_page) + this_page->size;
+  uintptr_t body = ((uintptr_t) (page_end - adjusted_alloc)) & ~((uintptr_t) align - 1);
+  struct fmem_page *selected = fpage_of(fm, (void *) body);
+  uint32_t front = (char *) selected - (char *) this_page;
+
+  bool moves = findex_moves(fm, this_page, front);
+  if(moves) res |= findex_remove(fm, this_page, set);
+  this_page->size = front;
+  fpage_init(fm, selected, page_end - (char *) selected);
+  fpage_link_after(fm, this_page, selected);
+  if(moves) res |= findex_insert(fm, this_page, set);
+  res |= fpage_tag(fm, this_page, set);
+
+  fpage_set_busy(selected);
+  if(align > fm->align) fpage_set_pinned(selected); // compaction would lose the alignment
+#ifdef __BAD_MEM__
+  fpage_set_magic(selected, POISON);
+#endif
+  fm->total_available -= selected->size;
+  fm->alloc_objects += 1;
+  FMEM_STAT(fm, allocs, 1);
+  FMEM_STAT(fm, size_hist[fclass_of(adjusted_alloc)], 1);
+
+  // padding after the body
+  if(fpage_actual(selected) - adjusted_alloc > fmem_remain_free(fm)){
+    fpage_release_tail(fm, selected, adjusted_alloc + fmem_overhead(fm), set, &res);
+  }else{
+    res |= fpage_commit_link(fm, set, fpage_next(fm, selected));
+    res |= fpage_tag(fm, selected, set);
+  }
+
+  // the page we carved from and the selected page headers (they may be next
+  // to each other), accounting, and the body is now owned by the user
+  res |= fpage_commit_header(fm, set, this_page);
+  res |= fpage_commit_header(fm, set, selected);
+  res |= commit_set_add_accounting(fm, set);
+  res |= commit_set_fence(fm, set, mem_from_fpage(selected), fpage_actual(selected));
+  return res != 0 ? (void *) E_COMMIT_FAILED : mem_from_fpage(selected);
+}
+
+// allocates memory from fmem. caller must hold the lock, the ranges that
+// need to be committed are collected in set and it is up to the caller to
+// flush them.
+static void* fmem_alloc_locked(struct fmem *fm, uint32_t size, struct commit_set *set){
+  void* ret = NULL;
+  struct fmem_page *selected = NULL;
+  int res = 0;
+  uint32_t adjusted_alloc = size < fm->min_alloc ? fm->min_alloc : size;
+  if(fm->align > 1) return fmem_alloc_aligned_locked(fm, size, fm->align, set);
+
+  if (fm->total_available < adjusted_alloc) {
+          goto done;
+    }
+
+  // free pages are indexed by size class, so we don't walk the page list.
+  // carving pages always carve towards the end of the page. this keeps the page
+  // we carve from at the same address and - unless its class changes - in
+  // the same free list.
+  struct fmem_page *this_page = findex_find(fm, adjusted_alloc);
+  if(this_page == NULL) goto done;
+
+  // check for corruption
+  int64_t check = fail_on_poison_check(fpage_get_magic(this_page), POISON, "selecting free mem page");
+  if( check != 0){
+         ret = (void *) check;
+         goto done;
+  }
+
+  int fit_status = fpage_can_fit(this_page, adjusted_alloc);
+  switch(fit_status){
+    case CAN_NOT_FIT:
+      break;
+    case FIT_AS_IS:
+      // the entire page leaves the index
+      res |= findex_remove(fm, this_page, set);
+      selected = this_page;
+      break;
+    case FIT_WITH_CARVE: // we need to carve this page
+      if(findex_moves(fm, this_page, this_page->size - (adjusted_alloc + fmem_overhead(fm)))){
+        // what remains of the page belongs somewhere else in the index
+        res |= findex_remove(fm, this_page, set);
+        fpage_carve(fm, this_page, &selected, adjusted_alloc);// carve it
+        res |= findex_insert(fm, this_page, set);
+      }else{
+        fpage_carve(fm, this_page, &selected, adjusted_alloc);// carve it
+      }
+
+      // we need to save
+      // previous page header (the one we carved from)
+      // next page list
+      res |= fpage_commit_header(fm, set, this_page);
+      res |= fpage_commit_link(fm, set, fpage_next(fm, selected));
+      res |= fpage_tag(fm, this_page, set);
+      break;
+  }
+
+done:
+  // at this point we don't care if it was selected as is or carved
+  if(selected != NULL){
+    fpage_set_busy(selected); // mark as busy
+#ifdef __BAD_MEM__
+    fpage_set_magic(selected, POISON);
+#endif
+    // do the accounting
+    fm->total_available -= selected->size;
+    fm->alloc_objects += 1;
+    ret = mem_from_fpage(selected);
+
+    // selected page header and accounting. the body is now owned by the user
+    res |= fpage_commit_header(fm, set, selected);
+    res |= fpage_tag(fm, selected, set);
+    res |= commit_set_add_accounting(fm, set);
+    res |= commit_set_fence(fm, set, ret, fpage_actual(selected));
+    if(res != 0) ret = (void *) E_COMMIT_FAILED;
+  }
+
+  if(ret == NULL){
+    FMEM_STAT(fm, alloc_failures, 1);
+    return (void *) FMEM_E_NOMEM;
+  }
+  if((int64_t) ret > 0){
+    FMEM_STAT(fm, allocs, 1);
+    FMEM_STAT(fm, size_hist[fclass_of(adjusted_alloc)], 1);
+  }
+  return ret;
+}
+
+fmem_sampler_t fmem_sampler = NULL;
+static __thread int64_t fmem_sample_left = 0; // bytes this thread allocates before the next sample
+
+void fmem_set_sampler(fmem_sampler_t sampler){
+  __atomic_store_n(&fmem_sampler, sampler, __ATOMIC_RELEASE);
+}
+
+// counts size down, returns true if this alloc is to be sampled
+static inline bool fmem_sample_due(uint64_t size){
+  if(__builtin_expect(__atomic_load_n(&fmem_sampler, __ATOMIC_ACQUIRE) == NULL, 1)) return false;
+  fmem_sample_left -= size;
+  return fmem_sample_left <= 0;
+}
+
+// calls the sampler for an alloc that is due, size is capped (huge allocs)
+static inline void fmem_sample_call(struct fmem *fm, void *mem, uint64_t size){
+  fmem_sampler_t sampler = __atomic_load_n(&fmem_sampler, __ATOMIC_ACQUIRE);
+  if(sampler == NULL) return;
+  fmem_sample_left = (int64_t) sampler(fm, mem, NULL, size > UINT32_MAX ? UINT32_MAX : (uint32_t) size, FMEM_SAMPLE_ALLOC);
+}
+
+// called with the lock held after an alloc, pages can't move under us
+static inline void fmem_sample_alloc(struct fmem *fm, void *mem, uint32_t size){
+  if((int64_t) mem <= 0 || !fmem_sample_due(size)) return;
+  fpage_set_sampled(fpage_of(fm, mem));
+  fmem_sample_call(fm, mem, size);
+}
+
+static inline void fmem_sample_event(struct fmem *fm, void *mem, void *to, int event){
+  fmem_sampler_t sampler = __atomic_load_n(&fmem_sampler, __ATOMIC_ACQUIRE);
+  if(sampler != NULL) sampler(fm, mem, to, 0, event);
+}
+
+void* fmem_alloc_aligned(struct fmem *fm, uint32_t size, uint32_t align){
+  if(align == 0 || align > os_page_size() || (align & (align - 1)) != 0) return (void *) E_BAD_ALIGN;
+  struct commit_set set = {0};
+
+  if(fmem_lock(fm) != 0) return (void *) E_BROKEN_MEM;
+  void *ret = fmem_alloc_aligned_locked(fm, size, align, &set);
+  fmem_sample_alloc(fm, ret, size);
+  if(commit_set_flush(fm, &set) != 0) ret = (void *) E_COMMIT_FAILED;
+  fmem_unlock(fm);
+
+  return ret;
+}
+
+// allocates memory from fmem
+void* fmem_alloc(struct fmem *fm, uint32_t size){
+  if(fm->huge_threshold != 0 && size >= fm->huge_threshold) return fmem_alloc_huge(fm, size);
+  struct commit_set set = {0};
+
+  if(fmem_lock(fm) != 0) return (void *) E_BROKEN_MEM;
+  void *ret = fmem_alloc_locked(fm, size, &set);
+  fmem_sample_alloc(fm, ret, size);
+  if(commit_set_flush(fm, &set) != 0) ret = (void *) E_COMMIT_FAILED;
+  fmem_unlock(fm);
+
+  return ret;
+}
+
+// frees a memory. caller must hold the lock. the ranges that need to be
+// committed are collected in set and it is up to the caller to flush them.
+static int64_t fmem_free_locked(struct fmem *fm, void *mem, struct commit_set *set){
+  struct fmem_page *fpage = fpage_of(fm, mem); // get the page for that mem. page is always stashed before the mem
+  int res = 0;
+
+  int64_t to_free = (int64_t) fpage->size; // keep the size aside
+  if(fpage_is_sampled(fpage)) fmem_sample_event(fm, mem, NULL, FMEM_SAMPLE_FREE);
+  fpage_set_free(fpage); // free it
+  FMEM_STAT(fm, frees, 1);
+
+  // free neighbours are about to be merged, they have to leave
+  // the index before thier size change
+  struct fmem_page *prev = fpage_prev_free(fm, fpage);
+  struct fmem_page *next = fpage_next(fm, fpage);
+  if(prev != NULL) res |= findex_remove(fm, prev, set);
+  if(next != fpage && fpage_is_free(next)) res |= findex_remove(fm, next, set);
+
+  struct fmem_page *modified = fpage_merge(fm, fpage); // merge, if we can
+  res |= findex_insert(fm, modified, set);
+  // accountig
+  fm->alloc_objects -= 1;
+  fm->total_available += to_free;
+
+	// commit
+	// header for modified
+	// header for previous (we only need the list pointers)
+	// header for next (we only need the list pointers)
+	// accounting and free lists heads
+	// compact pages have no links, footer and next prev free flag instead
+	res |= fpage_commit_header(fm, set, modified);
+	if(!(fm->flags & FMEM_F_COMPACT)) res |= commit_set_add(fm, set, rlist_prev(&modified->list), sizeof(struct rlist_head));
+	res |= fpage_commit_link(fm, set, fpage_next(fm, modified));
+	res |= fpage_tag(fm, modified, set);
+	res |= commit_set_add_accounting(fm, set);
+
+  return res != 0 ? E_COMMIT_FAILED : to_free;
+}
+
+// commits extents n.. (to the end of the table) and accounting
+static inline int fextent_commit_from(struct fmem *fm, struct commit_set *set, uint32_t n){
+  int res = commit_set_add(fm, set, &fmem_extents(fm)[n], (fm->huge_count - n) * sizeof(struct fmem_extent));
+  return res | commit_set_add_accounting(fm, set);
+}
+
+// extents are huge, best fit keeps big ones big
+void* fmem_alloc_huge(struct fmem *fm, uint64_t size){
+  if(fm->huge_size == 0 || size == 0 || size > fm->huge_size) return (void *) FMEM_E_NOMEM;
+  uint64_t needed = (size + os_page_size() - 1) & ~((uint64_t) os_page_size() - 1);
+  struct commit_set set = {0};
+  void *ret = (void *) FMEM_E_NOMEM;
+
+  if(fmem_lock(fm) != 0) return (void *) E_BROKEN_MEM;
+  struct fmem_extent *extents = fmem_extents(fm);
+  uint32_t best = fm->huge_count;
+  for(uint32_t n = 0; n < fm->huge_count; n++){
+    if(extents[n].size & FMEM_EXTENT_BUSY || extents[n].size < needed) continue;
+    if(best == fm->huge_count || extents[n].size < extents[best].size) best = n;
+  }
+  if(best < fm->huge_count){
+    // the rest stays free as the next extent, unless the table is full then
+    // it goes with the alloc
+    if(extents[best].size > needed && fm->huge_count < fm->huge_extents){
+      memmove(&extents[best + 2], &extents[best + 1], (fm->huge_count - best - 1) * sizeof(struct fmem_extent));
+      extents[best + 1].offset = extents[best].offset + needed;
+      extents[best + 1].size = extents[best].size - needed;
+      extents[best].size = needed;
+      fm->huge_count++;
+    }
+    fm->huge_available -= extents[best].size;
+    extents[best].size |= FMEM_EXTENT_BUSY;
+    FMEM_STAT(fm, allocs, 1);
+    ret = ((char *) fpage_from_mem(fm)) + extents[best].offset;
+    if(fmem_sample_due(size)){
+      extents[best].size |= FMEM_EXTENT_SAMPLED;
+      fmem_sample_call(fm, ret, size);
+    }
+    if(fextent_commit_from(fm, &set, best) != 0) ret = (void *) E_COMMIT_FAILED;
+  }
+  if(commit_set_flush(fm, &set) != 0) ret = (void *) E_COMMIT_FAILED;
+  fmem_unlock(fm);
+
+  return ret;
+}
+
+// returns the extent that starts at mem, table is in order
+static inline struct fmem_extent* fextent_of(struct fmem *fm, void *mem){
+  uint64_t offset = (char *) mem - (char *) fpage_from_mem(fm);
+  struct fmem_extent *extents = fmem_extents(fm);
+  uint32_t low = 0;
+  uint32_t high = fm->huge_count;
+  while(low < high){
+    uint32_t mid = (low + high) / 2;
+    if(extents[mid].offset == offset) return &extents[mid];
+    if(extents[mid].offset < offset) low = mid + 1; else high = mid;
+  }
+  return NULL;
+}
+
+// gives physical memory back. on shared memory (shmem or a file) remove punches
+// a hole, blocks on disk are freed too. private memory is just dropped
+static inline void fextent_release(void *start, uint64_t len){
+  if(madvise(start, len, MADV_REMOVE) != 0) madvise(start, len, MADV_DONTNEED);
+}
+
+// a sample follows memory that is moved (unless where it goes has one of its
+// own), the sampler sees a move instead of a free. caller holds the lock
+static void fmem_sample_follow(struct fmem *fm, void *from, void *to){
+  struct fmem_extent *from_extent = fmem_is_huge(fm, from) ? fextent_of(fm, from) : NULL;
+  struct fmem_extent *to_extent = fmem_is_huge(fm, to) ? fextent_of(fm, to) : NULL;
+  bool sampled = from_extent != NULL ? (from_extent->size & FMEM_EXTENT_SAMPLED) != 0 : fpage_is_sampled(fpage_of(fm, from));
+  bool to_sampled = to_extent != NULL ? (to_extent->size & FMEM_EXTENT_SAMPLED) != 0 : fpage_is_sampled(fpage_of(fm, to));
+  if(!sampled || to_sampled) return;
+
+  if(from_extent != NULL) from_extent->size &= ~FMEM_EXTENT_SAMPLED; else fpage_clear_sampled(fpage_of(fm, from));
+  if(to_extent != NULL) to_extent->size |= FMEM_EXTENT_SAMPLED; else fpage_set_sampled(fpage_of(fm, to));
+  fmem_sample_event(fm, from, to, FMEM_SAMPLE_MOVE);
+}
+
+static int64_t fmem_free_huge(struct fmem *fm, void *mem){
+  struct commit_set set = {0};
+
+  if(fmem_lock(fm) != 0) return E_BROKEN_MEM;
+  struct fmem_extent *extent = fextent_of(fm, mem);
+  if(extent == NULL || !(extent->size & FMEM_EXTENT_BUSY)){
+    fmem_unlock(fm);
+    return E_BAD_EXTENT;
+  }
+  if(extent->size & FMEM_EXTENT_SAMPLED) fmem_sample_event(fm, mem, NULL, FMEM_SAMPLE_FREE);
+  // memory is released while it is still ours, nobody can get it meanwhile
+  int64_t freed = (int64_t) (extent->size & ~(FMEM_EXTENT_BUSY | FMEM_EXTENT_SAMPLED));
+  fextent_release(mem, freed);
+  extent->size = freed;
+  fm->huge_available += freed;
+  FMEM_STAT(fm, frees, 1);
+
+  // merge with free neighbours, next first then previous
+  struct fmem_extent *extents = fmem_extents(fm);
+  uint32_t n = extent - extents;
+  if(n + 1 < fm->huge_count && !(extents[n + 1].size & FMEM_EXTENT_BUSY)){
+    extents[n].size += extents[n + 1].size;
+    memmove(&extents[n + 1], &extents[n + 2], (fm->huge_count - n - 2) * sizeof(struct fmem_extent));
+    fm->huge_count--;
+  }
+  if(n > 0 && !(extents[n - 1].size & FMEM_EXTENT_BUSY)){
+    extents[n - 1].size += extents[n].size;
+    memmove(&extents[n], &extents[n + 1], (fm->huge_count - n - 1) * sizeof(struct fmem_extent));
+    fm->huge_count--;
+    n--;
+  }
+  if(fextent_commit_from(fm, &set, n) != 0) freed = E_COMMIT_FAILED;
+  if(commit_set_flush(fm, &set) != 0) freed = E_COMMIT_FAILED;
+  fmem_unlock(fm);
+
+  return freed;
+}
+
+// frees a memory and returns total freed memory (includes page overhead, which will also be returned to pool)
+// BAD_MEM is tested for this one
+int64_t fmem_free(struct fmem *fm, void *mem){
+  if(fmem_is_huge(fm, mem)) return fmem_free_huge(fm, mem);
+  struct fmem_page *fpage = fpage_of(fm, mem); // get the page for that mem. page is always stashed before the mem
+
+  // POISON CHECK
+  int64_t check = fail_on_poison_check(fpage_get_magic(fpage), POISON, "reloading existing allocator");
+  if( check != 0) return check;
+
+  struct commit_set set = {0};
+
+  if(fmem_lock(fm) != 0) return E_BROKEN_MEM;
+  int64_t to_free = fmem_free_locked(fm, mem, &set);
+  if(commit_set_flush(fm, &set) != 0) to_free = E_COMMIT_FAILED;
+  fmem_unlock(fm);
+
+  return to_free;
+}
+
+// the lock is not taken if the caller owns fmem
+static inline int fmem_lock_variant(struct fmem *fm, uint32_t variant){
+  if(!(variant & FMEM_V_UNLOCKED)) return fmem_lock(fm);
+  return 0;
+}
+
+static inline void fmem_unlock_variant(struct fmem *fm, uint32_t variant){
+  if(!(variant & FMEM_V_UNLOCKED)) fmem_unlock(fm);
+}
+
+void* fmem_alloc_variant(struct fmem *fm, uint32_t size, uint32_t variant){
+  if(!(variant & FMEM_V_UNLOCKED)) return fmem_alloc(fm, size);
+  if(fm->huge_threshold != 0 && size >= fm->huge_threshold) return fmem_alloc_huge(fm, size);
+  struct commit_set set = {0};
+
+  void *ret = fmem_alloc_locked(fm, size, &set);
+  fmem_sample_alloc(fm, ret, size);
+  if(commit_set_flush(fm, &set) != 0) ret = (void *) E_COMMIT_FAILED;
+  return ret;
+}
+
+int64_t fmem_free_variant(struct fmem *fm, void *mem, uint32_t variant){
+  if(!(variant & FMEM_V_UNLOCKED) || fmem_is_huge(fm, mem)) return fmem_free(fm, mem);
+  int64_t check = fail_on_poison_check(fpage_get_magic(fpage_of(fm, mem)), POISON, "freeing unlocked");
+  if( check != 0) return check;
+  struct commit_set set = {0};
+
+  int64_t to_free = fmem_free_locked(fm, mem, &set);
+  if(commit_set_flush(fm, &set) != 0) to_free = E_COMMIT_FAILED;
+  return to_free;
+}
+
+// resizes memory, caller must hold the lock. the ranges that need to be
+// committed are collected in set and it is up to the caller to flush them.
+static void* fmem_realloc_locked(struct fmem *fm, void *mem, uint32_t size, struct commit_set *set){
+  struct fmem_page *fpage = fpage_of(fm, mem);
+  struct fmem_page *next = fpage_next(fm, fpage);
+  uint32_t overhead = fmem_overhead(fm);
+  uint32_t remain_free = fmem_remain_free(fm);
+  // handle pages keep their handle after the memory
+  bool handle_page = fpage_is_handle(fpage);
+  fmem_handle_t handle = handle_page ? fpage_handle_of(fpage) : 0;
+  uint32_t extra = handle_page ? sizeof(fmem_handle_t) : 0;
+  if(size > UINT32_MAX - overhead - extra) return (void *) FMEM_E_NOMEM;
+
+  uint32_t needed = fmem_align_body(fm, size + extra < fm->min_alloc ? fm->min_alloc : size + extra);
+  uint32_t actual = fpage_actual(fpage);
+  void *ret = mem;
+  int res = 0;
+
+  if(needed <= actual){
+    // shrink, carve the tail off if it is big enough to be used
+    if(actual - needed <= remain_free) return mem;
+    fpage_release_tail(fm, fpage, needed + overhead, set, &res);
+  }else if(fpage_is_free(next) && (uint64_t) actual + next->size >= needed){
+    // grow, absorb next page then carve what we don't need back off
+    uint32_t old_size = fpage->size;
+    res |= findex_remove(fm, next, set);
+    fpage_unlink(fm, next);
+    fpage->size += next->size;
+    fm->total_available -= next->size;
+    if(fpage_actual(fpage) - needed > remain_free){
+      fpage_release_tail(fm, fpage, needed + overhead, set, &res);
+    }else{
+      res |= fpage_commit_link(fm, set, fpage_next(fm, fpage));
+      res |= fpage_tag(fm, fpage, set);
+    }
+    // what used to be next page is now owned by the user
+    res |= commit_set_fence(fm, set, ((char *) fpage) + old_size, fpage->size - old_size);
+  }else{
+    // move, contents are committed with the op. aligned memory is moved to
+    // (at least) the same alignment it has now
+    void *moved = NULL;
+    if(fpage_is_pinned(fpage)){
+      uintptr_t at = (uintptr_t) mem;
+      uintptr_t align = at & -at;
+      if(align > os_page_size()) align = os_page_size();
+      moved = fmem_alloc_aligned_locked(fm, needed, (uint32_t) align, set);
+    }else{
+      moved = fmem_alloc_locked(fm, needed, set);
+    }
+    if((int64_t) moved <= 0) return moved;
+    uint32_t copy = actual - extra < size ? actual - extra : size;
+    memcpy(moved, mem, copy);
+    if(fm->log_size != 0){
+      // bodies are never logged, they go straight to the committer ahead
+      // of the record that makes them ours
+      struct commit_range r = {0};
+      r.start = moved;
+      r.len = copy;
+      if(copy != 0 && fmem_committer(fm) != NULL) res |= fmem_commit_ranges(fm, &r, 1);
+    }else{
+      res |= commit_set_add(fm, set, moved, copy);
+    }
+    if(handle_page){
+      uint64_t *table = (uint64_t *) rptr_get(&fm->handle_table);
+      table[handle - 1] = (char *) moved - (char *) fm;
+      fpage_set_handle(fpage_of(fm, moved));
+      res |= commit_set_add(fm, set, &table[handle - 1], sizeof(uint64_t));
+    }
+    fmem_sample_follow(fm, mem, moved);
+    if(fmem_free_locked(fm, mem, set) < 0) res |= E_COMMIT_FAILED;
+    fpage = fpage_of(fm, moved);
+    ret = moved;
+  }
+
+  if(handle_page){
+    memcpy(fpage_handle_slot(fpage), &handle, sizeof(fmem_handle_t));
+    res |= commit_set_add(fm, set, fpage_handle_slot(fpage), sizeof(fmem_handle_t));
+  }
+  res |= fpage_commit_header(fm, set, fpage);
+  res |= commit_set_add_accounting(fm, set);
+  return res != 0 ? (void *) E_COMMIT_FAILED : ret;
+}
+
+// huge memory is resized within its extent when it fits, the tail goes back
+// as a free extent (if the table has room), or it takes what it needs from a
+// free extent next to it. otherwise it is moved
+static void* fmem_realloc_huge(struct fmem *fm, void *mem, uint32_t size){
+  uint64_t page = os_page_size();
+  uint64_t needed = size == 0 ? page : ((uint64_t) size + page - 1) & ~(page - 1);
+  struct commit_set set = {0};
+  void *ret = mem;
+
+  if(fmem_lock(fm) != 0) return (void *) E_BROKEN_MEM;
+  struct fmem_extent *extent = fextent_of(fm, mem);
+  if(extent == NULL || !(extent->size & FMEM_EXTENT_BUSY)){
+    fmem_unlock(fm);
+    return (void *) E_BAD_EXTENT;
+  }
+  struct fmem_extent *extents = fmem_extents(fm);
+  uint32_t n = extent - extents;
+  uint64_t flags = extent->size & (FMEM_EXTENT_BUSY | FMEM_EXTENT_SAMPLED);
+  uint64_t have = extent->size & ~flags;
+  bool next_free = n + 1 < fm->huge_count && !(extents[n + 1].size & FMEM_EXTENT_BUSY);
+
+  if(needed < have && (next_free || fm->huge_count < fm->huge_extents)){
+    // shrink, the tail is released and joins the free extent after it
+    fextent_release(((char *) mem) + needed, have - needed);
+    if(!next_free){
+      memmove(&extents[n + 2], &extents[n + 1], (fm->huge_count - n - 1) * sizeof(struct fmem_extent));
+      extents[n + 1].size = 0;
+      fm->huge_count++;
+    }
+    extents[n + 1].offset = extents[n].offset + needed;
+    extents[n + 1].size += have - needed;
+    extent->size = needed | flags;
+    fm->huge_available += have - needed;
+  }else if(needed > have && next_free && have + extents[n + 1].size >= needed){
+    // grow, the free extent after it gives what is missing
+    uint64_t taken = needed - have;
+    extents[n + 1].offset += taken;
+    extents[n + 1].size -= taken;
+    if(extents[n + 1].size == 0){
+      memmove(&extents[n + 1], &extents[n + 2], (fm->huge_count - n - 2) * sizeof(struct fmem_extent));
+      fm->huge_count--;
+    }
+    extent->size = needed | flags;
+    fm->huge_available -= taken;
+  }else if(needed > have){
+    ret = NULL;
+  }
+  if(ret != NULL && fextent_commit_from(fm, &set, n) != 0) ret = (void *) E_COMMIT_FAILED;
+  if(commit_set_flush(fm, &set) != 0) ret = (void *) E_COMMIT_FAILED;
+  fmem_unlock(fm);
+  if(ret != NULL) return ret;
+
+  // move, the new memory is huge or not as fmem_alloc(..) sees fit. it is
+  // mem the caller owns, nobody touches it while it is copied
+  void *moved = fmem_alloc(fm, size);
+  if(moved == (void *) FMEM_E_NOMEM) moved = fmem_alloc_huge(fm, size);
+  if((int64_t) moved <= 0) return moved;
+  memcpy(moved, mem, have);
+  struct commit_range r = {0};
+  r.start = moved;
+  r.len = have;
+  if(fmem_committer(fm) != NULL && fmem_commit_ranges(fm, &r, 1) != 0) ret = (void *) E_COMMIT_FAILED;
+  if(fmem_lock(fm) != 0) return (void *) E_BROKEN_MEM;
+  fmem_sample_follow(fm, mem, moved);
+  fmem_unlock(fm);
+  if(fmem_free_huge(fm, mem) < 0) ret = (void *) E_COMMIT_FAILED;
+  return ret != NULL ? ret : moved;
+}
+
+void* fmem_realloc(struct fmem *fm, void *mem, uint32_t size){
+  if(mem == NULL) return fmem_alloc(fm, size);
+  if(fmem_is_huge(fm, mem)) return fmem_realloc_huge(fm, mem, size);
+
+  // POISON CHECK
+  int64_t check = fail_on_poison_check(fpage_get_magic(fpage_of(fm, mem)), POISON, "reallocating memory");
+  if( check != 0) return (void *) check;
+
+  struct commit_set set = {0};
+
+  if(fmem_lock(fm) != 0) return (void *) E_BROKEN_MEM;
+  void *ret = fmem_realloc_locked(fm, mem, size, &set);
+  if(commit_set_flush(fm, &set) != 0) ret = (void *) E_COMMIT_FAILED;
+  fmem_unlock(fm);
+
+  return ret;
+}
+
+// carves count pages of size out of one free page, pages are next to each
+// other so everything we touched is one contiguous range. caller must hold the
+// lock. returns false (nothing done) if there is no single page for all of them
+static bool fmem_alloc_run_locked(struct fmem *fm, uint32_t size, uint32_t count, void **out, struct commit_set *set, int *res){
+  uint32_t overhead = fmem_overhead(fm);
+  uint64_t run = ((uint64_t) size + overhead) * count;
+  if(run > UINT32_MAX || fm->total_available < run) return false;
+
+  struct fmem_page *this_page = findex_find(fm, run - overhead);
+  if(this_page == NULL || fpage_can_fit(this_page, run - overhead) != FIT_WITH_CARVE) return false;
+  if(fail_on_poison_check(fpage_get_magic(this_page), POISON, "selecting free mem page for a run") != 0) return false;
+
+  char *run_end = ((char *) this_page) + this_page->size;
+  struct fmem_page *next = fpage_next(fm, this_page);
+  struct fmem_page *last = NULL; // the one next to next
+  bool class_changes = findex_moves(fm, this_page, this_page->size - run);
+  if(class_changes) *res |= findex_remove(fm, this_page, set);
+
+  // every carve comes from the end, so the last carved is the lowest
+  for(uint32_t i = 0; i < count; i++){
+    struct fmem_page *selected = NULL;
+    fpage_carve(fm, this_page, &selected, size);
+    if(last == NULL) last = selected;
+    fpage_set_busy(selected);
+#ifdef __BAD_MEM__
+    fpage_set_magic(selected, POISON);
+#endif
+    out[count - 1 - i] = mem_from_fpage(selected);
+  }
+  if(class_changes) *res |= findex_insert(fm, this_page, set);
+
+  fm->total_available -= run;
+  fm->alloc_objects += count;
+  FMEM_STAT(fm, allocs, count);
+  FMEM_STAT(fm, size_hist[fclass_of(size)], count);
+
+  // the page we carved from, the run, and the page after it (its prev link)
+  char *run_start = ((char *) this_page) + this_page->size;
+  *res |= fpage_commit_header(fm, set, this_page);
+  *res |= commit_set_add(fm, set, run_start, run_end - run_start);
+  *res |= fpage_commit_header(fm, set, next);
+  *res |= fpage_tag(fm, this_page, set);
+  *res |= fpage_tag(fm, last, set);
+  *res |= commit_set_add_accounting(fm, set);
+  return true;
+}
+
+void fmem_stats(struct fmem *fm, struct fmem_stats *stats){
+  memset(stats, 0, sizeof(struct fmem_stats));
+
+  if(fmem_lock(fm) != 0) return;
+  stats->total_size = fm->total_size;
+  stats->total_available = fm->total_available;
+  stats->alloc_objects = fm->alloc_objects;
+  for(uint32_t class = 0; class < FMEM_SIZE_CLASSES; class++){
+    struct rlist_head *bucket = &fm->free_lists[class];
+    struct rlist_head *current = bucket;
+    rlist_for_each(current, bucket){
+      struct fmem_page *this_page = fpage_from_free_link(fm, current);
+      uint32_t actual = fpage_actual(this_page);
+      stats->free_pages++;
+      stats->free_pages_by_class[class]++;
+      stats->free_bytes += actual;
+      if(actual > stats->largest_free) stats->largest_free = actual;
+    }
+  }
+  for(struct fskip_node *node = rptr_get(&fm->free_skip[0]); node != NULL; node = rptr_get(&node->next[0])){
+    struct fmem_page *this_page = fpage_from_skip_node(fm, node);
+    uint32_t actual = fpage_actual(this_page);
+    stats->free_pages++;
+    stats->free_pages_by_class[fclass_of(this_page->size)]++;
+    stats->free_bytes += actual;
+    if(actual > stats->largest_free) stats->largest_free = actual; // the last one is the largest
+  }
+  if(fm->flags & FMEM_F_STATS) stats->counters = fm->counters;
+  fmem_unlock(fm);
+
+  if(stats->free_bytes > 0){
+    stats->fragmentation = (uint32_t) (((stats->free_bytes - stats->largest_free) * 1000) / stats->free_bytes);
+  }
+}
+
+// a walk checks pages from start up to the first page at or past limit
+struct fcheck_walk{
+  struct fmem *fm;
+  struct fmem_check_report *report;
+  uint64_t *cells;       // busy bytes of map cells of this walk, NULL if no map
+  uint64_t cell_bytes;
+  char *start;           // first page, NULL if the range has none
+  char *limit;
+  char *end;             // where the last page walked ends
+  bool broken;           // a page size is wrong, pages after it can't be found
+  bool first_free;
+  bool last_free;
+  uint32_t errors;
+  const char *first_error;
+  char *first_error_at;
+  uint64_t pages;
+  uint64_t busy_pages;
+  uint64_t busy_bytes;
+  uint64_t free_pages;
+  uint64_t free_bytes;
+  uint64_t largest_free;
+  uint64_t free_pages_by_class[FMEM_SIZE_CLASSES];
+  pthread_t thread;
+  bool started;
+};
+
+static void fcheck_error(struct fcheck_walk *walk, char *at, const char *message){
+  if(walk->errors++ == 0){
+    walk->first_error = message;
+    walk->first_error_at = at;
+  }
+}
+
+static void fcheck_mark(struct fcheck_walk *walk, char *at, uint64_t len){
+  if(walk->cells == NULL) return;
+  uint64_t from = at - (char *) fpage_from_mem(walk->fm);
+  while(len > 0){
+    uint64_t cell = from / walk->cell_bytes;
+    uint64_t in_cell = walk->cell_bytes - (from % walk->cell_bytes);
+    if(in_cell > len) in_cell = len;
+    walk->cells[cell] += in_cell;
+    from += in_cell;
+    len -= in_cell;
+  }
+}
+
+// the page list ends at total_size
+static inline char* fcheck_list_end(struct fmem *fm){
+  return ((char *) fpage_from_mem(fm)) + fm->total_size;
+}
+
+// true if the links of a page at x agree with its size and with the page after it
+static bool fcheck_linked(struct fmem *fm, char *x){
+  char *list_end = fcheck_list_end(fm);
+  struct fmem_page *fpage = (struct fmem_page *) x;
+  if(fpage->size < PAGE_OVERHEAD || fpage->size > (size_t) (list_end - x)) return false;
+  char *next = x + fpage->size;
+  if(next != list_end && next + PAGE_OVERHEAD > list_end) return false;
+  struct rlist_head *want = next == list_end ? &fpage_from_mem(fm)->list : &((struct fmem_page *) next)->list;
+  return rlist_next(&fpage->list) == want && rlist_prev(want) == &fpage->list;
+}
+
+static void fcheck_walk_pages(struct fcheck_walk *walk){
+  struct fmem *fm = walk->fm;
+  char *list_end = fcheck_list_end(fm);
+  uint32_t overhead = fmem_overhead(fm);
+  bool compact = (fm->flags & FMEM_F_COMPACT) != 0;
+  bool prev_free = false;
+  char *at = walk->start;
+
+  while(at < walk->limit && at < list_end){
+    struct fmem_page *fpage = (struct fmem_page *) at;
+    if(at + overhead > list_end || fpage->size < overhead || fpage->size > (size_t) (list_end - at)){
+      fcheck_error(walk, at, "bad page size");
+      walk->broken = true;
+      break;
+    }
+    uint16_t magic = fpage_get_magic(fpage);
+    if(magic != POISON && ((walk->report->flags & FMEM_CHECK_POISON) || magic != 0)) fcheck_error(walk, at, "bad poison");
+    if(compact != fpage_is_compact(fpage)) fcheck_error(walk, at, "bad page format");
+    if(!compact && !fcheck_linked(fm, at)) fcheck_error(walk, at, "broken page links");
+
+    bool is_free = fpage_is_free(fpage);
+    if(at == walk->start) walk->first_free = is_free;
+    walk->pages++;
+    if(is_free){
+      if(prev_free) fcheck_error(walk, at, "free pages not merged");
+      if(fpage_is_handle(fpage) || fpage_is_pinned(fpage)) fcheck_error(walk, at, "bad free page flags");
+      if(compact){
+        uint32_t footer;
+        memcpy(&footer, at + fpage->size - sizeof(uint32_t), sizeof(uint32_t));
+        if(footer != fpage->size) fcheck_error(walk, at, "bad boundary tag");
+      }
+      uint64_t actual = fpage_actual(fpage);
+      walk->free_pages++;
+      walk->free_pages_by_class[fclass_of(fpage->size)]++;
+      walk->free_bytes += actual;
+      if(actual > walk->largest_free) walk->largest_free = actual;
+    }else{
+      walk->busy_pages++;
+      walk->busy_bytes += fpage->size;
+      fcheck_mark(walk, at, fpage->size);
+    }
+    char *next = at + fpage->size;
+    if(compact && next + overhead <= list_end && fpage_prev_is_free((struct fmem_page *) next) != is_free){
+      fcheck_error(walk, next, "bad prev free flag");
+    }
+    prev_free = is_free;
+    at = next;
+  }
+  walk->last_free = prev_free;
+  walk->end = at;
+}
+
+// a range finds its first page by links, a false find (or corruption) shows
+// when it does not start where the range before it ended
+static void* fcheck_range(void *arg){
+  struct fcheck_walk *walk = (struct fcheck_walk *) arg;
+  char *list_end = fcheck_list_end(walk->fm);
+  char *x = walk->start;
+  walk->start = NULL;
+  for(; x < walk->limit && x + PAGE_OVERHEAD <= list_end; x++){
+    if(fcheck_linked(walk->fm, x)){
+      walk->start = x;
+      break;
+    }
+  }
+  if(walk->start != NULL) fcheck_walk_pages(walk);
+  return NULL;
+}
+
+// walks free lists and skip list
+// returns # of free pages indexed
+static uint64_t fcheck_index(struct fmem *fm, struct fcheck_walk *walk, uint64_t max){
+  char *low = ((char *) fpage_from_mem(fm)) + fpage_from_mem(fm)->size;
+  char *high = fcheck_list_end(fm);
+  uint64_t indexed = 0;
+
+  for(uint32_t class = 0; class < FMEM_SIZE_CLASSES; class++){
+    struct rlist_head *bucket = &fm->free_lists[class];
+    bool empty = rlist_next(bucket) == bucket;
+    if(empty == ((fm->free_map & (1u << class)) != 0)) fcheck_error(walk, (char *) bucket, "bad free map");
+    for(struct rlist_head *link = rlist_next(bucket); link != bucket; link = rlist_next(link)){
+      struct fmem_page *fpage = fpage_from_free_link(fm, link);
+      if((char *) fpage < low || (char *) link + sizeof(struct rlist_head) > high || indexed++ > max){
+        fcheck_error(walk, (char *) bucket, "broken free list");
+        break;
+      }
+      if(rlist_prev(rlist_next(link)) != link) fcheck_error(walk, (char *) fpage, "broken free list links");
+      if(!fpage_is_free(fpage) || fclass_of(fpage->size) != class || findex_in_skip(fpage->size)) fcheck_error(walk, (char *) fpage, "busy or misplaced page in free list");
+    }
+  }
+
+  struct fmem_page *prev = NULL;
+  for(struct fskip_node *node = rptr_get(&fm->free_skip[0]); node != NULL; node = rptr_get(&node->next[0])){
+    struct fmem_page *fpage = fpage_from_skip_node(fm, node);
+    if((char *) fpage < low || (char *) node + sizeof(struct fskip_node) > high || indexed++ > max){
+      fcheck_error(walk, (char *) fm->free_skip, "broken skip list");
+      break;
+    }
+    if(!fpage_is_free(fpage) || !findex_in_skip(fpage->size)) fcheck_error(walk, (char *) fpage, "busy or misplaced page in skip list");
+    if(node->level == 0 || node->level > FMEM_SKIP_LEVELS) fcheck_error(walk, (char *) fpage, "bad skip list level");
+    if(prev != NULL && !fskip_before(fm, fpage_skip_node(prev), fpage->size, fpage)) fcheck_error(walk, (char *) fpage, "skip list out of order");
+    prev = fpage;
+  }
+  return indexed;
+}
+
+// extents must cover the zone in order, free ones merged
+static void fcheck_extents(struct fmem *fm, struct fcheck_walk *walk, struct fmem_check_report *report){
+  if(fm->huge_size == 0) return;
+  char *head = (char *) fpage_from_mem(fm);
+  struct fmem_extent *extents = fmem_extents(fm);
+  if(fm->huge_count == 0 || fm->huge_count > fm->huge_extents){
+    fcheck_error(walk, (char *) extents, "bad extent count");
+    return;
+  }
+  uint64_t at = fm->huge_offset;
+  uint64_t available = 0;
+  bool prev_free = false;
+  for(uint32_t n = 0; n < fm->huge_count; n++){
+    uint64_t size = extents[n].size & ~(FMEM_EXTENT_BUSY | FMEM_EXTENT_SAMPLED);
+    bool is_free = !(extents[n].size & FMEM_EXTENT_BUSY);
+    if(extents[n].offset != at || size == 0 || size > fm->huge_offset + fm->huge_size - at){
+      fcheck_error(walk, head + at, "extents overlap or leave a gap");
+      return;
+    }
+    if(is_free && prev_free) fcheck_error(walk, head + at, "free extents not merged");
+    if(is_free){
+      available += size;
+    }else{
+      report->huge_busy++;
+      report->huge_busy_bytes += size;
+      fcheck_mark(walk, head + at, size);
+    }
+    prev_free = is_free;
+    at += size;
+  }
+  if(at != fm->huge_offset + fm->huge_size) fcheck_error(walk, head + at, "extents do not cover the huge zone");
+  if(available != fm->huge_available) fcheck_error(walk, (char *) &fm->huge_available, "huge_available does not add up");
+}
+
+int64_t fmem_check(void *mem, size_t length, uint32_t threads, struct fmem_check_report *report){
+  struct fmem_page *head = (struct fmem_page *) mem;
+  struct fmem *fm = (struct fmem *) mem_from_fpage(head);
+  uint32_t flags = report->flags;
+  uint32_t cells = report->cells;
+  uint8_t *map = report->map;
+  memset(report, 0, sizeof(struct fmem_check_report));
+  report->flags = flags;
+  report->cells = cells;
+  report->map = map;
+
+  // pages are poisoned only by fmem built with __BAD_MEM__
+  if(length < PAGE_OVERHEAD + sizeof(struct fmem) || fpage_is_free(head)) return E_BAD_INIT_MEM;
+  uint16_t magic = fpage_get_magic(head);
+  if(magic != POISON && ((flags & FMEM_CHECK_POISON) || magic != 0)) return E_BAD_INIT_MEM;
+  if(fm->total_size > length || fmem_length(fm) > length || head->size < PAGE_OVERHEAD + sizeof(struct fmem) || head->size >= fm->total_size) return E_BAD_INIT_MEM;
+
+  // whole ranges for threads, compact pages are walked by one
+  char *first = ((char *) head) + head->size;
+  char *list_end = fcheck_list_end(fm);
+  if(threads == 0) threads = (uint32_t) sysconf(_SC_NPROCESSORS_ONLN);
+  uint64_t ranges = (list_end - first) / FMEM_CHECK_MIN_RANGE;
+  if(ranges > threads) ranges = threads;
+  if(ranges == 0 || (fm->flags & FMEM_F_COMPACT)) ranges = 1;
+
+  // every walk has its own map cells, a walk that is thrown away takes them along
+  struct fcheck_walk *walks = calloc(ranges + 1, sizeof(struct fcheck_walk));
+  uint64_t *busy_cells = cells > 0 ? calloc((ranges + 2) * (uint64_t) cells, sizeof(uint64_t)) : NULL;
+  if(walks == NULL || (cells > 0 && busy_cells == NULL)){
+    free(walks);
+    free(busy_cells);
+    return FMEM_E_NOMEM;
+  }
+  uint64_t range_size = (list_end - first) / ranges;
+  for(uint64_t i = 0; i <= ranges; i++){
+    walks[i].fm = fm;
+    walks[i].report = report;
+    walks[i].cells = cells > 0 ? busy_cells + i * cells : NULL;
+    walks[i].cell_bytes = cells > 0 ? (fmem_length(fm) + cells - 1) / cells : 0;
+    walks[i].start = first + i * range_size;
+    walks[i].limit = i + 1 >= ranges ? list_end : first + (i + 1) * range_size;
+  }
+  uint64_t *map_cells = cells > 0 ? busy_cells + (ranges + 1) * cells : NULL;
+  // the last walk is not a range, it holds what is checked at the end
+  struct fcheck_walk *rest = &walks[ranges];
+  fcheck_mark(rest, (char *) head, head->size);
+  if(!(fm->flags & FMEM_F_COMPACT) && rlist_next(&head->list) != &((struct fmem_page *) first)->list && first != list_end){
+    fcheck_error(rest, (char *) head, "broken page links");
+  }
+
+  // the first range starts at the first page, others find theirs
+  report->threads = 1;
+  for(uint64_t i = 1; i < ranges; i++){
+    walks[i].started = pthread_create(&walks[i].thread, NULL, fcheck_range, &walks[i]) == 0;
+    if(walks[i].started) report->threads++;
+  }
+  fcheck_walk_pages(&walks[0]);
+  for(uint64_t i = 1; i < ranges; i++){
+    if(walks[i].started) pthread_join(walks[i].thread, NULL);
+    else fcheck_range(&walks[i]);
+  }
+
+  // stitch ranges in order, a range that did not start where the one before
+  // it ended is walked again from there
+  char *expect = walks[0].end;
+  bool broken = walks[0].broken;
+  bool last_free = walks[0].last_free;
+  for(uint64_t i = 1; i < ranges && !broken; i++){
+    struct fcheck_walk *walk = &walks[i];
+    if(walk->start != expect){
+      struct fcheck_walk redo = {0};
+      redo.fm = fm;
+      redo.report = report;
+      redo.cells = walk->cells;
+      redo.cell_bytes = walk->cell_bytes;
+      redo.start = expect;
+      redo.end = expect;
+      redo.limit = walk->limit;
+      if(redo.cells != NULL) memset(redo.cells, 0, cells * sizeof(uint64_t));
+      if(expect < walk->limit) fcheck_walk_pages(&redo);
+      *walk = redo;
+    }
+    if(walk->start != NULL && walk->end != walk->start){
+      if(last_free && walk->first_free) fcheck_error(walk, walk->start, "free pages not merged");
+      last_free = walk->last_free;
+      expect = walk->end;
+    }
+    broken = walk->broken;
+  }
+
+  uint64_t max_pages = 0;
+  for(uint64_t i = 0; i < ranges; i++) max_pages += walks[i].pages;
+  uint64_t indexed = fcheck_index(fm, rest, max_pages);
+  fcheck_extents(fm, rest, report);
+
+  for(uint64_t i = 0; i <= ranges; i++){
+    struct fcheck_walk *walk = &walks[i];
+    for(uint32_t cell = 0; cell < cells; cell++) map_cells[cell] += walk->cells[cell];
+    if(walk->errors > 0 && report->errors == 0){
+      report->first_error = walk->first_error;
+      report->first_error_at = walk->first_error_at - (char *) head;
+    }
+    report->errors += walk->errors;
+    report->pages += walk->pages;
+    report->busy_pages += walk->busy_pages;
+    report->busy_bytes += walk->busy_bytes;
+    report->free_pages += walk->free_pages;
+    report->free_bytes += walk->free_bytes;
+    if(walk->largest_free > report->largest_free) report->largest_free = walk->largest_free;
+    for(uint32_t class = 0; class < FMEM_SIZE_CLASSES; class++) report->free_pages_by_class[class] += walk->free_pages_by_class[class];
+  }
+
+  // what was walked must add up to the accounting
+  struct fcheck_walk sums = *rest;
+  sums.errors = 0;
+  if(!broken && expect != list_end) fcheck_error(&sums, expect, "pages do not add up to total_size");
+  if(!broken && report->busy_pages != fm->alloc_objects) fcheck_error(&sums, (char *) &fm->alloc_objects, "alloc_objects does not add up");
+  if(!broken && fm->total_available != fm->total_size - (head->size + fmem_overhead(fm)) - report->busy_bytes){
+    fcheck_error(&sums, (char *) &fm->total_available, "total_available does not add up");
+  }
+  if(!broken && indexed != report->free_pages) fcheck_error(&sums, (char *) fm->free_lists, "free pages missing from free index");
+  if(sums.errors > 0 && report->errors == 0){
+    report->first_error = sums.first_error;
+    report->first_error_at = sums.first_error_at - (char *) head;
+  }
+  report->errors += sums.errors;
+
+  uint64_t cell_bytes = walks[0].cell_bytes;
+  for(uint32_t cell = 0; cell < cells; cell++){
+    uint64_t from = (uint64_t) cell * cell_bytes;
+    uint64_t in_cell = from >= fmem_length(fm) ? 0 : fmem_length(fm) - from;
+    if(in_cell > cell_bytes) in_cell = cell_bytes;
+    map[cell] = in_cell == 0 ? 0 : (uint8_t) ((map_cells[cell] * 100) / in_cell);
+  }
+  free(busy_cells);
+  free(walks);
+  return report->errors;
+}
+
+int64_t fmem_alloc_many(struct fmem *fm, uint32_t size, uint32_t count, void **out){
+  if(count == 0) return 0;
+  uint32_t adjusted_alloc = size < fm->min_alloc ? fm->min_alloc : size;
+  struct commit_set set = {0};
+  int res = 0;
+  int64_t ret = 0;
+
+  if(fmem_lock(fm) != 0) return E_BROKEN_MEM;
+  // with a redo log bodies must never be logged (replay would write them
+  // over user data), so the run is logged page by page
+  if(fm->log_size == 0 && fm->align <= 1 && count > 1 && fmem_alloc_run_locked(fm, adjusted_alloc, count, out, &set, &res)){
+    ret = count;
+  }else{
+    for(uint32_t i = 0; i < count; i++){
+      void *mem = fmem_alloc_locked(fm, adjusted_alloc, &set);
+      if((int64_t) mem <= 0){
+        // we return what we have got so far, or the error if we got nothing
+        if(ret == 0) ret = (int64_t) mem;
+        if((int64_t) mem == E_COMMIT_FAILED) res = E_COMMIT_FAILED;
+        break;
+      }
+      out[i] = mem;
+      ret++;
+      res |= commit_set_op_done(fm, &set);
+    }
+  }
+  for(int64_t i = 0; i < ret; i++) fmem_sample_alloc(fm, out[i], size);
+  res |= commit_set_flush(fm, &set);
+  fmem_unlock(fm);
+
+  return res != 0 ? E_COMMIT_FAILED : ret;
+}
+
+int64_t fmem_free_many(struct fmem *fm, void **mems, uint32_t count){
+  // POISON CHECK, all of them before we touch anything
+  for(uint32_t i = 0; i < count; i++){
+    int64_t check = fail_on_poison_check(fpage_get_magic(fpage_of(fm, mems[i])), POISON, "freeing many");
+    if( check != 0) return check;
+  }
+
+  struct commit_set set = {0};
+  int64_t freed = 0;
+  int res = 0;
+
+  if(fmem_lock(fm) != 0) return E_BROKEN_MEM;
+  for(uint32_t i = 0; i < count; i++){
+    int64_t this_free = fmem_free_locked(fm, mems[i], &set);
+    if(this_free < 0) res = E_COMMIT_FAILED; else freed += this_free;
+    res |= commit_set_op_done(fm, &set);
+  }
+  res |= commit_set_flush(fm, &set);
+  fmem_unlock(fm);
+
+  return res != 0 ? E_COMMIT_FAILED : freed;
+}
+
+// moves the busy page that follows free page fpage into its place, the free
+// space moves up and merges with a free page after it. returns the free page
+// (now right after the moved page). caller must hold the lock
+static struct fmem_page* fmem_compact_move_locked(struct fmem *fm, struct fmem_page *fpage, fmem_relocate_t relocate, void *ctx, struct commit_set *set, int *res){
+  struct fmem_page *busy = fpage_next(fm, fpage);
+  // compact pages are not linked, there is no prev to link to
+  struct fmem_page *prev = (fm->flags & FMEM_F_COMPACT) ? NULL : rlist_entry(rlist_prev(&fpage->list), struct fmem_page, list);
+  uint32_t free_size = fpage->size;
+  uint32_t busy_size = busy->size;
+  uint32_t free_flags = fpage->flags;
+  void *from = mem_from_fpage(busy);
+
+  // both leave the page list, they come back swapped. links are relative
+  // so the busy page can not be moved while it is linked
+  *res |= findex_remove(fm, fpage, set);
+  fpage_unlink(fm, busy);
+  fpage_unlink(fm, fpage);
+
+  struct fmem_page *moved = fpage;
+  memmove(moved, busy, busy_size);
+  fpage_set_prev_free(moved, false); // it takes the place of a free page, whatever is before it is busy
+  struct fmem_page *freed = (struct fmem_page *) (((char *) moved) + busy_size);
+  fpage_init(fm, freed, free_size);
+  freed->flags = free_flags;
+  fpage_set_prev_free(freed, false);
+  fpage_link_after(fm, prev, moved);
+  fpage_link_after(fm, moved, freed);
+
+  // handles and the handle table are fixed here, the owner fixes whatever
+  // else points to the old place
+  uint64_t *table = (uint64_t *) rptr_get(&fm->handle_table);
+  if(table == from){
+    rptr_set(&fm->handle_table, mem_from_fpage(moved));
+    *res |= commit_set_add_accounting(fm, set);
+  }else if(fpage_is_handle(moved)){
+    fmem_handle_t handle = fpage_handle_of(moved);
+    table[handle - 1] = (char *) mem_from_fpage(moved) - (char *) fm;
+    *res |= commit_set_add(fm, set, &table[handle - 1], sizeof(uint64_t));
+  }
+  if(relocate != NULL) relocate(from, mem_from_fpage(moved), fpage_actual(moved), ctx);
+  if(fpage_is_sampled(moved)) fmem_sample_event(fm, from, mem_from_fpage(moved), FMEM_SAMPLE_MOVE);
+
+  struct fmem_page *next = fpage_next(fm, freed);
+  if(fpage_is_free(next)) *res |= findex_remove(fm, next, set);
+  freed = fpage_merge(fm, freed);
+  *res |= findex_insert(fm, freed, set);
+
+  // the moved page (body included), link of the page before it, the free
+  // page and the link of the page after it
+  *res |= commit_set_add(fm, set, moved, moved->size);
+  if(prev != NULL) *res |= fpage_commit_link(fm, set, prev);
+  *res |= fpage_commit_header(fm, set, freed);
+  *res |= fpage_commit_link(fm, set, fpage_next(fm, freed));
+  *res |= fpage_tag(fm, freed, set);
+  FMEM_STAT(fm, compact_moves, 1);
+  FMEM_STAT(fm, compact_bytes, busy_size);
+  return freed;
+}
+
+int64_t fmem_compact_step(struct fmem *fm, uint32_t max_moves, uint64_t budget_ns, fmem_relocate_t relocate, void *ctx){
+  struct commit_set set = {0};
+  int res = 0;
+  int64_t moves = 0;
+  uint64_t start = budget_ns != 0 ? fmem_now_ns() : 0;
+
+  if(fmem_lock(fm) != 0) return E_BROKEN_MEM;
+  struct fmem_page *head_page = fpage_from_mem(fm);
+
+  // the lowest free page, everything before it is already compact
+  struct fmem_page *fpage = NULL;
+  struct fmem_page *this_page = NULL;
+  fpage_for_each(fm, this_page){
+    if(fpage_is_free(this_page)){
+      fpage = this_page;
+      break;
+    }
+  }
+
+  // free pages never sit next to each other, so the page after a free page
+  // is either busy or the head (free space is at the end, we are done)
+  while(fpage != NULL && moves < max_moves && fpage_next(fm, fpage) != head_page){
+    struct fmem_page *busy = fpage_next(fm, fpage);
+    // a move by less than a multiple of the default alignment would lose it
+    if(fpage_is_pinned(busy) || (fm->align > 1 && fpage->size % fm->align != 0)){
+      // can't be moved, we carry on from the next free page after it
+      fpage = NULL;
+      for(this_page = fpage_next(fm, busy); this_page != head_page; this_page = fpage_next(fm, this_page)){
+        if(fpage_is_free(this_page)){
+          fpage = this_page;
+          break;
+        }
+      }
+      continue;
+    }
+    fpage = fmem_compact_move_locked(fm, fpage, relocate, ctx, &set, &res);
+    moves++;
+    if(fm->log_size != 0){
+      // a moved body is logged (it is moved under the lock, nobody wrote to
+      // it yet) but must never be replayed over what the user writes next,
+      // so the log is checkpointed right after the record
+      res |= commit_set_flush(fm, &set);
+      res |= flog_checkpoint(fm);
+    }else{
+      res |= commit_set_op_done(fm, &set);
+    }
+    if(budget_ns != 0 && fmem_now_ns() - start >= budget_ns) break;
+  }
+  res |= commit_set_flush(fm, &set);
+  fmem_unlock(fm);
+
+  return res != 0 ? E_COMMIT_FAILED : moves;
+}
+
+int64_t fmem_htable_create(struct fmem *fm, uint32_t count){
+  if(count == 0 || count > UINT32_MAX / sizeof(uint64_t)) return E_BAD_HANDLE;
+  struct commit_set set = {0};
+  int64_t ret = count;
+
+  if(fmem_lock(fm) != 0) return E_BROKEN_MEM;
+  if(fm->handle_count != 0){
+    fmem_unlock(fm);
+    return E_BAD_HANDLE;
+  }
+  uint64_t *table = fmem_alloc_locked(fm, count * sizeof(uint64_t), &set);
+  if((int64_t) table > 0){
+    // every handle is free, chained in order
+    for(uint32_t i = 0; i < count; i++) table[i] = FMEM_HANDLE_FREE | (i + 1 < count ? i + 2 : 0);
+    rptr_set(&fm->handle_table, table);
+    fm->handle_count = count;
+    fm->handle_free = 1;
+    int res = commit_set_add(fm, &set, table, count * sizeof(uint64_t));
+    res |= commit_set_add_accounting(fm, &set);
+    if(res != 0) ret = E_COMMIT_FAILED;
+  }else{
+    ret = (int64_t) table;
+  }
+  if(commit_set_flush(fm, &set) != 0) ret = E_COMMIT_FAILED;
+  fmem_unlock(fm);
+
+  return ret;
+}
+
+int64_t fmem_halloc(struct fmem *fm, uint32_t size){
+  if(size > UINT32_MAX - sizeof(fmem_handle_t)) return FMEM_E_NOMEM;
+  struct commit_set set = {0};
+  int64_t ret = 0;
+
+  if(fmem_lock(fm) != 0) return E_BROKEN_MEM;
+  if(fm->handle_count == 0){
+    ret = E_BAD_HANDLE;
+  }else if(fm->handle_free == 0){
+    ret = FMEM_E_NOMEM;
+  }else{
+    void *mem = fmem_alloc_locked(fm, size + sizeof(fmem_handle_t), &set);
+    ret = (int64_t) mem;
+    if(ret > 0){
+      uint64_t *table = (uint64_t *) rptr_get(&fm->handle_table);
+      fmem_handle_t handle = fm->handle_free;
+      fm->handle_free = (uint32_t) (table[handle - 1] & ~FMEM_HANDLE_FREE);
+      table[handle - 1] = (char *) mem - (char *) fm;
+
+      struct fmem_page *fpage = fpage_of(fm, mem);
+      fpage_set_handle(fpage);
+      fmem_sample_alloc(fm, mem, size);
+      memcpy(fpage_handle_slot(fpage), &handle, sizeof(fmem_handle_t));
+      // the page header was added by alloc. slot is past what the user
+      // writes, it is committed (and logged) with the op
+      int res = commit_set_add(fm, &set, fpage_handle_slot(fpage), sizeof(fmem_handle_t));
+      res |= commit_set_add(fm, &set, &table[handle - 1], sizeof(uint64_t));
+      res |= commit_set_add_accounting(fm, &set);
+      ret = res != 0 ? E_COMMIT_FAILED : handle;
+    }
+  }
+  if(commit_set_flush(fm, &set) != 0) ret = E_COMMIT_FAILED;
+  fmem_unlock(fm);
+
+  return ret;
+}
+
+int64_t fmem_hfree(struct fmem *fm, fmem_handle_t handle){
+  struct commit_set set = {0};
+
+  if(fmem_lock(fm) != 0) return E_BROKEN_MEM;
+  void *mem = fmem_deref(fm, handle);
+  if(mem == NULL){
+    fmem_unlock(fm);
+    return E_BAD_HANDLE;
+  }
+  // POISON CHECK
+  int64_t check = fail_on_poison_check(fpage_get_magic(fpage_of(fm, mem)), POISON, "freeing handle");
+  if( check != 0){
+    fmem_unlock(fm);
+    return check;
+  }
+
+  int64_t to_free = fmem_free_locked(fm, mem, &set);
+  uint64_t *table = (uint64_t *) rptr_get(&fm->handle_table);
+  table[handle - 1] = FMEM_HANDLE_FREE | fm->handle_free;
+  fm->handle_free = handle;
+  int res = commit_set_add(fm, &set, &table[handle - 1], sizeof(uint64_t));
+  res |= commit_set_add_accounting(fm, &set);
+  if(res != 0) to_free = E_COMMIT_FAILED;
+  if(commit_set_flush(fm, &set) != 0) to_free = E_COMMIT_FAILED;
+  fmem_unlock(fm);
+
+  return to_free;
+}
+
+static inline struct fmem_deferred* fmem_limbo(struct fmem_epochs *epochs){
+  return (struct fmem_deferred *) &epochs->slots[epochs->readers];
+}
+
+int64_t fmem_epochs_create(struct fmem *fm, uint32_t readers, uint32_t limbo_size){
+  if(readers == 0 || limbo_size == 0) return E_BAD_EPOCH;
+  uint64_t size = sizeof(struct fmem_epochs) + (uint64_t) readers * sizeof(struct fmem_reader) + (uint64_t) limbo_size * sizeof(struct fmem_deferred);
+  if(size > UINT32_MAX) return FMEM_E_NOMEM;
+  struct commit_set set = {0};
+  int64_t ret = readers;
+
+  if(fmem_lock(fm) != 0) return E_BROKEN_MEM;
+  if(rptr_get(&fm->epochs) != NULL){
+    fmem_unlock(fm);
+    return E_BAD_EPOCH;
+  }
+  // reader slots are a cache line each, so is the table
+  struct fmem_epochs *epochs = fmem_alloc_aligned_locked(fm, (uint32_t) size, 64, &set);
+  if((int64_t) epochs > 0){
+    memset(epochs, 0, size);
+    epochs->epoch = 1;
+    epochs->readers = readers;
+    epochs->limbo_size = limbo_size;
+    rptr_set(&fm->epochs, epochs);
+    int res = commit_set_add(fm, &set, epochs, (uint32_t) size);
+    res |= commit_set_add_accounting(fm, &set);
+    if(res != 0) ret = E_COMMIT_FAILED;
+  }else{
+    ret = (int64_t) epochs;
+  }
+  if(commit_set_flush(fm, &set) != 0) ret = E_COMMIT_FAILED;
+  fmem_unlock(fm);
+
+  return ret;
+}
+
+int64_t fmem_reader_register(struct fmem *fm){
+  struct fmem_epochs *epochs = (struct fmem_epochs *) rptr_get(&fm->epochs);
+  if(epochs == NULL) return E_BAD_EPOCH;
+
+  uint32_t me = (uint32_t) getpid();
+  for(uint32_t reader = 0; reader < epochs->readers; reader++){
+    struct fmem_reader *slot = &epochs->slots[reader];
+    if(atomic_compare_swap(&slot->pid, 0, me)){
+      __atomic_store_n(&slot->epoch, FMEM_READER_IDLE, __ATOMIC_SEQ_CST);
+      return reader;
+    }
+  }
+  return E_BAD_EPOCH;
+}
+
+int64_t fmem_reader_unregister(struct fmem *fm, uint32_t reader){
+  struct fmem_epochs *epochs = (struct fmem_epochs *) rptr_get(&fm->epochs);
+  if(epochs == NULL || reader >= epochs->readers) return E_BAD_EPOCH;
+
+  struct fmem_reader *slot = &epochs->slots[reader];
+  __atomic_store_n(&slot->epoch, FMEM_READER_IDLE, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&slot->pid, 0, __ATOMIC_SEQ_CST);
+  return 0;
+}
+
+// frees limbo entries put there before the oldest epoch a reader is in. caller
+// must hold the lock. returns # of pieces freed
+static int64_t fmem_reclaim_locked(struct fmem *fm, struct fmem_epochs *epochs, struct commit_set *set){
+  uint64_t oldest = UINT64_MAX;
+  for(uint32_t reader = 0; reader < epochs->readers; reader++){
+    struct fmem_reader *slot = &epochs->slots[reader];
+    uint32_t owner = __atomic_load_n(&slot->pid, __ATOMIC_SEQ_CST);
+    if(owner == 0) continue;
+    if(fmem_lock_owner_dead(owner)){
+      // reader died (maybe while reading), nobody is reading there
+      __atomic_store_n(&slot->epoch, FMEM_READER_IDLE, __ATOMIC_SEQ_CST);
+      atomic_compare_swap(&slot->pid, owner, 0);
+      continue;
+    }
+    uint64_t epoch = __atomic_load_n(&slot->epoch, __ATOMIC_SEQ_CST);
+    if(epoch != FMEM_READER_IDLE && epoch < oldest) oldest = epoch;
+  }
+
+  // a reader in epoch e started after everything stamped < e was unlinked
+  struct fmem_deferred *limbo = fmem_limbo(epochs);
+  int64_t freed = 0;
+  int res = 0;
+  while(epochs->limbo_head < epochs->limbo_tail){
+    struct fmem_deferred *entry = &limbo[epochs->limbo_head % epochs->limbo_size];
+    if(entry->epoch >= oldest) break;
+    if(fmem_free_locked(fm, ((char *) fm) + entry->offset, set) < 0) res = E_COMMIT_FAILED;
+    epochs->limbo_head++;
+    freed++;
+    res |= commit_set_op_done(fm, set);
+  }
+  if(freed > 0) res |= commit_set_add(fm, set, &epochs->limbo_head, sizeof(uint64_t));
+  return res != 0 ? E_COMMIT_FAILED : freed;
+}
+
+int64_t fmem_free_deferred(struct fmem *fm, void *mem){
+  struct fmem_epochs *epochs = (struct fmem_epochs *) rptr_get(&fm->epochs);
+  if(epochs == NULL) return E_BAD_EPOCH;
+
+  struct fmem_page *fpage = fpage_of(fm, mem);
+  // POISON CHECK
+  int64_t check = fail_on_poison_check(fpage_get_magic(fpage), POISON, "deferred free");
+  if( check != 0) return check;
+
+  struct commit_set set = {0};
+  int64_t ret = 0;
+  int res = 0;
+
+  if(fmem_lock(fm) != 0) return E_BROKEN_MEM;
+  if(epochs->limbo_tail - epochs->limbo_head == epochs->limbo_size && fmem_reclaim_locked(fm, epochs, &set) < 0) res = E_COMMIT_FAILED;
+  if(epochs->limbo_tail - epochs->limbo_head < epochs->limbo_size){
+    // stamped with the epoch before, readers that start from here on can't
+    // reach memory
+    struct fmem_deferred *entry = &fmem_limbo(epochs)[epochs->limbo_tail % epochs->limbo_size];
+    entry->offset = (char *) mem - (char *) fm;
+    entry->epoch = __atomic_fetch_add(&epochs->epoch, 1, __ATOMIC_SEQ_CST);
+    epochs->limbo_tail++;
+    // compaction must not move memory readers may be on
+    fpage_set_pinned(fpage);
+    res |= fpage_commit_header(fm, &set, fpage);
+    res |= commit_set_add(fm, &set, entry, sizeof(struct fmem_deferred));
+    res |= commit_set_add(fm, &set, epochs, offsetof(struct fmem_epochs, pad));
+
+    if(fmem_reclaim_locked(fm, epochs, &set) < 0) res = E_COMMIT_FAILED;
+    ret = (int64_t) (epochs->limbo_tail - epochs->limbo_head);
+  }else{
+    ret = FMEM_E_NOMEM;
+  }
+  res |= commit_set_flush(fm, &set);
+  fmem_unlock(fm);
+
+  return res != 0 ? E_COMMIT_FAILED : ret;
+}
+
+int64_t fmem_reclaim(struct fmem *fm){
+  struct fmem_epochs *epochs = (struct fmem_epochs *) rptr_get(&fm->epochs);
+  if(epochs == NULL) return E_BAD_EPOCH;
+  struct commit_set set = {0};
+
+  if(fmem_lock(fm) != 0) return E_BROKEN_MEM;
+  int64_t freed = fmem_reclaim_locked(fm, epochs, &set);
+  if(commit_set_flush(fm, &set) != 0) freed = E_COMMIT_FAILED;
+  fmem_unlock(fm);
+
+  return freed;
+}
+
+// pages that can span an os page are all large, they are in the skip list.
+// the body after the index node (and before the boundary tag) can go
+int64_t fmem_trim(struct fmem *fm){
+  uintptr_t page_mask = os_page_size() - 1;
+  int64_t trimmed = 0;
+
+  if(fmem_lock(fm) != 0) return E_BROKEN_MEM;
+  for(struct fskip_node *node = rptr_get(&fm->free_skip[0]); node != NULL; node = rptr_get(&node->next[0])){
+    struct fmem_page *fpage = fpage_from_skip_node(fm, node);
+    uintptr_t start = ((uintptr_t) node + findex_link_len(fpage) + page_mask) & ~page_mask;
+    uintptr_t end = ((uintptr_t) fpage + fpage->size - sizeof(uint32_t)) & ~page_mask;
+    if(start >= end) continue;
+    fextent_release((void *) start, end - start);
+    trimmed += end - start;
+  }
+  fmem_unlock(fm);
+
+  return trimmed;
+}
+
+static void* fmem_trimmer_run(void *arg){
+  struct fmem_trimmer *trimmer = (struct fmem_trimmer *) arg;
+
+  pthread_mutex_lock(&trimmer->mutex);
+  while(!trimmer->stop){
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    uint64_t ns = until.tv_nsec + (uint64_t) trimmer->interval_ms * 1000 * 1000;
+    until.tv_sec += ns / (1000 * 1000 * 1000);
+    until.tv_nsec = ns % (1000 * 1000 * 1000);
+    pthread_cond_timedwait(&trimmer->wake, &trimmer->mutex, &until);
+    if(trimmer->stop) break;
+
+    // nothing was freed, nothing new to trim
+    size_t available = __atomic_load_n(&trimmer->fm->total_available, __ATOMIC_RELAXED);
+    if(available <= trimmer->available){
+      trimmer->available = available;
+      continue;
+    }
+    pthread_mutex_unlock(&trimmer->mutex);
+    int64_t trimmed = fmem_trim(trimmer->fm);
+    pthread_mutex_lock(&trimmer->mutex);
+    trimmer->available = available;
+    __atomic_fetch_add(&trimmer->trimmed, trimmed, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&trimmer->mutex);
+  return NULL;
+}
+
+int64_t fmem_trimmer_start(struct fmem *fm, struct fmem_trimmer *trimmer, uint32_t interval_ms){
+  if(interval_ms == 0) return E_BAD_TRIM;
+
+  memset(trimmer, 0, sizeof(struct fmem_trimmer));
+  trimmer->fm = fm;
+  trimmer->interval_ms = interval_ms;
+  pthread_mutex_init(&trimmer->mutex, NULL);
+  pthread_cond_init(&trimmer->wake, NULL);
+  if(pthread_create(&trimmer->thread, NULL, fmem_trimmer_run, trimmer) != 0){
+    pthread_cond_destroy(&trimmer->wake);
+    pthread_mutex_destroy(&trimmer->mutex);
+    return E_BAD_TRIM;
+  }
+  return 0;
+}
+
+int64_t fmem_trimmer_stop(struct fmem_trimmer *trimmer){
+  pthread_mutex_lock(&trimmer->mutex);
+  trimmer->stop = true;
+  pthread_cond_signal(&trimmer->wake);
+  pthread_mutex_unlock(&trimmer->mutex);
+  pthread_join(trimmer->thread, NULL);
+
+  pthread_cond_destroy(&trimmer->wake);
+  pthread_mutex_destroy(&trimmer->mutex);
+  return (int64_t) trimmer->trimmed;
+}
+
+// a cache moves blocks from and to fmem in batches. blocks are linked via
+// a pointer stashed in their own body, so a cache costs no fmem memory.
+// min_alloc is always >= a pointer size.
+static inline int fmem_cache_class_of(struct fmem_cache *cache, uint32_t size){
+  uint32_t min_alloc = cache->fm->min_alloc;
+  if(size == 0) size = 1;
+  uint32_t class = (size - 1) / min_alloc;
+  return class < FMEM_CACHE_CLASSES ? (int) class : -1;
+}
+
+static inline void fmem_cache_push(struct fmem_cache *cache, int class, void *mem){
+  *((void **) mem) = cache->blocks[class];
+  cache->blocks[class] = mem;
+  cache->counts[class]++;
+}
+
+static inline void* fmem_cache_pop(struct fmem_cache *cache, int class){
+  void *mem = cache->blocks[class];
+  cache->blocks[class] = *((void **) mem);
+  cache->counts[class]--;
+  return mem;
+}
+
+// returns up to count blocks of a class to fmem under one lock hold
+static int64_t fmem_cache_release(struct fmem_cache *cache, int class, uint32_t count, uint32_t variant){
+  struct fmem *fm = cache->fm;
+  struct commit_set set = {0};
+  int64_t freed = 0;
+  int res = 0;
+
+  if(fmem_lock_variant(fm, variant) != 0) return E_BROKEN_MEM;
+  while(count > 0 && cache->counts[class] > 0){
+    int64_t this_free = fmem_free_locked(fm, fmem_cache_pop(cache, class), &set);
+    if(this_free < 0) res = E_COMMIT_FAILED; else freed += this_free;
+    res |= commit_set_op_done(fm, &set);
+    count--;
+  }
+  res |= commit_set_flush(fm, &set);
+  fmem_unlock_variant(fm, variant);
+
+  return res != 0 ? E_COMMIT_FAILED : freed;
+}
+
+void fmem_cache_init(struct fmem_cache *cache, struct fmem *fm){
+  memset(cache, 0, sizeof(struct fmem_cache));
+  cache->fm = fm;
+  cache->min_alloc = fm->min_alloc;
+  cache->overhead = fmem_overhead(fm);
+}
+
+void* fmem_cache_alloc(struct fmem_cache *cache, uint32_t size){
+  return fmem_cache_alloc_variant(cache, size, 0);
+}
+
+void* fmem_cache_alloc_variant(struct fmem_cache *cache, uint32_t size, uint32_t variant){
+  int class = fmem_cache_class_of(cache, size);
+  if(class < 0) return fmem_alloc_variant(cache->fm, size, variant); // not a small alloc
+
+  if(cache->counts[class] > 0){
+    void *mem = fmem_cache_pop(cache, class);
+    // flags are shared with ops on the neighbours, they are set under the lock
+    if(__builtin_expect(fmem_sample_due(size), 0) && fmem_lock_variant(cache->fm, variant) == 0){
+      fpage_set_sampled(fpage_of(cache->fm, mem));
+      fmem_sample_call(cache->fm, mem, size);
+      fmem_unlock_variant(cache->fm, variant);
+    }
+    return mem;
+  }
+
+  // refill, all blocks of a class are allocated with the class size
+  // so any of them can serve any request that falls in the class
+  struct fmem *fm = cache->fm;
+  struct commit_set set = {0};
+  uint32_t class_size = (class + 1) * fm->min_alloc;
+  void *ret = NULL;
+
+  if(fmem_lock_variant(fm, variant) != 0) return (void *) E_BROKEN_MEM;
+  for(int i = 0; i < FMEM_CACHE_BATCH; i++){
+    void *mem = fmem_alloc_locked(fm, class_size, &set);
+    if((int64_t) mem <= 0){
+      // we return what we have got so far, or the error if we got nothing
+      if(ret == NULL) ret = mem;
+      break;
+    }
+    if(ret == NULL) ret = mem; else fmem_cache_push(cache, class, mem);
+    if(commit_set_op_done(fm, &set) != 0) ret = (void *) E_COMMIT_FAILED;
+  }
+  fmem_sample_alloc(fm, ret, size); // cached blocks are sampled when they are handed out
+  if(commit_set_flush(fm, &set) != 0) ret = (void *) E_COMMIT_FAILED;
+  fmem_unlock_variant(fm, variant);
+
+  return ret;
+}
+
+int64_t fmem_cache_free(struct fmem_cache *cache, void *mem){
+  return fmem_cache_free_variant(cache, mem, 0);
+}
+
+int64_t fmem_cache_free_variant(struct fmem_cache *cache, void *mem, uint32_t variant){
+  if(fmem_is_huge(cache->fm, mem)) return fmem_free(cache->fm, mem);
+  struct fmem_page *fpage = fpage_of(cache->fm, mem);
+
+  // POISON CHECK
+  int64_t check = fail_on_poison_check(fpage_get_magic(fpage), POISON, "freeing into cache");
+  if( check != 0) return check;
+  // the handle table still points to it, it is freed by fmem_hfree(..) only
+  if(fpage_is_handle(fpage)) return E_BAD_HANDLE;
+
+  // blocks are cached by what they can actually hold. blocks of pages
+  // used as is (bigger than asked for) are cached in lower classes
+  uint32_t actual = fpage_actual(fpage);
+  int class = (actual / cache->fm->min_alloc) - 1;
+  if(class >= FMEM_CACHE_CLASSES) return fmem_free_variant(cache->fm, mem, variant);
+
+  // a sampled block is freed as far as the sampler goes
+  if(__builtin_expect(fpage_is_sampled(fpage), 0) && fmem_lock_variant(cache->fm, variant) == 0){
+    fpage_clear_sampled(fpage);
+    fmem_sample_event(cache->fm, mem, NULL, FMEM_SAMPLE_FREE);
+    fmem_unlock_variant(cache->fm, variant);
+  }
+  int64_t freed = (int64_t) fpage->size;
+  fmem_cache_push(cache, class, mem);
+  // too many cached, give back a batch
+  if(cache->counts[class] >= 2 * FMEM_CACHE_BATCH){
+    if(fmem_cache_release(cache, class, FMEM_CACHE_BATCH, variant) < 0) return E_COMMIT_FAILED;
+  }
+  return freed;
+}
+
+int64_t fmem_cache_flush(struct fmem_cache *cache){
+  return fmem_cache_flush_variant(cache, 0);
+}
+
+int64_t fmem_cache_flush_variant(struct fmem_cache *cache, uint32_t variant){
+  int64_t freed = 0;
+  for(int class = 0; class < FMEM_CACHE_CLASSES; class++){
+    if(cache->counts[class] == 0) continue;
+    int64_t this_free = fmem_cache_release(cache, class, cache->counts[class], variant);
+    if(this_free < 0) return this_free;
+    freed += this_free;
+  }
+  return freed;
+}
+
+static inline rptr_t* fmem_root_slot(struct fmem *fm, int n){
+	switch(n){
+		case 1: return &fm->user1;
+		case 2: return &fm->user2;
+		case 3: return &fm->user3;
+		case 4: return &fm->user4;
+	}
+	return NULL;
+}
+
+void fmem_set_root(struct fmem *fm, int n, void *root){
+	rptr_t *slot = fmem_root_slot(fm, n);
+	if(slot != NULL) rptr_set(slot, root);
+}
+
+void* fmem_get_root(struct fmem *fm, int n){
+	rptr_t *slot = fmem_root_slot(fm, n);
+	return slot == NULL ? NULL : rptr_get(slot);
+}
+
+int64_t fmem_commit_user_data(struct fmem *fm){
+	if(fmem_committer(fm) == NULL) return E_COMMIT_FAILED;
+
+  // POISON CHECK
+	struct fmem_page *fhead_page = fpage_from_mem(fm);
+  int64_t check = fail_on_poison_check(fpage_get_magic(fhead_page), POISON, "committing user data");
+  if( check != 0) return check;
+
+	// we don't need to lock here
+	struct commit_range r = {0};
+	r.start = (void *) &fm->user1;
+	r.len = 4 * sizeof(fm->user1);
+	if (fmem_commit_ranges(fm, &r, 1) < 0) return E_COMMIT_FAILED;
+
+	return r.len;
+}
+
+int64_t fmem_commit_mem(struct fmem *fm, void *mem, uint32_t len){
+	 if(fmem_committer(fm) == NULL) return E_COMMIT_FAILED;
+	if(fmem_is_huge(fm, mem)){
+		// huge memory is committed as is, it must stay inside the zone
+		char *zone_end = (char *) fpage_from_mem(fm) + fm->huge_offset + fm->huge_size;
+		if(len == 0 || (char *) mem + len > zone_end) return E_COMMIT_FAILED;
+		struct commit_range r = {.start = mem, .len = len};
+		return fmem_commit_ranges(fm, &r, 1) < 0 ? E_COMMIT_FAILED : len;
+	}
+
+	// should we lock here?
+	struct fmem_page *fpage = fpage_of(fm, mem);
+  // POISON CHECK
+  int64_t check = fail_on_poison_check(fpage_get_magic(fpage), POISON, "committing user memory");
+  if( check != 0) return check;
+
+
+	uint32_t page_size = fpage_actual(fpage);
+	if (len == 0){
+		len = page_size; // if no len then
+	}
+	// weather len is supplied or not, it must fit page boundries
+	if ( ((char *) mem + len) > ((char *) fpage + fpage_overhead(fpage) +  page_size)) return E_COMMIT_FAILED;
+
+
+	struct commit_range r = {0};
+	r.start = mem;
+	r.len = len;
+	if (fmem_commit_ranges(fm, &r,1) < 0) return E_COMMIT_FAILED;
+
+	return len;
+}
+
+int64_t fmem_commit_mem_at(struct fmem *fm, void *mem, void *at, uint32_t len){
+	if(fmem_committer(fm) == NULL || len == 0) return E_COMMIT_FAILED;
+	if(fmem_is_huge(fm, mem)){
+		// the table moves with allocs and frees, the extent is looked up locked
+		if(fmem_lock(fm) != 0) return E_BROKEN_MEM;
+		struct fmem_extent *extent = fextent_of(fm, mem);
+		uint64_t size = extent == NULL ? 0 : extent->size;
+		fmem_unlock(fm);
+		if(!(size & FMEM_EXTENT_BUSY)) return E_BAD_EXTENT;
+		char *end = (char *) mem + (size & ~(FMEM_EXTENT_BUSY | FMEM_EXTENT_SAMPLED));
+		if((char *) at < (char *) mem || (char *) at + len > end) return E_COMMIT_FAILED;
+		struct commit_range r = {.start = at, .len = len};
+		return fmem_commit_ranges(fm, &r, 1) < 0 ? E_COMMIT_FAILED : len;
+	}
+
+	struct fmem_page *fpage = fpage_of(fm, mem);
+	int64_t check = fail_on_poison_check(fpage_get_magic(fpage), POISON, "committing user memory");
+	if(check != 0) return check;
+
+	// the range must be inside the allocation
+	char *end = (char *) mem + fpage_actual(fpage);
+	if((char *) at < (char *) mem || (char *) at + len > end) return E_COMMIT_FAILED;
+
+	struct commit_range r = {.start = at, .len = len};
+	if(fmem_commit_ranges(fm, &r, 1) < 0) return E_COMMIT_FAILED;
+	return len;
+}
+
+int64_t fmem_batch_begin(struct fmem *fm, struct fmem_batch *batch, struct commit_range *storage, uint32_t capacity){
+	if(capacity == 0 || storage == NULL) return E_BAD_BATCH;
+	if(fmem_batch_of(fm) != NULL) return E_BAD_BATCH; // one at a time
+
+	memset(batch, 0, sizeof(struct fmem_batch));
+	batch->fm = fm;
+	batch->ranges = storage;
+	batch->capacity = capacity;
+	batch->next = open_batches;
+	open_batches = batch;
+	return 0;
+}
+
+int64_t fmem_batch_commit(struct fmem *fm){
+	struct fmem_batch *batch = fmem_batch_of(fm);
+	if(batch == NULL) return E_BAD_BATCH;
+
+	// close it first, so the committer can use fmem if it wants to
+	struct fmem_batch **link = &open_batches;
+	while(*link != batch) link = &(*link)->next;
+	*link = batch->next;
+	batch->next = NULL;
+
+	if(fmem_committer(fm) != NULL) fmem_batch_flush(fm, batch);
+	return batch->failed ? E_COMMIT_FAILED : batch->committed;
+}
+
+int64_t fmem_async_start(struct fmem *fm, struct fmem_async *async, struct fmem_async_slot *storage, uint32_t capacity){
+	if(storage == NULL || capacity < 2 || (capacity & (capacity - 1)) != 0) return E_BAD_ASYNC;
+	if(fmem_committer(fm) == NULL) return E_BAD_ASYNC;
+
+	pthread_mutex_lock(&async_commits_mutex);
+	if(fmem_async_of(fm) != NULL){
+		pthread_mutex_unlock(&async_commits_mutex);
+		return E_BAD_ASYNC;
+	}
+
+	memset(async, 0, sizeof(struct fmem_async));
+	async->fm = fm;
+	async->slots = storage;
+	async->mask = capacity - 1;
+	for(uint64_t i = 0; i < capacity; i++) storage[i].seq = i;
+	pthread_mutex_init(&async->mutex, NULL);
+	pthread_cond_init(&async->wake, NULL);
+	pthread_cond_init(&async->done, NULL);
+	if(pthread_create(&async->flusher, NULL, fmem_async_flusher, async) != 0){
+		pthread_mutex_unlock(&async_commits_mutex);
+		return E_BAD_ASYNC;
+	}
+
+	async->next = async_commits;
+	__atomic_store_n(&async_commits, async, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&async_commits_mutex);
+	return 0;
+}
+
+int64_t fmem_async_stop(struct fmem *fm){
+	pthread_mutex_lock(&async_commits_mutex);
+	struct fmem_async *async = fmem_async_of(fm);
+	if(async == NULL){
+		pthread_mutex_unlock(&async_commits_mutex);
+		return E_BAD_ASYNC;
+	}
+
+	// the flusher drains everything before it exits
+	pthread_mutex_lock(&async->mutex);
+	async->stop = true;
+	pthread_cond_signal(&async->wake);
+	pthread_mutex_unlock(&async->mutex);
+	pthread_join(async->flusher, NULL);
+
+	struct fmem_async **link = &async_commits;
+	while(*link != async) link = &(*link)->next;
+	*link = async->next;
+	pthread_mutex_unlock(&async_commits_mutex);
+
+	pthread_cond_destroy(&async->wake);
+	pthread_cond_destroy(&async->done);
+	pthread_mutex_destroy(&async->mutex);
+	return async->failed ? E_COMMIT_FAILED : 0;
+}
+
+uint64_t fmem_commit_seq(struct fmem *fm){
+	struct fmem_async *async = fmem_async_of(fm);
+	if(async == NULL) return 0;
+	return __atomic_load_n(&async->enqueue_pos, __ATOMIC_ACQUIRE);
+}
+
+int64_t fmem_commit_wait(struct fmem *fm, uint64_t seq){
+	struct fmem_async *async = fmem_async_of(fm);
+	if(async == NULL) return 0;
+
+	if(__atomic_load_n(&async->completed, __ATOMIC_ACQUIRE) < seq){
+		pthread_mutex_lock(&async->mutex);
+		while(__atomic_load_n(&async->completed, __ATOMIC_ACQUIRE) < seq){
+			pthread_cond_wait(&async->done, &async->mutex);
+		}
+		pthread_mutex_unlock(&async->mutex);
+	}
+	return __atomic_load_n(&async->failed, __ATOMIC_ACQUIRE) ? E_COMMIT_FAILED : 0;
+}
+
+#ifdef __UNIT_TESTING__
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "munit/munit.h"
+#include "fmem_fast.h"
+
+#define small_buffer_size 10
+#define large_buffer_size 50 * 1024
+
+// test committer saves data here
+#define MAX_COMMIT  COMMIT_SET_MAX
+struct commit_range  __test_ranges[MAX_COMMIT] = {0};
+int committed_range_count = 0;
+
+// resets committed values
+static void reset_test_committer(){
+	committed_range_count = 0;
+}
+static int failed_test_committer(struct commit_range *ranges, uint8_t count){
+	return -1;
+}
+// a test committer
+static int test_committer(struct commit_range *ranges, uint8_t count){
+	if (count == 0){
+			printf("TEST FAIL: committer got 0 count!\n");
+			return -1;
+	}
+
+	if (committed_range_count+ count > MAX_COMMIT){
+		printf("TEST FAIL: COMMITTER has %d and want additional %d which put it higher than max:%d\n",
+						committed_range_count, count, MAX_COMMIT);
+		return -1;
+	}
+	memcpy(__test_ranges + committed_range_count, ranges, count * sizeof(struct commit_range));
+	committed_range_count += count;
+	return 0;
+}
+
+// compares to whatever committer saved
+static MunitResult test_committer_compare_to(struct commit_range *expected, uint8_t count, bool count_only){
+	if(committed_range_count != count){
+		munit_logf(MUNIT_LOG_INFO, "got:%d expected:%d",committed_range_count, count);
+		return MUNIT_FAIL;
+	}
+
+	if (count_only) return MUNIT_OK;
+
+	for(int pos = 0; pos < committed_range_count; pos++){
+			struct commit_range *expected_current = expected + pos;
+			struct commit_range *saved_current = &__test_ranges[pos];
+
+			munit_logf(MUNIT_LOG_INFO, "at: %d", pos);
+			munit_assert(expected_current->start == saved_current->start);
+
+
+			munit_logf(MUNIT_LOG_INFO, "expected len:%lu: got:%lu",saved_current->len,  expected_current->len );
+			munit_assert(expected_current->len == saved_current->len);
+	}
+	return MUNIT_OK;
+}
+
+// handy helper to make  apage
+static void make_fpage(struct fmem_page *fpage, uint32_t size){
+  // reset all
+  memset(fpage, 0, size);
+  fpage->size = size;
+
+  rlist_head_init(&fpage->list);
+}
+
+// helper counter
+static int count_pages(struct fmem_page *fpage){
+  struct rlist_head *head = &fpage->list;
+  struct rlist_head *current = head;
+  int count = 0;
+
+  rlist_for_each(current, head){
+    count++;
+  }
+  // because our iterators does not like working with head
+  return count+1;
+}
+
+// helper counter, pages of fm (head included)
+static int fmem_count_pages(struct fmem *fm){
+  struct fmem_page *this_page = NULL;
+  int count = 0;
+
+  fpage_for_each(fm, this_page){
+    count++;
+  }
+  return count + 1;
+}
+
+// helper, checks that every free page is indexed in the list of its
+// class and that the index has nothing else. returns count of free pages
+static int check_free_index(struct fmem *fm){
+  struct fmem_page *this_page = NULL;
+  int free_pages = 0;
+
+  fpage_for_each(fm, this_page){
+    if(!fpage_is_free(this_page)) continue;
+    free_pages++;
+
+    bool found = false;
+    if(findex_in_skip(this_page->size)){
+      for(struct fskip_node *node = rptr_get(&fm->free_skip[0]); node != NULL; node = rptr_get(&node->next[0])){
+        if(fpage_from_skip_node(fm, node) == this_page) found = true;
+      }
+    }else{
+      uint32_t class = fclass_of(this_page->size);
+      struct rlist_head *bucket = &fm->free_lists[class];
+      struct rlist_head *link = bucket;
+      rlist_for_each(link, bucket){
+        if(fpage_from_free_link(fm, link) == this_page) found = true;
+      }
+    }
+    if(!found) return -1;
+  }
+
+  int indexed = 0;
+  for(uint32_t class = 0; class < FMEM_SIZE_CLASSES; class++){
+    struct rlist_head *bucket = &fm->free_lists[class];
+    struct rlist_head *link = bucket;
+    rlist_for_each(link, bucket){
+      indexed++;
+    }
+  }
+
+  // skip list is ordered at every level
+  for(uint32_t level = 0; level < FMEM_SKIP_LEVELS; level++){
+    struct fmem_page *before = NULL;
+    for(struct fskip_node *node = rptr_get(&fm->free_skip[level]); node != NULL; node = rptr_get(&node->next[level])){
+      struct fmem_page *this_page = fpage_from_skip_node(fm, node);
+      if(before != NULL && !fskip_before(fm, fpage_skip_node(before), this_page->size, this_page)) return -1;
+      before = this_page;
+      if(level == 0) indexed++;
+    }
+  }
+  return indexed == free_pages ? free_pages : -1;
+}
+
+static MunitResult test_fmem_free_lists(const MunitParameter params[], void* data){
+  char buffer[large_buffer_size] = {0};
+  struct fmem *fm =  fmem_create_new(buffer, large_buffer_size, 0, NULL);
+  munit_assert(fm > 0);
+
+  // a new fmem has one free page, the main page
+  munit_assert(check_free_index(fm) == 1);
+  munit_assert(findex_valid(fm));
+
+  // fill with mixed sizes
+  void *mems[64] = {0};
+  for(int i = 0; i < 64; i++){
+    mems[i] = fmem_alloc(fm, 24 + (i % 8) * 40);
+    munit_assert(mems[i] > 0);
+  }
+  munit_assert(check_free_index(fm) == 1);
+
+  // free every other one, nothing can merge so each is a free page of its own
+  for(int i = 0; i < 64; i += 2){
+    munit_assert(fmem_free(fm, mems[i]) > 0);
+  }
+  munit_assert(check_free_index(fm) == 33);
+  munit_assert(findex_valid(fm));
+
+  // the most recently freed page of a class gets reused when it fits
+  struct fmem_page *freed = fpage_from_mem(mems[62]);
+  void *reused = fmem_alloc(fm, fpage_actual(freed));
+  munit_assert(reused == mems[62]);
+  munit_assert(check_free_index(fm) == 32);
+
+  // free the rest, everything merges back into main page
+  for(int i = 1; i < 64; i += 2){
+    munit_assert(fmem_free(fm, mems[i]) > 0);
+  }
+  munit_assert(fmem_free(fm, mems[62]) > 0);
+  munit_assert(check_free_index(fm) == 1);
+  munit_assert(count_pages(fpage_from_mem(fm)) == 2);
+  munit_assert(fm->alloc_objects == 0);
+  return MUNIT_OK;
+}
+
+static MunitResult test_fmem_free_lists_rebuild(const MunitParameter params[], void* data){
+  char buffer[large_buffer_size] = {0};
+  struct fmem *fm =  fmem_create_new(buffer, large_buffer_size, 0, NULL);
+  munit_assert(fm > 0);
+
+  void *mems[16] = {0};
+  for(int i = 0; i < 16; i++){
+    mems[i] = fmem_alloc(fm, 100);
+    munit_assert(mems[i] > 0);
+  }
+  for(int i = 0; i < 16; i += 3){
+    munit_assert(fmem_free(fm, mems[i]) > 0);
+  }
+  int free_pages = check_free_index(fm);
+  munit_assert(free_pages > 0);
+
+  // mess up the index, reloading should detect and rebuild it
+  fm->free_map = 0;
+  munit_assert(false == findex_valid(fm));
+
+  struct fmem *reloaded = fmem_from_existing(buffer, NULL);
+  munit_assert(reloaded == fm);
+  munit_assert(findex_valid(fm));
+  munit_assert(check_free_index(fm) == free_pages);
+
+  // and it is usable after
+  void *mem = fmem_alloc(fm, 100);
+  munit_assert(mem > 0);
+  munit_assert(fmem_free(fm, mem) > 0);
+  munit_assert(check_free_index(fm) == free_pages);
+  return MUNIT_OK;
+}
+
+static MunitResult test_fmem_best_fit(const MunitParameter params[], void* data){
+  static char buffer[1024 * 1024];
+  struct fmem *fm =  fmem_create_new(buffer, sizeof(buffer), 0, NULL);
+  munit_assert(fm > 0);
+
+  // large holes of different sizes, kept apart by busy pages
+  uint32_t sizes[] = {4096, 2048, 8192, 3000, 2048};
+  void *holes[5] = {0};
+  for(int i = 0; i < 5; i++){
+    holes[i] = fmem_alloc(fm, sizes[i]);
+    munit_assert(holes[i] > 0);
+    munit_assert(fmem_alloc(fm, 32) > 0);
+  }
+  for(int i = 0; i < 5; i++) munit_assert(fmem_free(fm, holes[i]) > 0);
+  munit_assert(check_free_index(fm) == 6);
+
+  // smallest hole that fits, lowest address on ties (the last one carved is the lowest)
+  munit_assert(fmem_alloc(fm, 2000) == holes[4]);
+  munit_assert(fmem_alloc(fm, 2048) == holes[1]);
+  void *mem = fmem_alloc(fm, 7000);
+  munit_assert((char *) mem > (char *) holes[2] && (char *) mem < (char *) holes[2] + 8192);
+  mem = fmem_alloc(fm, 4000);
+  munit_assert((char *) mem >= (char *) holes[0] && (char *) mem < (char *) holes[0] + 4096);
+  munit_assert(check_free_index(fm) >= 0);
+
+  // churn, the skip list stays ordered and complete
+  uint64_t state = 11;
+  void *mems[128] = {0};
+  for(int i = 0; i < 4000; i++){
+    state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+    int at = state % 128;
+    if(mems[at] == NULL){
+      void *m = fmem_alloc(fm, 16 + (state >> 32) % 6000);
+      if((int64_t) m > 0) mems[at] = m;
+    }else{
+      munit_assert(fmem_free(fm, mems[at]) > 0);
+      mems[at] = NULL;
+    }
+    if(i % 500 == 0) munit_assert(check_free_index(fm) >= 0);
+  }
+  munit_assert(check_free_index(fm) >= 0);
+  munit_assert(findex_valid(fm));
+  return MUNIT_OK;
+}
+
+static MunitResult test_fmem_relocate(const MunitParameter params[], void* data){
+  static char buffer[large_buffer_size];
+  static char moved[large_buffer_size];
+  struct fmem *fm =  fmem_create_new(buffer, large_buffer_size, 0, NULL);
+  munit_assert(fm > 0);
+
+  // a small object graph, a root that points to a list of things
+  struct rthing { struct rlist_head list; int value; };
+  struct rlist_head *root = fmem_alloc(fm, sizeof(struct rlist_head));
+  munit_assert(root > 0);
+  rlist_head_init(root);
+  void *mems[16] = {0};
+  for(int i = 0; i < 16; i++){
+    struct rthing *thing = fmem_alloc(fm, sizeof(struct rthing));
+    munit_assert(thing > 0);
+    thing->value = i;
+    rlist_add_before(root, &thing->list);
+    mems[i] = fmem_alloc(fm, 64 + i);
+  }
+  for(int i = 0; i < 16; i += 2) munit_assert(fmem_free(fm, mems[i]) > 0);
+  fmem_set_root(fm, 2, root);
+  munit_assert(fmem_get_root(fm, 2) == root);
+  munit_assert(fmem_get_root(fm, 1) == NULL);
+  int free_pages = check_free_index(fm);
+
+  // memory shows up somewhere else, nothing needs fixing
+  memcpy(moved, buffer, large_buffer_size);
+  memset(buffer, 0, large_buffer_size);
+  struct fmem *moved_fm = fmem_from_existing(moved, NULL);
+  munit_assert((char *) moved_fm == moved + PAGE_OVERHEAD);
+  munit_assert(findex_valid(moved_fm));
+  munit_assert(check_free_index(moved_fm) == free_pages);
+
+  struct rlist_head *moved_root = fmem_get_root(moved_fm, 2);
+  munit_assert((char *) moved_root == moved + ((char *) root - buffer));
+  struct rlist_head *current = NULL;
+  int i = 0;
+  rlist_for_each(current, moved_root){
+    munit_assert(rlist_entry(current, struct rthing, list)->value == i);
+    i++;
+  }
+  munit_assert(i == 16);
+
+  // and it works as usual
+  for(int i = 1; i < 16; i += 2) munit_assert(fmem_free(moved_fm, (char *) mems[i] - buffer + moved) > 0);
+  void *mem = fmem_alloc(moved_fm, 100);
+  munit_assert((char *) mem > moved && (char *) mem < moved + large_buffer_size);
+  munit_assert(check_free_index(moved_fm) > 0);
+  return MUNIT_OK;
+}
+
+static MunitResult test_fmem_cache(const MunitParameter params[], void* data){
+  char buffer[large_buffer_size] = {0};
+  struct fmem *fm =  fmem_create_new(buffer, large_buffer_size, 0, NULL);
+  munit_assert(fm > 0);
+  size_t original_available = fm->total_available;
+
+  struct fmem_cache cache;
+  fmem_cache_init(&cache, fm);
+
+  // first alloc refills the class with a batch
+  void *mem1 = fmem_cache_alloc(&cache, 10);
+  munit_assert(mem1 > 0);
+  munit_assert(fm->alloc_objects == FMEM_CACHE_BATCH);
+  munit_assert(cache.counts[0] == FMEM_CACHE_BATCH - 1);
+
+  // hits and frees in the cache never touch the lock, we fake a held lock
+  // if they do this test hangs
+  fm->lock = 1;
+  void *mem2 = fmem_cache_alloc(&cache, fm->min_alloc);
+  munit_assert(mem2 > 0 && mem2 != mem1);
+  munit_assert(fmem_cache_free(&cache, mem2) > 0);
+  void *mem3 = fmem_cache_alloc(&cache, 5);
+  munit_assert(mem3 == mem2); // last in first out
+  fm->lock = 0;
+  munit_assert(fm->alloc_objects == FMEM_CACHE_BATCH);
+
+  // larger than cache classes go to fmem directly
+  void *large = fmem_cache_alloc(&cache, 2 * FMEM_CACHE_CLASSES * fm->min_alloc);
+  munit_assert(large > 0);
+  munit_assert(fm->alloc_objects == FMEM_CACHE_BATCH + 1);
+  munit_assert(fmem_cache_free(&cache, large) > 0);
+  munit_assert(fm->alloc_objects == FMEM_CACHE_BATCH);
+
+  // memory from fmem_alloc can be freed into the cache
+  void *direct = fmem_alloc(fm, 2 * fm->min_alloc);
+  munit_assert(direct > 0);
+  munit_assert(fmem_cache_free(&cache, direct) > 0);
+  munit_assert(cache.counts[1] == 1);
+
+  // too many cached blocks are given back in a batch
+  void *mems[2 * FMEM_CACHE_BATCH] = {0};
+  for(int i = 0; i < 2 * FMEM_CACHE_BATCH; i++){
+    mems[i] = fmem_cache_alloc(&cache, 10);
+    munit_assert(mems[i] > 0);
+  }
+  munit_assert(fmem_cache_free(&cache, mem1) > 0);
+  munit_assert(fmem_cache_free(&cache, mem3) > 0);
+  for(int i = 0; i < 2 * FMEM_CACHE_BATCH; i++){
+    munit_assert(fmem_cache_free(&cache, mems[i]) > 0);
+    munit_assert(cache.counts[0] < 2 * FMEM_CACHE_BATCH);
+  }
+
+  // flush gives everything back
+  munit_assert(fmem_cache_flush(&cache) > 0);
+  munit_assert(fm->alloc_objects == 0);
+  munit_assert(fm->total_available == original_available);
+  munit_assert(count_pages(fpage_from_mem(fm)) == 2);
+  return MUNIT_OK;
+}
+
+// cross process lock tests need memory that is shared with forked children
+static void* make_shared_buffer(size_t size){
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  munit_assert(mem != MAP_FAILED);
+  memset(mem, 0, size);
+  return mem;
+}
+
+static MunitResult test_fmem_lock_recovery(const MunitParameter params[], void* data){
+  char buffer[large_buffer_size] = {0};
+  struct fmem *fm =  fmem_create_new(buffer, large_buffer_size, 0, NULL);
+  munit_assert(fm > 0);
+  void *mem = fmem_alloc(fm, 100);
+  munit_assert(mem > 0);
+
+  // a process that is certainly dead
+  pid_t child = fork();
+  if(child == 0) _exit(0);
+  munit_assert(child > 0);
+  munit_assert(waitpid(child, NULL, 0) == child);
+
+  // it died holding the lock in the middle of updating accounting
+  fm->lock = (uint32_t) child;
+  fm->alloc_objects = 99;
+  fm->total_available = 0;
+
+  void *other = fmem_alloc(fm, 100);
+  munit_assert(other > 0);
+  munit_assert(fm->lock_recoveries == 1);
+  munit_assert(fm->lock == 0);
+  munit_assert(fm->alloc_objects == 2); // recomputed + the one we just allocated
+  munit_assert(check_free_index(fm) == 1);
+
+  munit_assert(fmem_free(fm, mem) > 0);
+  munit_assert(fmem_free(fm, other) > 0);
+  munit_assert(fm->total_available == large_buffer_size - (2 * PAGE_OVERHEAD + sizeof(struct fmem)));
+  return MUNIT_OK;
+}
+
+static MunitResult test_fmem_lock_broken(const MunitParameter params[], void* data){
+  char buffer[large_buffer_size] = {0};
+  struct fmem *fm =  fmem_create_new(buffer, large_buffer_size, 0, NULL);
+  munit_assert(fm > 0);
+  void *a = fmem_alloc(fm, 100);
+  void *b = fmem_alloc(fm, 100);
+  munit_assert(a > 0 && b > 0);
+
+  pid_t child = fork();
+  if(child == 0) _exit(0);
+  munit_assert(child > 0);
+  munit_assert(waitpid(child, NULL, 0) == child);
+
+  // it died half way linking b, the list loops on it
+  struct fmem_page *fpage = fpage_from_mem(b);
+  int64_t next = fpage->list.next;
+  fpage->list.next = 0;
+  fm->lock = (uint32_t) child;
+  fm->alloc_objects = 99;
+
+  // nothing is rebuilt from it, every op fails and nobody waits on the lock
+  munit_assert(fmem_alloc(fm, 100) == (void *) E_BROKEN_MEM);
+  munit_assert(fm->lock == 0 && fm->broken == 1);
+  munit_assert(fmem_free(fm, a) == E_BROKEN_MEM);
+  munit_assert(fm->alloc_objects == 99);
+  munit_assert(fmem_from_existing(buffer, NULL) == (void *) E_BROKEN_MEM);
+
+  // once the list is whole again attach repairs the rest
+  fpage->list.next = next;
+  munit_assert(fmem_from_existing(buffer, NULL) == fm);
+  munit_assert(fm->broken == 0 && fm->alloc_objects == 2);
+  munit_assert(fmem_free(fm, a) > 0);
+  munit_assert(fmem_free(fm, b) > 0);
+  munit_assert(fm->alloc_objects == 0 && fmem_accounting_valid(fm));
+  return MUNIT_OK;
+}
+
+static MunitResult test_fmem_lock_attach(const MunitParameter params[], void* data){
+  size_t size = large_buffer_size;
+  char *buffer = make_shared_buffer(size);
+  struct fmem *fm =  fmem_create_new(buffer, size, 0, NULL);
+  munit_assert(fm > 0);
+  fm->user1 = 0;
+
+  // a live process holds the lock for a while
+  pid_t child = fork();
+  if(child == 0){
+    fmem_lock(fm);
+    fm->user1 = 1; // tell parent that we have the lock
+    usleep(50 * 1000);
+    fmem_unlock(fm);
+    _exit(0);
+  }
+  munit_assert(child > 0);
+  while(__atomic_load_n(&fm->user1, __ATOMIC_SEQ_CST) == 0) sched_yield();
+
+  // attaching waits for it, instead of forcing unlock
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  struct fmem *attached = fmem_from_existing(buffer, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  munit_assert(attached == fm);
+
+  int64_t elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / (1000 * 1000);
+  munit_assert(elapsed_ms >= 10);
+  munit_assert(fm->lock == 0);
+  munit_assert(fm->lock_recoveries == 0);
+
+  munit_assert(waitpid(child, NULL, 0) == child);
+  munit_assert(munmap(buffer, size) == 0);
+  return MUNIT_OK;
+}
+
+static MunitResult test_fmem_lock_multi_process(const MunitParameter params[], void* data){
+  const int per_process = 2000;
+  size_t size = 1024 * 1024;
+  char *buffer = make_shared_buffer(size);
+  struct fmem_options opts = {0};
+  opts.flags = FMEM_F_FUTEX_LOCK;
+  struct fmem *fm =  fmem_create_new_opts(buffer, size, &opts);
+  munit_assert(fm > 0);
+  munit_assert(fm->flags == FMEM_F_FUTEX_LOCK);
+
+  pid_t children[2] = {0};
+  for(int c = 0; c < 2; c++){
+    children[c] = fork();
+    if(children[c] == 0){
+      // keep every other allocation
+      for(int i = 0; i < per_process; i++){
+        void *mem = fmem_alloc(fm, 16 + (i % 7) * 8);
+        if((int64_t) mem <= 0) _exit(1);
+        if(i % 2 == 0 && fmem_free(fm, mem) <= 0) _exit(1);
+      }
+      _exit(0);
+    }
+    munit_assert(children[c] > 0);
+  }
+
+  for(int c = 0; c < 2; c++){
+    int status = 0;
+    munit_assert(waitpid(children[c], &status, 0) == children[c]);
+    munit_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+
+  munit_assert(fm->lock == 0);
+  munit_assert(fm->lock_recoveries == 0);
+  munit_assert(fm->alloc_objects == per_process);
+  munit_assert(check_free_index(fm) > 0);
+
+  munit_assert(munmap(buffer, size) == 0);
+  return MUNIT_OK;
+}
+
+// batch tests committer, counts calls and keeps the last call ranges
+#define BATCH_TEST_MAX 256
+static struct commit_range batch_test_ranges[BATCH_TEST_MAX];
+static int batch_test_count = 0;
+static int batch_test_calls = 0;
+
+static int batch_test_committer(struct commit_range *ranges, uint8_t count){
+  batch_test_calls++;
+  batch_test_count = count;
+  memcpy(batch_test_ranges, ranges, count * sizeof(struct commit_range));
+  return 0;
+}
+
+static MunitResult test_fmem_batch(const MunitParameter params[], void* data){
+  size_t size = 64 * os_page_size();
+  char *buffer = make_shared_buffer(size);
+  struct fmem *fm =  fmem_create_new(buffer, size, 0, batch_test_committer);
+  munit_assert(fm > 0);
+  batch_test_calls = 0;
+
+  // nothing open
+  munit_assert(fmem_batch_commit(fm) == E_BAD_BATCH);
+
+  struct fmem_batch batch;
+  struct commit_range storage[64];
+  munit_assert(fmem_batch_begin(fm, &batch, storage, 64) == 0);
+  struct fmem_batch other;
+  munit_assert(fmem_batch_begin(fm, &other, storage, 64) == E_BAD_BATCH);
+
+  // a list of things, every op is deferred
+  for(int i = 0; i < 26; i++){
+    void *mem = fmem_alloc(fm, 24);
+    munit_assert(mem > 0);
+    munit_assert(fmem_commit_mem(fm, mem, 0) > 0);
+  }
+  munit_assert(fmem_commit_user_data(fm) > 0);
+  munit_assert(batch_test_calls == 0);
+
+  int64_t committed = fmem_batch_commit(fm);
+  munit_assert(committed > 0);
+  munit_assert(batch_test_calls == 1);
+
+  // ranges are page aligned, sorted and never touch each other
+  int64_t total = 0;
+  for(int i = 0; i < batch_test_count; i++){
+    struct commit_range *r = &batch_test_ranges[i];
+    munit_assert(((uintptr_t) r->start) % os_page_size() == 0);
+    munit_assert(r->len % os_page_size() == 0);
+    if(i > 0){
+      struct commit_range *before = &batch_test_ranges[i - 1];
+      munit_assert((char *) before->start + before->len < (char *) r->start);
+    }
+    total += r->len;
+  }
+  munit_assert(total == committed);
+  // head page + the tail of the main page we carve from
+  munit_assert(batch_test_count == 2);
+
+  // closed, ops commit directly again
+  munit_assert(fmem_alloc(fm, 24) > 0);
+  munit_assert(batch_test_calls == 2);
+
+  // a range inside an allocation, nothing past it
+  void *inside = fmem_alloc(fm, 500);
+  munit_assert(inside > 0);
+  munit_assert(fmem_commit_mem_at(fm, inside, ((char *) inside) + 100, 50) == 50);
+  munit_assert(batch_test_calls == 4 && batch_test_count == 1);
+  munit_assert(batch_test_ranges[0].start == ((char *) inside) + 100 && batch_test_ranges[0].len == 50);
+  munit_assert(fmem_commit_mem_at(fm, inside, ((char *) inside) + 480, 50) == E_COMMIT_FAILED);
+  munit_assert(fmem_commit_mem_at(fm, inside, ((char *) inside) - 8, 8) == E_COMMIT_FAILED);
+
+  // a small batch is flushed early when full
+  batch_test_calls = 0;
+  munit_assert(fmem_batch_begin(fm, &batch, storage, 1) == 0);
+  void *big = fmem_alloc(fm, 8 * os_page_size());
+  munit_assert(big > 0);
+  munit_assert(fmem_commit_mem(fm, big, 0) > 0); // spans many pages, but it is one range
+  munit_assert(fmem_commit_mem(fm, fmem_alloc(fm, 24), 0) > 0);
+  munit_assert(batch_test_calls > 0);
+  munit_assert(fmem_batch_commit(fm) > 0);
+
+  munit_assert(munmap(buffer, size) == 0);
+  return MUNIT_OK;
+}
+
+static MunitResult test_fmem_batch_huge(const MunitParameter params[], void* data){
+  size_t size = 64 * os_page_size();
+  char *buffer = make_shared_buffer(size);
+  struct fmem_options opts = {0};
+  opts.committer = batch_test_committer;
+  opts.huge_size = 16 * os_page_size();
+  struct fmem *fm = fmem_create_new_opts(buffer, size, &opts);
+  munit_assert(fm > 0);
+  char *huge = fmem_alloc_huge(fm, 4 * os_page_size());
+  char *last = fmem_alloc_huge(fm, 12 * os_page_size()); // up to the end of memory
+  munit_assert((int64_t) huge > 0 && (int64_t) last > 0);
+
+  // ranges stay inside the extent
+  batch_test_calls = 0;
+  munit_assert(fmem_commit_mem_at(fm, huge, huge + 4 * os_page_size() - 8, 16) == E_COMMIT_FAILED);
+  munit_assert(fmem_commit_mem_at(fm, last, huge + 4 * os_page_size() - 8, 8) == E_COMMIT_FAILED);
+  munit_assert(fmem_commit_mem_at(fm, huge + os_page_size(), huge + os_page_size(), 8) == E_BAD_EXTENT);
+  munit_assert(batch_test_calls == 0);
+
+  // huge memory is fmem memory, it is batched like pages
+  struct fmem_batch batch;
+  struct commit_range storage[8];
+  munit_assert(fmem_batch_begin(fm, &batch, storage, 8) == 0);
+  batch_test_calls = 0;
+  munit_assert(fmem_commit_mem(fm, huge, 4 * os_page_size()) == 4 * os_page_size());
+  munit_assert(fmem_commit_mem_at(fm, huge, huge + os_page_size(), 100) == 100);
+  munit_assert(fmem_commit_mem_at(fm, last, last + 12 * os_page_size() - 8, 8) == 8);
+  munit_assert(batch_test_calls == 0);
+  munit_assert(fmem_batch_commit(fm) == 5 * os_page_size());
+  munit_assert(batch_test_calls == 1 && batch_test_count == 2);
+  munit_assert(batch_test_ranges[0].start == huge && batch_test_ranges[0].len == 4 * os_page_size());
+  munit_assert(batch_test_ranges[1].start == last + 11 * os_page_size() && batch_test_ranges[1].len == os_page_size());
+
+  munit_assert(munmap(buffer, size) == 0);
+  return MUNIT_OK;
+}
+
+// redo log tests use a "disk": a copy of the buffer that only gets what
+// was committed. a crash is simulated by copying the disk back over the
+// buffer (same address, we don't support memory moves)
+#define flog_test_size 64 * 1024
+static char flog_test_live[flog_test_size];
+static char flog_test_disk[flog_test_size];
+static int flog_test_calls = 0;
+static int flog_test_ranges = 0;
+
+static int flog_test_committer(struct commit_range *ranges, uint8_t count){
+  flog_test_calls++;
+  for(int i = 0; i < count; i++){
+    size_t offset = (char *) ranges[i].start - flog_test_live;
+    if(offset + ranges[i].len > flog_test_size) return -1;
+    memcpy(flog_test_disk + offset, ranges[i].start, ranges[i].len);
+    flog_test_ranges++;
+  }
+  return 0;
 }
 
-// allocates memory from fmem
-void* fmem_alloc(struct fmem *fm, uint32_t size){
-  void* ret = NULL;
-  struct fmem_page *selected = NULL;
-  uint32_t adjusted_alloc = size < fm->min_alloc ? fm->min_alloc : size;
+static struct fmem* flog_test_create_flags(uint32_t log_size, uint32_t flags){
+  memset(flog_test_live, 0, flog_test_size);
+  memset(flog_test_disk, 0, flog_test_size);
+  struct fmem_options opts = {0};
+  opts.flags = FMEM_F_REDO_LOG | flags;
+  opts.log_size = log_size;
+  opts.committer = flog_test_committer;
+  return fmem_create_new_opts(flog_test_live, flog_test_size, &opts);
+}
 
-  fmem_lock(fm);
-  if (fm->total_available < adjusted_alloc) {
-          goto done;
-    }
+static struct fmem* flog_test_create(uint32_t log_size){
+  return flog_test_create_flags(log_size, 0);
+}
 
-  // carving pages always carve towards the end of the page
-  // meaning: our free pages are always closer(on the right) to head. this result into:
-  // 1- for initial allocs (until we fill up) they will be at o(1)
-  // 2- worest alloc (if we fill up and then release the last alloc) then it will be o(n)
-  // hence size of alloc matter. Larger is better. Larger yeilds into lower page count
-  //  we can get clever by maintain a cache of free pages but that will be later on
-  // get head page
-  struct fmem_page *head_page = fpage_from_mem(fm); // this the page that holds our accounting object. We don't iterate over it
-  struct list_head *head = &head_page->list;
-  struct list_head *current = head;
-	bool carved = false;
-  list_for_each(current, head){
-    struct fmem_page *this_page = list_entry(current, struct fmem_page, list);
-
-    // check for corruption
-    int64_t check = fail_on_poison_check(fpage_get_magic(this_page), POISON, "iterating and checking mem pages");
-    if( check != 0){
-           ret = (void *) check;
-           goto done;
-    }
+static struct fmem* flog_test_crash(){
+  memcpy(flog_test_live, flog_test_disk, flog_test_size);
+  return fmem_from_existing(flog_test_live, flog_test_committer);
+}
 
-    if (false == fpage_is_free(this_page)) continue; // can't work with a page in use
-    int fit_status = fpage_can_fit(this_page, adjusted_alloc);
-    switch(fit_status){
-      case CAN_NOT_FIT:
-        break;
-      case FIT_AS_IS:
-        selected = this_page;
-				carved = false;
-        goto done;
-      case FIT_WITH_CARVE: // we need to carve this page
-        fpage_carve(this_page, &selected, adjusted_alloc);// carve it
-				carved = true;
-        goto done;
+// checks that accounting agrees with the page list and the free index is sane
+// compact pages must agree with their boundary tags as well
+static bool check_consistent(struct fmem *fm){
+  struct fmem_page *head_page = fpage_from_mem(fm);
+  struct fmem_page *this_page = NULL;
+  size_t busy = 0;
+  uint32_t busy_count = 0;
+  size_t total = head_page->size;
+  bool prev_free = false;
+
+  fpage_for_each(fm, this_page){
+    total += this_page->size;
+    if((fm->flags & FMEM_F_COMPACT) && fpage_prev_is_free(this_page) != prev_free) return false;
+    prev_free = fpage_is_free(this_page);
+    if(fpage_is_free(this_page)){
+      uint32_t footer;
+      memcpy(&footer, ((char *) this_page) + this_page->size - sizeof(uint32_t), sizeof(uint32_t));
+      if((fm->flags & FMEM_F_COMPACT) && footer != this_page->size) return false;
+      continue;
     }
+    busy += this_page->size;
+    busy_count++;
   }
+  if(total != fm->total_size || busy_count != fm->alloc_objects) return false;
+  if(fm->total_available != fm->total_size - (head_page->size + fmem_overhead(fm)) - busy) return false;
+  return findex_valid(fm) && check_free_index(fm) >= 0;
+}
 
-done:
-  // at this point we don't care if it was selected as is or carved
-  if(selected != NULL){
-    fpage_set_busy(selected); // mark as busy
-#ifdef __BAD_MEM__
-    fpage_set_magic(selected, POISON);
-#endif
-    // do the accounting
-    fm->total_available -= selected->size;
-    fm->alloc_objects += 1;
-    ret = mem_from_fpage(selected);
-
-		if(fm->committer != NULL){
-			if(carved){
-				// we need to save
-				// selected page header
-				// next page list
-				// previous page header
-				struct commit_range ranges[3] = {0};
-				ranges[0].start = selected;
-				ranges[0].len = sizeof(struct fmem_page);
-
-				struct fmem_page *prev = list_entry(selected->list.prev, struct fmem_page, list);
-				ranges[1].start = prev;
-				ranges[1].len = sizeof(struct fmem_page);
-
-				struct list_head *next = selected->list.next;
-				ranges[2].start = next;
-				ranges[2].len = sizeof(struct list_head);
-				if( fm->committer(ranges, 1) < 0) ret = (void *) E_COMMIT_FAILED;
-			}else{
-				//if as is then we just need to commit current page header
-				struct commit_range range = {0};
-				range.start = selected;
-				range.len = sizeof(struct fmem_page);
-				if( fm->committer(&range, 1) < 0) ret = (void *) E_COMMIT_FAILED;
-			}
-		}
+static MunitResult test_fmem_redo_log(const MunitParameter params[], void* data){
+  struct fmem *fm = flog_test_create(0);
+  munit_assert(fm > 0);
+  munit_assert(fm->log_size == FMEM_DEFAULT_LOG_SIZE);
+  munit_assert(fm->total_available == flog_test_size - (2 * PAGE_OVERHEAD + sizeof(struct fmem) + FMEM_DEFAULT_LOG_SIZE));
+
+  // every op is one range, appended to the log
+  void *mems[32] = {0};
+  for(int i = 0; i < 32; i++){
+    flog_test_calls = 0;
+    flog_test_ranges = 0;
+    mems[i] = fmem_alloc(fm, 24 + i * 8);
+    munit_assert(mems[i] > 0);
+    munit_assert(flog_test_calls == 1 && flog_test_ranges == 1);
   }
-
-  fmem_unlock(fm);
-  return ret == NULL ? (void *)FMEM_E_NOMEM : ret;
+  for(int i = 0; i < 32; i += 2){
+    flog_test_calls = 0;
+    munit_assert(fmem_free(fm, mems[i]) > 0);
+    munit_assert(flog_test_calls == 1);
+  }
+  munit_assert(fm->log_records == 48);
+  size_t available = fm->total_available;
+  uint32_t objects = fm->alloc_objects;
+  int free_pages = check_free_index(fm);
+
+  // nothing but the log made it to disk, replay brings everything back
+  fm = flog_test_crash();
+  munit_assert(fm > 0);
+  munit_assert(check_consistent(fm));
+  munit_assert(fm->total_available == available);
+  munit_assert(fm->alloc_objects == objects);
+  munit_assert(check_free_index(fm) == free_pages);
+  // replayed log got checkpointed
+  munit_assert(fm->log_head == 0 && fm->log_records == 0 && fm->log_seq == 48);
+
+  // a crash right after a checkpoint replays nothing
+  fm = flog_test_crash();
+  munit_assert(fm > 0);
+  munit_assert(check_consistent(fm));
+  munit_assert(fm->alloc_objects == objects);
+  return MUNIT_OK;
 }
 
-// frees a memory and returns total freed memory (includes page overhead, which will also be returned to pool)
-// BAD_MEM is tested for this one
-int64_t fmem_free(struct fmem *fm, void *mem){
-  struct fmem_page *fpage = fpage_from_mem(mem); // get the page for that mem. page is always stashed before the mem
+static MunitResult test_fmem_redo_log_torn(const MunitParameter params[], void* data){
+  struct fmem *fm = flog_test_create(0);
+  munit_assert(fm > 0);
+
+  for(int i = 0; i < 8; i++) munit_assert(fmem_alloc(fm, 100) > 0);
+  size_t available = fm->total_available;
+  uint32_t head = fm->log_head;
+  munit_assert(fmem_alloc(fm, 100) > 0);
+
+  // last record is torn on disk, that op never happened
+  flog_test_disk[((char *) flog_area(fm) - flog_test_live) + fm->log_head - 1] ^= 0xFF;
+  fm = flog_test_crash();
+  munit_assert(fm > 0);
+  munit_assert(check_consistent(fm));
+  munit_assert(fm->alloc_objects == 8);
+  munit_assert(fm->total_available == available);
+  munit_assert(fm->log_seq == 8);
+  munit_assert(head > 0);
+  return MUNIT_OK;
+}
 
-  // POISON CHECK
-  int64_t check = fail_on_poison_check(fpage_get_magic(fpage), POISON, "reloading existing allocator");
-  if( check != 0) return check;
+static MunitResult test_fmem_redo_log_takeover(const MunitParameter params[], void* data){
+  struct fmem *fm = flog_test_create(0);
+  munit_assert(fm > 0);
+  void *a = fmem_alloc(fm, 100);
+  void *b = fmem_alloc(fm, 200);
+  munit_assert(a > 0 && b > 0);
+
+  pid_t child = fork();
+  if(child == 0) _exit(0);
+  munit_assert(child > 0);
+  munit_assert(waitpid(child, NULL, 0) == child);
+
+  // it died holding the lock, its op is in the log but memory is torn. the
+  // page list alone can't be recovered, the log replayed first fixes it
+  fpage_from_mem(b)->list.next = 0;
+  fm->alloc_objects = 99;
+  fm->lock = (uint32_t) child;
+
+  void *c = fmem_alloc(fm, 100);
+  munit_assert(c > 0);
+  munit_assert(fm->lock_recoveries == 1 && fm->broken == 0);
+  munit_assert(fm->alloc_objects == 3);
+  munit_assert(check_consistent(fm));
+  munit_assert(fmem_free(fm, b) > 0);
+
+  // what was replayed is what a crash brings back
+  fm = flog_test_crash();
+  munit_assert(fm > 0);
+  munit_assert(check_consistent(fm));
+  munit_assert(fm->alloc_objects == 2);
+  return MUNIT_OK;
+}
 
+static MunitResult test_fmem_redo_log_checkpoint(const MunitParameter params[], void* data){
+  // small log, fills up fast
+  struct fmem *fm = flog_test_create(1024);
+  munit_assert(fm > 0);
+  munit_assert(fm->log_size == 1024);
 
-  fmem_lock(fm);
+  void *mems[64] = {0};
+  for(int i = 0; i < 64; i++){
+    mems[i] = fmem_alloc(fm, 40);
+    munit_assert(mems[i] > 0);
+  }
+  for(int i = 0; i < 64; i += 3) munit_assert(fmem_free(fm, mems[i]) > 0);
+  munit_assert(fm->log_seq > 0); // checkpointed at least once
+  uint32_t objects = fm->alloc_objects;
+
+  fm = flog_test_crash();
+  munit_assert(fm > 0);
+  munit_assert(check_consistent(fm));
+  munit_assert(fm->alloc_objects == objects);
+
+  // records that can never fit the log are committed directly
+  fm = flog_test_create(64);
+  munit_assert(fm > 0);
+  for(int i = 0; i < 16; i++){
+    flog_test_ranges = 0;
+    munit_assert(fmem_alloc(fm, 40) > 0);
+    munit_assert(flog_test_ranges > 1);
+  }
+  munit_assert(fm->log_records == 0);
+  fm = flog_test_crash();
+  munit_assert(fm > 0);
+  munit_assert(check_consistent(fm));
+  munit_assert(fm->alloc_objects == 16);
+  return MUNIT_OK;
+}
 
-  int64_t to_free = (int64_t) fpage->size; // keep the size aside
-  fpage_set_free(fpage); // free it
-  struct fmem_page *modified = fpage_merge(fpage); // merge, if we can
-  // accountig
-  fm->alloc_objects -= 1;
-  fm->total_available += to_free;
+static MunitResult test_fmem_redo_log_fence(const MunitParameter params[], void* data){
+  struct fmem *fm = flog_test_create(0);
+  munit_assert(fm > 0);
+
+  // a sits at the end, it can't merge when freed
+  void *a = fmem_alloc(fm, 64);
+  munit_assert(fmem_alloc(fm, 64) > 0);
+  munit_assert(fmem_free(fm, a) > 0); // free link in a's body is now in the log
+  void *again = fmem_alloc(fm, 64);
+  munit_assert(again == a);
+
+  // user data over the old free link, committed directly
+  memset(a, 0xAB, 64);
+  munit_assert(fmem_commit_mem(fm, a, 64) > 0);
+
+  fm = flog_test_crash();
+  munit_assert(fm > 0);
+  munit_assert(check_consistent(fm));
+  for(int i = 0; i < 64; i++) munit_assert(((unsigned char *) a)[i] == 0xAB);
+  return MUNIT_OK;
+}
 
-	if(fm->committer != NULL){
-		// commit
-		// header for modified
-		// header for previous (we only need the list pointers)
-		// header for next (we only need the list pointers)
-		// we can get clever here but will keep it simple for now
-		struct commit_range ranges[3] = {0};
-  	struct list_head *prev = fpage->list.prev;
-  	struct list_head *next = fpage->list.next;
-
-		ranges[0].start = modified;
-		ranges[0].len = sizeof(struct fmem_page);
-
-		// prev
-		ranges[1].start = prev;
-		ranges[1].len = sizeof(struct list_head);
-
-		// next
-		ranges[2].start = next;
-		ranges[2].len =sizeof(struct list_head);
-
-		 if(fm->committer(ranges, 3) < 0)  {
-				to_free = E_COMMIT_FAILED;
-		 }
-	}
+// async tests, the committer is slow like a disk and counts what it got
+static int async_test_ranges = 0;
+static int async_test_committer(struct commit_range *ranges, uint8_t count){
+  usleep(1000);
+  __atomic_add_fetch(&async_test_ranges, count, __ATOMIC_SEQ_CST);
+  return 0;
+}
 
-  fmem_unlock(fm);
-  return to_free;
+static MunitResult test_fmem_async(const MunitParameter params[], void* data){
+  char buffer[large_buffer_size] = {0};
+  struct fmem *fm =  fmem_create_new(buffer, large_buffer_size, 0, async_test_committer);
+  munit_assert(fm > 0);
+  async_test_ranges = 0;
+
+  struct fmem_async async;
+  struct fmem_async_slot slots[64];
+  munit_assert(fmem_async_start(fm, &async, slots, 63) == E_BAD_ASYNC);
+  munit_assert(fmem_async_start(fm, &async, slots, 64) == 0);
+  struct fmem_async other;
+  munit_assert(fmem_async_start(fm, &other, slots, 64) == E_BAD_ASYNC);
+  munit_assert(fmem_commit_seq(fm) == 0);
+  munit_assert(fmem_commit_wait(fm, 0) == 0);
+
+  // ops don't wait for the committer. 100 ops, 1ms each if they did
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  void *mems[100] = {0};
+  for(int i = 0; i < 100; i++){
+    mems[i] = fmem_alloc(fm, 32);
+    munit_assert(mems[i] > 0);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  int64_t took_ns = (end.tv_sec - start.tv_sec) * 1000 * 1000 * 1000 + (end.tv_nsec - start.tv_nsec);
+  munit_assert(took_ns < 100 * 1000 * 1000);
+
+  // a hard durability point
+  uint64_t seq = fmem_commit_seq(fm);
+  munit_assert(seq > 0);
+  munit_assert(fmem_commit_wait(fm, seq) == 0);
+  munit_assert(__atomic_load_n(&async_test_ranges, __ATOMIC_SEQ_CST) == (int) seq);
+
+  for(int i = 0; i < 100; i++) munit_assert(fmem_free(fm, mems[i]) > 0);
+  munit_assert(fmem_commit_mem(fm, fmem_alloc(fm, 32), 0) > 0);
+  seq = fmem_commit_seq(fm);
+
+  // stop drains the ring
+  munit_assert(fmem_async_stop(fm) == 0);
+  munit_assert(__atomic_load_n(&async_test_ranges, __ATOMIC_SEQ_CST) == (int) seq);
+  munit_assert(fmem_async_stop(fm) == E_BAD_ASYNC);
+
+  // back to synchronous
+  int before = async_test_ranges;
+  munit_assert(fmem_alloc(fm, 32) > 0);
+  munit_assert(async_test_ranges > before);
+  munit_assert(fmem_commit_seq(fm) == 0);
+
+  // failures are reported by wait and stop
+  fmem_set_committer(fm, failed_test_committer);
+  munit_assert(fmem_async_start(fm, &async, slots, 64) == 0);
+  munit_assert(fmem_alloc(fm, 32) > 0); // queued, can't fail yet
+  munit_assert(fmem_commit_wait(fm, fmem_commit_seq(fm)) == E_COMMIT_FAILED);
+  munit_assert(fmem_async_stop(fm) == E_COMMIT_FAILED);
+  return MUNIT_OK;
 }
 
-int64_t fmem_commit_user_data(struct fmem *fm){
-	if(fm->committer == NULL) return E_COMMIT_FAILED;
+static MunitResult test_fmem_alloc_many(const MunitParameter params[], void* data){
+  char buffer[large_buffer_size] = {0};
+  struct fmem *fm =  fmem_create_new(buffer, large_buffer_size, 0, test_committer);
+  munit_assert(fm > 0);
+
+  // one run carved from one page. one range for all of them, the page we
+  // carved from, and the head page (accounting + the prev link of the page after)
+  void *mems[26] = {0};
+  reset_test_committer();
+  munit_assert(fmem_alloc_many(fm, 40, 26, mems) == 26);
+  munit_assert(committed_range_count == 3);
+  bool run_committed = false;
+  for(int i = 0; i < committed_range_count; i++){
+    char *start = (char *) __test_ranges[i].start;
+    char *end = start + __test_ranges[i].len;
+    if(start <= (char *) fpage_from_mem(mems[0]) && end >= (char *) mems[25] + 40) run_committed = true;
+  }
+  munit_assert(run_committed);
+  for(int i = 0; i < 26; i++){
+    struct fmem_page *fpage = fpage_from_mem(mems[i]);
+    munit_assert(!fpage_is_free(fpage));
+    munit_assert(fpage_actual(fpage) == 40);
+    // in address order, right next to each other
+    if(i > 0) munit_assert((char *) mems[i] == (char *) mems[i - 1] + 40 + PAGE_OVERHEAD);
+  }
+  munit_assert(fm->alloc_objects == 26);
+  munit_assert(check_consistent(fm));
+
+  // free them all, everything merges back
+  reset_test_committer();
+  munit_assert(fmem_free_many(fm, mems, 26) == 26 * (40 + PAGE_OVERHEAD));
+  munit_assert(fm->alloc_objects == 0);
+  munit_assert(count_pages(fpage_from_mem(fm)) == 2);
+  munit_assert(check_consistent(fm));
+
+  // no single page can take them all, they are allocated one by one
+  fmem_set_committer(fm, NULL);
+  void *filler[64] = {0};
+  for(int i = 0; i < 64; i++) filler[i] = fmem_alloc(fm, 200);
+  for(int i = 0; i < 64; i += 2) munit_assert(fmem_free(fm, filler[i]) > 0);
+  void *small[32] = {0};
+  munit_assert(fmem_alloc_many(fm, 100, 32, small) == 32);
+  munit_assert(check_consistent(fm));
+
+  // running out gets whatever is there
+  void *huge[8] = {0};
+  int64_t got = fmem_alloc_many(fm, 8 * 1024, 8, huge);
+  munit_assert(got > 0 && got < 8);
+  munit_assert(fmem_alloc_many(fm, 32 * 1024, 2, huge) == FMEM_E_NOMEM);
+  munit_assert(fmem_free_many(fm, huge, got) > 0);
+  munit_assert(fmem_free_many(fm, small, 32) > 0);
+  munit_assert(check_consistent(fm));
+  munit_assert(fmem_alloc_many(fm, 24, 0, small) == 0);
+  return MUNIT_OK;
+}
 
-  // POISON CHECK
-	struct fmem_page *fhead_page = fpage_from_mem(fm);
-  int64_t check = fail_on_poison_check(fpage_get_magic(fhead_page), POISON, "committing user data");
-  if( check != 0) return check;
+static MunitResult test_fmem_alloc_many_redo_log(const MunitParameter params[], void* data){
+  struct fmem *fm = flog_test_create(0);
+  munit_assert(fm > 0);
+
+  // page by page, but survives a crash all the same
+  void *mems[40] = {0};
+  munit_assert(fmem_alloc_many(fm, 48, 40, mems) == 40);
+  munit_assert(fmem_free_many(fm, mems, 20) > 0);
+  uint32_t objects = fm->alloc_objects;
+  fm = flog_test_crash();
+  munit_assert(fm > 0);
+  munit_assert(check_consistent(fm));
+  munit_assert(fm->alloc_objects == objects);
+  return MUNIT_OK;
+}
 
-	// we don't need to lock here
-	struct commit_range r = {0};
-	r.start = (void *) &fm->user1;
-	r.len = 4 * sizeof(fm->user1);
-	if (fm->committer(&r, 1) < 0) return E_COMMIT_FAILED;
+// relocation callback for compact tests, ctx is a table of pointers
+struct compact_test_table{
+  void **mems;
+  int count;
+  int calls;
+};
 
-	return r.len;
+static void compact_test_relocate(void *from, void *to, uint32_t size, void *ctx){
+  struct compact_test_table *table = (struct compact_test_table *) ctx;
+  table->calls++;
+  for(int i = 0; i < table->count; i++){
+    if(table->mems[i] == from) table->mems[i] = to;
+  }
 }
 
-int64_t fmem_commit_mem(struct fmem *fm, void *mem, uint32_t len){
-	 if(fm->committer == NULL) return E_COMMIT_FAILED;
+static MunitResult test_fmem_compact(const MunitParameter params[], void* data){
+  char buffer[large_buffer_size] = {0};
+  struct fmem *fm =  fmem_create_new(buffer, large_buffer_size, 0, NULL);
+  munit_assert(fm > 0);
 
-	// should we lock here?
-	struct fmem_page *fpage = fpage_from_mem(mem);
-  // POISON CHECK
-  int64_t check = fail_on_poison_check(fpage_get_magic(fpage), POISON, "committing user memory");
-  if( check != 0) return check;
+  // nothing to move on a new fmem
+  munit_assert(fmem_compact_step(fm, 100, 0, NULL, NULL) == 0);
 
+  void *mems[64] = {0};
+  for(int i = 0; i < 64; i++){
+    mems[i] = fmem_alloc(fm, 24 + (i % 8) * 40);
+    munit_assert(mems[i] > 0);
+    memset(mems[i], i, 24 + (i % 8) * 40);
+  }
+  // keep the odd ones, 32 holes
+  void *kept[32] = {0};
+  for(int i = 0; i < 64; i++){
+    if(i % 2 == 1) kept[i / 2] = mems[i]; else munit_assert(fmem_free(fm, mems[i]) > 0);
+  }
+  munit_assert(check_free_index(fm) == 33);
+  uint32_t available = fm->total_available;
+
+  // a step does no more than it is asked to
+  struct compact_test_table table = {kept, 32, 0};
+  munit_assert(fmem_compact_step(fm, 4, 0, compact_test_relocate, &table) == 4);
+  munit_assert(table.calls == 4);
+  munit_assert(check_consistent(fm));
+
+  // moves are committed in one go
+  fmem_set_committer(fm, test_committer);
+  reset_test_committer();
+  munit_assert(fmem_compact_step(fm, 2, 0, compact_test_relocate, &table) == 2);
+  munit_assert(committed_range_count > 0 && committed_range_count <= 8);
+  fmem_set_committer(fm, NULL);
+
+  // then the rest, in time bounded steps
+  int steps = 0;
+  while(fmem_compact_step(fm, 1000, 1, compact_test_relocate, &table) > 0) steps++;
+  munit_assert(steps > 1);
+
+  // head, busy pages in the same order, one free page at the end
+  munit_assert(check_free_index(fm) == 1);
+  munit_assert(count_pages(fpage_from_mem(fm)) == 2 + 32);
+  struct fmem_page *last = rlist_entry(rlist_prev(&fpage_from_mem(fm)->list), struct fmem_page, list);
+  munit_assert(fpage_is_free(last));
+  munit_assert(fm->total_available == available);
+  munit_assert(last->size == available + PAGE_OVERHEAD); // accounting keeps one header aside
+  munit_assert(fm->alloc_objects == 32);
+  for(int i = 0; i < 32; i++){
+    int n = 2 * i + 1;
+    if(i > 0) munit_assert((char *) kept[i] < (char *) kept[i - 1]); // carved from the end
+    for(int b = 0; b < 24 + (n % 8) * 40; b++) munit_assert(((unsigned char *) kept[i])[b] == n);
+  }
+  munit_assert(check_consistent(fm));
+
+  // memory is usable after
+  void *big = fmem_alloc(fm, fpage_actual(last));
+  munit_assert(big > 0);
+  for(int i = 0; i < 32; i++) munit_assert(fmem_free(fm, kept[i]) > 0);
+  munit_assert(fmem_free(fm, big) > 0);
+  munit_assert(count_pages(fpage_from_mem(fm)) == 2);
+  return MUNIT_OK;
+}
 
-	uint32_t page_size = fpage_actual(fpage);
-	if (len == 0){
-		len = page_size; // if no len then
-	}
-	// weather len is supplied or not, it must fit page boundries
-	if ( ((char *) mem + len) > ((char *) fpage + PAGE_OVERHEAD +  page_size)) return E_COMMIT_FAILED;
+static MunitResult test_fmem_compact_redo_log(const MunitParameter params[], void* data){
+  struct fmem *fm = flog_test_create(0);
+  munit_assert(fm > 0);
+
+  void *mems[40] = {0};
+  void *kept[20] = {0};
+  for(int i = 0; i < 40; i++){
+    mems[i] = fmem_alloc(fm, 300);
+    munit_assert(mems[i] > 0);
+    memset(mems[i], i, 300);
+    munit_assert(fmem_commit_mem(fm, mems[i], 0) >= 300);
+  }
+  for(int i = 0; i < 40; i++){
+    if(i % 2 == 1) kept[i / 2] = mems[i]; else munit_assert(fmem_free(fm, mems[i]) > 0);
+  }
 
+  struct compact_test_table table = {kept, 20, 0};
+  munit_assert(fmem_compact_step(fm, 1000, 0, compact_test_relocate, &table) == 20);
+  // user writes after the move are not replayed over
+  memset(kept[0], 0xAA, 300);
+  munit_assert(fmem_commit_mem(fm, kept[0], 0) >= 300);
+
+  fm = flog_test_crash();
+  munit_assert(fm > 0);
+  munit_assert(check_consistent(fm));
+  munit_assert(check_free_index(fm) == 1);
+  munit_assert(fm->alloc_objects == 20);
+  for(int b = 0; b < 300; b++) munit_assert(((unsigned char *) kept[0])[b] == 0xAA);
+  for(int i = 1; i < 20; i++){
+    for(int b = 0; b < 300; b++) munit_assert(((unsigned char *) kept[i])[b] == 2 * i + 1);
+  }
+  return MUNIT_OK;
+}
 
-	struct commit_range r = {0};
-	r.start = mem;
-	r.len = len;
-	if (fm->committer(&r,1) < 0) return E_COMMIT_FAILED;
+static MunitResult test_fmem_handles(const MunitParameter params[], void* data){
+  char buffer[large_buffer_size] = {0};
+  struct fmem *fm =  fmem_create_new(buffer, large_buffer_size, 0, NULL);
+  munit_assert(fm > 0);
+
+  // no table, no handles
+  munit_assert(fmem_halloc(fm, 100) == E_BAD_HANDLE);
+  munit_assert(fmem_deref(fm, 1) == NULL);
+
+  // something to free later so the table and handles can move down
+  void *filler = fmem_alloc(fm, 2048);
+  munit_assert(filler > 0);
+  munit_assert(fmem_htable_create(fm, 16) == 16);
+  munit_assert(fmem_htable_create(fm, 16) == E_BAD_HANDLE);
+  void *table = rptr_get(&fm->handle_table);
+
+  fmem_handle_t handles[16] = {0};
+  for(int i = 0; i < 16; i++){
+    int64_t handle = fmem_halloc(fm, 100 + i);
+    munit_assert(handle > 0);
+    handles[i] = (fmem_handle_t) handle;
+    memset(fmem_deref(fm, handles[i]), i, 100 + i);
+  }
+  // out of handles, not memory
+  munit_assert(fmem_halloc(fm, 100) == FMEM_E_NOMEM);
+
+  // a freed handle is not valid and gets reused
+  munit_assert(fmem_hfree(fm, handles[3]) > 0);
+  munit_assert(fmem_deref(fm, handles[3]) == NULL);
+  munit_assert(fmem_hfree(fm, handles[3]) == E_BAD_HANDLE);
+  munit_assert(fmem_hfree(fm, 0) == E_BAD_HANDLE);
+  munit_assert(fmem_hfree(fm, 17) == E_BAD_HANDLE);
+  int64_t reused = fmem_halloc(fm, 103);
+  munit_assert(reused == handles[3]);
+  memset(fmem_deref(fm, handles[3]), 3, 103);
+
+  // compaction moves the table and every object, handles stay good
+  munit_assert(fmem_free(fm, filler) > 0);
+  munit_assert(fmem_hfree(fm, handles[8]) > 0);
+  while(fmem_compact_step(fm, 1000, 0, NULL, NULL) > 0);
+  munit_assert(check_free_index(fm) == 1);
+  munit_assert(rptr_get(&fm->handle_table) != table);
+  for(int i = 0; i < 16; i++){
+    if(i == 8) continue;
+    unsigned char *mem = fmem_deref(fm, handles[i]);
+    munit_assert(mem != NULL);
+    for(int b = 0; b < 100 + i; b++) munit_assert(mem[b] == i);
+  }
+  munit_assert(check_consistent(fm));
+
+  // and the same memory mapped elsewhere
+  char *moved = malloc(large_buffer_size);
+  memcpy(moved, buffer, large_buffer_size);
+  struct fmem *other = fmem_from_existing(moved, NULL);
+  munit_assert(other > 0);
+  munit_assert(((unsigned char *) fmem_deref(other, handles[5]))[0] == 5);
+  munit_assert((char *) fmem_deref(other, handles[5]) - moved == (char *) fmem_deref(fm, handles[5]) - buffer);
+  free(moved);
+
+  for(int i = 0; i < 16; i++){
+    if(i != 8) munit_assert(fmem_hfree(fm, handles[i]) > 0);
+  }
+  munit_assert(fm->alloc_objects == 1); // the table
+  return MUNIT_OK;
+}
 
-	return len;
+static MunitResult test_fmem_handles_redo_log(const MunitParameter params[], void* data){
+  struct fmem *fm = flog_test_create(0);
+  munit_assert(fm > 0);
+  munit_assert(fmem_htable_create(fm, 64) == 64);
+
+  fmem_handle_t handles[32] = {0};
+  for(int i = 0; i < 32; i++){
+    handles[i] = (fmem_handle_t) fmem_halloc(fm, 200);
+    munit_assert(handles[i] > 0);
+    void *mem = fmem_deref(fm, handles[i]);
+    memset(mem, i, 200);
+    munit_assert(fmem_commit_mem(fm, mem, 200) == 200);
+  }
+  for(int i = 0; i < 32; i += 2) munit_assert(fmem_hfree(fm, handles[i]) > 0);
+  munit_assert(fmem_compact_step(fm, 1000, 0, NULL, NULL) > 0);
+
+  fm = flog_test_crash();
+  munit_assert(fm > 0);
+  munit_assert(check_consistent(fm));
+  for(int i = 0; i < 32; i++){
+    unsigned char *mem = fmem_deref(fm, handles[i]);
+    if(i % 2 == 0){
+      munit_assert(mem == NULL);
+      continue;
+    }
+    for(int b = 0; b < 200; b++) munit_assert(mem[b] == i);
+  }
+  // freed handles are reused after the crash too
+  munit_assert(fmem_halloc(fm, 200) == handles[30]);
+  return MUNIT_OK;
 }
 
-#ifdef __UNIT_TESTING__
-#include <stddef.h>
-#include <stdbool.h>
-#include <stdio.h>
-#include "munit/munit.h"
+static MunitResult test_fmem_realloc(const MunitParameter params[], void* data){
+  char buffer[large_buffer_size] = {0};
+  struct fmem *fm =  fmem_create_new(buffer, large_buffer_size, 0, NULL);
+  munit_assert(fm > 0);
+  size_t available = fm->total_available;
+
+  // pages are carved from the end, b sits right before a
+  void *a = fmem_alloc(fm, 1000);
+  void *b = fmem_alloc(fm, 1000);
+  munit_assert(a > 0 && b > 0);
+  memset(b, 0xB, 1000);
+
+  // shrink in place, the tail is a free page between b and a
+  munit_assert(fmem_realloc(fm, b, 200) == b);
+  munit_assert(fpage_actual(fpage_from_mem(b)) == 200);
+  munit_assert(check_free_index(fm) == 2);
+  munit_assert(check_consistent(fm));
+  // too small to give anything back
+  munit_assert(fmem_realloc(fm, b, 190) == b);
+  munit_assert(fpage_actual(fpage_from_mem(b)) == 200);
+
+  // grow in place into the tail
+  munit_assert(fmem_realloc(fm, b, 600) == b);
+  munit_assert(fpage_actual(fpage_from_mem(b)) == 600);
+  munit_assert(check_free_index(fm) == 2);
+  // all of it, nothing is left between b and a
+  munit_assert(fmem_realloc(fm, b, 1000) == b);
+  munit_assert(check_free_index(fm) == 1);
+  for(int i = 0; i < 200; i++) munit_assert(((unsigned char *) b)[i] == 0xB);
+  munit_assert(check_consistent(fm));
+  memset(b, 0xB, 1000);
+
+  // can't grow in place, it moves
+  void *moved = fmem_realloc(fm, b, 3000);
+  munit_assert(moved > 0 && moved != b);
+  for(int i = 0; i < 1000; i++) munit_assert(((unsigned char *) moved)[i] == 0xB);
+  munit_assert(fm->alloc_objects == 2);
+  munit_assert(check_consistent(fm));
+
+  // too big, memory is untouched
+  munit_assert(fmem_realloc(fm, moved, large_buffer_size) == (void *) FMEM_E_NOMEM);
+  munit_assert(((unsigned char *) moved)[999] == 0xB);
+
+  // handles are kept
+  munit_assert(fmem_htable_create(fm, 4) == 4);
+  int64_t handle = fmem_halloc(fm, 100);
+  munit_assert(handle > 0);
+  memset(fmem_deref(fm, handle), 0xC, 100);
+  void *filler = fmem_alloc(fm, 100); // so it can not grow in place
+  munit_assert(filler > 0);
+  void *grown = fmem_realloc(fm, fmem_deref(fm, handle), 4000);
+  munit_assert(grown > 0 && grown == fmem_deref(fm, handle));
+  munit_assert(((unsigned char *) grown)[99] == 0xC);
+  munit_assert(fmem_realloc(fm, grown, 50) == grown);
+  munit_assert(fpage_handle_of(fpage_from_mem(grown)) == handle);
+  munit_assert(check_consistent(fm));
+
+  munit_assert(fmem_hfree(fm, handle) > 0);
+  munit_assert(fmem_free(fm, filler) > 0);
+  munit_assert(fmem_free(fm, rptr_get(&fm->handle_table)) > 0);
+  munit_assert(fmem_free(fm, moved) > 0);
+  munit_assert(fmem_free(fm, a) > 0);
+  munit_assert(fm->total_available == available);
+  munit_assert(count_pages(fpage_from_mem(fm)) == 2);
+
+  // NULL is an alloc
+  void *fresh = fmem_realloc(fm, NULL, 100);
+  munit_assert(fresh > 0);
+  return MUNIT_OK;
+}
 
-#define small_buffer_size 10
-#define large_buffer_size 50 * 1024
+static MunitResult test_fmem_realloc_redo_log(const MunitParameter params[], void* data){
+  struct fmem *fm = flog_test_create(0);
+  munit_assert(fm > 0);
+
+  void *a = fmem_alloc(fm, 500);
+  void *b = fmem_alloc(fm, 500);
+  memset(b, 0xB, 500);
+  munit_assert(fmem_commit_mem(fm, b, 500) == 500);
+  munit_assert(fmem_realloc(fm, b, 100) == b);
+  munit_assert(fmem_realloc(fm, b, 400) == b);
+  // fenced, the free page that was here is not replayed over this
+  memset(b, 0xD, 400);
+  munit_assert(fmem_commit_mem(fm, b, 400) == 400);
+  void *moved = fmem_realloc(fm, a, 2000);
+  munit_assert(moved > 0);
+
+  fm = flog_test_crash();
+  munit_assert(fm > 0);
+  munit_assert(check_consistent(fm));
+  munit_assert(fm->alloc_objects == 2);
+  for(int i = 0; i < 400; i++) munit_assert(((unsigned char *) b)[i] == 0xD);
+  return MUNIT_OK;
+}
 
-// test committer saves data here
-#define MAX_COMMIT  3
-struct commit_range  __test_ranges[MAX_COMMIT] = {0};
-int committed_range_count = 0;
+static MunitResult test_fmem_alloc_aligned(const MunitParameter params[], void* data){
+  char buffer[large_buffer_size] = {0};
+  struct fmem *fm =  fmem_create_new(buffer, large_buffer_size, 0, NULL);
+  munit_assert(fm > 0);
+  size_t available = fm->total_available;
+
+  munit_assert(fmem_alloc_aligned(fm, 100, 0) == (void *) E_BAD_ALIGN);
+  munit_assert(fmem_alloc_aligned(fm, 100, 48) == (void *) E_BAD_ALIGN);
+  munit_assert(fmem_alloc_aligned(fm, 100, os_page_size() * 2) == (void *) E_BAD_ALIGN);
+
+  uint32_t aligns[] = {8, 16, 64, 256, 4096};
+  void *mems[5] = {0};
+  for(int i = 0; i < 5; i++){
+    mems[i] = fmem_alloc_aligned(fm, 100, aligns[i]);
+    munit_assert(mems[i] > 0);
+    munit_assert(((uintptr_t) mems[i] & (aligns[i] - 1)) == 0);
+    memset(mems[i], i, 100);
+    // padding is not kept by the page
+    munit_assert(fpage_actual(fpage_from_mem(mems[i])) <= 100 + PAGE_REMAIN_FREE);
+  }
+  munit_assert(check_consistent(fm));
+  // padding went back to free memory
+  munit_assert(available - fm->total_available <= 5 * (100 + PAGE_REMAIN_FREE + PAGE_OVERHEAD));
+
+  // compaction leaves them where they are
+  void *plain = fmem_alloc(fm, 100);
+  struct compact_test_table table = {&plain, 1, 0};
+  munit_assert(fmem_free(fm, mems[1]) > 0);
+  while(fmem_compact_step(fm, 1000, 0, compact_test_relocate, &table) > 0);
+  for(int i = 2; i < 5; i++) munit_assert(((unsigned char *) mems[i])[99] == i);
+  munit_assert(check_consistent(fm));
+
+  // realloc that moves keeps the alignment
+  void *filler = fmem_alloc(fm, 100);
+  void *grown = fmem_realloc(fm, mems[4], 2000);
+  munit_assert(grown > 0);
+  munit_assert(((uintptr_t) grown & 4095) == 0);
+  munit_assert(((unsigned char *) grown)[99] == 4);
+  mems[4] = grown;
+  munit_assert(check_consistent(fm));
+
+  munit_assert(fmem_free(fm, filler) > 0);
+  munit_assert(fmem_free(fm, plain) > 0);
+  for(int i = 0; i < 5; i++){
+    if(i != 1) munit_assert(fmem_free(fm, mems[i]) > 0);
+  }
+  munit_assert(fm->total_available == available);
+  munit_assert(count_pages(fpage_from_mem(fm)) == 2);
+  return MUNIT_OK;
+}
 
-// resets committed values
-static void reset_test_committer(){
-	committed_range_count = 0;
+static MunitResult test_fmem_default_align(const MunitParameter params[], void* data){
+  char buffer[large_buffer_size] = {0};
+  struct fmem_options opts = {0};
+  opts.align = 100;
+  munit_assert(fmem_create_new_opts(buffer, large_buffer_size, &opts) == (void *) E_BAD_ALIGN);
+  opts.align = 64;
+  struct fmem *fm = fmem_create_new_opts(buffer, large_buffer_size, &opts);
+  munit_assert(fm > 0);
+
+  // every path that allocates
+  void *mems[16] = {0};
+  munit_assert(fmem_alloc_many(fm, 40, 16, mems) == 16);
+  for(int i = 0; i < 16; i++) munit_assert(((uintptr_t) mems[i] & 63) == 0);
+  struct fmem_cache cache;
+  fmem_cache_init(&cache, fm);
+  void *cached = fmem_cache_alloc(&cache, 30);
+  munit_assert(cached > 0 && ((uintptr_t) cached & 63) == 0);
+  void *mem = fmem_alloc(fm, 1);
+  munit_assert(mem > 0 && ((uintptr_t) mem & 63) == 0);
+  munit_assert(check_consistent(fm));
+
+  munit_assert(fmem_cache_free(&cache, cached) > 0);
+  munit_assert(fmem_cache_flush(&cache) > 0);
+  munit_assert(fmem_free_many(fm, mems, 16) > 0);
+  munit_assert(fmem_free(fm, mem) > 0);
+  munit_assert(count_pages(fpage_from_mem(fm)) == 2);
+  return MUNIT_OK;
 }
-static int failed_test_committer(struct commit_range *ranges, uint8_t count){
-	return -1;
+
+static MunitResult test_fmem_compact_default_align(const MunitParameter params[], void* data){
+  char buffer[large_buffer_size] = {0};
+  struct fmem_options opts = {0};
+  opts.align = 64;
+  struct fmem *fm = fmem_create_new_opts(buffer, large_buffer_size, &opts);
+  munit_assert(fm > 0);
+
+  // default alignment does not pin, more than it does
+  void *mems[32] = {0};
+  for(int i = 0; i < 32; i++){
+    mems[i] = fmem_alloc(fm, 24 + (i % 8) * 40);
+    munit_assert(mems[i] > 0);
+    munit_assert(!fpage_is_pinned(fpage_of(fm, mems[i])));
+    memset(mems[i], i, 24 + (i % 8) * 40);
+  }
+  void *aligned = fmem_alloc_aligned(fm, 100, 32);
+  munit_assert(aligned > 0 && ((uintptr_t) aligned & 63) == 0);
+  munit_assert(!fpage_is_pinned(fpage_of(fm, aligned)));
+  void *pinned = fmem_alloc_aligned(fm, 100, 256);
+  munit_assert(pinned > 0 && ((uintptr_t) pinned & 255) == 0);
+  munit_assert(fpage_is_pinned(fpage_of(fm, pinned)));
+  munit_assert(fmem_free(fm, pinned) > 0);
+  munit_assert(fmem_free(fm, aligned) > 0);
+
+  // keep the odd ones, compaction moves them down and they stay aligned
+  void *kept[16] = {0};
+  for(int i = 0; i < 32; i++){
+    if(i % 2 == 1) kept[i / 2] = mems[i]; else munit_assert(fmem_free(fm, mems[i]) > 0);
+  }
+  struct compact_test_table table = {kept, 16, 0};
+  int64_t moves = 0;
+  int64_t step = 0;
+  while((step = fmem_compact_step(fm, 1000, 0, compact_test_relocate, &table)) > 0) moves += step;
+  munit_assert(step == 0);
+  munit_assert(moves == 16 && table.calls == 16);
+  munit_assert(check_free_index(fm) == 1);
+  munit_assert(check_consistent(fm));
+  for(int i = 0; i < 16; i++){
+    int n = 2 * i + 1;
+    munit_assert(((uintptr_t) kept[i] & 63) == 0);
+    for(int b = 0; b < 24 + (n % 8) * 40; b++) munit_assert(((unsigned char *) kept[i])[b] == n);
+  }
+
+  // realloc keeps it too, and pages stay compactable
+  kept[0] = fmem_realloc(fm, kept[0], 10);
+  munit_assert(kept[0] > 0 && ((uintptr_t) kept[0] & 63) == 0);
+  kept[1] = fmem_realloc(fm, kept[1], 1000);
+  munit_assert(kept[1] > 0 && ((uintptr_t) kept[1] & 63) == 0);
+  while(fmem_compact_step(fm, 1000, 0, compact_test_relocate, &table) > 0);
+  munit_assert(check_free_index(fm) == 1);
+  for(int i = 0; i < 16; i++){
+    munit_assert(((uintptr_t) kept[i] & 63) == 0);
+    munit_assert(fmem_free(fm, kept[i]) > 0);
+  }
+  munit_assert(check_consistent(fm));
+  munit_assert(count_pages(fpage_from_mem(fm)) == 2);
+  return MUNIT_OK;
 }
-// a test committer
-static int test_committer(struct commit_range *ranges, uint8_t count){
-	if (count == 0){
-			printf("TEST FAIL: committer got 0 count!\n");
-			return -1;
-	}
 
-	if (committed_range_count+ count > MAX_COMMIT){
-		printf("TEST FAIL: COMMITTER has %d and want additional %d which put it higher than max:%d\n",
-						committed_range_count, count, MAX_COMMIT);
-		return -1;
-	}
-	memcpy(__test_ranges + committed_range_count, ranges, count * sizeof(struct commit_range));
-	committed_range_count += count;
-	return 0;
+static MunitResult test_fmem_compact_headers(const MunitParameter params[], void* data){
+  char buffer[large_buffer_size] = {0};
+  struct fmem_options opts = {0};
+  opts.flags = FMEM_F_COMPACT;
+  struct fmem *fm = fmem_create_new_opts(buffer, large_buffer_size, &opts);
+  munit_assert(fm > 0);
+  munit_assert(fm->min_alloc == COMPACT_MIN_BODY);
+  size_t available = fm->total_available;
+  munit_assert(available == large_buffer_size - (PAGE_OVERHEAD + sizeof(struct fmem) + COMPACT_OVERHEAD));
+  munit_assert(check_consistent(fm));
+
+  // a small alloc costs its body and 8 bytes
+  void *one = fmem_alloc(fm, 1);
+  munit_assert(one > 0);
+  munit_assert(available - fm->total_available == COMPACT_MIN_BODY + COMPACT_OVERHEAD);
+  munit_assert(fpage_of(fm, one)->size == COMPACT_MIN_BODY + COMPACT_OVERHEAD);
+
+  // mixed sizes, free every other one then the rest. merges are found via footers
+  void *mems[64] = {0};
+  for(int i = 0; i < 64; i++){
+    mems[i] = fmem_alloc(fm, 8 + (i % 8) * 40);
+    munit_assert(mems[i] > 0);
+    memset(mems[i], i, 8 + (i % 8) * 40);
+  }
+  munit_assert(check_consistent(fm));
+  for(int i = 0; i < 64; i += 2) munit_assert(fmem_free(fm, mems[i]) > 0);
+  munit_assert(check_consistent(fm));
+  for(int i = 1; i < 64; i += 2) munit_assert(((unsigned char *) mems[i])[7] == i);
+
+  // realloc grows into the free page after, shrinks and moves
+  void *grown = fmem_realloc(fm, mems[3], 100);
+  munit_assert(grown > 0);
+  munit_assert(((unsigned char *) grown)[7] == 3);
+  mems[3] = fmem_realloc(fm, grown, 10);
+  munit_assert(mems[3] > 0);
+  void *moved = fmem_realloc(fm, mems[5], 4000);
+  munit_assert(moved > 0 && moved != mems[5]);
+  mems[5] = moved;
+  munit_assert(check_consistent(fm));
+
+  // aligned allocs and handles
+  void *aligned = fmem_alloc_aligned(fm, 100, 256);
+  munit_assert(aligned > 0 && ((uintptr_t) aligned & 255) == 0);
+  munit_assert(fmem_htable_create(fm, 8) == 8);
+  int64_t handle = fmem_halloc(fm, 50);
+  munit_assert(handle > 0);
+  memset(fmem_deref(fm, handle), 0xA, 50);
+  munit_assert(check_consistent(fm));
+
+  // compaction moves pages down, handles follow
+  void *kept[33] = {0};
+  int kept_count = 0;
+  kept[kept_count++] = one;
+  for(int i = 1; i < 64; i += 2) kept[kept_count++] = mems[i];
+  struct compact_test_table table = {kept, kept_count, 0};
+  while(fmem_compact_step(fm, 1000, 0, compact_test_relocate, &table) > 0);
+  munit_assert(table.calls > 0);
+  munit_assert(check_consistent(fm));
+  for(int i = 1; i < 33; i++){
+    int was = 2 * i - 1;
+    if(was != 3 && was != 5) munit_assert(((unsigned char *) kept[i])[7] == was);
+  }
+  munit_assert(((unsigned char *) fmem_deref(fm, handle))[49] == 0xA);
+
+  // a messed up index is rebuilt from the pages
+  fm->free_map = 0;
+  munit_assert(false == findex_valid(fm));
+  munit_assert(fmem_from_existing(buffer, NULL) == fm);
+  munit_assert(check_consistent(fm));
+
+  // everything goes back into one page
+  munit_assert(fmem_hfree(fm, handle) > 0);
+  munit_assert(fmem_free(fm, aligned) > 0);
+  for(int i = 0; i < kept_count; i++) munit_assert(fmem_free(fm, kept[i]) > 0);
+  void *table_mem = rptr_get(&fm->handle_table);
+  munit_assert(fmem_free(fm, table_mem) > 0);
+  munit_assert(fm->total_available == available);
+  munit_assert(fmem_count_pages(fm) == 2);
+  return MUNIT_OK;
 }
 
-// compares to whatever committer saved
-static MunitResult test_committer_compare_to(struct commit_range *expected, uint8_t count, bool count_only){
-	if(committed_range_count != count){
-		munit_logf(MUNIT_LOG_INFO, "got:%d expected:%d",committed_range_count, count);
-		return MUNIT_FAIL;
-	}
+static MunitResult test_fmem_compact_headers_redo_log(const MunitParameter params[], void* data){
+  struct fmem *fm = flog_test_create_flags(0, FMEM_F_COMPACT);
+  munit_assert(fm > 0);
 
-	if (count_only) return MUNIT_OK;
+  void *mems[32] = {0};
+  for(int i = 0; i < 32; i++){
+    mems[i] = fmem_alloc(fm, 16 + i * 8);
+    munit_assert(mems[i] > 0);
+  }
+  for(int i = 0; i < 32; i += 3) munit_assert(fmem_free(fm, mems[i]) > 0);
+  void *grown = fmem_realloc(fm, mems[1], 300);
+  munit_assert(grown > 0);
+  memset(grown, 0xD, 300);
+  munit_assert(fmem_commit_mem(fm, grown, 300) == 300);
+  munit_assert(check_consistent(fm));
+  uint32_t alloc_objects = fm->alloc_objects;
+  size_t available = fm->total_available;
+
+  fm = flog_test_crash();
+  munit_assert(fm > 0);
+  munit_assert(check_consistent(fm));
+  munit_assert(fm->alloc_objects == alloc_objects);
+  munit_assert(fm->total_available == available);
+  for(int i = 0; i < 300; i++) munit_assert(((unsigned char *) grown)[i] == 0xD);
+  return MUNIT_OK;
+}
 
-	for(int pos = 0; pos < committed_range_count; pos++){
-			struct commit_range *expected_current = expected + pos;
-			struct commit_range *saved_current = &__test_ranges[pos];
+static int attach_test_calls = 0;
+static int attach_test_committer(struct commit_range *ranges, uint8_t count){
+  attach_test_calls++;
+  return 0;
+}
 
-			munit_logf(MUNIT_LOG_INFO, "at: %d", pos);
-			munit_assert(expected_current->start == saved_current->start);
+static MunitResult test_fmem_attach_no_committer(const MunitParameter params[], void* data){
+  size_t size = 1 << 20;
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  munit_assert(mem != MAP_FAILED);
+  struct fmem *fm = fmem_create_new(mem, size, 0, attach_test_committer);
+  munit_assert(fm > 0);
+  munit_assert(fmem_alloc(fm, 64) > 0);
+
+  // another process attaches without a committer, then with its own. the
+  // committer we passed on create stays ours
+  pid_t pid = fork();
+  munit_assert(pid >= 0);
+  if(pid == 0){
+    int ok = fmem_from_existing(mem, NULL) == fm && fmem_committer(fm) == NULL;
+    ok = ok && fmem_alloc(fm, 64) > 0;
+    ok = ok && fmem_from_existing(mem, flog_test_committer) == fm;
+    ok = ok && fmem_alloc(fm, 64) > 0;
+    _exit(ok ? 0 : 1);
+  }
+  int status = 0;
+  munit_assert(waitpid(pid, &status, 0) == pid);
+  munit_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  munit_assert(fmem_committer(fm) == attach_test_committer);
+  munit_assert(check_consistent(fm));
+
+  attach_test_calls = 0;
+  flog_test_calls = 0;
+  for(int i = 0; i < 10; i++) munit_assert(fmem_alloc(fm, 64) > 0);
+  munit_assert(attach_test_calls >= 10);
+  munit_assert(flog_test_calls == 0);
+
+  // memory that held an fmem before gets the committer given on create
+  memset(mem, 0xAB, size);
+  fm = fmem_create_new(mem, size, 0, NULL);
+  munit_assert(fm > 0);
+  munit_assert(fmem_committer(fm) == NULL);
+  attach_test_calls = 0;
+  munit_assert(fmem_alloc(fm, 64) > 0);
+  munit_assert(attach_test_calls == 0);
+  munit_assert(munmap(mem, size) == 0);
+  return MUNIT_OK;
+}
 
+static MunitResult test_fmem_clean_detach(const MunitParameter params[], void* data){
+  struct fmem *fm = flog_test_create(0);
+  munit_assert(fm > 0);
+  munit_assert(fm->clean == 0 && fm->generation == 0);
 
-			munit_logf(MUNIT_LOG_INFO, "expected len:%lu: got:%lu",saved_current->len,  expected_current->len );
-			munit_assert(expected_current->len == saved_current->len);
-	}
-	return MUNIT_OK;
+  void *mems[32] = {0};
+  for(int i = 0; i < 32; i++){
+    mems[i] = fmem_alloc(fm, 24 + i * 8);
+    munit_assert(mems[i] > 0);
+  }
+  for(int i = 0; i < 32; i += 3) munit_assert(fmem_free(fm, mems[i]) > 0);
+  uint32_t alloc_objects = fm->alloc_objects;
+  size_t available = fm->total_available;
+
+  // a clean detach empties the log and commits the marker
+  munit_assert(fmem_detach(fm) == 1);
+  munit_assert(fm->clean == FMEM_CLEAN && fm->log_records == 0);
+  fm = flog_test_crash();
+  munit_assert(fm > 0);
+  munit_assert(fmem_is_clean(fm));
+  munit_assert(fm->alloc_objects == alloc_objects && fm->total_available == available);
+  munit_assert(check_consistent(fm));
+
+  // a clean attach trusts what it finds, nothing is validated
+  munit_assert(fmem_detach(fm) == 2);
+  struct fmem *on_disk = (struct fmem *) (flog_test_disk + ((char *) fm - flog_test_live));
+  uint32_t free_map = on_disk->free_map;
+  on_disk->free_map = 0;
+  on_disk->header_crc = fmem_header_crc(on_disk);
+  fm = flog_test_crash();
+  munit_assert(fm > 0);
+  munit_assert(false == findex_valid(fm));
+  fm->free_map = free_map;
+
+  // the first op clears the marker (on disk too)
+  void *mem = fmem_alloc(fm, 100);
+  munit_assert(mem > 0);
+  munit_assert(fm->clean == 0);
+  munit_assert(fmem_free(fm, mem) > 0);
+  munit_assert(flog_test_crash() == fm);
+  munit_assert(fm->clean == 0);
+  munit_assert(check_consistent(fm));
+
+  // a marker that does not match what is on disk is not trusted, accounting
+  // is rebuilt from the pages
+  munit_assert(fmem_detach(fm) == 3);
+  on_disk->total_available -= 1000;
+  on_disk->alloc_objects += 1;
+  fm = flog_test_crash();
+  munit_assert(fm > 0);
+  munit_assert(!fmem_is_clean(fm));
+  munit_assert(fm->alloc_objects == alloc_objects && fm->total_available == available);
+  munit_assert(check_consistent(fm));
+  return MUNIT_OK;
 }
 
-// handy helper to make  apage
-static void make_fpage(struct fmem_page *fpage, uint32_t size){
-  // reset all
-  memset(fpage, 0, size);
-  fpage->size = size;
+static MunitResult test_fmem_epochs(const MunitParameter params[], void* data){
+  char buffer[large_buffer_size] = {0};
+  struct fmem *fm =  fmem_create_new(buffer, large_buffer_size, 0, NULL);
+  munit_assert(fm > 0);
+  void *mem = fmem_alloc(fm, 100);
+  munit_assert(mem > 0);
+
+  // no table, no deferred frees
+  munit_assert(fmem_free_deferred(fm, mem) == E_BAD_EPOCH);
+  munit_assert(fmem_reader_register(fm) == E_BAD_EPOCH);
+  munit_assert(fmem_reclaim(fm) == E_BAD_EPOCH);
+  munit_assert(fmem_epochs_create(fm, 4, 8) == 4);
+  munit_assert(fmem_epochs_create(fm, 4, 8) == E_BAD_EPOCH);
+  munit_assert(((uintptr_t) rptr_get(&fm->epochs)) % 64 == 0);
+  uint32_t alloc_objects = fm->alloc_objects;
+
+  int64_t reader = fmem_reader_register(fm);
+  int64_t late = fmem_reader_register(fm);
+  munit_assert(reader == 0 && late == 1);
+
+  // nobody reads, memory is freed right away
+  munit_assert(fmem_free_deferred(fm, mem) == 0);
+  munit_assert(fm->alloc_objects == alloc_objects - 1);
+
+  // a reader that started before holds memory in limbo (pinned)
+  mem = fmem_alloc(fm, 100);
+  munit_assert(mem > 0);
+  fmem_read_begin(fm, reader);
+  munit_assert(fmem_free_deferred(fm, mem) == 1);
+  munit_assert(fm->alloc_objects == alloc_objects);
+  munit_assert(fpage_is_pinned(fpage_of(fm, mem)));
+  munit_assert(fmem_reclaim(fm) == 0);
+
+  // a reader that started after does not
+  fmem_read_begin(fm, late);
+  fmem_read_end(fm, reader);
+  munit_assert(fmem_reclaim(fm) == 1);
+  munit_assert(fm->alloc_objects == alloc_objects - 1);
+  fmem_read_end(fm, late);
+
+  // limbo is full, and stays full while the reader is in
+  void *mems[9] = {0};
+  for(int i = 0; i < 9; i++){
+    mems[i] = fmem_alloc(fm, 64);
+    munit_assert(mems[i] > 0);
+  }
+  fmem_read_begin(fm, reader);
+  for(int i = 0; i < 8; i++) munit_assert(fmem_free_deferred(fm, mems[i]) == i + 1);
+  munit_assert(fmem_free_deferred(fm, mems[8]) == FMEM_E_NOMEM);
+
+  // a reader that died while reading holds nothing
+  pid_t child = fork();
+  if(child == 0) _exit(0);
+  munit_assert(child > 0);
+  munit_assert(waitpid(child, NULL, 0) == child);
+  fmem_reader_slot(fm, reader)->pid = (uint32_t) child;
+  munit_assert(fmem_free_deferred(fm, mems[8]) == 0);
+  munit_assert(fmem_reader_slot(fm, reader)->pid == 0);
+  munit_assert(fm->alloc_objects == alloc_objects - 1);
+
+  // slots are given back and taken again
+  munit_assert(fmem_reader_unregister(fm, 4) == E_BAD_EPOCH);
+  munit_assert(fmem_reader_unregister(fm, late) == 0);
+  munit_assert(fmem_reader_register(fm) == 0);
+  munit_assert(fmem_reader_register(fm) == 1);
+  munit_assert(fmem_reader_register(fm) == 2);
+  munit_assert(check_consistent(fm));
+  return MUNIT_OK;
+}
+
+// readers check that the object at the root does not change, a writer replaces it
+struct epoch_test_obj{
+  uint64_t value;
+  uint64_t check; // ~value
+};
+
+struct epoch_test_shared{
+  struct fmem *fm;
+  rptr_t root;
+  volatile int done;
+  int failures;
+};
 
-  list_head_init(&fpage->list);
+static void* epoch_test_read(void *arg){
+  struct epoch_test_shared *shared = (struct epoch_test_shared *) arg;
+  int64_t reader = fmem_reader_register(shared->fm);
+  if(reader < 0){
+    __atomic_fetch_add(&shared->failures, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  while(!shared->done){
+    fmem_read_begin(shared->fm, reader);
+    // objects are never written once published, one that changes was reused
+    struct epoch_test_obj *obj = (struct epoch_test_obj *) rptr_get(&shared->root);
+    uint64_t value = __atomic_load_n(&obj->value, __ATOMIC_RELAXED);
+    for(int i = 0; i < 256; i++){
+      if(__atomic_load_n(&obj->value, __ATOMIC_RELAXED) != value || __atomic_load_n(&obj->check, __ATOMIC_RELAXED) != ~value){
+        __atomic_fetch_add(&shared->failures, 1, __ATOMIC_RELAXED);
+        break;
+      }
+    }
+    fmem_read_end(shared->fm, reader);
+  }
+  fmem_reader_unregister(shared->fm, reader);
+  return NULL;
 }
 
-// helper counter
-static int count_pages(struct fmem_page *fpage){
-  struct list_head *head = &fpage->list;
-  struct list_head *current = head;
-  int count = 0;
+static MunitResult test_fmem_epochs_threads(const MunitParameter params[], void* data){
+  char *buffer = calloc(1, large_buffer_size);
+  struct fmem *fm =  fmem_create_new(buffer, large_buffer_size, 0, NULL);
+  munit_assert(fm > 0);
+  munit_assert(fmem_epochs_create(fm, 4, 64) == 4);
+
+  struct epoch_test_shared shared = {.fm = fm};
+  struct epoch_test_obj *obj = fmem_alloc(fm, sizeof(struct epoch_test_obj));
+  obj->value = 0;
+  obj->check = ~obj->value;
+  rptr_set(&shared.root, obj);
+
+  pthread_t threads[3];
+  for(int i = 0; i < 3; i++) munit_assert(pthread_create(&threads[i], NULL, epoch_test_read, &shared) == 0);
+  for(uint64_t round = 1; round <= 20000; round++){
+    struct epoch_test_obj *next = fmem_alloc(fm, sizeof(struct epoch_test_obj));
+    if((int64_t) next <= 0){
+      munit_assert(fmem_reclaim(fm) >= 0);
+      continue;
+    }
+    next->value = round;
+    next->check = ~round;
+    // root moves (atomically, rptr is relative to the slot) then old goes to limbo
+    struct epoch_test_obj *old = (struct epoch_test_obj *) rptr_get(&shared.root);
+    __atomic_store_n(&shared.root, (char *) next - (char *) &shared.root, __ATOMIC_SEQ_CST);
+    while(fmem_free_deferred(fm, old) == FMEM_E_NOMEM) sched_yield();
+  }
+  shared.done = 1;
+  for(int i = 0; i < 3; i++) munit_assert(pthread_join(threads[i], NULL) == 0);
+  munit_assert(shared.failures == 0);
+
+  munit_assert(fmem_reclaim(fm) >= 0);
+  munit_assert(fm->alloc_objects == 2); // epoch table and the root
+  munit_assert(check_consistent(fm));
+  free(buffer);
+  return MUNIT_OK;
+}
 
-  list_for_each(current, head){
-    count++;
+static MunitResult test_fmem_stats(const MunitParameter params[], void* data){
+  char buffer[large_buffer_size] = {0};
+  struct fmem_options opts = {0};
+  opts.flags = FMEM_F_STATS;
+  opts.committer = test_committer;
+  reset_test_committer();
+  struct fmem *fm = fmem_create_new_opts(buffer, large_buffer_size, &opts);
+  munit_assert(fm > 0);
+
+  struct fmem_stats stats;
+  fmem_stats(fm, &stats);
+  munit_assert(stats.free_pages == 1);
+  munit_assert(stats.largest_free == stats.free_bytes);
+  munit_assert(stats.fragmentation == 0);
+  munit_assert(stats.counters.allocs == 0);
+
+  void *mems[32] = {0};
+  for(int i = 0; i < 32; i++){
+    reset_test_committer();
+    mems[i] = fmem_alloc(fm, 100);
+    munit_assert(mems[i] > 0);
   }
-  // because our iterators does not like working with head
-  return count+1;
+  munit_assert(fmem_alloc(fm, large_buffer_size) == (void *) FMEM_E_NOMEM);
+  for(int i = 0; i < 32; i += 2){
+    reset_test_committer();
+    munit_assert(fmem_free(fm, mems[i]) > 0);
+  }
+
+  fmem_stats(fm, &stats);
+  munit_assert(stats.alloc_objects == 16);
+  munit_assert(stats.total_available == fm->total_available);
+  munit_assert(stats.free_pages == 17);
+  munit_assert(stats.free_pages_by_class[fclass_of(100 + PAGE_OVERHEAD)] == 16);
+  munit_assert(stats.free_bytes == 16 * 100 + stats.largest_free);
+  munit_assert(stats.fragmentation > 0);
+  munit_assert(stats.counters.allocs == 32);
+  munit_assert(stats.counters.alloc_failures == 1);
+  munit_assert(stats.counters.frees == 16);
+  munit_assert(stats.counters.size_hist[fclass_of(100)] == 32);
+  munit_assert(stats.counters.lock_acquires >= 49);
+  munit_assert(stats.counters.commits == 32 + 16); // one per op
+  munit_assert(stats.counters.commit_ranges >= stats.counters.commits);
+  munit_assert(stats.counters.commit_bytes > 0);
+
+  // no counters unless asked for
+  struct fmem *plain = fmem_create_new(buffer, large_buffer_size, 0, NULL);
+  munit_assert(fmem_alloc(plain, 100) > 0);
+  fmem_stats(plain, &stats);
+  munit_assert(stats.alloc_objects == 1);
+  munit_assert(stats.counters.allocs == 0 && stats.counters.lock_acquires == 0);
+  return MUNIT_OK;
 }
 
 static MunitResult test_fmem_commit(const MunitParameter params[], void* data){
@@ -535,18 +5430,18 @@ static MunitResult test_fmem_commit(const MunitParameter params[], void* data){
 	struct fmem *fm = fmem_create_new(buffer, large_buffer_size, 0, test_committer);
 	// create compare
 	compare_ranges[0].start = (void *) buffer;
-	compare_ranges[0].len = PAGE_OVERHEAD + sizeof(struct fmem) + PAGE_OVERHEAD;
+	compare_ranges[0].len = PAGE_OVERHEAD + sizeof(struct fmem) + PAGE_OVERHEAD + findex_link_len(rlist_entry(rlist_next(&fpage_from_mem(fm)->list), struct fmem_page, list));
 	MunitResult compare_res = test_committer_compare_to(compare_ranges, 1, false);
 	if (compare_res != MUNIT_OK) return compare_res;
 
 	// CASE: commit user data with bad committer
 	reset_test_committer();
-	fm->committer = failed_test_committer;
+	fmem_set_committer(fm, failed_test_committer);
 	munit_assert(fmem_commit_user_data(fm) ==  E_COMMIT_FAILED);
 
 	// CASE: commit user data with good committer
 	reset_test_committer();
-	fm->committer = test_committer;
+	fmem_set_committer(fm, test_committer);
 	munit_assert(fmem_commit_user_data(fm) > 0 );
 	compare_ranges[0].start = &fm->user1;
 	compare_ranges[0].len = 4 * sizeof(fm->user1);
@@ -556,22 +5451,22 @@ static MunitResult test_fmem_commit(const MunitParameter params[], void* data){
 
 	// CASE: alloc with bad committer
 	reset_test_committer();
-	fm->committer = failed_test_committer;
+	fmem_set_committer(fm, failed_test_committer);
 	munit_assert(fmem_alloc(fm, 10) ==  (void *) E_COMMIT_FAILED);
 	// TODO: alloc with good committer (for both cases as-is or carving)
 
 
 	// CASE: commit user data with bad committer
 	reset_test_committer();
-	fm->committer = test_committer;
+	fmem_set_committer(fm, test_committer);
 	void * alloc1 = fmem_alloc(fm, 10);
 	munit_assert(alloc1 > 0);
-	fm->committer = failed_test_committer;
+	fmem_set_committer(fm, failed_test_committer);
 	munit_assert(fmem_commit_mem(fm, alloc1, 0) == E_COMMIT_FAILED);
 
 	// CASE: commit user data with good committer
 	reset_test_committer();
-	fm->committer = test_committer;
+	fmem_set_committer(fm, test_committer);
 	void * alloc2 = fmem_alloc(fm, 10); // this allocates min allocation
 	munit_assert(alloc2 > 0);
 	reset_test_committer();
@@ -585,24 +5480,25 @@ static MunitResult test_fmem_commit(const MunitParameter params[], void* data){
 
 	// CASE: free with bad committer
 	reset_test_committer();
-	fm->committer = test_committer;
+	fmem_set_committer(fm, test_committer);
 	void * alloc3 = fmem_alloc(fm, 10); // this allocates min allocation
 	munit_assert(alloc3 > 0);
 	reset_test_committer();
-	fm->committer = failed_test_committer;
+	fmem_set_committer(fm, failed_test_committer);
 	munit_assert(fmem_free(fm, alloc3) == E_COMMIT_FAILED);
 
 
 	// case: free with good committer
 	reset_test_committer();
-	fm->committer = test_committer;
+	fmem_set_committer(fm, test_committer);
 	void * alloc4 = fmem_alloc(fm, 10); // this allocates min allocation
 	munit_assert(alloc4 > 0);
 	reset_test_committer();
 	munit_assert(fmem_free(fm, alloc3) > 0);
 
 	// it is hard to get the offsets without channging code with if def for testing, so we are testing against count only
-	compare_res = test_committer_compare_to(NULL, 3, true);
+	// (accounting and the free list head it touched are not adjacent)
+	compare_res = test_committer_compare_to(NULL, 4, true);
 	if (compare_res != MUNIT_OK) return compare_res;
 
 
@@ -628,7 +5524,7 @@ static MunitResult test_fmem_poison(const MunitParameter params[], void* data){
     original_fm = fmem_create_new(buffer, large_buffer_size, 0, NULL);
     head_page = fpage_from_mem(original_fm);
     // we know that there is two pages, lets mess up the second on
-    struct fmem_page *main_page = list_entry(head_page->list.next, struct fmem_page, list);
+    struct fmem_page *main_page = rlist_entry(rlist_next(&head_page->list), struct fmem_page, list);
     fpage_set_magic(main_page, 0);
 
     void *mem = fmem_alloc(original_fm, large_buffer_size /2);
@@ -698,8 +5594,8 @@ static MunitResult test_fmem_alloc_free_simple(const MunitParameter params[], vo
     // so we only need to test:
     // accounting object size has changed as expected
     // third page is set as busy
-    struct list_head *second = head_page->list.next;
-    struct fmem_page *third_page = list_entry(second->next, struct fmem_page, list);
+    struct rlist_head *second = rlist_next(&head_page->list);
+    struct fmem_page *third_page = rlist_entry(rlist_next(second), struct fmem_page, list);
     munit_assert(false == fpage_is_free(third_page));
     munit_assert(fm->total_available == (original_available - third_page->size));
 
@@ -722,7 +5618,7 @@ static MunitResult test_fmem_creation(const MunitParameter params[], void* data)
     struct fmem *fm =  fmem_create_new(buffer, large_buffer_size, 10, NULL);
     munit_assert(fm != NULL);
 
-		munit_assert(fm->committer == NULL); // committer is not set
+		munit_assert(fmem_committer(fm) == NULL); // committer is not set
 
     // this also checks the correct stashing of our accounting object
     struct fmem_page *head_page = fpage_from_mem(fm);
@@ -734,7 +5630,7 @@ static MunitResult test_fmem_creation(const MunitParameter params[], void* data)
     munit_assert(count_pages(head_page) == 2);
     munit_assert( (char *) head_page == (char *) buffer);
 
-    struct fmem_page *main_page = list_entry(head_page->list.next, struct fmem_page, list);
+    struct fmem_page *main_page = rlist_entry(rlist_next(&head_page->list), struct fmem_page, list);
     munit_assert(POISON ==  fpage_get_magic(main_page));
     munit_assert(true == fpage_is_free(main_page));
 
@@ -753,7 +5649,7 @@ static MunitResult test_fmem_creation(const MunitParameter params[], void* data)
     // check that create frome existing work as expected
     struct fmem *fm_other = fmem_from_existing(buffer, NULL);
     munit_assert(fm_other == fm);
-		munit_assert(fm_other->committer == NULL); // committer is not set
+		munit_assert(fmem_committer(fm_other) == NULL); // committer is not set
 
     // test that large min allocs are respected
     struct fmem *fm_large_alloc =  fmem_create_new(buffer, large_buffer_size, 5 * sizeof(struct fmem_page), NULL);
@@ -763,11 +5659,11 @@ static MunitResult test_fmem_creation(const MunitParameter params[], void* data)
 		// test setting the committer
 
 		struct fmem *fm_with_committer =  fmem_create_new(buffer, large_buffer_size, 10, test_committer);
-		munit_assert(fm_with_committer->committer == test_committer);
+		munit_assert(fmem_committer(fm_with_committer) == test_committer);
 		// clear it
-		fm_with_committer->committer = NULL;
+		fmem_set_committer(fm_with_committer, NULL);
 		struct fmem *fm_other_with_comitter = fmem_from_existing(buffer, test_committer);
-		munit_assert(fm_other_with_comitter->committer == test_committer);
+		munit_assert(fmem_committer(fm_other_with_comitter) == test_committer);
 
 
     return MUNIT_OK;
@@ -835,22 +5731,23 @@ static MunitResult test_fpage_merge_all(const MunitParameter params[], void* dat
   struct fmem_page fpage_C = {.size = 10 * sizeof(struct fmem_page)};
   struct fmem_page fpage_D = {.size = 10 * sizeof(struct fmem_page)};
 
-  list_head_init(&fpage_A.list);
-  list_add_after(&fpage_A.list, &fpage_B.list);
-  list_add_after(&fpage_B.list, &fpage_C.list);
-  list_add_after(&fpage_C.list, &fpage_D.list);
+  struct fmem fm = {0}; // full headers, pages are linked
+  rlist_head_init(&fpage_A.list);
+  rlist_add_after(&fpage_A.list, &fpage_B.list);
+  rlist_add_after(&fpage_B.list, &fpage_C.list);
+  rlist_add_after(&fpage_C.list, &fpage_D.list);
   // mark first page as busy
   fpage_set_busy(&fpage_A);
   //merge them
   uint32_t expected_total_size_after = fpage_B.size + fpage_C.size +fpage_D.size;
-  fpage_merge(&fpage_C); // should merge prev, current, next
+  fpage_merge(&fm, &fpage_C); // should merge prev, current, next
   int count = count_pages(&fpage_A);
   munit_logf(MUNIT_LOG_INFO, " count:%d", count);
 
   munit_assert(count == 2); // 4 we lost 2
   munit_assert(fpage_B.size = expected_total_size_after); // size adjust correctly?
 
-  struct fmem_page *current_b =list_entry (fpage_A.list.next, struct fmem_page, list);
+  struct fmem_page *current_b =rlist_entry(rlist_next(&fpage_A.list), struct fmem_page, list);
   munit_assert(current_b ==  &fpage_B); // B shouldn't change
 
   return MUNIT_OK;
@@ -864,23 +5761,24 @@ static MunitResult test_fpage_merge_left(const MunitParameter params[], void* da
   struct fmem_page fpage_C = {.size = 10 * sizeof(struct fmem_page)};
   struct fmem_page fpage_D = {.size = 10 * sizeof(struct fmem_page)};
 
-  list_head_init(&fpage_A.list);
-  list_add_after(&fpage_A.list, &fpage_B.list);
-  list_add_after(&fpage_B.list, &fpage_C.list);
-  list_add_after(&fpage_C.list, &fpage_D.list);
+  struct fmem fm = {0}; // full headers, pages are linked
+  rlist_head_init(&fpage_A.list);
+  rlist_add_after(&fpage_A.list, &fpage_B.list);
+  rlist_add_after(&fpage_B.list, &fpage_C.list);
+  rlist_add_after(&fpage_C.list, &fpage_D.list);
   // mark first page as busy
   fpage_set_busy(&fpage_A);
   fpage_set_busy(&fpage_D); // marks last one busy
   //merge them
   uint32_t expected_total_size_after = fpage_B.size + fpage_C.size;
-  fpage_merge(&fpage_C); // should merge prev, current, next
+  fpage_merge(&fm, &fpage_C); // should merge prev, current, next
   int count = count_pages(&fpage_A);
   munit_logf(MUNIT_LOG_INFO, " count:%d", count);
 
   munit_assert(count == 3); // 4 we lost 1
   munit_assert(fpage_B.size = expected_total_size_after); // size adjust correctly?
 
-  struct fmem_page *current_b =list_entry (fpage_A.list.next, struct fmem_page, list);
+  struct fmem_page *current_b =rlist_entry(rlist_next(&fpage_A.list), struct fmem_page, list);
   munit_assert(current_b ==  &fpage_B); // B shouldn't change
 
   return MUNIT_OK;
@@ -893,23 +5791,24 @@ static MunitResult test_fpage_merge_right(const MunitParameter params[], void* d
   struct fmem_page fpage_C = {.size = 10 * sizeof(struct fmem_page)};
   struct fmem_page fpage_D = {.size = 10 * sizeof(struct fmem_page)};
 
-  list_head_init(&fpage_A.list);
-  list_add_after(&fpage_A.list, &fpage_B.list);
-  list_add_after(&fpage_B.list, &fpage_C.list);
-  list_add_after(&fpage_C.list, &fpage_D.list);
+  struct fmem fm = {0}; // full headers, pages are linked
+  rlist_head_init(&fpage_A.list);
+  rlist_add_after(&fpage_A.list, &fpage_B.list);
+  rlist_add_after(&fpage_B.list, &fpage_C.list);
+  rlist_add_after(&fpage_C.list, &fpage_D.list);
   // mark first page as busy
   fpage_set_busy(&fpage_A);
   fpage_set_busy(&fpage_B); // marks second one as busy, forces merge C+D
   //merge them
   uint32_t expected_total_size_after = fpage_C.size + fpage_D.size;
-  fpage_merge(&fpage_C); // should merge prev, current, next
+  fpage_merge(&fm, &fpage_C); // should merge prev, current, next
   int count = count_pages(&fpage_A);
   munit_logf(MUNIT_LOG_INFO, " count:%d", count);
 
   munit_assert(count == 3); // 4 we lost 1
   munit_assert(fpage_B.size = expected_total_size_after); // size adjust correctly?
 
-  struct fmem_page *current_b =list_entry (fpage_A.list.next, struct fmem_page, list);
+  struct fmem_page *current_b =rlist_entry(rlist_next(&fpage_A.list), struct fmem_page, list);
   munit_assert(current_b ==  &fpage_B); // B shouldn't change
 
   return MUNIT_OK;
@@ -922,23 +5821,24 @@ static MunitResult test_fpage_merge_none(const MunitParameter params[], void* da
   struct fmem_page fpage_C = {.size = 10 * sizeof(struct fmem_page)};
   struct fmem_page fpage_D = {.size = 10 * sizeof(struct fmem_page)};
 
-  list_head_init(&fpage_A.list);
-  list_add_after(&fpage_A.list, &fpage_B.list);
-  list_add_after(&fpage_B.list, &fpage_C.list);
-  list_add_after(&fpage_C.list, &fpage_D.list);
+  struct fmem fm = {0}; // full headers, pages are linked
+  rlist_head_init(&fpage_A.list);
+  rlist_add_after(&fpage_A.list, &fpage_B.list);
+  rlist_add_after(&fpage_B.list, &fpage_C.list);
+  rlist_add_after(&fpage_C.list, &fpage_D.list);
   fpage_set_busy(&fpage_A);
   fpage_set_busy(&fpage_B);
   fpage_set_busy(&fpage_D);
   //merge them
   uint32_t expected_total_size_after = fpage_C.size;
-  fpage_merge(&fpage_C); // should merge prev, current, next
+  fpage_merge(&fm, &fpage_C); // should merge prev, current, next
   int count = count_pages(&fpage_A);
   munit_logf(MUNIT_LOG_INFO, " count:%d", count);
 
   munit_assert(count == 4); // no merge should happen
   munit_assert(fpage_B.size = expected_total_size_after); // size adjust correctly?
 
-  struct fmem_page *current_b =list_entry (fpage_A.list.next, struct fmem_page, list);
+  struct fmem_page *current_b =rlist_entry(rlist_next(&fpage_A.list), struct fmem_page, list);
   munit_assert(current_b ==  &fpage_B); // B shouldn't change
 
   return MUNIT_OK;
@@ -981,6 +5881,7 @@ static MunitResult test_fpage_carving(const MunitParameter params[], void* data)
 
   int case_count = 3;
   char buffer[50 * 1024] = {0};
+  struct fmem fm = {0}; // full headers
   // munit while slim does not have the idea of dictionary of tests
   // the below is hack, ugly but works
   for(int i = 0; i < case_count; i++){
@@ -991,11 +5892,11 @@ static MunitResult test_fpage_carving(const MunitParameter params[], void* data)
     munit_logf(MUNIT_LOG_INFO, "working on:[%s]", cases[i].name);
 
     //carve
-    fpage_carve(fpage, &created, cases[i].carve);
+    fpage_carve(&fm, fpage, &created, cases[i].carve);
 
     // check
     munit_assert(created != NULL); // did we create the page?
-    munit_assert(fpage->list.next == &(created->list)); // did we add it right after
+    munit_assert(rlist_next(&fpage->list) == &(created->list)); // did we add it right after
 
     munit_assert(fpage->size == cases[i].size_after); // did we adjust the size after?
     munit_assert(created->size == cases[i].carved_size); // did we create the new one using the correct size?
@@ -1088,6 +5989,441 @@ static MunitResult test_fmem_get_size(const MunitParameter params[], void* data)
 }
 
 // all tests
+#define huge_test_size 1024 * 1024
+#define huge_test_zone 256 * 1024
+
+static MunitResult test_fmem_huge(const MunitParameter params[], void* data){
+  // shared so freed extents are punched out (and read back zero)
+  char *mem = mmap(NULL, huge_test_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  munit_assert(mem != MAP_FAILED);
+  struct fmem_options opts = {0};
+  opts.huge_size = huge_test_size;
+  munit_assert(fmem_create_new_opts(mem, huge_test_size, &opts) == (void *) E_BAD_INIT_MEM);
+  opts.huge_size = huge_test_zone;
+  opts.huge_extents = 4;
+  opts.huge_threshold = 64 * 1024;
+  struct fmem *fm = fmem_create_new_opts(mem, huge_test_size, &opts);
+  munit_assert(fm > 0);
+  munit_assert(fm->huge_size == huge_test_zone && fm->huge_available == huge_test_zone);
+  munit_assert(fmem_length(fm) == huge_test_size);
+  munit_assert(fm->total_size == huge_test_size - huge_test_zone);
+  munit_assert(check_consistent(fm));
+
+  // os page aligned, split from the front
+  char *a = fmem_alloc_huge(fm, 1);
+  munit_assert((int64_t) a > 0 && fmem_is_huge(fm, a));
+  munit_assert(((uintptr_t) a & (os_page_size() - 1)) == 0);
+  munit_assert(fm->huge_available == huge_test_zone - os_page_size());
+  memset(a, 0xAB, os_page_size());
+  // fmem_alloc(..) over the threshold goes huge, under does not
+  char *b = fmem_alloc(fm, 64 * 1024);
+  munit_assert(b == a + os_page_size());
+  void *small = fmem_alloc(fm, 100);
+  munit_assert((int64_t) small > 0 && !fmem_is_huge(fm, small));
+  char *c = fmem_alloc_huge(fm, 2 * os_page_size());
+  munit_assert(c == b + 64 * 1024);
+  munit_assert(fm->huge_count == 4);
+  munit_assert(fmem_commit_mem(fm, c, 100) == E_COMMIT_FAILED); // no committer
+
+  // table is full, the last one takes the rest
+  char *d = fmem_alloc_huge(fm, 1);
+  munit_assert(d == c + 2 * os_page_size());
+  munit_assert(fm->huge_count == 4 && fm->huge_available == 0);
+  munit_assert(fmem_alloc_huge(fm, 1) == (void *) FMEM_E_NOMEM);
+  munit_assert(fmem_alloc_huge(fm, huge_test_size) == (void *) FMEM_E_NOMEM);
+  munit_assert(check_consistent(fm));
+
+  // frees merge with free neighbours, memory is given back
+  munit_assert(fmem_free(fm, b) == 64 * 1024);
+  munit_assert(fmem_free(fm, b) == E_BAD_EXTENT);
+  munit_assert(fmem_free(fm, a + 1) == E_BAD_EXTENT);
+  munit_assert(fmem_free(fm, a) == os_page_size());
+  munit_assert(fm->huge_count == 3);
+  munit_assert(a[0] == 0 && a[os_page_size() - 1] == 0);
+  munit_assert(fmem_free(fm, d) > 0);
+  munit_assert(fm->huge_count == 3); // c is between
+  munit_assert(fmem_free(fm, c) == 2 * os_page_size());
+  munit_assert(fm->huge_count == 1 && fm->huge_available == huge_test_zone);
+  munit_assert(check_consistent(fm));
+
+  // best fit, the smallest hole that fits
+  a = fmem_alloc_huge(fm, os_page_size());
+  b = fmem_alloc_huge(fm, 2 * os_page_size());
+  c = fmem_alloc_huge(fm, os_page_size());
+  munit_assert(fmem_free(fm, a) > 0);
+  munit_assert(fmem_alloc_huge(fm, os_page_size()) == a);
+  munit_assert(fmem_free(fm, small) > 0);
+  munit_assert(check_consistent(fm));
+  munit_assert(munmap(mem, huge_test_size) == 0);
+  return MUNIT_OK;
+}
+
+static MunitResult test_fmem_huge_realloc(const MunitParameter params[], void* data){
+  char *mem = mmap(NULL, huge_test_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  munit_assert(mem != MAP_FAILED);
+  struct fmem_options opts = {0};
+  opts.huge_size = huge_test_zone;
+  opts.huge_extents = 4;
+  opts.huge_threshold = 64 * 1024;
+  struct fmem *fm = fmem_create_new_opts(mem, huge_test_size, &opts);
+  munit_assert(fm > 0);
+
+  // grows into the free extent after it, pages keep working
+  char *a = fmem_alloc_huge(fm, 64 * 1024);
+  munit_assert((int64_t) a > 0);
+  memset(a, 0x5A, 64 * 1024);
+  munit_assert(fmem_realloc(fm, a, 128 * 1024) == a);
+  munit_assert(fm->huge_available == huge_test_zone - 128 * 1024);
+  munit_assert(a[0] == 0x5A && a[64 * 1024 - 1] == 0x5A);
+  void *small = fmem_alloc(fm, 100);
+  munit_assert((int64_t) small > 0 && !fmem_is_huge(fm, small));
+  munit_assert(check_consistent(fm));
+
+  // shrinks in place, the tail is free again
+  munit_assert(fmem_realloc(fm, a, 32 * 1024) == a);
+  munit_assert(fm->huge_available == huge_test_zone - 32 * 1024);
+  munit_assert(fm->huge_count == 2);
+  munit_assert(a[0] == 0x5A && a[32 * 1024 - 1] == 0x5A);
+  munit_assert(check_consistent(fm));
+
+  // no room after it, moved and copied
+  char *b = fmem_alloc_huge(fm, os_page_size());
+  munit_assert(b == a + 32 * 1024);
+  char *moved = fmem_realloc(fm, a, 96 * 1024);
+  munit_assert((int64_t) moved > 0 && moved != a && fmem_is_huge(fm, moved));
+  munit_assert(moved[0] == 0x5A && moved[32 * 1024 - 1] == 0x5A);
+  munit_assert(fmem_free(fm, a) == E_BAD_EXTENT);
+  munit_assert(check_consistent(fm));
+
+  // under the threshold it goes to the page list
+  memset(b, 0x3C, os_page_size());
+  char *paged = fmem_realloc(fm, b, 2 * os_page_size());
+  munit_assert((int64_t) paged > 0 && !fmem_is_huge(fm, paged));
+  munit_assert(paged[0] == 0x3C && paged[os_page_size() - 1] == 0x3C);
+
+  // nothing big enough, memory is untouched
+  munit_assert(fmem_realloc(fm, moved, huge_test_size) == (void *) FMEM_E_NOMEM);
+  munit_assert(moved[0] == 0x5A);
+  munit_assert(fmem_free(fm, moved) == 96 * 1024);
+  munit_assert(fm->huge_count == 1 && fm->huge_available == huge_test_zone);
+  munit_assert(fmem_free(fm, paged) > 0);
+  munit_assert(fmem_free(fm, small) > 0);
+  munit_assert(check_consistent(fm));
+  munit_assert(munmap(mem, huge_test_size) == 0);
+  return MUNIT_OK;
+}
+
+static MunitResult test_fmem_huge_64bit(const MunitParameter params[], void* data){
+  // nothing is backed until touched
+  size_t length = 10ULL * 1024 * 1024 * 1024;
+  char *mem = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(mem == MAP_FAILED) return MUNIT_SKIP;
+  struct fmem *fm = fmem_create_new(mem, length, 0, NULL);
+  munit_assert(fm > 0);
+  // memory past what pages can cover is the huge zone
+  munit_assert(fm->total_size <= FMEM_MAX_PAGE_LIST);
+  munit_assert(fmem_length(fm) <= length && fmem_length(fm) > length - os_page_size());
+  munit_assert(fm->huge_size > 5ULL * 1024 * 1024 * 1024);
+
+  size_t size = 5ULL * 1024 * 1024 * 1024;
+  char *huge = fmem_alloc_huge(fm, size);
+  munit_assert((int64_t) huge > 0);
+  huge[0] = 1;
+  huge[size - 1] = 1;
+  munit_assert(fmem_alloc(fm, 1024) > 0);
+  munit_assert(fmem_free(fm, huge) == (int64_t) size);
+  munit_assert(fm->huge_available == fm->huge_size);
+  munit_assert(munmap(mem, length) == 0);
+  return MUNIT_OK;
+}
+
+// # of os pages of [mem, mem + len) that are in memory
+static size_t trim_test_resident(char *mem, size_t len){
+  size_t pages = len / os_page_size();
+  unsigned char vec[pages];
+  munit_assert(mincore(mem, len, vec) == 0);
+  size_t resident = 0;
+  for(size_t i = 0; i < pages; i++) resident += vec[i] & 1;
+  return resident;
+}
+
+static void trim_test_run(uint32_t flags){
+  char *mem = mmap(NULL, huge_test_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  munit_assert(mem != MAP_FAILED);
+  struct fmem_options opts = {0};
+  opts.flags = flags;
+  struct fmem *fm = fmem_create_new_opts(mem, huge_test_size, &opts);
+  munit_assert(fm > 0);
+
+  // a spike, then it is gone
+  char *spike = fmem_alloc(fm, huge_test_size / 2);
+  munit_assert(spike > 0);
+  void *small = fmem_alloc(fm, 100);
+  munit_assert(small > 0);
+  memset(spike, 0xCD, huge_test_size / 2);
+  munit_assert(trim_test_resident(mem, huge_test_size) >= (huge_test_size / 2) / os_page_size());
+  munit_assert(fmem_free(fm, spike) > 0);
+
+  int64_t trimmed = fmem_trim(fm);
+  munit_assert(trimmed >= huge_test_size / 2 - 2 * os_page_size());
+  munit_assert(trimmed % os_page_size() == 0);
+  munit_assert(trim_test_resident(mem, huge_test_size) < (huge_test_size / 2) / os_page_size());
+  munit_assert(spike[huge_test_size / 4] == 0); // comes back zero
+  munit_assert(check_consistent(fm));
+
+  // trimmed memory allocates as any other
+  spike = fmem_alloc(fm, huge_test_size / 2);
+  munit_assert(spike > 0);
+  memset(spike, 0xCD, huge_test_size / 2);
+  munit_assert(fmem_free(fm, small) > 0);
+  munit_assert(check_consistent(fm));
+  munit_assert(fmem_free(fm, spike) > 0);
+  munit_assert(fmem_trim(fm) > 0);
+  munit_assert(check_consistent(fm));
+  munit_assert(fm->alloc_objects == 0);
+  munit_assert(munmap(mem, huge_test_size) == 0);
+}
+
+static MunitResult test_fmem_trim(const MunitParameter params[], void* data){
+  trim_test_run(0);
+  trim_test_run(FMEM_F_COMPACT);
+  return MUNIT_OK;
+}
+
+static MunitResult test_fmem_trimmer(const MunitParameter params[], void* data){
+  char *mem = mmap(NULL, huge_test_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  munit_assert(mem != MAP_FAILED);
+  struct fmem *fm = fmem_create_new(mem, huge_test_size, 0, NULL);
+  munit_assert(fm > 0);
+  struct fmem_trimmer trimmer;
+  munit_assert(fmem_trimmer_start(fm, &trimmer, 0) == E_BAD_TRIM);
+  munit_assert(fmem_trimmer_start(fm, &trimmer, 1) == 0);
+
+  // allocs and frees go on while the trimmer runs
+  for(int i = 0; i < 100; i++){
+    char *spike = fmem_alloc(fm, huge_test_size / 4);
+    munit_assert(spike > 0);
+    memset(spike, i, huge_test_size / 4);
+    munit_assert(fmem_free(fm, spike) > 0);
+  }
+  for(int i = 0; i < 1000 && __atomic_load_n(&trimmer.trimmed, __ATOMIC_RELAXED) == 0; i++) usleep(1000);
+  munit_assert(fmem_trimmer_stop(&trimmer) > 0);
+  munit_assert(check_consistent(fm));
+  munit_assert(munmap(mem, huge_test_size) == 0);
+  return MUNIT_OK;
+}
+
+#define check_test_size 4 * 1024 * 1024
+#define check_test_allocs 8192
+
+// fills fm with allocs of mixed sizes, every third is freed
+static void check_test_fill(struct fmem *fm, void **mems){
+  uint64_t state = 7;
+  for(int i = 0; i < check_test_allocs; i++){
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    uint32_t size = (i % 500 == 0) ? 4096 + (state >> 54) : 1 + (state >> 56);
+    mems[i] = fmem_alloc(fm, size);
+    munit_assert(mems[i] > 0);
+  }
+  for(int i = 0; i < check_test_allocs; i += 3) munit_assert(fmem_free(fm, mems[i]) > 0);
+}
+
+static int64_t check_test_run(char *mem, uint32_t threads, struct fmem_check_report *report){
+  munit_assert(mprotect(mem, check_test_size, PROT_READ) == 0); // memory is only read
+  int64_t errors = fmem_check(mem, check_test_size, threads, report);
+  munit_assert(mprotect(mem, check_test_size, PROT_READ | PROT_WRITE) == 0);
+  return errors;
+}
+
+static MunitResult test_fmem_check(const MunitParameter params[], void* data){
+  char *mem = mmap(NULL, check_test_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  munit_assert(mem != MAP_FAILED);
+  struct fmem_check_report report = {0};
+  munit_assert(fmem_check(mem, check_test_size, 4, &report) == E_BAD_INIT_MEM);
+
+  struct fmem_options opts = {0};
+  opts.huge_size = 1024 * 1024;
+  struct fmem *fm = fmem_create_new_opts(mem, check_test_size, &opts);
+  munit_assert(fm > 0);
+  void **mems = calloc(check_test_allocs, sizeof(void *));
+  check_test_fill(fm, mems);
+  void *huge = fmem_alloc_huge(fm, 100 * 1024);
+  munit_assert((int64_t) huge > 0);
+
+  // every page is poisoned in tests
+  uint8_t map[64] = {0};
+  report.flags = FMEM_CHECK_POISON;
+  report.cells = 64;
+  report.map = map;
+  munit_assert(check_test_run(mem, 4, &report) == 0);
+  munit_assert(report.threads == 4);
+  munit_assert(report.busy_pages == fm->alloc_objects);
+  munit_assert(report.pages == report.busy_pages + report.free_pages);
+  munit_assert(report.free_pages > check_test_allocs / 4);
+  munit_assert(report.huge_busy == 1 && report.huge_busy_bytes >= 100 * 1024);
+  munit_assert(map[0] > 0 && map[0] <= 100);
+  munit_assert(map[63] == 0); // the end of the huge zone is free
+
+  // ranges give what one walk gives
+  struct fmem_check_report single = {0};
+  munit_assert(check_test_run(mem, 1, &single) == 0);
+  munit_assert(single.threads == 1);
+  munit_assert(single.pages == report.pages && single.free_bytes == report.free_bytes && single.busy_bytes == report.busy_bytes);
+
+  // accounting
+  fm->alloc_objects++;
+  munit_assert(check_test_run(mem, 4, &report) > 0);
+  munit_assert(strcmp(report.first_error, "alloc_objects does not add up") == 0);
+  fm->alloc_objects--;
+
+  // links of a page in a later range
+  struct fmem_page *fpage = fpage_of(fm, mems[check_test_allocs - 2]);
+  struct rlist_head saved = fpage->list;
+  fpage->list.next += 8;
+  munit_assert(check_test_run(mem, 4, &report) > 0);
+  munit_assert(report.first_error_at == (uint64_t) ((char *) fpage - mem));
+  fpage->list = saved;
+
+  // a bad size
+  fpage = fpage_of(fm, mems[check_test_allocs / 2 + 1]);
+  fpage->size += 8;
+  munit_assert(check_test_run(mem, 4, &report) > 0);
+  fpage->size -= 8;
+
+  // poison
+  fpage_set_magic(fpage, 0);
+  munit_assert(check_test_run(mem, 4, &report) > 0);
+  munit_assert(strcmp(report.first_error, "bad poison") == 0);
+  fpage_set_magic(fpage, POISON);
+
+  // extents
+  fmem_extents(fm)[1].offset += os_page_size();
+  munit_assert(check_test_run(mem, 4, &report) > 0);
+  fmem_extents(fm)[1].offset -= os_page_size();
+  munit_assert(check_test_run(mem, 4, &report) == 0);
+
+  free(mems);
+  munit_assert(munmap(mem, check_test_size) == 0);
+  return MUNIT_OK;
+}
+
+static MunitResult test_fmem_check_compact(const MunitParameter params[], void* data){
+  char *mem = mmap(NULL, check_test_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  munit_assert(mem != MAP_FAILED);
+  struct fmem_options opts = {0};
+  opts.flags = FMEM_F_COMPACT;
+  struct fmem *fm = fmem_create_new_opts(mem, check_test_size, &opts);
+  munit_assert(fm > 0);
+  void **mems = calloc(check_test_allocs, sizeof(void *));
+  check_test_fill(fm, mems);
+
+  // no links, one walk
+  struct fmem_check_report report = {0};
+  munit_assert(check_test_run(mem, 4, &report) == 0);
+  munit_assert(report.threads == 1);
+  munit_assert(report.busy_pages == fm->alloc_objects);
+
+  // boundary tag of a free page
+  struct fmem_page *fpage = fpage_of(fm, mems[3]);
+  munit_assert(fpage_is_free(fpage));
+  char *footer = ((char *) fpage) + fpage->size - sizeof(uint32_t);
+  footer[0]++;
+  munit_assert(check_test_run(mem, 4, &report) > 0);
+  munit_assert(strcmp(report.first_error, "bad boundary tag") == 0);
+  footer[0]--;
+  munit_assert(check_test_run(mem, 4, &report) == 0);
+
+  free(mems);
+  munit_assert(munmap(mem, check_test_size) == 0);
+  return MUNIT_OK;
+}
+
+FMEM_DEFINE(fast_owned, FMEM_UNLOCKED, FMEM_VOLATILE, FMEM_UNPOISONED)
+FMEM_DEFINE(fast_shared, FMEM_LOCKED, FMEM_PERSISTED, FMEM_POISONED)
+
+static MunitResult test_fmem_fast(const MunitParameter params[], void* data){
+  char buffer[large_buffer_size] = {0};
+  struct fmem *fm = fmem_create_new(buffer, large_buffer_size, 0, NULL);
+  munit_assert(fm > 0);
+  struct fmem_cache cache;
+  fast_owned_init(&cache, fm);
+
+  // the owned variant never takes the lock, not even for refills, give backs
+  // and large allocs. we fake a held lock, if it does this test hangs
+  fm->lock = 1;
+  void *slots[64] = {0};
+  for(int i = 0; i < 4096; i++){
+    int slot = (i * 7) % 64;
+    if(slots[slot] == NULL){
+      slots[slot] = fast_owned_alloc(&cache, 1 + (i % (FMEM_CACHE_CLASSES * fm->min_alloc)));
+      munit_assert(slots[slot] > 0);
+      memset(slots[slot], i, 1);
+    }else{
+      munit_assert(fast_owned_free(&cache, slots[slot]) > 0);
+      slots[slot] = NULL;
+    }
+  }
+  void *large = fast_owned_alloc(&cache, 4 * FMEM_CACHE_CLASSES * fm->min_alloc);
+  munit_assert(large > 0);
+  munit_assert(fast_owned_commit(fm, large, 16) == 16); // volatile, nothing to commit
+  munit_assert(fast_owned_free(&cache, large) > 0);
+  for(int slot = 0; slot < 64; slot++){
+    if(slots[slot] != NULL) munit_assert(fast_owned_free(&cache, slots[slot]) > 0);
+  }
+  munit_assert(fast_owned_flush(&cache) > 0);
+  fm->lock = 0;
+  munit_assert(fm->alloc_objects == 0);
+  munit_assert(check_consistent(fm));
+
+  // handle memory is not cached, the table would still point to it
+  munit_assert(fmem_htable_create(fm, 4) > 0);
+  int64_t handle = fmem_halloc(fm, 10);
+  munit_assert(handle > 0);
+  void *held = fmem_deref(fm, handle);
+  munit_assert(fast_owned_free(&cache, held) == E_BAD_HANDLE);
+  munit_assert(fmem_cache_free(&cache, held) == E_BAD_HANDLE);
+  munit_assert(cache.counts[0] == 0 && cache.counts[1] == 0);
+  munit_assert(fmem_hfree(fm, handle) > 0);
+  munit_assert(fm->alloc_objects == 1); // the table
+  munit_assert(check_consistent(fm));
+  return MUNIT_OK;
+}
+
+static MunitResult test_fmem_fast_shared(const MunitParameter params[], void* data){
+  char buffer[large_buffer_size] = {0};
+  reset_test_committer();
+  struct fmem *fm = fmem_create_new(buffer, large_buffer_size, 0, test_committer);
+  munit_assert(fm > 0);
+  struct fmem_cache cache;
+  fast_shared_init(&cache, fm);
+
+  // first alloc refills, the rest are hits
+  void *mem = fast_shared_alloc(&cache, 10);
+  munit_assert(mem > 0);
+  munit_assert(fm->alloc_objects == FMEM_CACHE_BATCH);
+  fm->lock = 1;
+  void *hit = fast_shared_alloc(&cache, 10);
+  munit_assert(hit > 0 && hit != mem);
+  munit_assert(fast_shared_free(&cache, hit) > 0);
+  fm->lock = 0;
+
+  // persisted, commits go to the committer
+  reset_test_committer();
+  munit_assert(fast_shared_commit(fm, mem, 8) == 8);
+  munit_assert(committed_range_count == 1);
+
+  // poisoned, a bad page goes to fmem which finds it
+  struct fmem_page *fpage = fpage_of(fm, mem);
+  fpage_set_magic(fpage, 0);
+  munit_assert(fast_shared_free(&cache, mem) == EE_BAD_MEM);
+  fpage_set_magic(fpage, POISON);
+  munit_assert(fast_shared_free(&cache, mem) > 0);
+  munit_assert(fast_shared_flush(&cache) > 0);
+  munit_assert(fm->alloc_objects == 0);
+  munit_assert(check_consistent(fm));
+  return MUNIT_OK;
+}
+
 MunitTest fmem_tests[] = {
   /* tests struct: name(string),  test func, setup func, tear down func, opts, params*/
 	// TEST ORDER IS IMPORTANT.
@@ -1105,11 +6441,56 @@ MunitTest fmem_tests[] = {
   {"/fmem-creation", test_fmem_creation, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
   {"/fmem-simple-alloc-free", test_fmem_alloc_free_simple, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
   {"/fmem-simple-alloc-fails", test_fmem_alloc_fails, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+  {"/fmem-free-lists", test_fmem_free_lists, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+  {"/fmem-free-lists-rebuild", test_fmem_free_lists_rebuild, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-best-fit", test_fmem_best_fit, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-relocate", test_fmem_relocate, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+  {"/fmem-cache", test_fmem_cache, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+  // lock tests
+  {"/fmem-lock-recovery", test_fmem_lock_recovery, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+  {"/fmem-lock-broken", test_fmem_lock_broken, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+  {"/fmem-lock-attach", test_fmem_lock_attach, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+  {"/fmem-lock-multi-process", test_fmem_lock_multi_process, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
   // poison tests
   {"/fmem-all-free-poison", test_fmem_free_poison, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
   {"/fmem-reuse-poison", test_fmem_poison, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
 	// commit tests
 	{"/fmem-commit", test_fmem_commit, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-batch", test_fmem_batch, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-batch-huge", test_fmem_batch_huge, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-redo-log", test_fmem_redo_log, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-redo-log-torn", test_fmem_redo_log_torn, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-attach-no-committer", test_fmem_attach_no_committer, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-redo-log-takeover", test_fmem_redo_log_takeover, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-redo-log-checkpoint", test_fmem_redo_log_checkpoint, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-redo-log-fence", test_fmem_redo_log_fence, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-async", test_fmem_async, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-alloc-many", test_fmem_alloc_many, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-alloc-many-redo-log", test_fmem_alloc_many_redo_log, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-stats", test_fmem_stats, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-compact", test_fmem_compact, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-compact-redo-log", test_fmem_compact_redo_log, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-handles", test_fmem_handles, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-handles-redo-log", test_fmem_handles_redo_log, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-realloc", test_fmem_realloc, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-realloc-redo-log", test_fmem_realloc_redo_log, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-alloc-aligned", test_fmem_alloc_aligned, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-default-align", test_fmem_default_align, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-compact-default-align", test_fmem_compact_default_align, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-compact-headers", test_fmem_compact_headers, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-compact-headers-redo-log", test_fmem_compact_headers_redo_log, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-clean-detach", test_fmem_clean_detach, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-epochs", test_fmem_epochs, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-epochs-threads", test_fmem_epochs_threads, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-huge", test_fmem_huge, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-huge-realloc", test_fmem_huge_realloc, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-huge-64bit", test_fmem_huge_64bit, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-trim", test_fmem_trim, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-trimmer", test_fmem_trimmer, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-check", test_fmem_check, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-check-compact", test_fmem_check_compact, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-fast", test_fmem_fast, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/fmem-fast-shared", test_fmem_fast_shared, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
 
   // final entry must be null, as we don't pass in count
   { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
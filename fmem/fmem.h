@@ -2,6 +2,7 @@
 #define __FMEM__
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include "list/list.h"
 
 
@@ -24,7 +25,7 @@ struct fmem_page{
 	 */
 	uint32_t flags; // status and other things to come
 	uint32_t size; // that mean max alloc is 2^32 bits - page size
-	struct list_head list; // prev, next
+	struct rlist_head list; // prev, next (relative, memory can be mapped anywhere)
 };
 
 // a commit range desicrbes a range that needs to be written to the backing
@@ -34,16 +35,45 @@ struct commit_range{
 	size_t len;
 };
 
+// free pages are kept in segregated lists, one per power of two size class.
+// class n holds free pages where 2^n <= page size < 2^(n+1)
+#define FMEM_SIZE_CLASSES 32
+// large free pages (size >= 2^FMEM_SKIP_MIN_CLASS) are kept in a size ordered
+// skip list instead, allocs that need them are best fit
+#define FMEM_SKIP_MIN_CLASS 10
+#define FMEM_SKIP_LEVELS 16
+
 // committer is a function provided by owner of fmem. fmem will call it
 // when memory value needs to be presisted (such as in the case of adjusting
 // pages, or user triggered). fmem makes the following assumption:
-// 1- writes are presisted once the function retrurns.
+// 1- writes are presisted once the function retrurns (with async commits, see
+// 		fmem_async_start(..), the committer is called by a flusher thread and ops
+// 		don't wait for it).
 // 2- if the committer is implemented in a way to support async then
 // 		committer must copy commit ranges locally before returning.
 // 3- failure in commmits will leave fmem in a broken unoperable state
 // 4- any >= 0 return is considered success
 typedef int (*committer_t)(struct commit_range*, uint8_t count);
 
+// counters kept when fmem is created with FMEM_F_STATS. they live in fmem
+// memory, so they cover ops of every process attached. they are never committed
+struct fmem_counters{
+	uint64_t allocs;         // successful allocs
+	uint64_t alloc_failures; // allocs that failed for no memory
+	uint64_t frees;
+	uint64_t findex_scans;   // allocs that had to walk a free list
+	uint64_t findex_steps;   // pages looked at by these walks
+	uint64_t lock_acquires;
+	uint64_t lock_spins;     // backoff rounds spent waiting for the lock
+	uint64_t lock_waits;     // times a waiter yielded or slept
+	uint64_t commits;        // calls to committer (or async queue)
+	uint64_t commit_ranges;
+	uint64_t commit_bytes;
+	uint64_t compact_moves;  // pages moved by compaction
+	uint64_t compact_bytes;
+	uint64_t size_hist[FMEM_SIZE_CLASSES]; // allocs by size class of asked size
+};
+
 // fmmem is the root object for all fixed memory on which this allocator operate on. it has the lock,
 // the accounting data and a reference to our double linked list of pages. and is hidden
 // in the first page (aka head). Because our iterators skip head *and* we never allocate
@@ -56,22 +86,277 @@ struct fmem{
 	size_t total_available; // total available (note: includes overhead that will be used on alloc)
 	uint32_t alloc_objects; // pages in use
 	uint32_t min_alloc;     // minimum unit of allocation
+	uint32_t flags;         // FMEM_F_* options set on creation
+	uint32_t align;         // every alloc is aligned to this, 0 if not set
+	// free pages index. each free page is linked into the list of its size class
+	// via a link stashed in the page body (the body is unused while the page is free)
+	uint32_t free_map;      // bit n is set if free_lists[n] is not empty
+	// handle table (see fmem_halloc(..)), an array of handle_count entries. an entry
+	// is the offset of the memory from fmem, or FMEM_HANDLE_FREE | next free handle
+	rptr_t handle_table;
+	uint32_t handle_count;
+	uint32_t handle_free;   // first free handle, 0 if none
+	rptr_t epochs;          // epoch table (see fmem_epochs_create(..)), 0 if none
+	// huge zone (see fmem_alloc_huge(..)), os page aligned memory after the page
+	// list split in extents. the extent table follows the redo log in the head page
+	uint64_t huge_offset;    // start of huge zone from the head page, 0 if none
+	uint64_t huge_size;      // size of huge zone
+	uint64_t huge_available; // free bytes in huge zone
+	uint32_t huge_extents;   // # of entries extent table can hold
+	uint32_t huge_count;     // # of entries in use, they cover the zone in order
+	uint32_t huge_threshold; // fmem_alloc(..) of this size or more goes to huge zone, 0 never
+	uint32_t huge_unused;
+	// clean detach marker (see fmem_detach(..)). any op clears clean, it is
+	// committed with the accounting
+	uint64_t generation;    // # of clean detaches
+	uint32_t clean;         // FMEM_CLEAN if nothing changed since the last clean detach
+	uint32_t header_crc;    // crc of accounting, free index and log state at the last clean detach
+	uint64_t snapshot_epoch; // # of snapshots taken (see fsnap/), not part of header crc
+	// * free lists heads are committed by ops that change them
+	struct rlist_head free_lists[FMEM_SIZE_CLASSES];
+	rptr_t free_skip[FMEM_SKIP_LEVELS]; // skip list of large free pages, first node at each level
+
+	// * redo log, the log itself follows this struct in the head page.
+	// * log_size and log_seq are committed on checkpoint
+	uint32_t log_size;    // size of the log area, 0 if not used
+	uint32_t log_head;    // where the next record goes
+	uint32_t log_records; // # of records in the log
+	uint64_t log_seq;     // seq of the first record in the log
 
 	// * the following can be recommitted on demand using commit_user_data();
 	// this where user can stash a root pointer to thier own data
 	// we never touch these data. we went with 4 parts data assuming
 	// it should cover most usecases without have to get the caller
 	// to build thier own index of root pointers.
-	void *user1;
-	void *user2;
-	void *user3;
-	void *user4;
-
-	// * the following is never committed (except on creation)
-	// * and is set on create from existing
-	committer_t committer;  // commit funciton supplied by fmem owner
+	// roots are relative pointers (see rptr_t), use fmem_set_root(..)/fmem_get_root(..)
+	rptr_t user1;
+	rptr_t user2;
+	rptr_t user3;
+	rptr_t user4;
+
 	// * the following is never committed after ceration
-	uint32_t lock;          // spin lock
+	uint32_t lock;            // lock, holds the pid of the owner or 0 if free
+	uint32_t lock_waiters;    // # of waiters sleeping on the lock futex
+	uint32_t lock_recoveries; // # of times the lock was taken from a dead owner
+	uint32_t broken;          // set if recovery after a dead owner failed, ops fail with E_BROKEN_MEM
+
+	// * the following is never committed
+	struct fmem_counters counters; // only maintained with FMEM_F_STATS
+};
+
+// fmem_create_new_opts(..) options. zeroed options are the same as
+// fmem_create_new(on_mem, length, 0, NULL)
+struct fmem_options{
+	uint32_t min_alloc;    // minimum unit of allocation, see fmem_create_new(..)
+	uint32_t flags;        // FMEM_F_* flags
+	committer_t committer; // see fmem_create_new(..)
+	uint32_t log_size;     // size of redo log if FMEM_F_REDO_LOG is set, 0 means FMEM_DEFAULT_LOG_SIZE
+	uint32_t align;        // default alignment of all allocs (power of 2, up to os page size), 0 means none. pages are rounded up to it, compaction keeps it
+	uint64_t huge_size;    // bytes at the end of memory used for huge allocs, 0 means none (unless memory is larger than FMEM_MAX_PAGE_LIST)
+	uint32_t huge_extents; // size of extent table, 0 means FMEM_DEFAULT_EXTENTS
+	uint32_t huge_threshold; // fmem_alloc(..) of this size or more is a huge alloc, 0 means only fmem_alloc_huge(..)
+};
+
+// page sizes are 32 bit, the page list can not own more than that. memory
+// past it is used for huge allocs
+#define FMEM_MAX_PAGE_LIST ((size_t) UINT32_MAX & ~((size_t) 0xFFFF))
+#define FMEM_DEFAULT_EXTENTS 64
+#define FMEM_EXTENT_BUSY (1ULL << 63)
+#define FMEM_EXTENT_SAMPLED (1ULL << 62) // see fmem_set_sampler(..)
+
+// huge allocs are os page aligned extents of the huge zone, they don't carry
+// a page header. extents are kept in order in a table, free neighbours merge
+struct fmem_extent{
+	uint64_t offset; // from the head page
+	uint64_t size;   // FMEM_EXTENT_BUSY is set if the extent is in use, FMEM_EXTENT_SAMPLED if it is sampled
+};
+
+// the lock works across processes mapping the same memory. it spins with
+// exponential backoff, then waits (yield, or futex if FMEM_F_FUTEX_LOCK
+// is set). waiters check if the owner pid is alive, a lock held by a dead
+// process is taken over and accounting + free lists are rebuilt. if the
+// page list itself is broken every op returns E_BROKEN_MEM from then on,
+// fmem_from_existing(..) gets another try.
+// note: pids are only meaningful within the same pid namespace.
+#define FMEM_F_FUTEX_LOCK 0x1 // waiters sleep on a futex instead of yielding
+#define FMEM_LOCK_SPINS 64 // # of backoff rounds before waiting
+#define FMEM_LOCK_MAX_BACKOFF 1024 // max # of pauses in a backoff round
+#define FMEM_LOCK_WAIT_NS (1000 * 1000) // max time a waiter sleeps before checking on the owner
+
+// with a redo log every alloc/free appends one record (after images of all
+// page headers, links and accounting the op touched) to a log that lives in
+// the head page and commits only that record, one sequential write instead
+// of a commit per range. ranges themselves are committed when the log is
+// full (checkpoint). the log is replayed by fmem_from_existing(..), an op
+// is either entirely replayed or not at all.
+#define FMEM_F_REDO_LOG 0x2 // use a redo log for allocator data
+
+// low overhead counters on alloc, free, lock and commit paths. see fmem_stats(..)
+#define FMEM_F_STATS 0x4
+
+// compact page headers, 8 bytes (flags + size) instead of 24. pages are found
+// by their size and a free page keeps its size in its last 4 bytes (boundary
+// tag) so the page after it can find it when merging. saves 16 bytes for every
+// alloc, best for many small allocations. min_alloc can go down to 20 bytes.
+// the format is chosen at create time and is fixed for the life of fmem.
+#define FMEM_F_COMPACT 0x8
+
+#define FMEM_CLEAN 0x434C454E // "CLEN", see fmem_detach(..)
+#define FMEM_DEFAULT_LOG_SIZE (32 * 1024)
+
+// a cache is an optional per thread front end for small allocations. it holds
+// freed blocks for each of FMEM_CACHE_CLASSES small size classes (class n
+// holds blocks that fit (n+1) * min_alloc) and moves blocks from and to fmem
+// in batches of FMEM_CACHE_BATCH under one lock hold, so most small allocs
+// and frees never touch the shared lock.
+// -- a cache is owned by its caller and lives in process memory (e.g. a
+// 	 __thread variable). it must not be used by two threads at the same time.
+// -- cached blocks are busy as far as fmem is concerned, flush the cache
+// 	 before the thread (or process) exits or they will be lost.
+#define FMEM_CACHE_CLASSES 8
+#define FMEM_CACHE_BATCH 16
+struct fmem_cache{
+	struct fmem *fm;
+	void *blocks[FMEM_CACHE_CLASSES];    // cached blocks, linked via their body
+	uint32_t counts[FMEM_CACHE_CLASSES]; // # of blocks per class
+	uint32_t min_alloc;                  // of fm, kept here for inlined fast paths (fmem/fmem_fast.h)
+	uint32_t overhead;                   // page header size of fm
+};
+
+// a batch defers commits of many ops (alloc, free, commit_mem..) and hands
+// them to the committer in one call when the batch is committed. ranges are
+// rounded to os pages and overlapping/adjacent ranges are merged, a page that
+// was touched by many ops is committed once. storage for ranges is supplied
+// by the caller, a full batch is flushed early.
+// -- batches are per thread, ops of other threads are committed as usual.
+// -- nothing in the batch is persisted until fmem_batch_commit(..) returns
+struct fmem_batch{
+	struct fmem *fm;
+	struct commit_range *ranges; // caller supplied storage
+	uint32_t capacity;           // # of ranges storage can hold
+	uint32_t count;              // # of ranges pending
+	int64_t committed;           // total bytes handed to committer so far
+	bool failed;                 // set if any commit failed
+	struct fmem_batch *next;     // other batches open on the same thread
+};
+
+// async commits. once started, ranges are queued on a lock free ring and a
+// flusher thread hands them to the committer, ops don't wait for the disk.
+// every queued range gets a sequence #, fmem_commit_seq(..) returns the last
+// one and fmem_commit_wait(..) blocks until everything up to it is persisted.
+// -- async state lives in process memory, every process that wants async
+// 	 commits starts its own. storage for the ring is supplied by the caller.
+// -- committer is still called with ranges in the order they were queued.
+struct fmem_async_slot{
+	uint64_t seq;             // ring slot state (vyukov)
+	struct commit_range range;
+};
+
+struct fmem_async{
+	struct fmem *fm;
+	struct fmem_async_slot *slots; // caller supplied storage
+	uint64_t mask;                 // capacity - 1, capacity is a power of 2
+	uint64_t enqueue_pos;          // next slot producers claim
+	uint64_t dequeue_pos;          // next slot the flusher drains
+	uint64_t completed;            // ranges up to this seq are persisted
+	bool failed;                   // set if any commit failed
+	bool stop;
+	uint32_t idle;                 // set while the flusher sleeps
+	pthread_t flusher;
+	pthread_mutex_t mutex;
+	pthread_cond_t wake;           // flusher sleeps here
+	pthread_cond_t done;           // fmem_commit_wait(..) sleeps here
+	struct fmem_async *next;       // other fmem with async commits in this process
+};
+#define FMEM_ASYNC_WAIT_NS (1000 * 1000) // max time the flusher sleeps before looking at the ring
+
+// a point in time view of fmem, see fmem_stats(..). free space figures are
+// computed by walking the free lists (not the page list)
+struct fmem_stats{
+	size_t total_size;
+	size_t total_available;
+	uint32_t alloc_objects;
+	uint32_t free_pages;
+	size_t free_bytes;        // bytes usable by allocs, page overhead excluded
+	uint32_t largest_free;    // largest alloc that can succeed now
+	uint32_t fragmentation;   // per mille of free bytes outside the largest free page
+	uint32_t free_pages_by_class[FMEM_SIZE_CLASSES];
+	struct fmem_counters counters; // zeroed if fmem has no FMEM_F_STATS
+};
+
+// verification walks fmem memory without attaching or taking the lock, it
+// only reads (memory can be mapped read only, writers should be quiet). it
+// checks page sizes, links (next/prev, boundary tags of compact pages), poison,
+// that free pages are merged and all in the free index, that sizes add up to
+// the accounting and that huge extents cover the zone without overlap.
+// memory is split in address ranges walked by threads, a thread finds its
+// first page by its links. compact pages have no links, they are walked by one thread.
+#define FMEM_CHECK_POISON 0x1 // every page must be poisoned (fmem built with __BAD_MEM__)
+#define FMEM_CHECK_MIN_RANGE (64 * 1024) // smallest range a thread walks
+
+struct fmem_check_report{
+	// in
+	uint32_t flags;          // FMEM_CHECK_*
+	uint32_t cells;          // # of cells in map, 0 for no map
+	uint8_t *map;            // fragmentation map, % busy of every cell of fmem_length(..) bytes
+	// out
+	uint32_t threads;        // threads that walked
+	uint32_t errors;         // problems found
+	const char *first_error;
+	uint64_t first_error_at; // offset from the start of memory
+	uint64_t pages;          // but head
+	uint64_t busy_pages;
+	uint64_t busy_bytes;     // page overhead included
+	uint64_t free_pages;
+	uint64_t free_bytes;     // bytes usable by allocs
+	uint64_t largest_free;
+	uint64_t free_pages_by_class[FMEM_SIZE_CLASSES];
+	uint64_t huge_busy;      // busy extents
+	uint64_t huge_busy_bytes;
+};
+
+// called by fmem_compact_step(..) for every page it moves. memory at from is
+// no longer valid (the move may have overwritten it), the owner must update
+// every reference it has to from (or to anything inside it) to point to to.
+typedef void (*fmem_relocate_t)(void *from, void *to, uint32_t size, void *ctx);
+
+// handles are an optional way to refer to allocated memory. a handle is an
+// index into a table that lives in fmem memory, it stays the same when memory
+// is moved (compaction) and is valid in every process no matter where fmem is
+// mapped. handles are resolved with fmem_deref(..). 0 is never a valid handle
+typedef uint32_t fmem_handle_t;
+#define FMEM_HANDLE_FREE (1ULL << 63)
+
+// epoch based reclamation, for readers that walk fmem memory without locks
+// while writers change it. a reader announces the epoch it starts in, memory
+// freed with fmem_free_deferred(..) goes into limbo stamped with the current
+// epoch and is freed once every reader that could have seen it is done. the
+// epoch table (reader slots, limbo ring) lives in fmem memory, readers of all
+// processes share it.
+// -- a reader is a thread, it takes a slot once (fmem_reader_register(..))
+// -- slots of dead processes are taken back when memory is reclaimed
+// -- limbo memory is pinned, compaction does not move it
+#define FMEM_READER_IDLE 0
+struct fmem_reader{
+	uint32_t pid;   // owner, 0 if slot is free
+	uint32_t unused;
+	uint64_t epoch; // epoch the reader started in, FMEM_READER_IDLE if not reading
+	char pad[48];   // a cache line per reader
+};
+
+struct fmem_deferred{
+	uint64_t offset; // memory, from fmem
+	uint64_t epoch;  // epoch memory was put in limbo
+};
+
+struct fmem_epochs{
+	uint64_t epoch;      // current epoch, starts at 1
+	uint32_t readers;    // # of reader slots
+	uint32_t limbo_size; // # of entries limbo ring can hold
+	uint64_t limbo_head; // oldest entry in limbo, positions only move forward
+	uint64_t limbo_tail; // where the next entry goes
+	char pad[32];
+	struct fmem_reader slots[]; // limbo ring follows the slots
 };
 
 // we can not really operate on less than that
@@ -80,10 +365,21 @@ struct fmem{
 #define E_COMMIT_FAILED -2 // failed to commit memory to backing store
 #define DEFAULT_MIN_ALLOC  sizeof(struct fmem_page) // minimum allocation, we try to avoid too many small objects
 #define E_BAD_INIT_MEM -2 // mini alloc > total alloc
+#define E_BAD_BATCH -3 // batch is already open (or not open) or has no storage
+#define E_BAD_ASYNC -4 // async commits already started (or not started) or bad storage
+#define E_BAD_HANDLE -5 // no handle table (or already has one) or handle is not in use
+#define E_BAD_ALIGN -6 // alignment is not a power of 2 or is larger than os page size
+#define E_BAD_EPOCH -13 // no epoch table (or already has one), no free reader slot or bad reader
+#define E_BAD_EXTENT -15 // memory is not a busy huge extent
+#define E_BAD_TRIM -16 // trimmer could not start, bad interval
+#define E_BROKEN_MEM -20 // a lock holder died and left a page list that can't be recovered
 // the following are possible return values for all the below function
 // positive value (mem reference or mem size as applicable)
 #define FMEM_E_NOMEM -1 // no more mem to allcate
 
+// pages are poisoned with it (high 2 bytes of flags) when fmem is built with __BAD_MEM__
+#define FMEM_POISON 0xBEEF
+
 // unit testing only
 #if defined(__UNIT_TESTING__) && defined(__BAD_MEM__)
 #define EE_BAD_MEM -2 // to test memory corruption we use this. otherwise the process exist with error logs
@@ -95,10 +391,67 @@ struct fmem{
 // returns E_COMMIT_FAILED
 struct fmem* fmem_create_new(void *on_mem, size_t length, uint32_t min_alloc, committer_t committer);
 
+// same as fmem_create_new(..) using options
+struct fmem* fmem_create_new_opts(void *on_mem, size_t length, const struct fmem_options *opts);
+
 // gets a reference to an existing allocator occupying on_mem memory
 // BAD_MEM is tested for this one
+// the free lists are validated and rebuilt from the page list if they are found broken
+// many processes can attach to the same memory, the lock state is kept as is (a lock
+// held by a dead process is recovered)
+// committer is that of this process, NULL means not persisted by this process
+// returns E_BROKEN_MEM if the page list can't be recovered, E_COMMIT_FAILED
 struct fmem* fmem_from_existing(void *on_mem, committer_t committer);
 
+// committers are kept per process (a function pointer is meaningless to other
+// processes attached to the same memory). fmem_create_new(..) and
+// fmem_from_existing(..) set it, NULL means ops of this process commit nothing
+committer_t fmem_committer(struct fmem *fm);
+// returns FMEM_E_NOMEM
+int64_t fmem_set_committer(struct fmem *fm, committer_t committer);
+
+// marks fmem as cleanly detached, the redo log (if any) is checkpointed and
+// a crc of the allocator state is committed with the marker. attaching to a
+// clean fmem (fmem_from_existing(..)) does no replay and no validation, O(1).
+// attaching to an fmem that was not (or changed after it was) cleanly detached
+// walks the page list and rebuilds accounting and free lists if they don't add up.
+// async commits must be stopped before. fmem can be used after, the first op
+// clears the marker. returns the generation (# of clean detaches)
+// returns E_COMMIT_FAILED
+int64_t fmem_detach(struct fmem *fm);
+
+// runs fn holding fm lock, allocs and frees of every process attached wait
+// until it returns. fn must not call anything that takes the lock
+// returns what fn returns
+typedef int64_t (*fmem_locked_t)(struct fmem *fm, void *ctx);
+int64_t fmem_run_locked(struct fmem *fm, fmem_locked_t fn, void *ctx);
+
+// stashes a root pointer in user slot n (1..4). roots are stored relative
+// to the slot, they are valid wherever memory is mapped next time
+void fmem_set_root(struct fmem *fm, int n, void *root);
+
+// returns root pointer stashed in user slot n (1..4), NULL if not set
+void* fmem_get_root(struct fmem *fm, int n);
+
+// fills stats, takes the lock for as long as it takes to walk the free lists
+void fmem_stats(struct fmem *fm, struct fmem_stats *stats);
+
+// verifies fmem at the start of mem (length bytes mapped) with threads (0
+// means one per cpu). report flags, cells and map are set by the caller
+// returns # of problems found, E_BAD_INIT_MEM if mem is not fmem memory
+int64_t fmem_check(void *mem, size_t length, uint32_t threads, struct fmem_check_report *report);
+
+// moves busy pages towards the head of fmem memory so free memory gathers in
+// one large page at the end. stops after max_moves moves or once budget_ns
+// has passed (0 means no time limit), so it can be called in small steps.
+// relocate is called (with the lock held) for every moved page.
+// -- cached blocks (fmem_cache) are busy and will be moved, flush caches first.
+// -- memory that may move must not be used while this runs, other than by
+// 	 relocate.
+// returns # of moves (0 if memory is already compact)
+// returns E_COMMIT_FAILED if commit failed
+int64_t fmem_compact_step(struct fmem *fm, uint32_t max_moves, uint64_t budget_ns, fmem_relocate_t relocate, void *ctx);
+
 // allocates memory, returns reference
 // we don't support allocation more than 2^32- PAGE_OVERHEAD
 // returns E_COMMIT_FAILED if commit failed
@@ -109,6 +462,158 @@ void* fmem_alloc(struct fmem *fm, uint32_t size);
 // returns E_COMMIT_FAILED if commit failed
 int64_t fmem_free(struct fmem *fm, void *mem);
 
+// allocates memory at an align boundary. align must be a power of 2 up to the
+// os page size. padding after the memory is given back as free memory.
+// memory aligned past the default alignment (fmem_options.align) is never moved
+// by compaction, fmem_realloc(..) keeps it aligned
+// returns E_BAD_ALIGN, FMEM_E_NOMEM, E_COMMIT_FAILED if commit failed
+void* fmem_alloc_aligned(struct fmem *fm, uint32_t size, uint32_t align);
+
+// resizes memory to size, contents are kept (up to the smaller of the sizes).
+// memory shrinks in place (the tail is freed), grows in place if the page
+// after it is free and big enough, otherwise it is moved (contents are
+// copied and committed). NULL mem is the same as fmem_alloc(..)
+// memory allocated by fmem_halloc(..) keeps its handle. huge memory is resized
+// within its extent or next to a free one, or moved.
+// returns reference to memory (which may have moved)
+// returns FMEM_E_NOMEM (mem is untouched), E_COMMIT_FAILED if commit failed
+// BAD_MEM is tested here
+void* fmem_realloc(struct fmem *fm, void *mem, uint32_t size);
+
+// allocates count pieces of memory of size under one lock hold, into out.
+// pieces are carved next to each other out of one free page when possible and
+// committed as one range
+// returns # of pieces allocated (can be less than count if we ran out of memory)
+// returns FMEM_E_NOMEM if nothing could be allocated, E_COMMIT_FAILED if commit failed
+int64_t fmem_alloc_many(struct fmem *fm, uint32_t size, uint32_t count, void **out);
+
+// frees count pieces of memory under one lock hold, returns total freed
+// BAD_MEM is tested here (all pieces are checked before any is freed)
+// returns E_COMMIT_FAILED if commit failed
+int64_t fmem_free_many(struct fmem *fm, void **mems, uint32_t count);
+
+// creates the handle table with room for count handles. the table is allocated
+// from fmem (count * 8 bytes) and can not grow.
+// returns count, E_BAD_HANDLE if fmem already has a table
+// returns FMEM_E_NOMEM, E_COMMIT_FAILED
+int64_t fmem_htable_create(struct fmem *fm, uint32_t count);
+
+// allocates memory same as fmem_alloc(..) and returns a handle to it. the
+// handle costs 4 bytes of the allocation (kept after the memory). memory
+// allocated this way is fixed by compaction (relocate still gets called).
+// returns the handle (> 0), FMEM_E_NOMEM if out of memory or handles
+// returns E_BAD_HANDLE if fmem has no handle table, E_COMMIT_FAILED
+int64_t fmem_halloc(struct fmem *fm, uint32_t size);
+
+// frees memory allocated by fmem_halloc(..) and the handle. returns the same as fmem_free(..)
+// returns E_BAD_HANDLE if handle is not in use
+// BAD_MEM is tested here
+int64_t fmem_hfree(struct fmem *fm, fmem_handle_t handle);
+
+// resolves a handle to memory, NULL if handle is not in use. the returned
+// reference is good until memory is moved again (see fmem_compact_step(..))
+static inline void* fmem_deref(struct fmem *fm, fmem_handle_t handle){
+	if(handle == 0 || handle > fm->handle_count) return NULL;
+	uint64_t entry = ((uint64_t *) rptr_get(&fm->handle_table))[handle - 1];
+	return (entry & FMEM_HANDLE_FREE) ? NULL : (void *) (((char *) fm) + entry);
+}
+
+// creates the epoch table with room for readers reader slots and limbo_size
+// pieces of memory in limbo. the table is allocated from fmem and can not grow
+// returns readers, E_BAD_EPOCH if fmem already has a table
+// returns FMEM_E_NOMEM, E_COMMIT_FAILED
+int64_t fmem_epochs_create(struct fmem *fm, uint32_t readers, uint32_t limbo_size);
+
+// takes a reader slot for calling thread
+// returns the reader, E_BAD_EPOCH if there is no table or no free slot
+int64_t fmem_reader_register(struct fmem *fm);
+
+// gives the slot back
+// returns E_BAD_EPOCH if reader is not a slot
+int64_t fmem_reader_unregister(struct fmem *fm, uint32_t reader);
+
+// puts memory in limbo, it is freed once readers that started before are done.
+// memory must be unreachable for readers that start after (unlinked first).
+// not for handle memory (see fmem_hfree(..))
+// returns # of pieces in limbo, FMEM_E_NOMEM if limbo is full (and nothing
+// could be reclaimed), E_BAD_EPOCH if fmem has no epoch table, E_COMMIT_FAILED
+// BAD_MEM is tested here
+int64_t fmem_free_deferred(struct fmem *fm, void *mem);
+
+// frees memory in limbo no reader can see anymore, fmem_free_deferred(..)
+// does that on every call
+// returns # of pieces freed, E_BAD_EPOCH, E_COMMIT_FAILED
+int64_t fmem_reclaim(struct fmem *fm);
+
+static inline struct fmem_reader* fmem_reader_slot(struct fmem *fm, uint32_t reader){
+	return &((struct fmem_epochs *) rptr_get(&fm->epochs))->slots[reader];
+}
+
+// starts a read, memory read from here until fmem_read_end(..) is not freed
+// under the reader. wait free, a load and a store
+static inline void fmem_read_begin(struct fmem *fm, uint32_t reader){
+	struct fmem_epochs *epochs = (struct fmem_epochs *) rptr_get(&fm->epochs);
+	__atomic_store_n(&epochs->slots[reader].epoch, __atomic_load_n(&epochs->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+// ends a read, references taken since fmem_read_begin(..) are no longer safe
+static inline void fmem_read_end(struct fmem *fm, uint32_t reader){
+	__atomic_store_n(&fmem_reader_slot(fm, reader)->epoch, FMEM_READER_IDLE, __ATOMIC_RELEASE);
+}
+
+// allocates size bytes (64 bit) from the huge zone. memory is os page aligned
+// and sized and does not touch the page list. free it with fmem_free(..),
+// freed extents give thier physical memory (and blocks of the backing file)
+// back to the os. fmem_free_many(..) and handles are not for huge memory, fmem_realloc(..)
+// takes sizes up to UINT32_MAX
+// returns FMEM_E_NOMEM if there is no huge zone or no extent big enough
+// returns E_COMMIT_FAILED if commit failed
+void* fmem_alloc_huge(struct fmem *fm, uint64_t size);
+
+// returns true if mem is in the huge zone of fm
+static inline bool fmem_is_huge(struct fmem *fm, void *mem){
+	char *zone = ((char *) fm) - sizeof(struct fmem_page) + fm->huge_offset;
+	return fm->huge_size != 0 && (char *) mem >= zone && (char *) mem < zone + fm->huge_size;
+}
+
+// returns size of memory fmem owns, page list and huge zone
+static inline size_t fmem_length(struct fmem *fm){
+	return fm->huge_size != 0 ? fm->huge_offset + fm->huge_size : fm->total_size;
+}
+
+// trim gives physical memory under free pages back to the os (and punches
+// the blocks out of a shared backing file). only whole os pages inside free
+// bodies go, page headers and free list links stay. memory comes back zero
+// filled the next time it is touched. the huge zone is always trimmed (see
+// fmem_alloc_huge(..)).
+// -- a trimmer is a thread that trims every interval if memory was freed
+// 	 since the last time. trimmer state lives in process memory.
+struct fmem_trimmer{
+	struct fmem *fm;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t wake;
+	uint32_t interval_ms;
+	bool stop;
+	uint64_t trimmed;   // bytes given back by this trimmer
+	uint64_t available; // fm->total_available at the last trim
+};
+
+// trims free pages of fm
+// returns # of bytes given back
+int64_t fmem_trim(struct fmem *fm);
+
+// starts a thread that trims fm every interval_ms. trimmer must outlive it
+// returns E_BAD_TRIM
+int64_t fmem_trimmer_start(struct fmem *fm, struct fmem_trimmer *trimmer, uint32_t interval_ms);
+
+// stops the trimmer and waits for its thread
+// returns # of bytes it gave back
+int64_t fmem_trimmer_stop(struct fmem_trimmer *trimmer);
+
+// returns crc32 (ieee) of data, crc is the crc of what came before (0 to start)
+uint32_t fmem_crc32(uint32_t crc, const void *data, size_t len);
+
 //commits user set root pointers to backing store
 // returns E_COMMIT_FAILED if commit failed
 // BAD_MEM is tested here
@@ -122,4 +627,85 @@ int64_t fmem_commit_user_data(struct fmem *fm);
 // that was used to allocate this memory
 // BAD_MEM is tested here
 int64_t fmem_commit_mem(struct fmem *fm, void *mem, uint32_t len); // TODO
+
+// commits len bytes at at, a range inside memory mem (allocated from that fmem)
+// returns E_COMMIT_FAILED if commit fails or the range is outside mem
+// returns E_BAD_EXTENT if mem is huge and not allocated
+// BAD_MEM is tested here
+int64_t fmem_commit_mem_at(struct fmem *fm, void *mem, void *at, uint32_t len);
+
+// opens a batch on fmem for calling thread. storage must outlive the batch.
+// returns E_BAD_BATCH if the thread already has a batch open on fmem
+int64_t fmem_batch_begin(struct fmem *fm, struct fmem_batch *batch, struct commit_range *storage, uint32_t capacity);
+
+// commits everything in the open batch of calling thread and closes it
+// returns total bytes committed by the batch
+// returns E_COMMIT_FAILED if any commit failed, E_BAD_BATCH if no batch is open
+int64_t fmem_batch_commit(struct fmem *fm);
+
+// starts async commits on fmem for this process. capacity must be a power
+// of 2, storage must outlive async commits.
+// returns E_BAD_ASYNC if already started or storage is bad
+int64_t fmem_async_start(struct fmem *fm, struct fmem_async *async, struct fmem_async_slot *storage, uint32_t capacity);
+
+// waits for all queued commits then stops the flusher. no other op on fmem
+// may be running while this is called
+// returns E_COMMIT_FAILED if any async commit failed, E_BAD_ASYNC if not started
+int64_t fmem_async_stop(struct fmem *fm);
+
+// returns the sequence # of the last queued commit (0 if none)
+uint64_t fmem_commit_seq(struct fmem *fm);
+
+// waits until every commit up to seq is persisted. returns immediately if
+// async commits are not started (commits are synchronous)
+// returns E_COMMIT_FAILED if any async commit failed
+int64_t fmem_commit_wait(struct fmem *fm, uint64_t seq);
+
+// inits a cache on top of an fmem
+void fmem_cache_init(struct fmem_cache *cache, struct fmem *fm);
+
+// allocates memory using the cache, allocs that are larger than the cache
+// classes go directly to fmem. same returns as fmem_alloc
+void* fmem_cache_alloc(struct fmem_cache *cache, uint32_t size);
+
+// frees memory into a cache, memory can be allocated by fmem_alloc or
+// fmem_cache_alloc. returns size of the page freed (or cached)
+// returns E_BAD_HANDLE for memory of fmem_halloc(..), see fmem_hfree(..)
+// BAD_MEM is tested here
+// returns E_COMMIT_FAILED if the cache gave back a batch and commit failed
+int64_t fmem_cache_free(struct fmem_cache *cache, void *mem);
+
+// gives back all cached blocks to fmem, returns total freed
+// returns E_COMMIT_FAILED if commit failed
+int64_t fmem_cache_flush(struct fmem_cache *cache);
+
+// variants of alloc, free and cache ops, the slow paths of fast paths defined
+// by FMEM_DEFINE(..) (see fmem/fmem_fast.h). same returns as the above
+#define FMEM_V_UNLOCKED 0x1 // fmem is owned by the caller (one thread of one process), the lock is not taken
+void* fmem_alloc_variant(struct fmem *fm, uint32_t size, uint32_t variant);
+int64_t fmem_free_variant(struct fmem *fm, void *mem, uint32_t variant);
+void* fmem_cache_alloc_variant(struct fmem_cache *cache, uint32_t size, uint32_t variant);
+int64_t fmem_cache_free_variant(struct fmem_cache *cache, void *mem, uint32_t variant);
+int64_t fmem_cache_flush_variant(struct fmem_cache *cache, uint32_t variant);
+
+// allocation sampling (see fprof/). the sampler is process wide, every thread
+// counts down the bytes it allocates (by any alloc path, huge allocs and cache
+// hits included) and once it gets past zero calls the sampler holding fmem
+// lock. the sampler returns the next countdown. sampled pages (and extents)
+// are flagged, when they are freed (by any free path, into a cache too) or
+// moved by compaction the sampler is called again. size of huge allocs is
+// capped at UINT32_MAX.
+#define FMEM_SAMPLE_ALLOC 1 // mem of size was allocated
+#define FMEM_SAMPLE_FREE 2  // mem is being freed
+#define FMEM_SAMPLE_MOVE 3  // mem moved to to
+typedef uint64_t (*fmem_sampler_t)(struct fmem *fm, void *mem, void *to, uint32_t size, int event);
+
+// sets (or clears with NULL) the sampler of this process
+void fmem_set_sampler(fmem_sampler_t sampler);
+
+// true if this process has a sampler, fmem_fast.h takes the out of line paths then
+extern fmem_sampler_t fmem_sampler;
+static inline bool fmem_sampling(){
+	return __atomic_load_n(&fmem_sampler, __ATOMIC_RELAXED) != NULL;
+}
 #endif
@@ -0,0 +1,72 @@
+#ifndef __FMEM_FAST__
+#define __FMEM_FAST__
+#include <stdint.h>
+#include "fmem/fmem.h"
+
+// FMEM_DEFINE(name, locking, persistence, poison) defines static inline
+// name_init(..), name_alloc(..), name_free(..), name_flush(..) and
+// name_commit(..) on top of a struct fmem_cache. arguments are compile time
+// constants, every combination compiles to its own fast path: small allocs
+// and frees are a pop or a push of the cache, no lock, no committer and no
+// poison check unless asked for. only refills and give backs (batches of
+// FMEM_CACHE_BATCH) and allocs larger than the cache classes call into fmem,
+// the variant they call is picked at compile time too.
+// -- locking FMEM_LOCKED: fmem is shared, one cache per thread (e.g. __thread).
+// 	 FMEM_UNLOCKED: one thread of one process owns fmem, the lock is never taken.
+// -- persistence FMEM_PERSISTED: name_commit(..) commits user memory.
+// 	 FMEM_VOLATILE: fmem has no committer, name_commit(..) compiles to nothing.
+// -- poison FMEM_POISONED: frees check page poison, for fmem built with __BAD_MEM__.
+// 	 FMEM_UNPOISONED: they don't.
+// -- cached blocks are busy as far as fmem is concerned, name_flush(..) before
+// 	 the cache goes away (same as fmem_cache_flush(..)).
+// -- with a sampler installed (fmem_set_sampler(..)) allocs, and frees of
+// 	 sampled blocks, take the out of line paths.
+// e.g. FMEM_DEFINE(things, FMEM_UNLOCKED, FMEM_VOLATILE, FMEM_UNPOISONED) then
+// things_alloc(&cache, 32), things_free(&cache, mem)
+#define FMEM_LOCKED 1
+#define FMEM_UNLOCKED 0
+#define FMEM_PERSISTED 1
+#define FMEM_VOLATILE 0
+#define FMEM_POISONED 1
+#define FMEM_UNPOISONED 0
+#define FMEM_FAST_SAMPLED (1 << 10) // page flag of sampled pages (see fmem.c)
+#define FMEM_FAST_HANDLE (1 << 14)  // page flag of fmem_halloc(..) pages, they are never cached
+
+#define FMEM_DEFINE(name, locking, persistence, poison) \
+static inline void name##_init(struct fmem_cache *cache, struct fmem *fm){ \
+	fmem_cache_init(cache, fm); \
+} \
+\
+static inline void* name##_alloc(struct fmem_cache *cache, uint32_t size){ \
+	uint32_t class = (size == 0 ? 0 : size - 1) / cache->min_alloc; \
+	if(__builtin_expect(class < FMEM_CACHE_CLASSES && cache->counts[class] > 0 && !fmem_sampling(), 1)){ \
+		void *mem = cache->blocks[class]; \
+		cache->blocks[class] = *((void **) mem); \
+		cache->counts[class]--; \
+		return mem; \
+	} \
+	return fmem_cache_alloc_variant(cache, size, (locking) ? 0 : FMEM_V_UNLOCKED); \
+} \
+\
+static inline int64_t name##_free(struct fmem_cache *cache, void *mem){ \
+	struct fmem_page *fpage = (struct fmem_page *) (((char *) mem) - cache->overhead); \
+	bool fast = !fmem_is_huge(cache->fm, mem) && (!(poison) || (fpage->flags >> 16) == FMEM_POISON) && !(fpage->flags & (FMEM_FAST_HANDLE | FMEM_FAST_SAMPLED)); \
+	uint32_t class = (fpage->size - cache->overhead) / cache->min_alloc - 1; \
+	if(__builtin_expect(fast && class < FMEM_CACHE_CLASSES && cache->counts[class] + 1 < 2 * FMEM_CACHE_BATCH, 1)){ \
+		*((void **) mem) = cache->blocks[class]; \
+		cache->blocks[class] = mem; \
+		cache->counts[class]++; \
+		return (int64_t) fpage->size; \
+	} \
+	return fmem_cache_free_variant(cache, mem, (locking) ? 0 : FMEM_V_UNLOCKED); \
+} \
+\
+static inline int64_t name##_flush(struct fmem_cache *cache){ \
+	return fmem_cache_flush_variant(cache, (locking) ? 0 : FMEM_V_UNLOCKED); \
+} \
+\
+static inline int64_t name##_commit(struct fmem *fm, void *mem, uint32_t len){ \
+	if(persistence) return fmem_commit_mem(fm, mem, len); \
+	return (int64_t) len; \
+}
+#endif
@@ -0,0 +1,553 @@
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <execinfo.h>
+
+#include "fmem/fmem.h"
+#include "fprof.h"
+
+// a stack (and tag) with what was sampled on it
+struct fprof_stack{
+	uint64_t hash;   // 0 if the slot is empty
+	const char *tag;
+	uint32_t depth;
+	uint32_t unused;
+	void *frames[FPROF_DEPTH];
+	uint64_t inuse_objects;
+	uint64_t inuse_bytes;
+	uint64_t alloc_objects;
+	uint64_t alloc_bytes;
+};
+
+// a sampled alloc still in use
+struct fprof_sample{
+	void *mem;       // NULL if the slot is empty
+	uint64_t size;
+	uint32_t stack;  // slot in stacks
+	uint32_t unused;
+};
+
+// both tables are open addressed (linear probing) with mask + 1 slots, at
+// most capacity are used
+static struct{
+	bool started;
+	uint64_t rate;
+	uint32_t capacity;
+	uint32_t mask;
+	struct fprof_stack *stacks;
+	struct fprof_sample *samples;
+	uint64_t nstacks;
+	uint64_t nsamples;
+	uint64_t dropped;
+	pthread_mutex_t lock;
+} prof = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static __thread const char *thread_tag = NULL;
+static __thread uint64_t thread_rand = 0;
+
+static inline uint64_t fprof_mix(uint64_t x){
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+// gaps between samples are exponential with rate as mean
+static uint64_t fprof_next(){
+	if(prof.rate <= 1) return 1;
+	if(thread_rand == 0) thread_rand = fprof_mix((uintptr_t) &thread_rand) | 1;
+	thread_rand ^= thread_rand << 13;
+	thread_rand ^= thread_rand >> 7;
+	thread_rand ^= thread_rand << 17;
+	double u = ((thread_rand >> 11) + 1) * (1.0 / 9007199254740992.0); // (0, 1]
+	return (uint64_t) (-log(u) * prof.rate) + 1;
+}
+
+// returns slot of the stack, adds it if it is not there. -1 if the table is full
+static int64_t fprof_stack_of(void **frames, uint32_t depth, const char *tag){
+	uint64_t hash = fprof_mix((uintptr_t) tag);
+	for(uint32_t i = 0; i < depth; i++) hash = fprof_mix(hash ^ (uintptr_t) frames[i]);
+	if(hash == 0) hash = 1;
+
+	for(uint32_t slot = hash & prof.mask;; slot = (slot + 1) & prof.mask){
+		struct fprof_stack *stack = &prof.stacks[slot];
+		if(stack->hash == 0){
+			if(prof.nstacks == prof.capacity) return -1;
+			stack->hash = hash;
+			stack->tag = tag;
+			stack->depth = depth;
+			memcpy(stack->frames, frames, depth * sizeof(void *));
+			prof.nstacks++;
+			return slot;
+		}
+		if(stack->hash == hash && stack->tag == tag && stack->depth == depth &&
+		   memcmp(stack->frames, frames, depth * sizeof(void *)) == 0) return slot;
+	}
+}
+
+static inline uint32_t fprof_home(void *mem){
+	return fprof_mix((uintptr_t) mem) & prof.mask;
+}
+
+// returns slot of the sample of mem, -1 if mem was not sampled
+static int64_t fprof_sample_find(void *mem){
+	for(uint32_t slot = fprof_home(mem);; slot = (slot + 1) & prof.mask){
+		if(prof.samples[slot].mem == NULL) return -1;
+		if(prof.samples[slot].mem == mem) return slot;
+	}
+}
+
+static void fprof_sample_insert(struct fprof_sample *sample){
+	uint32_t slot = fprof_home(sample->mem);
+	while(prof.samples[slot].mem != NULL) slot = (slot + 1) & prof.mask;
+	prof.samples[slot] = *sample;
+	prof.nsamples++;
+}
+
+// samples after the hole that can move closer to thier home do, so probes
+// never stop at a hole
+static void fprof_sample_remove(uint32_t slot){
+	uint32_t hole = slot;
+	for(uint32_t next = (hole + 1) & prof.mask; prof.samples[next].mem != NULL; next = (next + 1) & prof.mask){
+		uint32_t home = fprof_home(prof.samples[next].mem);
+		if(((next - home) & prof.mask) >= ((next - hole) & prof.mask)){
+			prof.samples[hole] = prof.samples[next];
+			hole = next;
+		}
+	}
+	prof.samples[hole].mem = NULL;
+	prof.nsamples--;
+}
+
+static uint64_t fprof_sampler(struct fmem *fm, void *mem, void *to, uint32_t size, int event){
+	if(event == FMEM_SAMPLE_ALLOC){
+		// the sampler itself is not part of the stack
+		void *frames[FPROF_DEPTH + 1];
+		int depth = backtrace(frames, FPROF_DEPTH + 1);
+
+		pthread_mutex_lock(&prof.lock);
+		if(prof.started){
+			int64_t stack = depth > 1 ? fprof_stack_of(frames + 1, depth - 1, thread_tag) : -1;
+			if(stack < 0 || prof.nsamples == prof.capacity){
+				prof.dropped++;
+			}else{
+				struct fprof_sample sample = {.mem = mem, .size = size, .stack = (uint32_t) stack};
+				fprof_sample_insert(&sample);
+				prof.stacks[stack].inuse_objects++;
+				prof.stacks[stack].inuse_bytes += size;
+				prof.stacks[stack].alloc_objects++;
+				prof.stacks[stack].alloc_bytes += size;
+			}
+		}
+		uint64_t next = fprof_next();
+		pthread_mutex_unlock(&prof.lock);
+		return next;
+	}
+
+	pthread_mutex_lock(&prof.lock);
+	int64_t slot = prof.started ? fprof_sample_find(mem) : -1;
+	if(slot >= 0){
+		struct fprof_sample sample = prof.samples[slot];
+		fprof_sample_remove(slot);
+		if(event == FMEM_SAMPLE_MOVE){
+			sample.mem = to;
+			fprof_sample_insert(&sample);
+		}else{
+			prof.stacks[sample.stack].inuse_objects--;
+			prof.stacks[sample.stack].inuse_bytes -= sample.size;
+		}
+	}
+	pthread_mutex_unlock(&prof.lock);
+	return 0;
+}
+
+int64_t fprof_start(uint64_t rate, uint32_t capacity){
+	if(capacity == 0 || capacity > (1u << 30)) return E_BAD_PROF;
+	// loads what backtrace needs now, not while sampling
+	void *warm[1];
+	backtrace(warm, 1);
+
+	pthread_mutex_lock(&prof.lock);
+	if(prof.started){
+		pthread_mutex_unlock(&prof.lock);
+		return E_BAD_PROF;
+	}
+	uint32_t slots = 2;
+	while(slots < 2 * capacity) slots <<= 1;
+	prof.stacks = calloc(slots, sizeof(struct fprof_stack));
+	prof.samples = calloc(slots, sizeof(struct fprof_sample));
+	if(prof.stacks == NULL || prof.samples == NULL){
+		free(prof.stacks);
+		free(prof.samples);
+		pthread_mutex_unlock(&prof.lock);
+		return E_BAD_PROF;
+	}
+	prof.rate = rate == 0 ? FPROF_DEFAULT_RATE : rate;
+	prof.capacity = capacity;
+	prof.mask = slots - 1;
+	prof.nstacks = 0;
+	prof.nsamples = 0;
+	prof.dropped = 0;
+	prof.started = true;
+	pthread_mutex_unlock(&prof.lock);
+
+	fmem_set_sampler(fprof_sampler);
+	return 0;
+}
+
+int64_t fprof_stop(){
+	fmem_set_sampler(NULL);
+
+	pthread_mutex_lock(&prof.lock);
+	if(!prof.started){
+		pthread_mutex_unlock(&prof.lock);
+		return E_BAD_PROF;
+	}
+	prof.started = false;
+	free(prof.stacks);
+	free(prof.samples);
+	prof.stacks = NULL;
+	prof.samples = NULL;
+	pthread_mutex_unlock(&prof.lock);
+	return 0;
+}
+
+void fprof_tag(const char *tag){
+	thread_tag = tag;
+}
+
+// caller holds the lock
+static void fprof_totals(struct fprof_stats *stats){
+	memset(stats, 0, sizeof(struct fprof_stats));
+	if(!prof.started) return;
+	stats->samples = prof.nsamples;
+	stats->stacks = prof.nstacks;
+	stats->dropped = prof.dropped;
+	for(uint32_t slot = 0; slot <= prof.mask; slot++){
+		struct fprof_stack *stack = &prof.stacks[slot];
+		if(stack->hash == 0) continue;
+		stats->inuse_objects += stack->inuse_objects;
+		stats->inuse_bytes += stack->inuse_bytes;
+		stats->alloc_objects += stack->alloc_objects;
+		stats->alloc_bytes += stack->alloc_bytes;
+	}
+}
+
+void fprof_stats(struct fprof_stats *stats){
+	pthread_mutex_lock(&prof.lock);
+	fprof_totals(stats);
+	pthread_mutex_unlock(&prof.lock);
+}
+
+// pprof needs the mappings to find symbols
+static int64_t fprof_write_maps(int fd){
+	if(dprintf(fd, "\nMAPPED_LIBRARIES:\n") < 0) return E_BAD_PROF;
+	int maps = open("/proc/self/maps", O_RDONLY);
+	if(maps < 0) return 0; // no symbols, addresses only
+	char buffer[4096];
+	ssize_t len;
+	int64_t res = 0;
+	while((len = read(maps, buffer, sizeof(buffer))) > 0){
+		if(write(fd, buffer, len) != len){
+			res = E_BAD_PROF;
+			break;
+		}
+	}
+	close(maps);
+	return res;
+}
+
+// heap_v2 profiles carry the rate, pprof scales samples up by it
+int64_t fprof_write_pprof(int fd){
+	pthread_mutex_lock(&prof.lock);
+	if(!prof.started){
+		pthread_mutex_unlock(&prof.lock);
+		return E_BAD_PROF;
+	}
+	struct fprof_stats stats;
+	fprof_totals(&stats);
+	int64_t res = 0;
+	if(dprintf(fd, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%llu\n",
+	           (unsigned long long) stats.inuse_objects, (unsigned long long) stats.inuse_bytes,
+	           (unsigned long long) stats.alloc_objects, (unsigned long long) stats.alloc_bytes,
+	           (unsigned long long) prof.rate) < 0) res = E_BAD_PROF;
+	for(uint32_t slot = 0; slot <= prof.mask && res == 0; slot++){
+		struct fprof_stack *stack = &prof.stacks[slot];
+		if(stack->hash == 0) continue;
+		if(dprintf(fd, "%llu: %llu [%llu: %llu] @",
+		           (unsigned long long) stack->inuse_objects, (unsigned long long) stack->inuse_bytes,
+		           (unsigned long long) stack->alloc_objects, (unsigned long long) stack->alloc_bytes) < 0) res = E_BAD_PROF;
+		for(uint32_t i = 0; i < stack->depth && res == 0; i++){
+			if(dprintf(fd, " 0x%llx", (unsigned long long) (uintptr_t) stack->frames[i]) < 0) res = E_BAD_PROF;
+		}
+		if(res == 0 && dprintf(fd, "\n") < 0) res = E_BAD_PROF;
+	}
+	pthread_mutex_unlock(&prof.lock);
+
+	return res != 0 ? res : fprof_write_maps(fd);
+}
+
+// a sample of size stands for 1 / (1 - e^(-size/rate)) allocs of that size
+static inline double fprof_scale(uint64_t objects, uint64_t bytes){
+	if(prof.rate <= 1 || objects == 0) return 1;
+	double size = (double) bytes / objects;
+	return 1 / (1 - exp(-size / prof.rate));
+}
+
+int64_t fprof_write_tags(int fd){
+	pthread_mutex_lock(&prof.lock);
+	if(!prof.started){
+		pthread_mutex_unlock(&prof.lock);
+		return E_BAD_PROF;
+	}
+	// tags are few, stacks are grouped by tag one tag at a time
+	int64_t res = 0;
+	if(dprintf(fd, "# tag, bytes in use, objects in use (estimated)\n") < 0) res = E_BAD_PROF;
+	char *done = calloc(prof.mask + 1, 1);
+	if(done == NULL) res = E_BAD_PROF;
+	for(uint32_t slot = 0; slot <= prof.mask && res == 0; slot++){
+		struct fprof_stack *first = &prof.stacks[slot];
+		if(first->hash == 0 || done[slot]) continue;
+		double bytes = 0;
+		double objects = 0;
+		for(uint32_t other = slot; other <= prof.mask; other++){
+			struct fprof_stack *stack = &prof.stacks[other];
+			if(stack->hash == 0 || done[other]) continue;
+			if(stack->tag != first->tag && (stack->tag == NULL || first->tag == NULL || strcmp(stack->tag, first->tag) != 0)) continue;
+			double scale = fprof_scale(stack->inuse_objects, stack->inuse_bytes);
+			bytes += stack->inuse_bytes * scale;
+			objects += stack->inuse_objects * scale;
+			done[other] = 1;
+		}
+		if(dprintf(fd, "%s %.0f %.0f\n", first->tag != NULL ? first->tag : "(none)", bytes, objects) < 0) res = E_BAD_PROF;
+	}
+	free(done);
+	pthread_mutex_unlock(&prof.lock);
+	return res;
+}
+
+#ifdef __UNIT_TESTING__
+#include "munit/munit.h"
+#include "fmem/fmem_fast.h"
+
+#define prof_test_size 8 * 1024 * 1024
+
+FMEM_DEFINE(prof_fast, FMEM_LOCKED, FMEM_VOLATILE, FMEM_UNPOISONED)
+
+static char prof_test_buffer[prof_test_size];
+
+// reads what was written to fd
+static char* prof_test_read(int fd){
+	off_t len = lseek(fd, 0, SEEK_END);
+	char *text = calloc(len + 1, 1);
+	munit_assert(pread(fd, text, len, 0) == len);
+	return text;
+}
+
+static int prof_test_file(){
+	char path[] = "/tmp/fprof-test-XXXXXX";
+	int fd = mkstemp(path);
+	if(fd >= 0) unlink(path);
+	return fd;
+}
+
+static __attribute__((noinline)) void* prof_test_control(struct fmem *fm, uint32_t size){
+	return fmem_alloc(fm, size);
+}
+
+static __attribute__((noinline)) void* prof_test_data(struct fmem *fm, uint32_t size){
+	return fmem_alloc(fm, size);
+}
+
+static MunitResult test_prof_sample(const MunitParameter params[], void* data){
+	struct fmem *fm = fmem_create_new(prof_test_buffer, prof_test_size, 0, NULL);
+	munit_assert(fm > 0);
+	munit_assert(fprof_write_pprof(1) == E_BAD_PROF);
+	munit_assert(fprof_start(1, 1024) == 0); // every alloc
+	munit_assert(fprof_start(1, 1024) == E_BAD_PROF);
+
+	void *control[10];
+	void *data_mem[5];
+	fprof_tag("control");
+	for(int i = 0; i < 10; i++) munit_assert((control[i] = prof_test_control(fm, 100)) > 0);
+	fprof_tag("data");
+	for(int i = 0; i < 5; i++) munit_assert((data_mem[i] = prof_test_data(fm, 1000)) > 0);
+	fprof_tag(NULL);
+	for(int i = 0; i < 3; i++) munit_assert(fmem_free(fm, control[i]) > 0);
+
+	struct fprof_stats stats;
+	fprof_stats(&stats);
+	munit_assert(stats.samples == 12);
+	munit_assert(stats.stacks == 2);
+	munit_assert(stats.inuse_objects == 12 && stats.inuse_bytes == 7 * 100 + 5 * 1000);
+	munit_assert(stats.alloc_objects == 15);
+	munit_assert(stats.dropped == 0);
+
+	// moved memory stays sampled
+	munit_assert(fmem_compact_step(fm, 1000, 0, NULL, NULL) > 0);
+	fprof_stats(&stats);
+	munit_assert(stats.samples == 12 && stats.inuse_bytes == 7 * 100 + 5 * 1000);
+
+	int fd = prof_test_file();
+	munit_assert(fd >= 0);
+	munit_assert(fprof_write_pprof(fd) == 0);
+	char *text = prof_test_read(fd);
+	munit_assert(strncmp(text, "heap profile: 12: 5700 [15: 6000] @ heap_v2/1\n", 46) == 0);
+	munit_assert(strstr(text, "\n7: 700 [10: 1000] @ 0x") != NULL);
+	munit_assert(strstr(text, "\n5: 5000 [5: 5000] @ 0x") != NULL);
+	munit_assert(strstr(text, "MAPPED_LIBRARIES:\n") != NULL);
+	free(text);
+
+	munit_assert(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+	munit_assert(fprof_write_tags(fd) == 0);
+	text = prof_test_read(fd);
+	munit_assert(strstr(text, "\ncontrol 700 7\n") != NULL);
+	munit_assert(strstr(text, "\ndata 5000 5\n") != NULL);
+	free(text);
+	close(fd);
+
+	// frees after stop are not seen
+	munit_assert(fprof_stop() == 0);
+	munit_assert(fprof_stop() == E_BAD_PROF);
+	munit_assert(fmem_free(fm, data_mem[0]) > 0);
+	munit_assert(fprof_start(1, 1024) == 0);
+	fprof_stats(&stats);
+	munit_assert(stats.samples == 0);
+	munit_assert(fprof_stop() == 0);
+	return MUNIT_OK;
+}
+
+static MunitResult test_prof_paths(const MunitParameter params[], void* data){
+	struct fmem_options opts = {0};
+	opts.huge_size = 2 * 1024 * 1024;
+	struct fmem *fm = fmem_create_new_opts(prof_test_buffer, prof_test_size, &opts);
+	munit_assert(fm > 0 && fm->huge_size > 0);
+	munit_assert(fmem_htable_create(fm, 16) > 0);
+	munit_assert(fprof_start(1, 1024) == 0);
+	struct fprof_stats stats;
+
+	// huge allocs
+	void *huge = fmem_alloc_huge(fm, 100000);
+	munit_assert(huge > 0);
+	fprof_stats(&stats);
+	munit_assert(stats.samples == 1 && stats.inuse_bytes == 100000);
+	munit_assert(fmem_free(fm, huge) > 0);
+	fprof_stats(&stats);
+	munit_assert(stats.samples == 0 && stats.inuse_bytes == 0);
+
+	// many at once and handles
+	void *mems[8];
+	munit_assert(fmem_alloc_many(fm, 100, 8, mems) == 8);
+	fmem_handle_t handle = fmem_halloc(fm, 200);
+	munit_assert(handle > 0);
+	fprof_stats(&stats);
+	munit_assert(stats.samples == 9 && stats.inuse_bytes == 8 * 100 + 200);
+	munit_assert(fmem_free_many(fm, mems, 8) > 0);
+	munit_assert(fmem_hfree(fm, handle) > 0);
+	fprof_stats(&stats);
+	munit_assert(stats.samples == 0);
+
+	// realloc that moves, the sample goes with the memory
+	void *moving = fmem_alloc(fm, 100);
+	void *blocker = fmem_alloc(fm, 100);
+	munit_assert(moving > 0 && blocker > 0);
+	void *moved = fmem_realloc(fm, moving, 3000);
+	munit_assert(moved > 0 && moved != moving);
+	fprof_stats(&stats);
+	munit_assert(stats.samples == 2 && stats.inuse_bytes == 200);
+	munit_assert(fmem_free(fm, moved) > 0);
+	munit_assert(fmem_free(fm, blocker) > 0);
+	fprof_stats(&stats);
+	munit_assert(stats.samples == 0 && stats.inuse_bytes == 0);
+
+	// a refill, a hit, blocks back in the cache are freed
+	struct fmem_cache cache;
+	fmem_cache_init(&cache, fm);
+	void *first = fmem_cache_alloc(&cache, 30);
+	void *second = fmem_cache_alloc(&cache, 30);
+	munit_assert(first > 0 && second > 0);
+	fprof_stats(&stats);
+	munit_assert(stats.samples == 2 && stats.inuse_bytes == 60);
+	munit_assert(fmem_cache_free(&cache, first) > 0);
+	fprof_stats(&stats);
+	munit_assert(stats.samples == 1 && stats.inuse_bytes == 30);
+	munit_assert(fmem_cache_free(&cache, second) > 0);
+	munit_assert(fmem_cache_flush(&cache) > 0);
+	fprof_stats(&stats);
+	munit_assert(stats.samples == 0 && stats.inuse_objects == 0);
+
+	// same for the compile time variants
+	prof_fast_init(&cache, fm);
+	first = prof_fast_alloc(&cache, 30);
+	second = prof_fast_alloc(&cache, 30);
+	munit_assert(first > 0 && second > 0);
+	fprof_stats(&stats);
+	munit_assert(stats.samples == 2 && stats.inuse_bytes == 60);
+	munit_assert(prof_fast_free(&cache, first) > 0);
+	munit_assert(prof_fast_free(&cache, second) > 0);
+	fprof_stats(&stats);
+	munit_assert(stats.samples == 0);
+	munit_assert(prof_fast_flush(&cache) > 0);
+	munit_assert(stats.alloc_objects == 16);
+	munit_assert(fprof_stop() == 0);
+	return MUNIT_OK;
+}
+
+static MunitResult test_prof_rate(const MunitParameter params[], void* data){
+	struct fmem *fm = fmem_create_new(prof_test_buffer, prof_test_size, 0, NULL);
+	munit_assert(fm > 0);
+	munit_assert(fprof_start(4096, 16) == 0);
+
+	// about 1 in 64, some do not fit
+	const int n = 40000;
+	for(int i = 0; i < n; i++) munit_assert(prof_test_control(fm, 64) > 0);
+	struct fprof_stats stats;
+	fprof_stats(&stats);
+	munit_assert(stats.samples == 16);
+	munit_assert(stats.samples + stats.dropped > n / 128 && stats.samples + stats.dropped < n / 32);
+
+	// scaled up it is close to what is in use
+	munit_assert(fprof_stop() == 0);
+	munit_assert(fprof_start(4096, 4096) == 0);
+	for(int i = 0; i < n; i++) munit_assert(prof_test_data(fm, 64) > 0);
+	int fd = prof_test_file();
+	munit_assert(fd >= 0);
+	munit_assert(fprof_write_tags(fd) == 0);
+	char *text = prof_test_read(fd);
+	double bytes = 0;
+	double objects = 0;
+	munit_assert(sscanf(strchr(text, '\n') + 1, "(none) %lf %lf", &bytes, &objects) == 2);
+	munit_assert(bytes > n * 64 / 2 && bytes < n * 64 * 2);
+	free(text);
+	close(fd);
+	munit_assert(fprof_stop() == 0);
+	return MUNIT_OK;
+}
+
+MunitTest fprof_tests[] = {
+	{"/prof-sample", test_prof_sample, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/prof-paths", test_prof_paths, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/prof-rate", test_prof_rate, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+static const MunitSuite fprof_test_suite = {
+	(char*) "fprof-tests",
+	fprof_tests,
+	NULL,
+	1,
+	MUNIT_SUITE_OPTION_NONE
+};
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]){
+	return munit_suite_main(&fprof_test_suite, NULL, argc, argv);
+}
+#endif
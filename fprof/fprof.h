@@ -0,0 +1,56 @@
+#ifndef __FPROF__
+#define __FPROF__
+#include <stdint.h>
+#include <stddef.h>
+#include "fmem/fmem.h"
+
+// sampling allocation profiler. on average one alloc every rate bytes (rate
+// is the mean of exponentially distributed gaps, so big allocs are sampled
+// more often and every byte has the same chance) is recorded with its call
+// stack and the tag of the thread. records live in process memory, fmem
+// memory is not touched (but for a flag in the page header). samples leave
+// the profile when thier memory is freed, what is left is memory in use,
+// leaks and bloat show as stacks (or tags) that keep growing.
+// -- the profile is written in the (text) heap profile format pprof reads,
+// 	 `pprof -top <binary> <file>`. tags are written as a table of their own.
+// -- one profiler per process, it covers every fmem of the process.
+// -- samples are kept in fixed tables sized at start, samples that don't fit
+// 	 are dropped (and counted).
+// -- link with -lm.
+#define FPROF_DEPTH 32                  // frames kept of a stack
+#define FPROF_DEFAULT_RATE (512 * 1024) // bytes
+
+#define E_BAD_PROF -17 // profiler not started (or already), no memory for tables, write failed
+
+struct fprof_stats{
+	uint64_t samples;       // in use
+	uint64_t stacks;
+	uint64_t dropped;       // samples that did not fit
+	uint64_t inuse_objects; // sampled, not scaled
+	uint64_t inuse_bytes;
+	uint64_t alloc_objects; // sampled since start, freed or not
+	uint64_t alloc_bytes;
+};
+
+// starts sampling every rate bytes (0 means FPROF_DEFAULT_RATE, 1 samples every
+// alloc) with room for capacity samples in use (and as many stacks)
+// returns E_BAD_PROF
+int64_t fprof_start(uint64_t rate, uint32_t capacity);
+
+// stops sampling and frees the tables
+// returns E_BAD_PROF
+int64_t fprof_stop();
+
+// tags allocs of this thread from now on, tag must outlive the profiler. NULL clears
+void fprof_tag(const char *tag);
+
+void fprof_stats(struct fprof_stats *stats);
+
+// writes the profile (memory in use by stack) to fd
+// returns E_BAD_PROF
+int64_t fprof_write_pprof(int fd);
+
+// writes estimated bytes and objects in use by tag to fd, one tag a line
+// returns E_BAD_PROF
+int64_t fprof_write_tags(int fd);
+#endif
@@ -0,0 +1,249 @@
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "fmem/fmem.h"
+#include "farena/farena.h"
+#include "fregion.h"
+
+// older headers may not have them
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+// mbind(2) is called directly, we don't depend on libnuma
+#define FREGION_MPOL_BIND 2
+#define FREGION_MPOL_MF_MOVE (1 << 1)
+#define FREGION_MAX_NODES 1024
+
+// numa node of calling thread, -1 until looked up
+static __thread int thread_node = -1;
+
+size_t fregion_huge_page_size(){
+	size_t size = 2 * 1024 * 1024;
+	FILE *meminfo = fopen("/proc/meminfo", "r");
+	if(meminfo == NULL) return size;
+
+	char line[128];
+	size_t kb = 0;
+	while(fgets(line, sizeof(line), meminfo) != NULL){
+		if(sscanf(line, "Hugepagesize: %zu kB", &kb) == 1){
+			size = kb * 1024;
+			break;
+		}
+	}
+	fclose(meminfo);
+	return size;
+}
+
+int fregion_nodes(){
+	// possible nodes are listed as ranges (e.g. 0-3 or 0,2-3), the last one is the highest
+	FILE *possible = fopen("/sys/devices/system/node/possible", "r");
+	if(possible == NULL) return 1;
+
+	char line[256] = {0};
+	int nodes = 1;
+	if(fgets(line, sizeof(line), possible) != NULL){
+		char *last = line;
+		for(char *at = line; *at != '\0'; at++){
+			if(*at == ',' || *at == '-') last = at + 1;
+		}
+		int highest = atoi(last);
+		if(highest >= 0 && highest < FREGION_MAX_NODES) nodes = highest + 1;
+	}
+	fclose(possible);
+	return nodes;
+}
+
+int64_t fregion_bind(void *mem, size_t length, int node){
+	if(node < 0 || node >= fregion_nodes()) return E_BAD_REGION;
+
+	unsigned long mask[FREGION_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+	mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+	long res = syscall(SYS_mbind, mem, length, FREGION_MPOL_BIND, mask, FREGION_MAX_NODES, FREGION_MPOL_MF_MOVE);
+	return res == 0 ? 0 : E_BAD_REGION;
+}
+
+int64_t fregion_prefault(void *mem, size_t length){
+	if(madvise(mem, length, MADV_POPULATE_WRITE) == 0) return 0;
+	if(errno != EINVAL) return E_BAD_REGION;
+
+	// kernel does not know populate, we touch every page. a write of what is
+	// already there gets the page writable without changing it
+	size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+	for(size_t at = 0; at < length; at += page_size){
+		volatile char *p = ((volatile char *) mem) + at;
+		*p = *p;
+	}
+	return 0;
+}
+
+void* fregion_map(int fd, size_t length, const struct fregion_options *opts){
+	struct fregion_options none = {0};
+	if(opts == NULL) opts = &none;
+	if(length == 0) return (void *) E_BAD_REGION;
+	if((opts->flags & FREGION_F_HUGETLB) && length % fregion_huge_page_size() != 0) return (void *) E_BAD_REGION;
+
+	int flags = MAP_SHARED;
+	if(fd < 0) flags |= MAP_ANONYMOUS;
+	if(opts->flags & FREGION_F_HUGETLB) flags |= MAP_HUGETLB;
+	void *mem = mmap(NULL, length, PROT_READ | PROT_WRITE, flags, fd, 0);
+	if(mem == MAP_FAILED) return (void *) E_BAD_REGION;
+
+	// advice and binding go before the fault in, so pages are huge and local from the start
+	int64_t res = 0;
+	if((opts->flags & FREGION_F_THP) && madvise(mem, length, MADV_HUGEPAGE) != 0) res = E_BAD_REGION;
+	if(res == 0 && (opts->flags & FREGION_F_BIND)) res = fregion_bind(mem, length, opts->node);
+	if(res == 0 && (opts->flags & FREGION_F_PREFAULT)) res = fregion_prefault(mem, length);
+	if(res != 0){
+		munmap(mem, length);
+		return (void *) res;
+	}
+	return mem;
+}
+
+int64_t fregion_unmap(void *mem, size_t length){
+	return munmap(mem, length) == 0 ? 0 : E_BAD_REGION;
+}
+
+struct farena* fregion_arenas_per_node(void *mem, size_t length, const struct fmem_options *opts){
+	int nodes = fregion_nodes();
+	if(nodes > FARENA_MAX) nodes = FARENA_MAX;
+
+	struct farena *arenas = farena_create(mem, length, (uint32_t) nodes, opts);
+	if((int64_t) arenas < 0) return arenas;
+
+	// arenas heads are already faulted in (wherever we run), binding moves them
+	for(int node = 0; node < nodes; node++){
+		char *start = ((char *) mem) + arenas->first + node * arenas->arena_size;
+		if(fregion_bind(start, arenas->arena_size, node) != 0) return (void *) E_BAD_REGION;
+	}
+	return arenas;
+}
+
+struct fmem* fregion_arena_local(struct farena *arenas){
+	if(thread_node < 0){
+		unsigned cpu = 0;
+		unsigned node = 0;
+		if(syscall(SYS_getcpu, &cpu, &node, NULL) != 0) node = 0;
+		thread_node = (int) node;
+	}
+	return farena_get(arenas, (uint32_t) thread_node % arenas->count);
+}
+
+#ifdef __UNIT_TESTING__
+#include <fcntl.h>
+#include "munit/munit.h"
+
+static MunitResult test_region_map(const MunitParameter params[], void* data){
+	munit_assert(fregion_map(-1, 0, NULL) == (void *) E_BAD_REGION);
+
+	size_t length = 8 * 1024 * 1024;
+	struct fregion_options opts = {0};
+	opts.flags = FREGION_F_THP | FREGION_F_PREFAULT | FREGION_F_BIND;
+	opts.node = 0;
+	char *mem = fregion_map(-1, length, &opts);
+	munit_assert((int64_t) mem > 0);
+	// prefaulted memory is still zeroed
+	for(size_t at = 0; at < length; at += 4096) munit_assert(mem[at] == 0);
+
+	struct fmem *fm = fmem_create_new(mem, length, 0, NULL);
+	munit_assert(fm > 0);
+	void *big = fmem_alloc(fm, 4 * 1024 * 1024);
+	munit_assert(big > 0);
+	memset(big, 0xA, 4 * 1024 * 1024);
+	munit_assert(fmem_free(fm, big) > 0);
+	munit_assert(fregion_unmap(mem, length) == 0);
+
+	// explicit huge pages need a multiple of huge page size (and huge pages
+	// to be reserved, they are not on most test boxes)
+	opts.flags = FREGION_F_HUGETLB;
+	munit_assert(fregion_map(-1, fregion_huge_page_size() + 4096, &opts) == (void *) E_BAD_REGION);
+	mem = fregion_map(-1, fregion_huge_page_size(), &opts);
+	munit_assert((int64_t) mem > 0 || mem == (void *) E_BAD_REGION);
+	if((int64_t) mem > 0) munit_assert(fregion_unmap(mem, fregion_huge_page_size()) == 0);
+
+	// no such node
+	opts.flags = FREGION_F_BIND;
+	opts.node = fregion_nodes();
+	munit_assert(fregion_map(-1, length, &opts) == (void *) E_BAD_REGION);
+	return MUNIT_OK;
+}
+
+static MunitResult test_region_prefault_file(const MunitParameter params[], void* data){
+	char path[] = "/tmp/fregion-test-XXXXXX";
+	int fd = mkstemp(path);
+	munit_assert(fd >= 0);
+	unlink(path);
+
+	size_t length = 1024 * 1024;
+	char *page = calloc(1, length);
+	for(size_t at = 0; at < length; at++) page[at] = (char) (at % 251);
+	munit_assert(write(fd, page, length) == (ssize_t) length);
+
+	// prefault must keep what is on file
+	struct fregion_options opts = {0};
+	opts.flags = FREGION_F_PREFAULT;
+	char *mem = fregion_map(fd, length, &opts);
+	munit_assert((int64_t) mem > 0);
+	munit_assert(memcmp(mem, page, length) == 0);
+	munit_assert(fregion_unmap(mem, length) == 0);
+	close(fd);
+	free(page);
+	return MUNIT_OK;
+}
+
+static MunitResult test_region_arenas_per_node(const MunitParameter params[], void* data){
+	munit_assert(fregion_nodes() >= 1);
+	munit_assert(fregion_huge_page_size() >= 4096);
+
+	size_t length = 16 * 1024 * 1024;
+	char *mem = fregion_map(-1, length, NULL);
+	munit_assert((int64_t) mem > 0);
+	struct fmem_options opts = {0};
+	struct farena *arenas = fregion_arenas_per_node(mem, length, &opts);
+	munit_assert((int64_t) arenas > 0);
+	munit_assert(arenas->count == (uint32_t) (fregion_nodes() > FARENA_MAX ? FARENA_MAX : fregion_nodes()));
+
+	// the local arena is one of them and serves allocs
+	struct fmem *local = fregion_arena_local(arenas);
+	munit_assert(local != NULL);
+	void *mem_local = fmem_alloc(local, 1000);
+	munit_assert(mem_local > 0);
+	munit_assert(farena_of(arenas, mem_local) == local);
+	munit_assert(fregion_arena_local(arenas) == local);
+	munit_assert(fregion_unmap(mem, length) == 0);
+	return MUNIT_OK;
+}
+
+MunitTest fregion_tests[] = {
+	{"/region-map", test_region_map, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/region-prefault-file", test_region_prefault_file, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/region-arenas-per-node", test_region_arenas_per_node, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+static const MunitSuite fregion_test_suite = {
+	(char*) "fregion-tests",
+	fregion_tests,
+	NULL,
+	1,
+	MUNIT_SUITE_OPTION_NONE
+};
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]){
+	return munit_suite_main(&fregion_test_suite, NULL, argc, argv);
+}
+#endif
@@ -0,0 +1,55 @@
+#ifndef __FREGION__
+#define __FREGION__
+#include <stdint.h>
+#include <stddef.h>
+#include "fmem/fmem.h"
+#include "farena/farena.h"
+
+// region helpers map the memory fmem sits on. large regions mapped with
+// 4K pages thrash the tlb on every page walk, a region can be mapped with
+// huge pages (explicit or transparent), bound to a numa node and faulted in
+// up front. a region is plain memory, create fmem (or arenas) on top of it.
+#define FREGION_F_HUGETLB 0x1  // explicit huge pages (MAP_HUGETLB), length must be a multiple of huge page size
+#define FREGION_F_THP 0x2      // transparent huge pages, madvise(MADV_HUGEPAGE)
+#define FREGION_F_PREFAULT 0x4 // fault every page in once mapped (contents are not changed)
+#define FREGION_F_BIND 0x8     // bind memory to numa node fregion_options.node
+
+#define E_BAD_REGION -10 // mapping, binding or advice failed, or bad length/node
+
+struct fregion_options{
+	uint32_t flags; // FREGION_F_* flags
+	int node;       // numa node for FREGION_F_BIND
+};
+
+// maps length bytes of fd (shm_open(..), open(..) or a hugetlbfs file) shared.
+// fd < 0 maps anonymous shared memory
+// returns E_BAD_REGION
+void* fregion_map(int fd, size_t length, const struct fregion_options *opts);
+
+// unmaps a region mapped by fregion_map(..)
+// returns E_BAD_REGION
+int64_t fregion_unmap(void *mem, size_t length);
+
+// binds memory to a numa node, pages already faulted in are moved
+// returns E_BAD_REGION
+int64_t fregion_bind(void *mem, size_t length, int node);
+
+// faults every page in without changing its contents
+// returns E_BAD_REGION
+int64_t fregion_prefault(void *mem, size_t length);
+
+// returns # of numa nodes (1 on systems without numa)
+int fregion_nodes();
+
+// returns size of (default) huge pages
+size_t fregion_huge_page_size();
+
+// creates one arena per numa node on mem (see farena_create(..)) and binds
+// every arena to its node
+// returns E_BAD_REGION or any farena_create(..) error
+struct farena* fregion_arenas_per_node(void *mem, size_t length, const struct fmem_options *opts);
+
+// returns the arena of the node calling thread runs on. the node is looked
+// up on the first call of each thread, threads should be pinned to a node
+struct fmem* fregion_arena_local(struct farena *arenas);
+#endif
@@ -0,0 +1,461 @@
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "fmem/fmem.h"
+#include "frepl.h"
+
+static struct{
+	bool started;
+	int fd;
+	char *base;
+	size_t length;
+	uint64_t seq;       // last frame sent
+	committer_t next;
+	char *buffer;         // entries and data of the frame being sent
+	size_t capacity;
+	pthread_mutex_t lock; // frames of concurrent commits don't mix on the stream
+} sender = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+int64_t frepl_start(int fd, void *base, size_t length, committer_t next){
+	if(fd < 0 || base == NULL || length == 0) return E_BAD_REPL;
+
+	pthread_mutex_lock(&sender.lock);
+	if(sender.started){
+		pthread_mutex_unlock(&sender.lock);
+		return E_BAD_REPL;
+	}
+	sender.fd = fd;
+	sender.base = (char *) base;
+	sender.length = length;
+	sender.seq = 0;
+	sender.next = next;
+	sender.started = true;
+	pthread_mutex_unlock(&sender.lock);
+	return 0;
+}
+
+int64_t frepl_stop(){
+	pthread_mutex_lock(&sender.lock);
+	int64_t res = sender.started ? (int64_t) sender.seq : E_BAD_REPL;
+	sender.started = false;
+	sender.fd = -1;
+	free(sender.buffer);
+	sender.buffer = NULL;
+	sender.capacity = 0;
+	pthread_mutex_unlock(&sender.lock);
+	return res;
+}
+
+// writes all of iov, moves along on short writes
+static int frepl_writev(int fd, struct iovec *iov, int count){
+	while(count > 0){
+		ssize_t done = writev(fd, iov, count);
+		if(done < 0 && errno == EINTR) continue;
+		if(done <= 0) return E_BAD_REPL;
+		while(count > 0 && (size_t) done >= iov->iov_len){
+			done -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if(count > 0){
+			iov->iov_base = ((char *) iov->iov_base) + done;
+			iov->iov_len -= done;
+		}
+	}
+	return 0;
+}
+
+int frepl_committer(struct commit_range *ranges, uint8_t count){
+	if(count == 0) return 0;
+
+	pthread_mutex_lock(&sender.lock);
+	if(!sender.started){
+		pthread_mutex_unlock(&sender.lock);
+		return E_BAD_REPL;
+	}
+	if(sender.next != NULL && sender.next(ranges, count) < 0){
+		pthread_mutex_unlock(&sender.lock);
+		return E_COMMIT_FAILED;
+	}
+
+	// ranges are copied before the crc, what is sent is what the crc covers
+	// even if memory is written to (bodies are not under the fmem lock)
+	struct frepl_frame frame = {0};
+	frame.len = count * sizeof(struct frepl_entry);
+	for(int i = 0; i < count; i++){
+		char *start = (char *) ranges[i].start;
+		if(start < sender.base || ranges[i].len > sender.length || start - sender.base > sender.length - ranges[i].len){
+			pthread_mutex_unlock(&sender.lock);
+			return E_BAD_REPL;
+		}
+		frame.len += ranges[i].len;
+	}
+	if(frame.len > sender.capacity){
+		char *buffer = realloc(sender.buffer, frame.len);
+		if(buffer == NULL){
+			pthread_mutex_unlock(&sender.lock);
+			return E_BAD_REPL;
+		}
+		sender.buffer = buffer;
+		sender.capacity = frame.len;
+	}
+	struct frepl_entry *entries = (struct frepl_entry *) sender.buffer;
+	char *data = sender.buffer + count * sizeof(struct frepl_entry);
+	for(int i = 0; i < count; i++){
+		entries[i].offset = (char *) ranges[i].start - sender.base;
+		entries[i].len = ranges[i].len;
+		memcpy(data, ranges[i].start, ranges[i].len);
+		data += ranges[i].len;
+	}
+
+	frame.crc = fmem_crc32(0, sender.buffer, frame.len);
+	frame.magic = FREPL_MAGIC;
+	frame.count = count;
+	frame.seq = sender.seq + 1;
+	struct iovec iov[2];
+	iov[0].iov_base = &frame;
+	iov[0].iov_len = sizeof(frame);
+	iov[1].iov_base = sender.buffer;
+	iov[1].iov_len = frame.len;
+
+	int res = frepl_writev(sender.fd, iov, 2);
+	if(res == 0) sender.seq++;
+	pthread_mutex_unlock(&sender.lock);
+	return res;
+}
+
+void frepl_receiver_init(struct frepl_receiver *rx, int fd, void *base, size_t length, committer_t committer){
+	memset(rx, 0, sizeof(struct frepl_receiver));
+	rx->fd = fd;
+	rx->base = (char *) base;
+	rx->length = length;
+	rx->committer = committer;
+}
+
+void frepl_receiver_close(struct frepl_receiver *rx){
+	free(rx->buffer);
+	rx->buffer = NULL;
+	rx->capacity = 0;
+}
+
+// reads len bytes of the frame at rx->pos + at. returns 1 once all is read,
+// 0 if the stream (or the file, so far) ends first
+static int frepl_read(struct frepl_receiver *rx, bool file, void *to, size_t len, uint64_t at){
+	char *into = (char *) to;
+	while(len > 0){
+		ssize_t done = file ? pread(rx->fd, into, len, rx->pos + at) : read(rx->fd, into, len);
+		if(done < 0 && errno == EINTR) continue;
+		if(done < 0) return E_BAD_REPL;
+		if(done == 0) return 0;
+		into += done;
+		len -= done;
+		at += done;
+	}
+	return 1;
+}
+
+int64_t frepl_receive(struct frepl_receiver *rx){
+	// files are read by position so a frame that is half written is read again
+	// (whole) next time. streams can't go back, once a frame started it must end
+	bool file = lseek(rx->fd, 0, SEEK_CUR) >= 0;
+	struct frepl_frame frame = {0};
+	int got = frepl_read(rx, file, &frame, sizeof(frame), 0);
+	if(got <= 0) return got;
+
+	if(frame.magic != FREPL_MAGIC || frame.seq != rx->seq + 1 || frame.count == 0 || frame.count > UINT8_MAX) return E_BAD_REPL;
+	if(frame.len < frame.count * sizeof(struct frepl_entry) || frame.len - frame.count * sizeof(struct frepl_entry) > rx->length) return E_BAD_REPL;
+	if(frame.len > rx->capacity){
+		char *buffer = realloc(rx->buffer, frame.len);
+		if(buffer == NULL) return E_BAD_REPL;
+		rx->buffer = buffer;
+		rx->capacity = frame.len;
+	}
+	got = frepl_read(rx, file, rx->buffer, frame.len, sizeof(frame));
+	if(got < 0 || (got == 0 && !file)) return E_BAD_REPL;
+	if(got == 0) return 0;
+	if(fmem_crc32(0, rx->buffer, frame.len) != frame.crc) return E_BAD_REPL;
+
+	// every range must fit before any is applied
+	struct frepl_entry *entries = (struct frepl_entry *) rx->buffer;
+	for(uint32_t i = 0; i < frame.count; i++){
+		if(entries[i].len > rx->length || entries[i].offset > rx->length - entries[i].len) return E_BAD_REPL;
+	}
+
+	struct commit_range ranges[UINT8_MAX];
+	char *data = rx->buffer + frame.count * sizeof(struct frepl_entry);
+	for(uint32_t i = 0; i < frame.count; i++){
+		memcpy(rx->base + entries[i].offset, data, entries[i].len);
+		ranges[i].start = rx->base + entries[i].offset;
+		ranges[i].len = entries[i].len;
+		data += entries[i].len;
+	}
+	rx->seq = frame.seq;
+	rx->pos += sizeof(frame) + frame.len;
+	if(rx->committer != NULL && rx->committer(ranges, (uint8_t) frame.count) < 0) return E_COMMIT_FAILED;
+	return (int64_t) frame.seq;
+}
+
+#ifdef __UNIT_TESTING__
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include "munit/munit.h"
+
+#define repl_test_size 256 * 1024
+
+static char repl_test_primary[repl_test_size];
+static char repl_test_standby[repl_test_size];
+
+// a table of rows rooted at user1. rows are updated in place, only the
+// bytes that changed are committed so frames carry ranges inside allocations
+struct repl_test_table{
+	uint32_t count;
+	uint32_t unused;
+	rptr_t rows[];
+};
+
+static void repl_test_build(struct fmem *fm, int n){
+	struct repl_test_table *table = fmem_alloc(fm, sizeof(struct repl_test_table) + n * sizeof(rptr_t));
+	munit_assert(table > 0);
+	memset(table, 0, sizeof(struct repl_test_table) + n * sizeof(rptr_t));
+	table->count = n;
+	munit_assert(fmem_commit_mem(fm, table, sizeof(struct repl_test_table)) > 0);
+	for(int i = 0; i < n; i++){
+		uint32_t len = 64 + (i % 8) * 64;
+		char *row = fmem_alloc(fm, len);
+		munit_assert(row > 0);
+		memset(row, i, len);
+		munit_assert(fmem_commit_mem(fm, row, len) > 0);
+		rptr_set(&table->rows[i], row);
+		munit_assert(fmem_commit_mem_at(fm, table, &table->rows[i], sizeof(rptr_t)) > 0);
+	}
+	fmem_set_root(fm, 1, table);
+	munit_assert(fmem_commit_user_data(fm) >= 0);
+}
+
+// writes value to 8 bytes in the middle of row n, commits just those
+static void repl_test_update(struct fmem *fm, int n, char value){
+	struct repl_test_table *table = fmem_get_root(fm, 1);
+	char *row = rptr_get(&table->rows[n]);
+	memset(row + 32, value, 8);
+	munit_assert(fmem_commit_mem_at(fm, row, row + 32, 8) > 0);
+}
+
+// returns crc of every row there is
+static int64_t repl_test_walk(struct fmem *fm){
+	struct repl_test_table *table = fmem_get_root(fm, 1);
+	uint32_t crc = 0;
+	for(uint32_t i = 0; i < table->count; i++){
+		char *row = rptr_get(&table->rows[i]);
+		if(row != NULL) crc = fmem_crc32(crc, row, 64 + (i % 8) * 64);
+	}
+	return crc;
+}
+
+// standby persistence
+static int repl_test_committer(struct commit_range *ranges, uint8_t count){
+	return 0;
+}
+
+static void* repl_test_receive(void *arg){
+	struct frepl_receiver *rx = (struct frepl_receiver *) arg;
+	int64_t res = 0;
+	while((res = frepl_receive(rx)) > 0);
+	return (void *) res;
+}
+
+static MunitResult test_repl_socket(const MunitParameter params[], void* data){
+	int fds[2];
+	munit_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	memset(repl_test_primary, 0, repl_test_size);
+	memset(repl_test_standby, 0, repl_test_size);
+
+	munit_assert(frepl_committer(NULL, 1) == E_BAD_REPL);
+	munit_assert(frepl_start(fds[0], repl_test_primary, repl_test_size, NULL) == 0);
+	munit_assert(frepl_start(fds[0], repl_test_primary, repl_test_size, NULL) == E_BAD_REPL);
+
+	struct frepl_receiver rx;
+	frepl_receiver_init(&rx, fds[1], repl_test_standby, repl_test_size, NULL);
+	pthread_t receiver;
+	munit_assert(pthread_create(&receiver, NULL, repl_test_receive, &rx) == 0);
+
+	// everything the primary commits makes it to the standby
+	struct fmem *fm = fmem_create_new(repl_test_primary, repl_test_size, 0, frepl_committer);
+	munit_assert(fm > 0);
+	repl_test_build(fm, 200);
+	for(int i = 0; i < 200; i += 3) repl_test_update(fm, i, 'x');
+	struct repl_test_table *table = fmem_get_root(fm, 1);
+	char *first = rptr_get(&table->rows[0]);
+	rptr_set(&table->rows[0], NULL);
+	munit_assert(fmem_commit_mem_at(fm, table, &table->rows[0], sizeof(rptr_t)) > 0);
+	munit_assert(fmem_free(fm, first) > 0);
+
+	// a range outside replicated memory is refused
+	struct commit_range outside = {.start = repl_test_standby, .len = 8};
+	munit_assert(frepl_committer(&outside, 1) == E_BAD_REPL);
+
+	int64_t sent = frepl_stop();
+	munit_assert(sent > 0);
+	close(fds[0]);
+	void *res = NULL;
+	munit_assert(pthread_join(receiver, &res) == 0);
+	munit_assert(res == NULL);
+	munit_assert((int64_t) rx.seq == sent);
+	frepl_receiver_close(&rx);
+
+	// failover, standby is already there
+	uint32_t alloc_objects = fm->alloc_objects;
+	size_t available = fm->total_available;
+	int64_t sum = repl_test_walk(fm);
+	struct fmem *standby = fmem_from_existing(repl_test_standby, repl_test_committer);
+	munit_assert(standby > 0);
+	munit_assert(standby->alloc_objects == alloc_objects);
+	munit_assert(standby->total_available == available);
+	munit_assert(repl_test_walk(standby) == sum);
+	munit_assert((int64_t) fmem_alloc(standby, 1000) > 0);
+	close(fds[1]);
+	return MUNIT_OK;
+}
+
+static int repl_test_file(){
+	char path[] = "/tmp/frepl-test-XXXXXX";
+	int fd = mkstemp(path);
+	if(fd >= 0) unlink(path);
+	return fd;
+}
+
+struct repl_test_writer{
+	char *at;
+	size_t len;
+	int stop;
+};
+
+// keeps writing to memory that is being committed
+static void* repl_test_scribble(void *arg){
+	struct repl_test_writer *w = (struct repl_test_writer *) arg;
+	unsigned char value = 0;
+	while(!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) memset(w->at, value++, w->len);
+	return NULL;
+}
+
+static MunitResult test_repl_concurrent_writes(const MunitParameter params[], void* data){
+	int fd = repl_test_file();
+	munit_assert(fd >= 0);
+	memset(repl_test_primary, 0, repl_test_size);
+	memset(repl_test_standby, 0, repl_test_size);
+	munit_assert(frepl_start(fd, repl_test_primary, repl_test_size, NULL) == 0);
+	struct repl_test_writer writer = {repl_test_primary + 4096, 8192, 0};
+	pthread_t scribbler;
+	munit_assert(pthread_create(&scribbler, NULL, repl_test_scribble, &writer) == 0);
+
+	// every frame adds up while the range changes under it
+	struct commit_range ranges[3] = {
+		{.start = writer.at, .len = 4096},
+		{.start = repl_test_primary, .len = 64},
+		{.start = writer.at + 4096, .len = 4096},
+	};
+	for(int i = 0; i < 2000; i++) munit_assert(frepl_committer(ranges, 1 + i % 3) == 0);
+	__atomic_store_n(&writer.stop, 1, __ATOMIC_RELEASE);
+	munit_assert(pthread_join(scribbler, NULL) == 0);
+	munit_assert(frepl_committer(ranges, 3) == 0);
+
+	int64_t sent = frepl_stop();
+	munit_assert(sent == 2001);
+
+	struct frepl_receiver rx;
+	frepl_receiver_init(&rx, fd, repl_test_standby, repl_test_size, NULL);
+	int64_t seq = 0;
+	while((seq = frepl_receive(&rx)) > 0);
+	munit_assert(seq == 0);
+	munit_assert((int64_t) rx.seq == sent);
+	munit_assert(memcmp(repl_test_standby, repl_test_primary, 4096 + 8192) == 0);
+	frepl_receiver_close(&rx);
+	close(fd);
+	return MUNIT_OK;
+}
+
+static MunitResult test_repl_file(const MunitParameter params[], void* data){
+	int fd = repl_test_file();
+	munit_assert(fd >= 0);
+	memset(repl_test_primary, 0, repl_test_size);
+	memset(repl_test_standby, 0, repl_test_size);
+
+	munit_assert(frepl_start(fd, repl_test_primary, repl_test_size, NULL) == 0);
+	struct fmem *fm = fmem_create_new(repl_test_primary, repl_test_size, 0, frepl_committer);
+	munit_assert(fm > 0);
+	repl_test_build(fm, 50);
+	repl_test_update(fm, 49, 'x');
+	int64_t sent = frepl_stop();
+	munit_assert(sent > 2);
+
+	off_t stream_len = lseek(fd, 0, SEEK_END);
+	char *stream = malloc(stream_len);
+	munit_assert(pread(fd, stream, stream_len, 0) == stream_len);
+
+	// a file that has half of the stream so far, the frame that is cut is not
+	// applied until it is whole
+	int partial_fd = repl_test_file();
+	munit_assert(partial_fd >= 0);
+	munit_assert(write(partial_fd, stream, stream_len / 2) == stream_len / 2);
+	struct frepl_receiver rx;
+	frepl_receiver_init(&rx, partial_fd, repl_test_standby, repl_test_size, NULL);
+	int64_t seq = 0;
+	while((seq = frepl_receive(&rx)) > 0) munit_assert(seq == (int64_t) rx.seq);
+	munit_assert(seq == 0);
+	munit_assert(rx.seq > 0 && (int64_t) rx.seq < sent);
+	munit_assert(rx.pos <= (uint64_t) stream_len / 2);
+
+	munit_assert(write(partial_fd, stream + stream_len / 2, stream_len - stream_len / 2) == stream_len - stream_len / 2);
+	while((seq = frepl_receive(&rx)) > 0);
+	munit_assert(seq == 0 && (int64_t) rx.seq == sent);
+	frepl_receiver_close(&rx);
+	struct fmem *standby = fmem_from_existing(repl_test_standby, repl_test_committer);
+	munit_assert(standby > 0);
+	munit_assert(standby->alloc_objects == fm->alloc_objects);
+	munit_assert(repl_test_walk(standby) == repl_test_walk(fm));
+
+	// a frame that does not add up stops the standby before it
+	const uint64_t broken_at = stream_len - 1; // last byte of the last frame
+	stream[broken_at] ^= 0xFF;
+	int broken_fd = repl_test_file();
+	munit_assert(broken_fd >= 0);
+	munit_assert(write(broken_fd, stream, stream_len) == stream_len);
+	memset(repl_test_standby, 0, repl_test_size);
+	frepl_receiver_init(&rx, broken_fd, repl_test_standby, repl_test_size, NULL);
+	while((seq = frepl_receive(&rx)) > 0);
+	munit_assert(seq == E_BAD_REPL);
+	munit_assert((int64_t) rx.seq == sent - 1);
+	frepl_receiver_close(&rx);
+
+	free(stream);
+	close(fd);
+	close(partial_fd);
+	close(broken_fd);
+	return MUNIT_OK;
+}
+
+MunitTest frepl_tests[] = {
+	{"/repl-socket", test_repl_socket, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/repl-file", test_repl_file, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/repl-concurrent-writes", test_repl_concurrent_writes, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+static const MunitSuite frepl_test_suite = {
+	(char*) "frepl-tests",
+	frepl_tests,
+	NULL,
+	1,
+	MUNIT_SUITE_OPTION_NONE
+};
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]){
+	return munit_suite_main(&frepl_test_suite, NULL, argc, argv);
+}
+#endif
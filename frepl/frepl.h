@@ -0,0 +1,77 @@
+#ifndef __FREPL__
+#define __FREPL__
+#include <stdint.h>
+#include <stddef.h>
+#include "fmem/fmem.h"
+
+// replication ships what fmem commits to a standby. frepl_committer(..) is a
+// committer (give it to fmem_create_new(..)/fmem_from_existing(..)), every
+// call is sent as one frame (seq #, offset and length of every range, then the
+// data) on a stream: a socket, a pipe or a file opened for append. the
+// receiver applies frames to the standby memory in order, a frame all at once
+// or not at all, so the standby is always at a commit point of the primary.
+// once the primary is gone the standby attaches (fmem_from_existing(..), with
+// its own committer) to memory that is already mapped and warm.
+// -- ranges travel as offsets from the start of memory, the standby can be
+// 	 mapped anywhere.
+// -- there is one sender per process (committers take no context).
+// -- frames are sent after the next committer (local persistence) is done,
+// 	 the standby is never ahead of the primary.
+// -- ranges are copied to a buffer of the sender (kept until frepl_stop(..))
+// 	 and sent from there, memory written to while it is sent can't break a frame.
+#define FREPL_MAGIC 0x4652504C // "FRPL"
+
+#define E_BAD_REPL -14 // sender not started (or already), range outside memory, stream broken or out of order
+
+// frame on the stream, followed by count entries then the data of every entry
+struct frepl_frame{
+	uint32_t magic;
+	uint32_t count; // # of ranges
+	uint64_t seq;   // frames are numbered from 1 with no gaps
+	uint64_t len;   // # of bytes after the frame header
+	uint32_t crc;   // crc32 of everything after the frame header
+	uint32_t unused;
+};
+
+struct frepl_entry{
+	uint64_t offset; // from start of memory
+	uint64_t len;
+};
+
+// applies frames read from fd to memory of the standby
+struct frepl_receiver{
+	int fd;
+	char *base;            // standby memory
+	size_t length;
+	committer_t committer; // standby persistence, can be NULL
+	uint64_t seq;          // last frame applied
+	uint64_t pos;          // where the next frame starts if fd is a file
+	char *buffer;          // frame being read
+	size_t capacity;
+};
+
+// starts sending ranges of memory [base, base + length) committed through
+// frepl_committer(..) on fd. next is called for every range first, can be NULL
+// returns E_BAD_REPL
+int64_t frepl_start(int fd, void *base, size_t length, committer_t next);
+
+// stops sending, fd is left open
+// returns the seq # of the last frame sent, E_BAD_REPL
+int64_t frepl_stop();
+
+// committer that sends what it is given (see frepl_start(..))
+int frepl_committer(struct commit_range *ranges, uint8_t count);
+
+// sets up a receiver that applies frames from fd to [base, base + length)
+// standby memory. committer (can be NULL) is called with ranges of every frame applied
+void frepl_receiver_init(struct frepl_receiver *rx, int fd, void *base, size_t length, committer_t committer);
+
+// reads and applies the next frame. blocks on sockets and pipes, on files a
+// frame not (completely) written yet is not read
+// returns the seq # of the frame, 0 if there is no frame (end of stream),
+// E_BAD_REPL if the stream is broken, E_COMMIT_FAILED
+int64_t frepl_receive(struct frepl_receiver *rx);
+
+// frees what the receiver holds, fd is left open
+void frepl_receiver_close(struct frepl_receiver *rx);
+#endif
@@ -0,0 +1,413 @@
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "list/list.h"
+#include "fmem/fmem.h"
+#include "fslab.h"
+
+// # of pages freed by one fmem_free_many(..) call
+#define FSLAB_RELEASE_BATCH 32
+
+// a slab page starts with this header, objects follow it. the page is os
+// page aligned, so an object finds its page by aligning its address down
+struct fslab_page{
+	struct rlist_head list; // in one of the slab lists. must be first
+	uint32_t used;          // # of busy slots
+	uint32_t hint;          // map words before this one have no free slot
+	uint64_t map[];         // a bit per slot, set when busy
+};
+
+static inline struct fmem* fslab_fm(struct fmem_slab *slab){
+	return (struct fmem *) rptr_get(&slab->fm);
+}
+
+static inline uint32_t fslab_map_words(uint32_t per_page){
+	return (per_page + 63) / 64;
+}
+
+static inline struct fslab_page* fslab_page_of(struct fmem_slab *slab, void *mem){
+	return (struct fslab_page *) ((uintptr_t) mem & ~((uintptr_t) slab->page_size - 1));
+}
+
+// slab and pages are allocations of their own, so they are committed
+// via fmem_commit_mem(..). nothing to do if fmem is not persisted
+static inline int fslab_commit(struct fmem *fm, void *mem, uint32_t len){
+	if(fmem_committer(fm) == NULL) return 0;
+	return fmem_commit_mem(fm, mem, len) < 0 ? E_COMMIT_FAILED : 0;
+}
+
+// commits a link of a slab list. list heads are in the slab, every op
+// commits the slab anyway
+static int fslab_commit_link(struct fmem_slab *slab, struct rlist_head *link){
+	char *at = (char *) link;
+	if(at >= (char *) slab && at < (char *) (slab + 1)) return 0;
+	return fslab_commit(fslab_fm(slab), at, sizeof(struct rlist_head));
+}
+
+// moves a page to the front of list, its own link is committed with its header
+static int fslab_move(struct fmem_slab *slab, struct fslab_page *page, struct rlist_head *list){
+	struct rlist_head *prev = rlist_prev(&page->list);
+	struct rlist_head *next = rlist_next(&page->list);
+	rlist_remove_at(&page->list);
+	rlist_add_after(list, &page->list);
+
+	int res = fslab_commit_link(slab, prev);
+	res |= fslab_commit_link(slab, next);
+	res |= fslab_commit_link(slab, rlist_next(&page->list));
+	return res;
+}
+
+// releases up to count pages from the front of list to fmem. pages leave
+// the slab (committed) before they are freed, we leak them on a crash in
+// between instead of keeping freed pages in the slab
+static int64_t fslab_release(struct fmem_slab *slab, struct rlist_head *list, uint32_t count){
+	struct fmem *fm = fslab_fm(slab);
+	void *pages[FSLAB_RELEASE_BATCH];
+	int64_t released = 0;
+
+	while(count > 0 && rlist_next(list) != list){
+		uint32_t batch = 0;
+		while(batch < FSLAB_RELEASE_BATCH && count > 0 && rlist_next(list) != list){
+			struct fslab_page *page = rlist_entry(rlist_next(list), struct fslab_page, list);
+			rlist_remove_at(&page->list);
+			slab->objects -= page->used;
+			slab->pages--;
+			if(list == &slab->empty) slab->empty_pages--;
+			pages[batch++] = page;
+			count--;
+		}
+
+		int res = fslab_commit_link(slab, rlist_next(list));
+		res |= fslab_commit(fm, slab, sizeof(struct fmem_slab));
+		if(res != 0 || fmem_free_many(fm, pages, batch) < 0) return E_COMMIT_FAILED;
+		released += batch;
+	}
+	return released;
+}
+
+struct fmem_slab* fmem_slab_create(struct fmem *fm, uint32_t obj_size){
+	uint32_t page_size = (uint32_t) sysconf(_SC_PAGESIZE);
+	if(obj_size == 0 || obj_size > page_size) return (void *) E_BAD_SLAB_SIZE;
+	obj_size = (obj_size + 7) & ~7u; // objects are 8 bytes aligned
+
+	// as many objects as fit with a bit each, the header is then rounded up
+	// and may take a few of them back
+	uint32_t base = offsetof(struct fslab_page, map);
+	uint32_t per_page = (uint32_t) (((uint64_t) (page_size - base) * 8) / ((uint64_t) obj_size * 8 + 1));
+	uint32_t header_size = 0;
+	for(; per_page > 0; per_page--){
+		header_size = (base + fslab_map_words(per_page) * sizeof(uint64_t) + 15) & ~15u;
+		if(header_size + per_page * obj_size <= page_size) break;
+	}
+	if(per_page < FSLAB_MIN_OBJECTS) return (void *) E_BAD_SLAB_SIZE;
+
+	struct fmem_slab *slab = (struct fmem_slab *) fmem_alloc(fm, sizeof(struct fmem_slab));
+	if((int64_t) slab <= 0) return slab;
+
+	memset(slab, 0, sizeof(struct fmem_slab));
+	rptr_set(&slab->fm, fm);
+	slab->obj_size = obj_size;
+	slab->page_size = page_size;
+	slab->header_size = header_size;
+	slab->per_page = per_page;
+	rlist_head_init(&slab->partial);
+	rlist_head_init(&slab->full);
+	rlist_head_init(&slab->empty);
+
+	if(fslab_commit(fm, slab, sizeof(struct fmem_slab)) != 0) return (void *) E_COMMIT_FAILED;
+	return slab;
+}
+
+void* fmem_slab_alloc(struct fmem_slab *slab){
+	struct fmem *fm = fslab_fm(slab);
+	int res = 0;
+
+	// a page with a free slot. empty pages are reused before we go to fmem
+	struct fslab_page *page = NULL;
+	if(rlist_next(&slab->partial) != &slab->partial){
+		page = rlist_entry(rlist_next(&slab->partial), struct fslab_page, list);
+	}else if(slab->empty_pages > 0){
+		page = rlist_entry(rlist_next(&slab->empty), struct fslab_page, list);
+		slab->empty_pages--;
+		res |= fslab_move(slab, page, &slab->partial);
+	}else{
+		page = (struct fslab_page *) fmem_alloc_aligned(fm, slab->page_size, slab->page_size);
+		if((int64_t) page <= 0) return page;
+		memset(page, 0, slab->header_size);
+		rlist_add_after(&slab->partial, &page->list);
+		res |= fslab_commit_link(slab, rlist_next(&page->list));
+		slab->pages++;
+	}
+
+	// a partial page has a free slot at or after its hint. bits past the
+	// last slot are never looked at, words before them are full
+	uint32_t word = page->hint;
+	while(page->map[word] == UINT64_MAX) word++;
+	uint32_t bit = __builtin_ctzll(~page->map[word]);
+	page->map[word] |= 1ULL << bit;
+	page->hint = word;
+	page->used++;
+	slab->objects++;
+	if(page->used == slab->per_page) res |= fslab_move(slab, page, &slab->full);
+
+	res |= fslab_commit(fm, page, slab->header_size);
+	res |= fslab_commit(fm, slab, sizeof(struct fmem_slab));
+	if(res != 0) return (void *) E_COMMIT_FAILED;
+	return ((char *) page) + slab->header_size + (word * 64 + bit) * slab->obj_size;
+}
+
+int64_t fmem_slab_free(struct fmem_slab *slab, void *mem){
+	struct fmem *fm = fslab_fm(slab);
+	struct fslab_page *page = fslab_page_of(slab, mem);
+	uintptr_t offset = (char *) mem - (char *) page;
+	if(offset < slab->header_size || (offset - slab->header_size) % slab->obj_size != 0) return E_BAD_SLAB_MEM;
+
+	uint32_t slot = (offset - slab->header_size) / slab->obj_size;
+	uint32_t word = slot / 64;
+	uint64_t mask = 1ULL << (slot % 64);
+	if(slot >= slab->per_page || (page->map[word] & mask) == 0) return E_BAD_SLAB_MEM;
+
+	int res = 0;
+	bool was_full = (page->used == slab->per_page);
+	page->map[word] &= ~mask;
+	if(word < page->hint) page->hint = word;
+	page->used--;
+	slab->objects--;
+
+	if(page->used == 0){
+		res |= fslab_move(slab, page, &slab->empty);
+		slab->empty_pages++;
+	}else if(was_full){
+		res |= fslab_move(slab, page, &slab->partial);
+	}
+	res |= fslab_commit(fm, page, slab->header_size);
+	res |= fslab_commit(fm, slab, sizeof(struct fmem_slab));
+
+	// too many empty pages, they go back together
+	if(res == 0 && slab->empty_pages > FSLAB_KEEP_EMPTY){
+		if(fslab_release(slab, &slab->empty, slab->empty_pages - 1) < 0) res = E_COMMIT_FAILED;
+	}
+	return res != 0 ? E_COMMIT_FAILED : slab->obj_size;
+}
+
+int64_t fmem_slab_shrink(struct fmem_slab *slab){
+	return fslab_release(slab, &slab->empty, slab->empty_pages);
+}
+
+int64_t fmem_slab_destroy(struct fmem_slab *slab){
+	struct fmem *fm = fslab_fm(slab);
+	if(fslab_release(slab, &slab->partial, UINT32_MAX) < 0) return E_COMMIT_FAILED;
+	if(fslab_release(slab, &slab->full, UINT32_MAX) < 0) return E_COMMIT_FAILED;
+	if(fslab_release(slab, &slab->empty, UINT32_MAX) < 0) return E_COMMIT_FAILED;
+	return fmem_free(fm, slab) < 0 ? E_COMMIT_FAILED : 0;
+}
+
+#ifdef __UNIT_TESTING__
+#include <stdio.h>
+#include <stdlib.h>
+#include "munit/munit.h"
+#include "things.h"
+
+#define slab_test_size 256 * 1024
+static char slab_test_live[slab_test_size] __attribute__((aligned(4096)));
+static char slab_test_disk[slab_test_size];
+
+// copies committed ranges to a disk image, a crash is a copy back
+static int slab_test_committer(struct commit_range *ranges, uint8_t count){
+	for(int i = 0; i < count; i++){
+		size_t offset = (char *) ranges[i].start - slab_test_live;
+		if(offset + ranges[i].len > slab_test_size) return -1;
+		memcpy(slab_test_disk + offset, ranges[i].start, ranges[i].len);
+	}
+	return 0;
+}
+
+static struct fmem* slab_test_fmem(committer_t committer){
+	memset(slab_test_live, 0, slab_test_size);
+	memset(slab_test_disk, 0, slab_test_size);
+	struct fmem *fm = fmem_create_new(slab_test_live, slab_test_size, 0, committer);
+	if(committer != NULL) memcpy(slab_test_disk, slab_test_live, slab_test_size);
+	return fm;
+}
+
+// counts busy bits of every page and checks pages are in the right list
+static bool slab_consistent(struct fmem_slab *slab){
+	struct rlist_head *lists[] = {&slab->partial, &slab->full, &slab->empty};
+	uint64_t objects = 0;
+	uint32_t pages = 0;
+	uint32_t empty = 0;
+
+	for(int i = 0; i < 3; i++){
+		struct rlist_head *current = lists[i];
+		rlist_for_each(current, lists[i]){
+			struct fslab_page *page = rlist_entry(current, struct fslab_page, list);
+			uint32_t used = 0;
+			for(uint32_t word = 0; word < fslab_map_words(slab->per_page); word++) used += __builtin_popcountll(page->map[word]);
+			if(used != page->used) return false;
+			if(i == 0 && (used == 0 || used == slab->per_page)) return false;
+			if(i == 1 && used != slab->per_page) return false;
+			if(i == 2 && used != 0) return false;
+			if(i == 2) empty++;
+			objects += used;
+			pages++;
+		}
+	}
+	return objects == slab->objects && pages == slab->pages && empty == slab->empty_pages;
+}
+
+static MunitResult test_slab_create(const MunitParameter params[], void* data){
+	struct fmem *fm = slab_test_fmem(NULL);
+	munit_assert(fm > 0);
+	uint32_t page_size = (uint32_t) sysconf(_SC_PAGESIZE);
+
+	munit_assert(fmem_slab_create(fm, 0) == (void *) E_BAD_SLAB_SIZE);
+	munit_assert(fmem_slab_create(fm, page_size) == (void *) E_BAD_SLAB_SIZE);
+	munit_assert(fmem_slab_create(fm, page_size / 4) == (void *) E_BAD_SLAB_SIZE);
+
+	uint32_t sizes[] = {1, 8, sizeof(struct thing), 100, page_size / FSLAB_MIN_OBJECTS - 64};
+	for(int i = 0; i < 5; i++){
+		struct fmem_slab *slab = fmem_slab_create(fm, sizes[i]);
+		munit_assert(slab > 0);
+		munit_assert(slab->obj_size >= sizes[i] && slab->obj_size % 8 == 0);
+		munit_assert(slab->per_page >= FSLAB_MIN_OBJECTS);
+		munit_assert(slab->header_size >= offsetof(struct fslab_page, map) + fslab_map_words(slab->per_page) * sizeof(uint64_t));
+		munit_assert(slab->header_size + slab->per_page * slab->obj_size <= page_size);
+		// nothing more can fit
+		uint32_t more_header = (offsetof(struct fslab_page, map) + fslab_map_words(slab->per_page + 1) * sizeof(uint64_t) + 15) & ~15u;
+		munit_assert(more_header + (slab->per_page + 1) * slab->obj_size > page_size);
+		munit_assert(fmem_slab_destroy(slab) == 0);
+	}
+	munit_assert(fm->alloc_objects == 0);
+	return MUNIT_OK;
+}
+
+static MunitResult test_slab_alloc_free(const MunitParameter params[], void* data){
+	struct fmem *fm = slab_test_fmem(NULL);
+	munit_assert(fm > 0);
+	size_t available = fm->total_available;
+
+	struct fmem_slab *slab = fmem_slab_create(fm, sizeof(struct thing));
+	munit_assert(slab > 0);
+	uint32_t count = slab->per_page * 6 + 3;
+	void **mems = calloc(count, sizeof(void *));
+
+	for(uint32_t i = 0; i < count; i++){
+		mems[i] = fmem_slab_alloc(slab);
+		munit_assert(mems[i] > 0);
+		munit_assert(((uintptr_t) mems[i] & 7) == 0);
+		memset(mems[i], i & 0xFF, sizeof(struct thing));
+	}
+	munit_assert(slab->pages == 7);
+	munit_assert(slab->objects == count);
+	munit_assert(slab_consistent(slab));
+	for(uint32_t i = 0; i < count; i++) munit_assert(((unsigned char *) mems[i])[sizeof(struct thing) - 1] == (i & 0xFF));
+
+	// freed slots are reused first
+	munit_assert(fmem_slab_free(slab, mems[10]) == slab->obj_size);
+	munit_assert(fmem_slab_free(slab, mems[3]) == slab->obj_size);
+	munit_assert(slab_consistent(slab));
+	munit_assert(fmem_slab_alloc(slab) == mems[3]);
+	munit_assert(fmem_slab_alloc(slab) == mems[10]);
+	munit_assert(slab->pages == 7);
+
+	// not ours, or not busy
+	munit_assert(fmem_slab_free(slab, ((char *) mems[5]) + 4) == E_BAD_SLAB_MEM);
+	munit_assert(fmem_slab_free(slab, fslab_page_of(slab, mems[5])) == E_BAD_SLAB_MEM);
+	munit_assert(fmem_slab_free(slab, mems[5]) > 0);
+	munit_assert(fmem_slab_free(slab, mems[5]) == E_BAD_SLAB_MEM);
+	mems[5] = fmem_slab_alloc(slab);
+
+	// empty pages are kept up to FSLAB_KEEP_EMPTY then go back to fmem
+	for(uint32_t i = 0; i < count; i++){
+		munit_assert(fmem_slab_free(slab, mems[i]) > 0);
+		munit_assert(slab->empty_pages <= FSLAB_KEEP_EMPTY);
+	}
+	munit_assert(slab->objects == 0);
+	munit_assert(slab->pages == slab->empty_pages);
+	munit_assert(slab_consistent(slab));
+
+	// empty pages serve allocs before fmem does
+	uint32_t pages = slab->pages;
+	void *mem = fmem_slab_alloc(slab);
+	munit_assert(mem > 0);
+	munit_assert(slab->pages == pages && slab->empty_pages == pages - 1);
+	munit_assert(fmem_slab_free(slab, mem) > 0);
+
+	munit_assert(fmem_slab_shrink(slab) == pages);
+	munit_assert(slab->pages == 0);
+	munit_assert(slab_consistent(slab));
+
+	// destroy frees everything, busy objects included
+	for(uint32_t i = 0; i < count; i++) munit_assert(fmem_slab_alloc(slab) > 0);
+	munit_assert(fmem_slab_destroy(slab) == 0);
+	munit_assert(fm->alloc_objects == 0);
+	munit_assert(fm->total_available == available);
+	free(mems);
+	return MUNIT_OK;
+}
+
+static MunitResult test_slab_persisted(const MunitParameter params[], void* data){
+	struct fmem *fm = slab_test_fmem(slab_test_committer);
+	munit_assert(fm > 0);
+
+	struct fmem_slab *slab = fmem_slab_create(fm, sizeof(struct thing));
+	munit_assert(slab > 0);
+	fmem_set_root(fm, 1, slab);
+	munit_assert(fmem_commit_user_data(fm) > 0);
+
+	void *mems[300] = {0};
+	for(int i = 0; i < 300; i++){
+		mems[i] = fmem_slab_alloc(slab);
+		munit_assert(mems[i] > 0);
+		struct thing *this_thing = (struct thing *) mems[i];
+		this_thing->value = (char) i;
+		munit_assert(fmem_commit_mem(fm, fslab_page_of(slab, mems[i]), slab->page_size) > 0);
+	}
+	for(int i = 0; i < 300; i += 3) munit_assert(fmem_slab_free(slab, mems[i]) > 0);
+	uint64_t objects = slab->objects;
+	uint32_t pages = slab->pages;
+
+	// crash, everything we did is on disk
+	memcpy(slab_test_live, slab_test_disk, slab_test_size);
+	fm = fmem_from_existing(slab_test_live, slab_test_committer);
+	munit_assert(fm > 0);
+	slab = fmem_get_root(fm, 1);
+	munit_assert(slab->objects == objects && slab->pages == pages);
+	munit_assert(slab_consistent(slab));
+	for(int i = 1; i < 300; i += 3) munit_assert(((struct thing *) mems[i])->value == (char) i);
+
+	// busy objects are never handed out again
+	for(int i = 0; i < 200; i++){
+		void *mem = fmem_slab_alloc(slab);
+		munit_assert(mem > 0);
+		for(int j = 0; j < 300; j++){
+			if(j % 3 != 0) munit_assert(mem != mems[j]);
+		}
+	}
+	munit_assert(slab_consistent(slab));
+	munit_assert(fmem_slab_destroy(slab) == 0);
+	munit_assert(fm->alloc_objects == 0);
+	return MUNIT_OK;
+}
+
+MunitTest fslab_tests[] = {
+	{"/slab-create", test_slab_create, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/slab-alloc-free", test_slab_alloc_free, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/slab-persisted", test_slab_persisted, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+static const MunitSuite fslab_test_suite = {
+	(char*) "fslab-tests",
+	fslab_tests,
+	NULL,
+	1,
+	MUNIT_SUITE_OPTION_NONE
+};
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]){
+	return munit_suite_main(&fslab_test_suite, NULL, argc, argv);
+}
+#endif
@@ -0,0 +1,57 @@
+#ifndef __FSLAB__
+#define __FSLAB__
+#include <stdint.h>
+#include "list/list.h"
+#include "fmem/fmem.h"
+
+// a slab hands out fixed size objects carved out of os page sized (and
+// aligned) slab pages it allocates from fmem. objects carry no header, a
+// slab page starts with a small header (list link, # of used slots and a
+// bitmap of busy slots) and the page an object belongs to is found by
+// aligning its address down. the slab itself and its pages live in fmem
+// memory, so occupancy survives restarts and the slab can be stashed as
+// a root (fmem_set_root(..)).
+// -- slab pages are pinned (aligned allocs), compaction does not move them.
+// -- a slab is not locked, callers that share one must serialize access.
+// -- a slab page that empties is kept for reuse, once more than
+// 	 FSLAB_KEEP_EMPTY pages are empty all but one go back to fmem at once.
+#define FSLAB_KEEP_EMPTY 4
+#define FSLAB_MIN_OBJECTS 8 // a slab page holds at least that many objects
+
+#define E_BAD_SLAB_SIZE -7 // obj size is 0 or too big for FSLAB_MIN_OBJECTS per slab page
+#define E_BAD_SLAB_MEM -8 // memory is not a busy object of this slab
+
+struct fmem_slab{
+	rptr_t fm;              // fmem the slab allocates from
+	uint32_t obj_size;      // size of each object (rounded up to 8 bytes)
+	uint32_t page_size;     // size (and alignment) of slab pages
+	uint32_t header_size;   // slab page header, objects start after it
+	uint32_t per_page;      // # of objects in a slab page
+	uint32_t pages;         // # of slab pages
+	uint32_t empty_pages;   // # of pages in empty list
+	uint64_t objects;       // # of objects allocated
+	struct rlist_head partial; // slab pages with used and free slots
+	struct rlist_head full;    // slab pages with no free slots
+	struct rlist_head empty;   // slab pages with no used slots
+};
+
+// creates a slab (in fmem memory) for objects of obj_size
+// returns E_BAD_SLAB_SIZE, FMEM_E_NOMEM, E_COMMIT_FAILED
+struct fmem_slab* fmem_slab_create(struct fmem *fm, uint32_t obj_size);
+
+// allocates an object
+// returns FMEM_E_NOMEM, E_COMMIT_FAILED
+void* fmem_slab_alloc(struct fmem_slab *slab);
+
+// frees an object, returns the object size
+// returns E_BAD_SLAB_MEM, E_COMMIT_FAILED
+int64_t fmem_slab_free(struct fmem_slab *slab, void *mem);
+
+// gives every empty slab page back to fmem, returns # of pages freed
+// returns E_COMMIT_FAILED
+int64_t fmem_slab_shrink(struct fmem_slab *slab);
+
+// frees every slab page (objects included) and the slab itself
+// returns E_COMMIT_FAILED
+int64_t fmem_slab_destroy(struct fmem_slab *slab);
+#endif
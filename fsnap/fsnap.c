@@ -0,0 +1,252 @@
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fmem/fmem.h"
+#include "fsnap.h"
+
+// older headers may not have it
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+// fmem sits right after its head page, in memory and in the image
+#define FSNAP_FM_OFFSET sizeof(struct fmem_page)
+
+struct fsnap_target{
+	int src_fd;
+	int dst_fd;
+};
+
+static int fsnap_pwrite(int fd, const void *from, size_t len, off_t offset){
+	const char *at = (const char *) from;
+	while(len > 0){
+		ssize_t done = pwrite(fd, at, len, offset);
+		if(done <= 0) return E_BAD_SNAPSHOT;
+		at += done;
+		len -= done;
+		offset += done;
+	}
+	return 0;
+}
+
+// runs holding fm lock, a copy holds it for as long as all of memory is written
+static int64_t fsnap_take(struct fmem *fm, void *ctx){
+	struct fsnap_target *target = (struct fsnap_target *) ctx;
+	char *head = ((char *) fm) - FSNAP_FM_OFFSET;
+
+	fm->snapshot_epoch++;
+	committer_t committer = fmem_committer(fm);
+	if(committer != NULL){
+		struct commit_range r = {0};
+		r.start = &fm->snapshot_epoch;
+		r.len = sizeof(fm->snapshot_epoch);
+		if(committer(&r, 1) < 0) return E_COMMIT_FAILED;
+	}
+
+	if(ftruncate(target->dst_fd, 0) != 0) return E_BAD_SNAPSHOT;
+	bool cloned = target->src_fd >= 0 && ioctl(target->dst_fd, FICLONE, target->src_fd) == 0;
+	if(!cloned && fsnap_pwrite(target->dst_fd, head, fmem_length(fm), 0) != 0) return E_BAD_SNAPSHOT;
+
+	// the image is taken holding the lock, in the image it must be free
+	uint32_t lock[2] = {0};
+	if(fsnap_pwrite(target->dst_fd, lock, sizeof(lock), FSNAP_FM_OFFSET + offsetof(struct fmem, lock)) != 0) return E_BAD_SNAPSHOT;
+	return (int64_t) fm->snapshot_epoch;
+}
+
+int64_t fmem_snapshot(struct fmem *fm, int src_fd, int dst_fd){
+	struct fsnap_target target = {.src_fd = src_fd, .dst_fd = dst_fd};
+	return fmem_run_locked(fm, fsnap_take, &target);
+}
+
+struct fmem* fmem_snapshot_open(int fd){
+	struct stat st = {0};
+	struct fmem header = {0};
+	if(fstat(fd, &st) != 0 || st.st_size < (off_t) (FSNAP_FM_OFFSET + sizeof(struct fmem))) return (void *) E_BAD_SNAPSHOT;
+	if(pread(fd, &header, sizeof(header), FSNAP_FM_OFFSET) != sizeof(header)) return (void *) E_BAD_SNAPSHOT;
+	if(header.total_size < FSNAP_FM_OFFSET + sizeof(struct fmem) || fmem_length(&header) > (size_t) st.st_size) return (void *) E_BAD_SNAPSHOT;
+
+	// private, attaching (and anything readers do) stays in this process
+	void *mem = mmap(NULL, fmem_length(&header), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if(mem == MAP_FAILED) return (void *) E_BAD_SNAPSHOT;
+
+	struct fmem *snap = fmem_from_existing(mem, NULL);
+	if((int64_t) snap < 0){
+		munmap(mem, fmem_length(&header));
+		return (void *) E_BAD_SNAPSHOT;
+	}
+	return snap;
+}
+
+int64_t fmem_snapshot_close(struct fmem *snap){
+	return munmap(((char *) snap) - FSNAP_FM_OFFSET, fmem_length(snap)) == 0 ? 0 : E_BAD_SNAPSHOT;
+}
+
+#ifdef __UNIT_TESTING__
+#include <stdio.h>
+#include <stdlib.h>
+#include "munit/munit.h"
+
+#define snap_test_size 1024 * 1024
+#define snap_test_objects 100
+
+// a ledger of counters, the counters are a huge alloc so images carry the
+// huge zone (and its extent table) too
+struct snap_test_ledger{
+	uint64_t count;
+	rptr_t values;
+};
+
+static int snap_test_file(){
+	char path[] = "/tmp/fsnap-test-XXXXXX";
+	int fd = mkstemp(path);
+	if(fd >= 0) unlink(path);
+	return fd;
+}
+
+static struct fmem* snap_test_fmem(char *mem){
+	struct fmem_options opts = {0};
+	opts.huge_size = snap_test_size / 2;
+	struct fmem *fm = fmem_create_new_opts(mem, snap_test_size, &opts);
+	munit_assert(fm > 0 && fm->huge_size > 0);
+	return fm;
+}
+
+// roots a ledger at user1, values are 0..n-1
+static void snap_test_build(struct fmem *fm){
+	struct snap_test_ledger *ledger = fmem_alloc(fm, sizeof(struct snap_test_ledger));
+	munit_assert(ledger > 0);
+	uint64_t *values = fmem_alloc_huge(fm, snap_test_objects * sizeof(uint64_t));
+	munit_assert(values > 0);
+	for(int i = 0; i < snap_test_objects; i++) values[i] = i;
+	ledger->count = snap_test_objects;
+	rptr_set(&ledger->values, values);
+	fmem_set_root(fm, 1, ledger);
+}
+
+// copies the counters to a new huge alloc with one of them moved on, the old
+// one is freed
+static void snap_test_move_on(struct fmem *fm, int n, uint64_t by){
+	struct snap_test_ledger *ledger = fmem_get_root(fm, 1);
+	uint64_t *values = fmem_alloc_huge(fm, ledger->count * sizeof(uint64_t));
+	munit_assert(values > 0);
+	uint64_t *old = rptr_get(&ledger->values);
+	memcpy(values, old, ledger->count * sizeof(uint64_t));
+	values[n] += by;
+	rptr_set(&ledger->values, values);
+	munit_assert(fmem_free(fm, old) > 0);
+}
+
+// returns sum of the counters of the ledger at user1, -1 if there is none
+static int64_t snap_test_walk(struct fmem *fm){
+	struct snap_test_ledger *ledger = fmem_get_root(fm, 1);
+	if(ledger == NULL) return -1;
+	uint64_t *values = rptr_get(&ledger->values);
+	int64_t sum = 0;
+	for(uint64_t i = 0; i < ledger->count; i++) sum += values[i];
+	return sum;
+}
+
+static MunitResult test_snapshot_file(const MunitParameter params[], void* data){
+	int src_fd = snap_test_file();
+	int dst_fd = snap_test_file();
+	munit_assert(src_fd >= 0 && dst_fd >= 0);
+	munit_assert(ftruncate(src_fd, snap_test_size) == 0);
+	char *mem = mmap(NULL, snap_test_size, PROT_READ | PROT_WRITE, MAP_SHARED, src_fd, 0);
+	munit_assert(mem != MAP_FAILED);
+
+	struct fmem *fm = snap_test_fmem(mem);
+	snap_test_build(fm);
+	int64_t sum = snap_test_walk(fm);
+	uint32_t huge_count = fm->huge_count;
+	munit_assert(fmem_snapshot(fm, src_fd, dst_fd) == 1);
+	munit_assert(fm->snapshot_epoch == 1);
+
+	// live fmem moves on
+	snap_test_move_on(fm, 1, 1000);
+	munit_assert(snap_test_walk(fm) == sum + 1000);
+	munit_assert(fm->huge_count == huge_count + 1);
+
+	// the image does not
+	struct fmem *snap = fmem_snapshot_open(dst_fd);
+	munit_assert((int64_t) snap > 0);
+	munit_assert(snap != fm);
+	munit_assert(snap->snapshot_epoch == 1);
+	munit_assert(snap->huge_count == huge_count);
+	munit_assert(snap_test_walk(snap) == sum);
+
+	// what readers do stays in their view
+	munit_assert(fmem_alloc_huge(snap, 100) > 0);
+	munit_assert(fmem_snapshot_close(snap) == 0);
+	snap = fmem_snapshot_open(dst_fd);
+	munit_assert((int64_t) snap > 0);
+	munit_assert(snap->huge_count == huge_count);
+	munit_assert(fmem_snapshot_close(snap) == 0);
+
+	// next snapshot has the next epoch and what changed
+	munit_assert(fmem_snapshot(fm, src_fd, dst_fd) == 2);
+	snap = fmem_snapshot_open(dst_fd);
+	munit_assert((int64_t) snap > 0);
+	munit_assert(snap->snapshot_epoch == 2);
+	munit_assert(snap->huge_count == huge_count + 1);
+	munit_assert(snap->huge_available == fm->huge_available);
+	munit_assert(snap_test_walk(snap) == snap_test_walk(fm));
+	munit_assert(fmem_snapshot_close(snap) == 0);
+
+	munit_assert(munmap(mem, snap_test_size) == 0);
+	close(src_fd);
+	close(dst_fd);
+	return MUNIT_OK;
+}
+
+static MunitResult test_snapshot_memory(const MunitParameter params[], void* data){
+	int dst_fd = snap_test_file();
+	munit_assert(dst_fd >= 0);
+	munit_assert((int64_t) fmem_snapshot_open(dst_fd) == E_BAD_SNAPSHOT);
+
+	char *mem = mmap(NULL, snap_test_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	munit_assert(mem != MAP_FAILED);
+	struct fmem *fm = snap_test_fmem(mem);
+	snap_test_build(fm);
+	snap_test_move_on(fm, 0, 7);
+
+	// no backing file, memory is copied
+	munit_assert(fmem_snapshot(fm, -1, dst_fd) == 1);
+	struct fmem *snap = fmem_snapshot_open(dst_fd);
+	munit_assert((int64_t) snap > 0);
+	munit_assert(snap_test_walk(snap) == snap_test_walk(fm));
+	munit_assert(snap->lock == 0);
+	munit_assert(fmem_committer(snap) == NULL);
+	munit_assert(fmem_snapshot_close(snap) == 0);
+
+	// not an image
+	munit_assert(ftruncate(dst_fd, 0) == 0);
+	munit_assert(ftruncate(dst_fd, 4096) == 0);
+	munit_assert((int64_t) fmem_snapshot_open(dst_fd) == E_BAD_SNAPSHOT);
+	munit_assert(munmap(mem, snap_test_size) == 0);
+	close(dst_fd);
+	return MUNIT_OK;
+}
+
+MunitTest fsnap_tests[] = {
+	{"/snapshot-file", test_snapshot_file, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/snapshot-memory", test_snapshot_memory, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+static const MunitSuite fsnap_test_suite = {
+	(char*) "fsnap-tests",
+	fsnap_tests,
+	NULL,
+	1,
+	MUNIT_SUITE_OPTION_NONE
+};
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]){
+	return munit_suite_main(&fsnap_test_suite, NULL, argc, argv);
+}
+#endif
@@ -0,0 +1,38 @@
+#ifndef __FSNAP__
+#define __FSNAP__
+#include <stdint.h>
+#include <stddef.h>
+#include "fmem/fmem.h"
+
+// snapshots are point in time images of fmem memory written to a file. the
+// image is taken holding fmem lock, so the allocator state in it is
+// consistent (allocs and frees wait, writers of user memory do not). on a
+// file system that can share extents (btrfs, xfs) the image is a reflink of
+// the backing file and costs a metadata update, anywhere else fmem memory is
+// copied into the file. every snapshot gets an epoch (fmem->snapshot_epoch
+// in the image), readers map images privately with fmem_snapshot_open(..)
+// and walk user1..user4 rooted data without locks, live fmem never changes
+// what they see. an image is pinned for as long as it is open.
+// -- user memory written while a snapshot is taken may be caught half way,
+// 	 callers that need it whole must pause their writers.
+// -- the copy (no reflink) is all of fmem memory written holding the lock,
+// 	 allocs and frees of every process wait for O(fmem_length(..)) of i/o.
+// 	 bodies can't be copied before the lock is taken, a page moved meanwhile
+// 	 (compaction, realloc) would be in the image with what was there before.
+// -- images are not synced, fsync(2) the file for a backup that survives a crash.
+#define E_BAD_SNAPSHOT -12 // image could not be written or read, or is not an fmem image
+
+// writes an image of fm to dst_fd (truncated first). src_fd is the file fm
+// is mapped from (fm created at the start of its mapping), it is reflinked if
+// the file system can. src_fd < 0 (or no reflink) copies from memory
+// returns the epoch of the image, E_BAD_SNAPSHOT, E_COMMIT_FAILED
+int64_t fmem_snapshot(struct fmem *fm, int src_fd, int dst_fd);
+
+// maps the image in fd privately (nothing is ever written back to it)
+// returns fmem of the image, E_BAD_SNAPSHOT
+struct fmem* fmem_snapshot_open(int fd);
+
+// unmaps an image opened by fmem_snapshot_open(..)
+// returns E_BAD_SNAPSHOT
+int64_t fmem_snapshot_close(struct fmem *snap);
+#endif
@@ -0,0 +1,316 @@
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "list/list.h"
+#include "fmem/fmem.h"
+#include "fvec.h"
+
+static inline struct fmem* fvec_fm(struct fmem_vec *vec){
+	return (struct fmem *) rptr_get(&vec->fm);
+}
+
+// vector and elements are allocations of their own, ranges inside them are
+// committed via fmem_commit_mem_at(..). nothing to do if fmem is not persisted
+static inline int fvec_commit(struct fmem *fm, void *mem, void *at, uint64_t len){
+	if(fmem_committer(fm) == NULL || len == 0) return 0;
+	return fmem_commit_mem_at(fm, mem, at, (uint32_t) len) < 0 ? E_COMMIT_FAILED : 0;
+}
+
+static inline int fvec_commit_header(struct fmem_vec *vec){
+	return fvec_commit(fvec_fm(vec), vec, vec, sizeof(struct fmem_vec));
+}
+
+static inline int fvec_commit_elem(struct fmem_vec *vec, uint64_t i){
+	char *data = (char *) rptr_get(&vec->data);
+	return fvec_commit(fvec_fm(vec), data, data + i * vec->elem_size, vec->elem_size);
+}
+
+struct fmem_vec* fmem_vec_create(struct fmem *fm, uint32_t elem_size, uint64_t cap){
+	if(elem_size == 0) return (void *) E_BAD_VEC;
+
+	struct fmem_vec *vec = (struct fmem_vec *) fmem_alloc(fm, sizeof(struct fmem_vec));
+	if((int64_t) vec <= 0) return vec;
+
+	memset(vec, 0, sizeof(struct fmem_vec));
+	rptr_set(&vec->fm, fm);
+	vec->elem_size = elem_size;
+	if(fvec_commit_header(vec) != 0){
+		fmem_free(fm, vec);
+		return (void *) E_COMMIT_FAILED;
+	}
+
+	if(cap > 0){
+		int64_t res = fmem_vec_reserve(vec, cap);
+		if(res < 0){
+			void *data = rptr_get(&vec->data);
+			if(data != NULL) fmem_free(fm, data);
+			fmem_free(fm, vec);
+			return (void *) res;
+		}
+	}
+	return vec;
+}
+
+// elements move to a new allocation that is committed before the vector
+// points to it, the old one is freed after. on a crash in between we leak
+// one of them instead of pointing to freed memory
+int64_t fmem_vec_reserve(struct fmem_vec *vec, uint64_t cap){
+	if(cap <= vec->cap) return cap;
+	struct fmem *fm = fvec_fm(vec);
+	uint64_t bytes = cap * vec->elem_size;
+	if(cap > UINT32_MAX || bytes > UINT32_MAX / 2) return FMEM_E_NOMEM;
+
+	char *data = (char *) fmem_alloc_aligned(fm, (uint32_t) bytes, FVEC_ALIGN);
+	if((int64_t) data <= 0) return (int64_t) data;
+
+	char *old = (char *) rptr_get(&vec->data);
+	uint64_t used = vec->len * vec->elem_size;
+	if(used > 0) memcpy(data, old, used);
+	if(fvec_commit(fm, data, data, used) != 0){
+		fmem_free(fm, data);
+		return E_COMMIT_FAILED;
+	}
+
+	rptr_set(&vec->data, data);
+	vec->cap = cap;
+	if(fvec_commit_header(vec) != 0) return E_COMMIT_FAILED;
+	if(old != NULL && fmem_free(fm, old) < 0) return E_COMMIT_FAILED;
+	return cap;
+}
+
+int64_t fmem_vec_push(struct fmem_vec *vec, const void *elem){
+	if(vec->len == vec->cap){
+		uint64_t cap = vec->cap < FVEC_MIN_CAP ? FVEC_MIN_CAP : vec->cap * 2;
+		int64_t res = fmem_vec_reserve(vec, cap);
+		if(res < 0) return res;
+	}
+
+	uint64_t i = vec->len;
+	memcpy(((char *) rptr_get(&vec->data)) + i * vec->elem_size, elem, vec->elem_size);
+	if(fvec_commit_elem(vec, i) != 0) return E_COMMIT_FAILED;
+	vec->len++;
+	if(fvec_commit_header(vec) != 0) return E_COMMIT_FAILED;
+	return i;
+}
+
+int64_t fmem_vec_pop(struct fmem_vec *vec, void *out){
+	if(vec->len == 0) return E_BAD_VEC;
+	if(out != NULL) memcpy(out, fmem_vec_at(vec, vec->len - 1), vec->elem_size);
+	vec->len--;
+	if(fvec_commit_header(vec) != 0) return E_COMMIT_FAILED;
+	return vec->len;
+}
+
+int64_t fmem_vec_set(struct fmem_vec *vec, uint64_t i, const void *elem){
+	void *at = fmem_vec_at(vec, i);
+	if(at == NULL) return E_BAD_VEC;
+	memcpy(at, elem, vec->elem_size);
+	return fmem_vec_commit(vec, i);
+}
+
+int64_t fmem_vec_commit(struct fmem_vec *vec, uint64_t i){
+	if(i >= vec->len) return E_BAD_VEC;
+	if(fvec_commit_elem(vec, i) != 0) return E_COMMIT_FAILED;
+	return i;
+}
+
+int64_t fmem_vec_clear(struct fmem_vec *vec){
+	vec->len = 0;
+	return fvec_commit_header(vec) != 0 ? E_COMMIT_FAILED : 0;
+}
+
+// the vector goes first, on a crash after it the elements leak
+int64_t fmem_vec_destroy(struct fmem_vec *vec){
+	struct fmem *fm = fvec_fm(vec);
+	void *data = rptr_get(&vec->data);
+	if(fmem_free(fm, vec) < 0) return E_COMMIT_FAILED;
+	if(data != NULL && fmem_free(fm, data) < 0) return E_COMMIT_FAILED;
+	return 0;
+}
+
+#ifdef __UNIT_TESTING__
+#include <stdio.h>
+#include <stdlib.h>
+#include "munit/munit.h"
+#include "things.h"
+
+#define vec_test_size 1024 * 1024
+static char vec_test_live[vec_test_size] __attribute__((aligned(4096)));
+static char vec_test_disk[vec_test_size];
+static int vec_test_calls = 0;
+static int vec_test_fail_at = 0; // the call that fails, 0 if none
+
+// copies committed ranges to a disk image, a crash is a copy back
+static int vec_test_committer(struct commit_range *ranges, uint8_t count){
+	if(++vec_test_calls == vec_test_fail_at) return -1;
+	for(int i = 0; i < count; i++){
+		size_t offset = (char *) ranges[i].start - vec_test_live;
+		if(offset + ranges[i].len > vec_test_size) return -1;
+		memcpy(vec_test_disk + offset, ranges[i].start, ranges[i].len);
+	}
+	return 0;
+}
+
+static struct fmem* vec_test_fmem(committer_t committer){
+	memset(vec_test_live, 0, vec_test_size);
+	memset(vec_test_disk, 0, vec_test_size);
+	struct fmem *fm = fmem_create_new(vec_test_live, vec_test_size, 0, committer);
+	if(committer != NULL) memcpy(vec_test_disk, vec_test_live, vec_test_size);
+	return fm;
+}
+
+FMEM_VEC_DEFINE(things, struct thing)
+FMEM_VEC_DEFINE(ids, uint64_t)
+
+static MunitResult test_vec_push_pop(const MunitParameter params[], void* data){
+	struct fmem *fm = vec_test_fmem(NULL);
+	munit_assert(fm > 0);
+	size_t available = fm->total_available;
+
+	munit_assert(fmem_vec_create(fm, 0, 0) == (void *) E_BAD_VEC);
+	struct fmem_vec *vec = ids_create(fm, 0);
+	munit_assert(vec > 0);
+	munit_assert(vec->len == 0 && vec->cap == 0);
+	munit_assert(ids_at(vec, 0) == NULL);
+	munit_assert(ids_pop(vec, NULL) == E_BAD_VEC);
+
+	// grows by doubling, elements survive every move
+	for(uint64_t i = 0; i < 1000; i++){
+		munit_assert(ids_push(vec, i * 3) == (int64_t) i);
+		munit_assert(vec->len <= vec->cap);
+		munit_assert(((uintptr_t) ids_at(vec, 0)) % FVEC_ALIGN == 0);
+	}
+	munit_assert(vec->cap == 1024);
+	for(uint64_t i = 0; i < 1000; i++) munit_assert(*ids_at(vec, i) == i * 3);
+	munit_assert(ids_at(vec, 1000) == NULL);
+
+	munit_assert(ids_set(vec, 10, 7) == 10);
+	munit_assert(*ids_at(vec, 10) == 7);
+	munit_assert(ids_set(vec, 1000, 7) == E_BAD_VEC);
+
+	uint64_t last = 0;
+	munit_assert(ids_pop(vec, &last) == 999);
+	munit_assert(last == 999 * 3);
+	munit_assert(fmem_vec_clear(vec) == 0);
+	munit_assert(vec->len == 0 && vec->cap == 1024);
+
+	// room asked for up front, no moves
+	munit_assert(fmem_vec_reserve(vec, 100) == 100);
+	munit_assert(vec->cap == 1024);
+	munit_assert(fmem_vec_destroy(vec) == 0);
+
+	vec = things_create(fm, 50);
+	munit_assert(vec > 0 && vec->cap == 50);
+	void *first = rptr_get(&vec->data);
+	for(int i = 0; i < 50; i++){
+		struct thing t = {0};
+		t.value = (char) i;
+		munit_assert(things_push(vec, t) == i);
+	}
+	munit_assert(rptr_get(&vec->data) == first);
+	things_at(vec, 3)->value = 'x';
+	munit_assert(fmem_vec_commit(vec, 3) == 3);
+	munit_assert(things_at(vec, 49)->value == 49);
+
+	// too big is out of memory, the vector is untouched
+	munit_assert(fmem_vec_reserve(vec, vec_test_size) == FMEM_E_NOMEM);
+	munit_assert(vec->cap == 50 && rptr_get(&vec->data) == first);
+	munit_assert(fmem_vec_destroy(vec) == 0);
+
+	munit_assert(fm->alloc_objects == 0);
+	munit_assert(fm->total_available == available);
+	return MUNIT_OK;
+}
+
+static MunitResult test_vec_persisted(const MunitParameter params[], void* data){
+	struct fmem *fm = vec_test_fmem(vec_test_committer);
+	munit_assert(fm > 0);
+
+	struct fmem_vec *vec = ids_create(fm, 0);
+	munit_assert(vec > 0);
+	fmem_set_root(fm, 2, vec);
+	munit_assert(fmem_commit_user_data(fm) > 0);
+	for(uint64_t i = 0; i < 300; i++) munit_assert(ids_push(vec, i + 1) >= 0);
+	munit_assert(ids_pop(vec, NULL) == 299);
+
+	// crash, everything we did is on disk
+	memcpy(vec_test_live, vec_test_disk, vec_test_size);
+	fm = fmem_from_existing(vec_test_live, vec_test_committer);
+	munit_assert(fm > 0);
+	vec = fmem_get_root(fm, 2);
+	munit_assert(vec->len == 299 && vec->cap == 512);
+	for(uint64_t i = 0; i < 299; i++) munit_assert(*ids_at(vec, i) == i + 1);
+	munit_assert(fm->alloc_objects == 2); // old elements were freed
+
+	// pushes in a batch get to the committer once
+	struct fmem_batch batch;
+	struct commit_range storage[16];
+	munit_assert(fmem_batch_begin(fm, &batch, storage, 16) == 0);
+	vec_test_calls = 0;
+	for(uint64_t i = 0; i < 100; i++) munit_assert(ids_push(vec, 5000 + i) >= 0);
+	munit_assert(vec_test_calls == 0);
+	munit_assert(fmem_batch_commit(fm) > 0);
+	munit_assert(vec_test_calls == 1);
+
+	memcpy(vec_test_live, vec_test_disk, vec_test_size);
+	fm = fmem_from_existing(vec_test_live, vec_test_committer);
+	vec = fmem_get_root(fm, 2);
+	munit_assert(vec->len == 399);
+	munit_assert(*ids_at(vec, 398) == 5099);
+	munit_assert(fmem_vec_destroy(vec) == 0);
+	munit_assert(fm->alloc_objects == 0);
+	return MUNIT_OK;
+}
+
+static MunitResult test_vec_commit_failed(const MunitParameter params[], void* data){
+	struct fmem *fm = vec_test_fmem(vec_test_committer);
+	munit_assert(fm > 0);
+	struct fmem_vec *vec = ids_create(fm, 0);
+	munit_assert(vec > 0);
+	for(uint64_t i = 0; i < 5; i++) munit_assert(ids_push(vec, i) >= 0);
+	void *first = rptr_get(&vec->data);
+	uint32_t alloc_objects = fm->alloc_objects;
+
+	// new elements that don't make it to disk are freed, the vector is untouched
+	vec_test_calls = 0;
+	vec_test_fail_at = 2; // alloc, then elements
+	munit_assert(fmem_vec_reserve(vec, 100) == E_COMMIT_FAILED);
+	munit_assert(vec->cap == FVEC_MIN_CAP && rptr_get(&vec->data) == first);
+	munit_assert(fm->alloc_objects == alloc_objects);
+
+	// so is a vector
+	vec_test_calls = 0;
+	munit_assert(ids_create(fm, 0) == (void *) E_COMMIT_FAILED); // alloc, then the vector
+	munit_assert(fm->alloc_objects == alloc_objects);
+	vec_test_calls = 0;
+	vec_test_fail_at = 4; // vector alloc and commit, elements alloc, then the vector
+	munit_assert(ids_create(fm, 10) == (void *) E_COMMIT_FAILED);
+	munit_assert(fm->alloc_objects == alloc_objects);
+	vec_test_fail_at = 0;
+
+	munit_assert(ids_push(vec, 5) == 5);
+	munit_assert(fmem_vec_destroy(vec) == 0);
+	munit_assert(fm->alloc_objects == 0);
+	return MUNIT_OK;
+}
+
+MunitTest fvec_tests[] = {
+	{"/vec-push-pop", test_vec_push_pop, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/vec-persisted", test_vec_persisted, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/vec-commit-failed", test_vec_commit_failed, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+static const MunitSuite fvec_test_suite = {
+	(char*) "fvec-tests",
+	fvec_tests,
+	NULL,
+	1,
+	MUNIT_SUITE_OPTION_NONE
+};
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]){
+	return munit_suite_main(&fvec_test_suite, NULL, argc, argv);
+}
+#endif
@@ -0,0 +1,90 @@
+#ifndef __FVEC__
+#define __FVEC__
+#include <stdint.h>
+#include "list/list.h"
+#include "fmem/fmem.h"
+
+// a growable array of fixed size elements. the vector and its elements live
+// in fmem memory (elements are one allocation that doubles when full), links
+// are relative so the vector can be stashed as a root (fmem_set_root(..)) and
+// used by every process attached. every change is committed (element first,
+// then length), ops in a batch (fmem_batch_begin(..)) reach the committer as
+// one call.
+// -- elements are 64 bytes aligned, compaction does not move them. pointers
+// 	 to elements are good until the vector grows.
+// -- a vector is not locked, callers that share one must serialize access.
+// FMEM_VEC_DEFINE(name, type) defines typed static inline wrappers, e.g.
+// FMEM_VEC_DEFINE(ids, uint64_t) then ids_push(vec, 42), *ids_at(vec, 0)
+#define FVEC_ALIGN 64
+#define FVEC_MIN_CAP 8
+
+#define E_BAD_VEC -18 // elem size is 0, index out of range, pop from empty
+
+struct fmem_vec{
+	rptr_t fm;          // fmem the vector allocates from
+	rptr_t data;        // elements, 0 until the first one
+	uint32_t elem_size;
+	uint32_t unused;
+	uint64_t len;       // # of elements
+	uint64_t cap;       // # of elements data has room for
+};
+
+// creates a vector (in fmem memory) of elements of elem_size with room for cap
+// returns E_BAD_VEC, FMEM_E_NOMEM, E_COMMIT_FAILED
+struct fmem_vec* fmem_vec_create(struct fmem *fm, uint32_t elem_size, uint64_t cap);
+
+// returns element i, NULL if i is out of range
+static inline void* fmem_vec_at(struct fmem_vec *vec, uint64_t i){
+	if(i >= vec->len) return NULL;
+	return ((char *) rptr_get(&vec->data)) + i * vec->elem_size;
+}
+
+// makes room for cap elements
+// returns cap, FMEM_E_NOMEM (vector is untouched), E_COMMIT_FAILED
+int64_t fmem_vec_reserve(struct fmem_vec *vec, uint64_t cap);
+
+// appends a copy of elem
+// returns its index, FMEM_E_NOMEM, E_COMMIT_FAILED
+int64_t fmem_vec_push(struct fmem_vec *vec, const void *elem);
+
+// removes the last element and copies it to out (can be NULL)
+// returns # of elements left, E_BAD_VEC if empty, E_COMMIT_FAILED
+int64_t fmem_vec_pop(struct fmem_vec *vec, void *out);
+
+// overwrites element i with a copy of elem
+// returns i, E_BAD_VEC, E_COMMIT_FAILED
+int64_t fmem_vec_set(struct fmem_vec *vec, uint64_t i, const void *elem);
+
+// commits element i after it was changed in place (through fmem_vec_at(..))
+// returns i, E_BAD_VEC, E_COMMIT_FAILED
+int64_t fmem_vec_commit(struct fmem_vec *vec, uint64_t i);
+
+// drops every element, memory is kept
+// returns E_COMMIT_FAILED
+int64_t fmem_vec_clear(struct fmem_vec *vec);
+
+// frees elements and the vector itself
+// returns E_COMMIT_FAILED
+int64_t fmem_vec_destroy(struct fmem_vec *vec);
+
+#define FMEM_VEC_DEFINE(name, type) \
+static inline struct fmem_vec* name##_create(struct fmem *fm, uint64_t cap){ \
+	return fmem_vec_create(fm, sizeof(type), cap); \
+} \
+\
+static inline type* name##_at(struct fmem_vec *vec, uint64_t i){ \
+	return (type *) fmem_vec_at(vec, i); \
+} \
+\
+static inline int64_t name##_push(struct fmem_vec *vec, type elem){ \
+	return fmem_vec_push(vec, &elem); \
+} \
+\
+static inline int64_t name##_pop(struct fmem_vec *vec, type *out){ \
+	return fmem_vec_pop(vec, out); \
+} \
+\
+static inline int64_t name##_set(struct fmem_vec *vec, uint64_t i, type elem){ \
+	return fmem_vec_set(vec, i, &elem); \
+}
+#endif
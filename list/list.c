@@ -35,11 +35,54 @@ void list_remove_at(struct list_head *current){
 	next->prev = prev;
 }
 
+// relative list, offsets are recomputed from where each link sits
+static inline void rlist_set_next(struct rlist_head *l, struct rlist_head *next){
+	l->next = ((char *) next) - ((char *) l);
+}
+
+static inline void rlist_set_prev(struct rlist_head *l, struct rlist_head *prev){
+	l->prev = ((char *) prev) - ((char *) l);
+}
+
+void rlist_head_init(struct rlist_head *l)
+{
+	l->next = 0;
+	l->prev = 0;
+}
+
+void rlist_add_after(struct rlist_head *current, struct rlist_head *new){
+	struct rlist_head *next = rlist_next(current);
+
+	rlist_set_prev(next, new);
+	rlist_set_next(new, next);
+	rlist_set_prev(new, current);
+	rlist_set_next(current, new);
+}
+
+void rlist_add_before(struct rlist_head *current, struct rlist_head *new){
+	struct rlist_head *prev = rlist_prev(current);
+
+	rlist_set_prev(new, prev);
+	rlist_set_next(new, current);
+
+	rlist_set_prev(current, new);
+	rlist_set_next(prev, new);
+}
+
+void rlist_remove_at(struct rlist_head *current){
+	struct rlist_head *prev = rlist_prev(current);
+	struct rlist_head *next = rlist_next(current);
+
+	rlist_set_next(prev, next);
+	rlist_set_prev(next, prev);
+}
+
 
 #ifdef __UNIT_TESTING__
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include "munit/munit.h"
 
 struct carrier{
@@ -262,6 +305,83 @@ static MunitResult test_iterator_backward(const MunitParameter params[], void* d
 	return MUNIT_OK;
 }
 
+struct rcarrier{
+	char content;
+	struct rlist_head list;
+};
+
+// relative list, add remove and iterate, the list survives a move
+static MunitResult test_rlist(const MunitParameter params[], void* data){
+	struct rcarrier carriers[5] = {
+		{.content = 'A'},
+		{.content = 'B'},
+		{.content = 'C'},
+		{.content = 'D'},
+		{.content = 'E'},
+	};
+
+	// zeroed head is an empty list
+	struct rlist_head *head = &carriers[0].list;
+	munit_assert(rlist_next(head) == head && rlist_prev(head) == head);
+	rlist_head_init(head);
+	munit_assert(rlist_next(head) == head);
+
+	rlist_add_after(head, &carriers[1].list);
+	rlist_add_after(&carriers[1].list, &carriers[3].list);
+	rlist_add_before(&carriers[3].list, &carriers[2].list);
+	rlist_add_before(head, &carriers[4].list); // at the tail
+	rlist_remove_at(&carriers[4].list);
+
+	const char *expected = "BCD";
+	struct rlist_head *current = NULL;
+	int i = 0;
+	rlist_for_each(current, head){
+		munit_assert(rlist_entry(current, struct rcarrier, list)->content == expected[i]);
+		i++;
+	}
+	munit_assert(i == 3);
+	i = 2;
+	rlist_for_each_backward(current, head){
+		munit_assert(rlist_entry(current, struct rcarrier, list)->content == expected[i]);
+		i--;
+	}
+
+	// move all of them somewhere else, links still work
+	struct rcarrier moved[5];
+	memcpy(moved, carriers, sizeof(carriers));
+	memset(carriers, 0, sizeof(carriers));
+	head = &moved[0].list;
+	i = 0;
+	rlist_for_each(current, head){
+		munit_assert(current >= &moved[0].list && current <= &moved[4].list);
+		munit_assert(rlist_entry(current, struct rcarrier, list)->content == expected[i]);
+		i++;
+	}
+	munit_assert(i == 3);
+	return MUNIT_OK;
+}
+
+// relative pointers
+static MunitResult test_rptr(const MunitParameter params[], void* data){
+	struct {
+		rptr_t to;
+		char value;
+	} pair[2] = {0};
+
+	munit_assert(rptr_get(&pair[0].to) == NULL);
+	rptr_set(&pair[0].to, &pair[1].value);
+	pair[1].value = 'X';
+	munit_assert(*((char *) rptr_get(&pair[0].to)) == 'X');
+
+	typeof(pair[0]) moved[2];
+	memcpy(moved, pair, sizeof(pair));
+	munit_assert(rptr_get(&moved[0].to) == &moved[1].value);
+
+	rptr_set(&pair[0].to, NULL);
+	munit_assert(rptr_get(&pair[0].to) == NULL);
+	return MUNIT_OK;
+}
+
 // all tests
 MunitTest list_tests[] = {
 	/* tests struct: name(string),  test func, setup func, tear down func, opts, params*/
@@ -272,6 +392,8 @@ MunitTest list_tests[] = {
 	{"/remove-at", test_remove_at, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
 	{"/fwd-iterator", test_iterator_forward, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
 	{"/bwd-iterator", test_iterator_backward, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/rlist", test_rlist, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{"/rptr", test_rptr, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
 	// final entry must be null, as we don't pass in count
  	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
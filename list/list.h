@@ -2,6 +2,7 @@
 #define __LIST__
 
 #include <stddef.h>
+#include <stdint.h>
 
 /*
  * standard double linked list styled after kernel own implementation
@@ -39,4 +40,59 @@ void list_remove_at(struct list_head *current);
 #define list_for_each_backward(pos, head) \
 	for (pos = (head)->prev; pos != (head); pos = pos->prev)
 
+/*
+ * relative double linked list. links store offsets from the link itself instead of
+ * pointers, a list that lives in memory mapped at a different address on every run
+ * (or in many processes at different addresses) needs no fix ups. a zeroed rlist_head
+ * is an empty list.
+ */
+struct rlist_head {
+	int64_t next, prev; // offsets from this link
+};
+
+static inline struct rlist_head* rlist_next(struct rlist_head *l){
+	return (struct rlist_head *) (((char *) l) + l->next);
+}
+
+static inline struct rlist_head* rlist_prev(struct rlist_head *l){
+	return (struct rlist_head *) (((char *) l) + l->prev);
+}
+
+// inits a new list
+void rlist_head_init(struct rlist_head *l);
+
+// adds a new entry after another
+void rlist_add_after(struct rlist_head *current, struct rlist_head *new);
+
+// adds a new entry before another
+void rlist_add_before(struct rlist_head *current, struct rlist_head *new);
+
+// removes an entry
+void rlist_remove_at(struct rlist_head *current);
+
+#define rlist_entry(ptr, type, member) \
+	container_of(ptr, type, member)
+
+#define rlist_for_each(pos, head) \
+	for (pos = rlist_next(head); pos != (head); pos = rlist_next(pos))
+
+#define rlist_for_each_backward(pos, head) \
+	for (pos = rlist_prev(head); pos != (head); pos = rlist_prev(pos))
+
+/*
+ * relative pointers for user object graphs. same idea, the pointer is stored as an
+ * offset from where it is stored. 0 is NULL (a pointer can not point to itself).
+ * -- rptr_set(&s->field, ptr)
+ * -- type *p = rptr_get(&s->field)
+ */
+typedef int64_t rptr_t;
+
+static inline void rptr_set(rptr_t *at, void *ptr){
+	*at = ptr == NULL ? 0 : ((char *) ptr) - ((char *) at);
+}
+
+static inline void* rptr_get(rptr_t *at){
+	return *at == 0 ? NULL : (void *) (((char *) at) + *at);
+}
+
 #endif
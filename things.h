@@ -6,7 +6,8 @@
 #include <string.h>
 
 /* things is a list data structure with a simple _value_ field
- * used to compare mems.
+ * used to compare mems. it uses relative lists, so it can be
+ * mapped at any address.
  */
 #include "list/list.h"
 
@@ -20,13 +21,13 @@ typedef void (*oneach_t)(void *each, size_t len);
 
 // a list of things
 struct things{
-  struct list_head list;
+  struct rlist_head list;
    uint8_t count;
 };
 
 // a thing
 struct thing{
-   struct list_head list;
+   struct rlist_head list;
   char value;
 };
 
@@ -48,7 +49,7 @@ int make_wellknown_things(void **where, alloc_t allocator, oneach_t oneach){
 
   allocated += sizeof(struct things);
 
-  list_head_init(&header->list);
+  rlist_head_init(&header->list);
 
   // list of capital letters A->Z
   for(int i = 90; i > 64; i--){
@@ -63,7 +64,7 @@ int make_wellknown_things(void **where, alloc_t allocator, oneach_t oneach){
 
     allocated += sizeof(struct thing);
     this_thing->value = i;
-    list_add_after(&header->list, &this_thing->list);
+    rlist_add_after(&header->list, &this_thing->list);
     header->count++;
 
     if(oneach != NULL){
@@ -91,21 +92,21 @@ int verify_things(struct things *what){
 	}
 
 	// remember iterator does not go over head
-	struct list_head *head = &what->list;
-	struct list_head *current = head;
-	struct list_head *to_current = what->list.next;
+	struct rlist_head *head = &what->list;
+	struct rlist_head *current = head;
+	struct rlist_head *to_current = rlist_next(&what->list);
 
 	int i = 0;
-	list_for_each(current, head){
-		struct thing *current_thing = list_entry(current, struct thing, list);
-		struct thing *to_current_thing = list_entry(to_current, struct thing, list);
+	rlist_for_each(current, head){
+		struct thing *current_thing = rlist_entry(current, struct thing, list);
+		struct thing *to_current_thing = rlist_entry(to_current, struct thing, list);
 		if(current_thing->value != to_current_thing->value){
 			printf("at %d expected value %c != %c\n", i, current_thing->value, to_current_thing->value);
 			return -1;
 		}
 		 printf("at %d value %c == %c\n", i, current_thing->value, to_current_thing->value);
 
-		to_current = to_current->next; // we are comparing two lists
+		to_current = rlist_next(to_current); // we are comparing two lists
 		i++;
 	}
 	return 0;
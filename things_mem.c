@@ -39,12 +39,6 @@ void * alloc_using_fm(size_t size){
   return fmem_alloc(fm, size);
 }
 
-// fixed map address must be multiple of page sizes.
-size_t get_map_address(){
-  size_t heap = getpagesize();
-  return heap * 1000000;  // skip the first million page
-}
-
 int mode_init(){
   size_t *shared_mem = NULL;
 
@@ -53,10 +47,10 @@ int mode_init(){
 
   if(ftruncate(fd, MAP_SIZE) != 0) errExit("failed to turncate file\n");
 
-  void *map_to = (void *) get_map_address();
-
-  shared_mem = mmap(map_to, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED /*if you expect multiple thread to race to cerate map then use _REPLACE flag*/, fd, 0);
+  // the allocator (and things) use relative pointers, memory can be mapped anywhere
+  shared_mem = mmap(NULL, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   if (shared_mem == MAP_FAILED) errExit("mmap\n");
+  void *map_to = shared_mem;
 
   // create a fixed memory allocator on the shared memory
   fm = fmem_create_new(map_to, MAP_SIZE, 0 /* use default alloc size */, NULL /* we are not committing anything */);
@@ -69,7 +63,7 @@ int mode_init(){
 
   // header now has a ref to things (header)
   // stash it in fm user data
-  fm->user1 = header;
+  fmem_set_root(fm, 1, header);
   return EXIT_SUCCESS;
 }
 
@@ -84,16 +78,16 @@ int mode_read(){
   if (fd == -1) errExit("shm_open\n");
 
 
-  void *map_to = (void *) get_map_address();
-
-  shared_mem = mmap(map_to, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED /*if you expect multiple thread to race to cerate map then use _REPLACE flag*/, fd, 0);
+  // the allocator (and things) use relative pointers, memory can be mapped anywhere
+  shared_mem = mmap(NULL, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   if (shared_mem == MAP_FAILED) errExit("mmap\n");
+  void *map_to = shared_mem;
 
   // create a fixed memory allocator on the shared memory
   fm = fmem_from_existing(map_to, NULL /* we are not committing anything */);
   if(fm <= 0) errExit("failed to create fixed mem object\n");
 
-  struct things *header = (struct things *) fm->user1;
+  struct things *header = (struct things *) fmem_get_root(fm, 1);
 
   // verify
   if(verify_things(header) != 0) errExit("memory is not the same\n");
@@ -45,12 +45,6 @@ static inline void align_addr(struct commit_range* range){
 
 
 
-// fixed map address must be multiple of page sizes.
-size_t get_map_address(){
-  size_t heap = getpagesize();
-  return heap * 1000000;  // skip the first million page
-}
-
 // used by our things maker to allocate using fm
 void * alloc_using_fm(size_t size){
   return fmem_alloc(fm, size);
@@ -110,25 +104,35 @@ int mode_init(){
   if(ftruncate(fd, MAP_SIZE) != 0) errExit("failed to turncate file\n");
 
 	// resize
-  map_to = (void *) get_map_address();
-  void *shared_mem = mmap(map_to, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+  // the allocator (and things) use relative pointers, memory can be mapped anywhere
+  void *shared_mem = mmap(NULL, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   if (shared_mem == MAP_FAILED) errExit("mmap\n");
+  map_to = shared_mem;
 
   // create a fixed memory allocator on the shared memory
   fm = fmem_create_new(map_to, MAP_SIZE, 0 /* use default alloc size */, the_committer /* our committer */);
   if(fm <= 0) errExit("failed to create fixed mem object\n");
 
+  // things maker does many small allocs and commits, instead of flushing
+  // on every one of them we batch them and flush all touched pages once.
+  struct fmem_batch batch;
+  struct commit_range batch_ranges[64];
+  if(fmem_batch_begin(fm, &batch, batch_ranges, 64) != 0) errExit("failed to open commit batch");
+
   void *header = NULL;
   int allocated = make_wellknown_things(&header, alloc_using_fm, things_maker_oneach /* call for every mem change*/);
   if(allocated <= 0) errExit("failed to make things on memory owned by fmem\n");
 
   // header now has a ref to things (header)
   // stash it in fm user data
-  fm->user1 = header;
+  fmem_set_root(fm, 1, header);
 
 	// we need to commit user data in our fixed memory
 	if(fmem_commit_user_data(fm) < 0) errExit("failed to commit user data");
 
+	// nothing is on disk until the batch is committed
+	if(fmem_batch_commit(fm) < 0) errExit("failed to commit batch");
+
   return EXIT_SUCCESS;
 }
 
@@ -144,20 +148,16 @@ int mode_read(){
   if(ftruncate(fd, MAP_SIZE) != 0) errExit("failed to turncate file\n");
 
 	// resize
-  map_to = (void *) get_map_address();
-  void *shared_mem = mmap(map_to, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
-  if (shared_mem == MAP_FAILED) errExit("mmap\n");
-
-  map_to = (void *) get_map_address();
-
-  shared_mem = mmap(map_to, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED , fd, 0);
+  // not necessarily where it was when created
+  void *shared_mem = mmap(NULL, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   if (shared_mem == MAP_FAILED) errExit("mmap\n");
+  map_to = shared_mem;
 
   // create a fixed memory allocator on the shared memory
   fm = fmem_from_existing(map_to, NULL );
   if(fm <= 0) errExit("failed to create fixed mem object\n");
 
-  struct things *header = (struct things *) fm->user1;
+  struct things *header = (struct things *) fmem_get_root(fm, 1);
 
   // verify
   if(verify_things(header) != 0) errExit("memory is not the same\n");
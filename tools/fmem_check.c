@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fmem/fmem.h"
+
+/*
+ * verifies fmem memory in a file (or /dev/shm object) without attaching to
+ * it, the file is mapped read only. with -d prints a fragmentation map and
+ * free pages by size class. exits 0 if fmem is sound, 1 if problems were
+ * found, 2 if the file is not fmem memory.
+ * fmem_check [-t <threads>] [-p] [-d] <file>
+ */
+#define errExit(msg)    do { perror(msg); exit(3); } while (0)
+#define MAP_COLUMNS 64
+#define MAP_ROWS 16
+
+static void usage(const char *name){
+  fprintf(stderr, "usage: %s [-t <threads>] [-p] [-d] <file>\n", name);
+  fprintf(stderr, "  -t threads to walk with (default one per cpu)\n");
+  fprintf(stderr, "  -p every page must be poisoned (fmem built with __BAD_MEM__)\n");
+  fprintf(stderr, "  -d dump a fragmentation map\n");
+  exit(3);
+}
+
+// one char for % busy of a cell
+static char map_char(uint8_t busy){
+  if(busy == 0) return '.';
+  if(busy < 25) return '-';
+  if(busy < 50) return '+';
+  if(busy < 75) return '*';
+  return '#';
+}
+
+static void dump(struct fmem_check_report *report, size_t length){
+  printf("\nmap (%zu bytes a cell, . free - <25%% + <50%% * <75%% # busy)\n", (length + report->cells - 1) / report->cells);
+  for(uint32_t row = 0; row < MAP_ROWS; row++){
+    printf("  ");
+    for(uint32_t col = 0; col < MAP_COLUMNS; col++) putchar(map_char(report->map[row * MAP_COLUMNS + col]));
+    putchar('\n');
+  }
+
+  printf("\nfree pages by class\n");
+  for(uint32_t class = 0; class < FMEM_SIZE_CLASSES; class++){
+    if(report->free_pages_by_class[class] == 0) continue;
+    printf("  [%10llu, %10llu) %llu\n", 1ULL << class, 1ULL << (class + 1), (unsigned long long) report->free_pages_by_class[class]);
+  }
+}
+
+int main(int argc, char *argv[]){
+  uint32_t threads = 0;
+  bool dump_map = false;
+  uint32_t flags = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "t:pd")) != -1){
+    switch(opt){
+      case 't':
+        threads = (uint32_t) atoi(optarg);
+        break;
+      case 'p':
+        flags |= FMEM_CHECK_POISON;
+        break;
+      case 'd':
+        dump_map = true;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if(optind != argc - 1) usage(argv[0]);
+
+  int fd = open(argv[optind], O_RDONLY);
+  if(fd == -1) errExit("open");
+  struct stat st;
+  if(fstat(fd, &st) == -1) errExit("fstat");
+  if(st.st_size == 0){
+    fprintf(stderr, "%s: is empty\n", argv[optind]);
+    return 2;
+  }
+  void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if(mem == MAP_FAILED) errExit("mmap");
+
+  uint8_t map[MAP_COLUMNS * MAP_ROWS];
+  struct fmem_check_report report = {0};
+  report.flags = flags;
+  if(dump_map){
+    report.cells = MAP_COLUMNS * MAP_ROWS;
+    report.map = map;
+  }
+  int64_t errors = fmem_check(mem, st.st_size, threads, &report);
+  if(errors == E_BAD_INIT_MEM){
+    fprintf(stderr, "%s: not fmem memory\n", argv[optind]);
+    return 2;
+  }
+  if(errors < 0) errExit("fmem_check");
+
+  struct fmem *fm = (struct fmem *) (((char *) mem) + sizeof(struct fmem_page));
+  printf("%s: %zu bytes, %llu threads\n", argv[optind], fmem_length(fm), (unsigned long long) report.threads);
+  printf("  pages %llu busy %llu (%llu bytes) free %llu (%llu bytes, largest %llu)\n",
+         (unsigned long long) report.pages, (unsigned long long) report.busy_pages, (unsigned long long) report.busy_bytes,
+         (unsigned long long) report.free_pages, (unsigned long long) report.free_bytes, (unsigned long long) report.largest_free);
+  if(fm->huge_size != 0){
+    printf("  huge extents busy %llu (%llu bytes)\n", (unsigned long long) report.huge_busy, (unsigned long long) report.huge_busy_bytes);
+  }
+  if(errors > 0){
+    printf("  %lld problems, first: %s at offset %llu\n", (long long) errors, report.first_error, (unsigned long long) report.first_error_at);
+  }else{
+    printf("  ok\n");
+  }
+  if(dump_map) dump(&report, fmem_length(fm));
+
+  munmap(mem, st.st_size);
+  close(fd);
+  return errors > 0 ? 1 : 0;
+}